@@ -0,0 +1,125 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#include "admin.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "common/unix_listener.h"
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
+namespace backend {
+
+AdminServer::AdminServer(HandlerFn handler)
+    : handler_(handler), mu_(), stop_(false), listen_fd_(-1), path_(),
+      thread_()
+{
+}
+
+AdminServer::~AdminServer()
+{
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stop_ = true;
+    if (listen_fd_ >= 0) {
+      // Wakes the blocked accept().
+      shutdown(listen_fd_, SHUT_RDWR);
+    }
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    unlink(path_.c_str());
+  }
+}
+
+bool
+AdminServer::Listen(const std::string& path)
+{
+  // Admin ops can release id's, keep other users out.
+  listen_fd_ = UnixListen(path, 0660);
+  if (listen_fd_ < 0) {
+    return false;
+  }
+  path_ = path;
+  thread_ = std::thread(&AdminServer::AcceptLoop, this);
+  return true;
+}
+
+void
+AdminServer::AcceptLoop()
+{
+  while (true) {
+    const int fd = accept(listen_fd_, nullptr, nullptr);
+    if (fd < 0) {
+      if ((errno == EINTR) || (errno == ECONNABORTED)) {
+        continue;
+      }
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (stop_) {
+        close(fd);
+        return;
+      }
+    }
+    Serve(fd);
+    close(fd);
+  }
+}
+
+void
+AdminServer::Serve(int fd)
+{
+  // A client that never sends its command does not hold up the others.
+  struct timeval timeout;
+  timeout.tv_sec = ADMIN_READ_TIMEOUT_MS / 1000;
+  timeout.tv_usec = (ADMIN_READ_TIMEOUT_MS % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  std::string line;
+  char buffer[4096];
+  while (line.find('\n') == std::string::npos) {
+    const ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    if (got == 0) {
+      break;
+    }
+    line.append(buffer, got);
+    if (line.size() > ADMIN_MAX_LINE) {
+      return;
+    }
+  }
+  line = line.substr(0, line.find('\n'));
+  if (!line.empty() && (line.back() == '\r')) {
+    line.pop_back();
+  }
+
+  const std::string reply = handler_(line);
+  const char* p = reply.data();
+  size_t bytes = reply.size();
+  while (bytes > 0) {
+    const ssize_t sent = send(fd, p, bytes, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    p += sent;
+    bytes -= sent;
+  }
+}
+
+}}}}  // namespace dnapoleone::inferenceserver::correlation_id_mgr::backend
@@ -0,0 +1,53 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Out-of-band admin listener on a Unix domain socket.
+//
+// Each connection sends one command line and gets the handler's reply,
+// then the socket is closed, so `echo stats | nc -U /path` or socat make a
+// scraper. Commands are served one at a time on the listener's own
+// thread, never through the inference server or Execute.
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
+namespace backend {
+
+// Longest command line accepted.
+#define ADMIN_MAX_LINE 65536
+
+// Time a connection has to send its command.
+#define ADMIN_READ_TIMEOUT_MS 1000
+
+class AdminServer {
+ public:
+  // Reply to a command line, without its newline.
+  typedef std::function<std::string(const std::string&)> HandlerFn;
+
+  explicit AdminServer(HandlerFn handler);
+  ~AdminServer();
+
+  // Listen on the socket path, replacing a stale socket but no other
+  // file, readable and writable by the owner and group only. False on
+  // error.
+  bool Listen(const std::string& path);
+
+ private:
+  void AcceptLoop();
+
+  // Read the command from a connection and write the reply.
+  void Serve(int fd);
+
+  HandlerFn handler_;
+  std::mutex mu_;
+  bool stop_;
+  int listen_fd_;
+  std::string path_;
+  std::thread thread_;
+};
+
+}}}}  // namespace dnapoleone::inferenceserver::correlation_id_mgr::backend
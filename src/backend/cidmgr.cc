@@ -1,12 +1,41 @@
 // Copyright (c) 2019 Doug Napoleone, All rights reserved.
 
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "src/custom/sdk/custom_instance.h"
 
+#include "admin.h"
 #include "cidmgr.h"
+#include "common/histogram.h"
+#include "common/id_layout.h"
+#include "common/packed_request.h"
+#include "common/shm_registry.h"
+#include "common/trace.h"
+#include "registry.h"
+#include "replication.h"
+#include "sparse_registry.h"
 
 namespace ni = nvidia::inferenceserver;
 namespace nic = nvidia::inferenceserver::custom;
@@ -17,21 +46,26 @@ namespace dicb = dnapoleone::inferenceserver::correlation_id_mgr::backend;
 #define LOG_INFO std::cout
 #define QUOTE(seq) "\""#seq"\""
 
-// Just to be sane, we will set the max to be well below the uint64 max.
-// We will only hit this if contexts are not being cleaned up. 
-// trtis will clean up stale contexts, but this is really a bug in client
-// code, or clients are dying. We want to know about this happening.
-// However we don't want undue errors, or runaway allocation. 
-// This gives us space to see the problem via Peak() stat always increasing 
-// before we get close to an overflow or insane amounts of memory allocated. 
-// This will reach ~4GB of memory allocated before we run out of ID's.
-#define MAX_CORRELATION_ID (1<<30)
-
 // 1 hour minimum idle recommended to prevent premature context deletion for
 // the it manager. We want there to only ever be 1 manager, and we only want
 // it deleted if there are no outstanding id's. 
 #define MIN_SEQUENCE_IDLE 3600000000
 
+// Default number of id's in the same-host shared memory block when the
+// 'shm_name' model parameter is set.
+#define DEFAULT_SHM_IDS 65536
+
+// Default number of id bits above CORRELATION_ID_BITS used to carry the
+// namespace, giving 255 namespaces besides the default one.
+#define DEFAULT_NAMESPACE_BITS 8
+#define MAX_NAMESPACE_BITS 16
+
+// Default number of events kept in the trace ring.
+#define DEFAULT_TRACE_EVENTS 65536
+
+// How often the trace thread checks for SIGUSR2.
+#define TRACE_SIGNAL_POLL_MS 100
+
 
 // This custom backend takes two one-element input tensors, and one
 // two-element tensor. Two INT32 control values and one an [uns8, uint64] input; 
@@ -42,19 +76,158 @@ namespace dicb = dnapoleone::inferenceserver::correlation_id_mgr::backend;
 // on the control values in "START" and "READY":
 //
 //   READY=0, START=*, CONTROL=*:               CORRELATION_ID=*: Ignore value input, do nothing.
-//   READY=1, START=1: CONTROL=CIDMGR_NEW:      CORRELATION_ID=*: Create new correlation ID and return it.
+//   READY=1, START=1: CONTROL=CIDMGR_NEW:      CORRELATION_ID=K: Create new correlation ID in namespace K (or under prefix K) and return it.
 //   READY=1, START=*: CONTROL=CIDMGR_DELETE:   CORRELATION_ID=N: Clear correlation ID N for reuse.
-//   READY=1, START=*: CONTROL=CIDMGR_ACTIVE:   CORRELATION_ID=*: Num context id's in use.
-//   READY=1, START=*: CONTROL=CIDMGR_INACTIVE: CORRELATION_ID=*: Num context id's no longer in use.
-//   READY=1, START=*: CONTROL=CIDMGR_PEAK:     CORRELATION_ID=*: Peak num contexts used at one time.
+//   READY=1, START=*: CONTROL=CIDMGR_ACTIVE:   CORRELATION_ID=K: Num context id's in use.
+//   READY=1, START=*: CONTROL=CIDMGR_INACTIVE: CORRELATION_ID=K: Num context id's no longer in use.
+//   READY=1, START=*: CONTROL=CIDMGR_PEAK:     CORRELATION_ID=K: Peak num contexts used at one time.
+//   READY=1, START=*: CONTROL=CIDMGR_NODE:     CORRELATION_ID=*: Packed NodeLayout of this node.
+//   READY=1, START=*: CONTROL=CIDMGR_VALIDATE:  CORRELATION_ID=[N...]: Bitmask of the id's still reserved.
+//   READY=1, START=*: CONTROL=CIDMGR_RECONCILE: CORRELATION_ID=[N...]: Re-reserve the id's, bitmask of success.
+//   READY=1, START=*: CONTROL=CIDMGR_TRACE:     CORRELATION_ID=*: Write the trace ring to trace_file, num events.
+//   READY=1, START=*: CONTROL=CIDMGR_PROMOTE:   CORRELATION_ID=*: Promote a standby to primary, last sequence number applied.
+//
+// Timing: if the optional TIMING output is requested it gets the
+// MonotonicNanos() at Execute entry, and at the start and end of the
+// registry op, so clients can split their round trip into the network and
+// queueing outside Execute, Execute itself and the registry op.
+//
+// Packed format: a model configured with a single UINT64 REQUEST input and
+// RESPONSE output (config_packed.pbtxt.in, no sequence batcher) takes the op
+// code, flags, count and argument in one vector and answers in one vector,
+// see common/packed_request.h. It runs the same ops on the same registry
+// code, with one input_fn read per request instead of four.
+//
+// Bulk ops: more than one id per request needs CORRELATION_ID and OUTPUT
+// configured with dims [ -1 ] (config_bulk.pbtxt.in); the default config's
+// [ 1 ] takes one id per request. OUTPUT is ceil(count / 64) words, bit i of word i / 64 for id i. An id
+// with CIDMGR_RELEASE_BIT set is released instead, its bit set if it was
+// reserved. RECONCILE re-reserves id's no longer reserved, e.g. after a
+// restart; only pre-registered namespaces keep their numbers across one.
+//
+// Namespaces: K is a 32 bit namespace key, normally the FNV-1a hash of the
+// downstream model name (see common/id_layout.h), or 0 for the default
+// namespace. Each namespace has its own dense allocator. The server maps
+// keys to small namespace numbers on first use and carries the number in
+// the id bits above CORRELATION_ID_BITS, so DELETE finds the namespace from
+// the id alone. Stats for K=0 are the totals across all namespaces.
+//
+// Sparse id space: with id_space "sparse" the node's whole range of the
+// id space (63 bits, or node_stride_bits when partitioned) is one sparse
+// registry (see sparse_registry.h), whose memory follows the live id's
+// instead of the high water mark. There are no namespaces; instead K may
+// be PrefixArg(prefix, prefix_bits) (see common/id_layout.h) to get the
+// lowest free id whose top prefix_bits bits are the prefix, so id's can
+// carry tenant, shard or time bits for downstream routing. K=0 is
+// anywhere in the range. The shared memory block and the registry warm up
+// are not available in this mode.
 //
 // We abuse the START=1 control value and never reset the registry.
 // By always passing START=1 there are no race conditions on being the first client to
 // initialize the registry.
+//
+// Optional model config parameters:
+//
+//   shm_name: POSIX shared memory name (e.g. "/trtis_cidmgr") to publish a
+//             block of id's for same-host clients to allocate from directly.
+//   shm_ids:  number of id's in the shared memory block (default 65536).
+//   shm_group: group whose members may map the shared memory block too
+//             (default none, only the server's user).
+//   namespace_bits: id bits used for the namespace number (default 8).
+//   namespaces: comma separated model names pre-registered, in order, to
+//             namespace numbers 1..N.
+//   node_id_bits: width of the node id field for multi-node partitioning
+//             (default 0, unpartitioned).
+//   node_id:  this node's id, below 2^node_id_bits (default 0).
+//   node_stride_bits: log2 of the id range owned by each node, the node id
+//             field starts at this bit (default 63 - node_id_bits).
+//   trace_events: size of the event trace ring (default 65536, 0 disables).
+//   trace_file: where CIDMGR_TRACE and SIGUSR2 write the trace (default
+//             /tmp/cidmgr_trace.<instance>.<pid>.json).
+//   trace_signal: "0" to not install the SIGUSR2 handler (default "1").
+//   id_space: "dense" (default) or "sparse" for the full 64 bit id space.
+//   max_ids:  most id's each namespace hands out at once (default 2^30).
+//   expected_concurrency: id's in use at once per namespace to size and
+//             fault in the registry memory for at load (default max_ids
+//             when max_ids is set, otherwise 0 to grow on demand).
+//   huge_pages: "1" to back the pre-sized registry memory with transparent
+//             huge pages (default "0").
+//   replication_listen: "host:port" or "unix:/path" a primary ships its op
+//             log to standbys on, or a standby will once promoted.
+//   replication_primary: address of the primary's replication_listen; the
+//             instance starts as its standby.
+//   replication_max_unacked: most ops the primary runs ahead of a standby
+//             (default 1024, 0 is synchronous).
+//   replication_ack_timeout_ms: how long the primary waits on a lagging
+//             standby before dropping it (default 1000).
+//   replication_require_standby: "1" to have the primary refuse NEW,
+//             DELETE and RECONCILE while no standby is in sync (default
+//             "0", carry on alone).
+//   admin_socket: Unix socket path for the out-of-band admin listener.
+//   verbose:  "1" to log every Execute and its inputs (default "0"). This
+//             writes to stdout on the request path, so leave it off when
+//             measuring.
+//
+// Warm up: with expected_concurrency or max_ids set, Init() allocates and
+// touches the id bitmap and free id heap of the default and pre-registered
+// namespaces, so a fleet restart's burst of NEWs does not pay for growth
+// and page faults. The time taken is logged. Namespaces registered later
+// are pre-sized when they are first used.
+//
+// Replication: a primary appends every NEW, DELETE, release and re-reserve
+// to a sequence numbered op log shipped to its standbys (see
+// replication.h). A response is held back while any standby in sync is
+// more than replication_max_unacked ops behind, so at most that many
+// acknowledged ops are lost on failover to it. A standby that falls
+// further behind is dropped and the primary carries on alone, so a
+// standby promoted before it resyncs misses every op since, unless
+// replication_require_standby stops the writes instead. A standby applies
+// the log to its own registry,
+// answers only the stats, NODE and TRACE, and takes over on CIDMGR_PROMOTE:
+// it fences off replication_max_unacked id's per namespace that the lost
+// ops may have handed out, and starts shipping to standbys of its own on
+// replication_listen. Clients should RECONCILE with reserve after a
+// failover to re-reserve id's from lost ops.
+//
+// Admin socket: with admin_socket set, a thread of its own answers one
+// command per connection, never entering Execute or the sequence batcher:
+//
+//   stats [json]       totals, per namespace counts, Execute and per op
+//                      latency (Prometheus text by default)
+//   holdings [json]    shared memory id's held per owner pid
+//   release ID...      force release id's, e.g. of a client that is gone
+//   reap               release shared memory id's of exited owner pids
+//
+// stats and holdings read counters the registry publishes to atomics after
+// every change, and the lock-free histograms and shared memory block, so a
+// scrape never waits on or delays an op. release takes the registry lock
+// and is replicated like a DELETE. reap leaves id's with owner 0, the ones
+// re-reserved by RECONCILE, alone.
+//
+// Tracing: Execute and every op record begin and end events into a fixed
+// size ring (see common/trace.h), written as Chrome trace-event JSON on
+// CIDMGR_TRACE or when the process gets SIGUSR2. The SIGUSR2 handler is
+// only installed if nothing else handles the signal.
+//
+// Partitioned nodes allocate only inside their own range (see NodeLayout in
+// common/id_layout.h), so several cidmgr nodes behind a load balancer never
+// issue the same id and no cross node traffic is needed. Clients route
+// DELETEs to the owning node by the node id bits.
+//
+// Every cidmgr model, and every instance of one, loaded in a server has
+// its own registry. A Context whose node range or shm_name overlaps one
+// already loaded in the process fails to load, so two models serving one
+// server (e.g. cidmgr and cidmgr_packed) must be distinct nodes.
+//
+// The shared memory block is [1, shm_ids]; id's handed out through Execute
+// start after it. The shared memory block belongs to the default namespace.
 
 namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
 namespace backend {
 
+// Number of op codes, for the per op latency.
+const int kOpCodes = CIDMGR_PROMOTE + 1;
+
 // Context object. All state must be kept in this object.
 class Context: public nic::CustomInstance {
  public:
@@ -72,29 +245,230 @@ class Context: public nic::CustomInstance {
       const uint32_t payload_cnt, CustomPayload* payloads,
       CustomGetNextInputFn_t input_fn, CustomGetOutputFn_t output_fn);
 
-  // Stats
+  // Stats for the namespace with key, or all namespaces for key 0.
   // In use reserved context id's
-  uint64_t Active() const { return (uint64_t)reserved_.size();}
+  uint64_t Active(uint32_t key) const;
   // No longer in use, created id's
-  uint64_t Inactive() const { return (uint64_t)available_.size(); }
+  uint64_t Inactive(uint32_t key) const;
   // Peak number of contexts in use at one time
-  uint64_t Peak() const { return next_correlation_id_-1; }
+  uint64_t Peak(uint32_t key) const;
 
  private:
+  // Validate the tensors of the control and CODE / CORRELATION_ID format.
+  int InitTensors();
+
+  // Validate the tensors of the packed REQUEST / RESPONSE format.
+  int InitPackedTensors();
+
+  // Execute a packed REQUEST payload.
+  int ExecutePacked(
+      CustomPayload& payload, CustomGetNextInputFn_t input_fn,
+      CustomGetOutputFn_t output_fn, uint64_t execute_start);
+
+  // Run op 'code'. The single value ops take 'arg' and leave their result
+  // in *value; NEW creates 'count' id's in namespace 'arg', into *value for
+  // one and *words for more. The bulk ops take 'count' id's and leave
+  // their bitmask in *words.
+  int RunOp(
+      int8_t code, uint64_t arg, const uint64_t* ids, size_t count,
+      uint64_t* value, std::vector<uint64_t>* words, ScopedTrace* trace);
+
+  // RunOp() on the registry, with registry_mu_ held.
+  int RunRegistryOp(
+      int8_t code, uint64_t arg, const uint64_t* ids, size_t count,
+      uint64_t* value, std::vector<uint64_t>* words, ScopedTrace* trace);
+
+  // Replication gating around every registry write. BeginWrite() refuses
+  // it with kNoStandby while replication_require_standby is set and no
+  // standby is in sync. EndWrite() holds the response until the standbys
+  // are close enough behind, and turns a write's kSuccess into
+  // kNotReplicated if no standby in sync acknowledged it.
+  int BeginWrite();
+  int EndWrite(int err);
+
+  // Start as a standby, or as a primary if replication_listen is set.
+  int InitReplication();
+
+  // Bind replication_listen_ into *listen_fd, -1 if it is not set.
+  int ListenReplication(int* listen_fd);
+
+  // Ship the op log on the socket from ListenReplication(), if any, from
+  // sequence 'seq'.
+  void StartPrimary(uint64_t seq, int listen_fd);
+
+  // Stop following the primary and take over, leaving the last sequence
+  // number applied in *value.
+  int Promote(uint64_t* value);
+
+  // Append a registry change to the op log if we are a primary. Requires
+  // registry_mu_.
+  void Replicate(uint32_t op, uint32_t key, uint64_t id);
+
+  // The live state of the registries as op log records, for a standby.
+  // Requires registry_mu_.
+  void Snapshot(std::vector<ReplicationRecord>* records);
+
+  // Apply op log records from the primary.
+  void ApplyReplication(
+      bool reset, const ReplicationRecord* records, size_t count);
+
+  // Start the admin listener if admin_socket is set.
+  int InitAdmin();
+
+  // Reply to an admin socket command.
+  std::string Admin(const std::string& line);
+  std::string AdminStats(bool json);
+  std::string AdminHoldings(bool json);
+  std::string AdminRelease(const std::vector<std::string>& ids);
+  std::string AdminReap();
+
+  // Publish the registry's counters for the admin socket. Requires
+  // registry_mu_.
+  void Publish(const Registry* registry);
+  void Publish(const SparseRegistry* registry);
+  void PublishAll();
+
+  // Set up the trace ring and the SIGUSR2 dump.
+  int InitTrace();
+
+  // Write the trace ring to trace_file_, number of events or -1.
+  int64_t WriteTrace();
+
+  // Look up a string model config parameter, false if not set.
+  bool GetParameter(const std::string& key, std::string* value) const;
+
+  // Read the namespace and node partitioning of the id space.
+  int InitLayout();
+
+  // Claim this node's range of the id space and its shared memory name
+  // in the process, failing if another Context already has either.
+  int ClaimRange();
+  void ReleaseRange();
+
+  // Publish the same-host shared memory id block if configured.
+  int InitSharedMemory();
+
+  // Read the registry sizing parameters.
+  int InitCapacity();
+
+  // Set up the default and pre-registered namespaces.
+  int InitNamespaces();
+
+  // New registry for the namespace with the given base, pre-sized.
+  Registry* MakeRegistry(uint64_t base, uint64_t first);
+
+  // Registry for the namespace key, registering it if 'create'.
+  // nullptr if unknown (and not created) or out of namespaces.
+  Registry* Namespace(uint32_t key, bool create);
+
   int GetInputTensor(
       CustomGetNextInputFn_t input_fn, void* input_context, const char* name,
       const size_t expected_byte_size, std::vector<uint8_t>* input);
 
-  // generate a new correlation id, 0 is an error.
-  uint64_t NewCorrelationID();
+  // Write a [count] uint64 output tensor.
+  int WriteOutput(
+      CustomPayload& payload, CustomGetOutputFn_t output_fn,
+      const char* output_name, const uint64_t* values, size_t count);
+
+  // Number of elements in the payload's input, 1 when not given.
+  size_t InputElementCount(const CustomPayload& payload, const char* name) const;
+
+  // Is the id reserved, 0 or 1.
+  uint64_t Live(uint64_t id) const;
+
+  // VALIDATE and RECONCILE of count ids into ceil(count / 64) words.
+  void Probe(
+      const uint64_t* ids, size_t count, bool reconcile, uint64_t* bits);
+
+  // Liveness of the ids of a block of up to 64 selected by 'select', as a
+  // bitmask.
+  uint64_t ProbeLive(const uint64_t* block, size_t n, uint64_t select) const;
+
+  // Registry holding the id, nullptr if none.
+  Registry* Owner(uint64_t id) const;
+
+  // Is arg a valid namespace key or prefix for NEW.
+  bool ValidNewArg(uint64_t arg) const;
+
+  // generate a new correlation id in the namespace, or under the prefix
+  // with a sparse id space, 0 is an error.
+  uint64_t NewCorrelationID(uint64_t arg);
 
   // clear an already registered correlation id.
   int ClearCorrelationID(uint64_t id);
 
-  // registry of active ID's.
-  std::unordered_set<uint64_t> reserved_;
-  std::set<uint64_t> available_;
-  uint64_t next_correlation_id_;
+  // registry of active ID's per namespace, indexed by namespace number.
+  // Namespace 0 is the default namespace.
+  std::vector<std::unique_ptr<Registry>> namespaces_;
+  std::unordered_map<uint32_t, uint32_t> namespace_numbers_;
+  uint32_t namespace_bits_;
+
+  // this node's range of the id space.
+  NodeLayout node_;
+  bool range_claimed_;
+
+  // the whole range as one sparse registry instead of the namespaces, for
+  // id_space "sparse".
+  std::unique_ptr<SparseRegistry> sparse_;
+  bool sparse_ids_;
+
+  // CORRELATION_ID and OUTPUT are variable size, for the bulk ops.
+  bool variable_size_;
+
+  // The model uses the packed REQUEST / RESPONSE format.
+  bool packed_;
+
+  // Log every request's inputs and payload count, for debugging only.
+  bool verbose_;
+
+  // event trace ring, and the thread writing it on SIGUSR2.
+  std::unique_ptr<TraceRing> trace_;
+  std::string trace_file_;
+  std::thread trace_thread_;
+  std::mutex trace_mu_;
+  std::condition_variable trace_cv_;
+  bool trace_stop_;
+
+  // registry sizing: id cap per namespace, id's to pre-size each
+  // namespace for, and whether to use huge pages for it.
+  uint64_t max_ids_;
+  uint64_t prepare_ids_;
+  bool huge_pages_;
+  size_t prepared_bytes_;
+
+  // same-host shared memory block of id's [base + 1, base + shm_ids_].
+  std::unique_ptr<ShmRegistry> shm_;
+  uint64_t shm_ids_;
+
+  // Guards the registries against the replication threads.
+  std::mutex registry_mu_;
+
+  // op log shipping, as the primary or as a standby. Swapped on
+  // promotion under registry_mu_.
+  std::unique_ptr<ReplicationPrimary> primary_;
+  std::unique_ptr<ReplicationStandby> standby_;
+  std::string replication_listen_;
+  uint64_t replication_max_unacked_;
+  uint32_t replication_ack_timeout_ms_;
+  bool replication_require_standby_;
+
+  // Counters of one namespace, written under registry_mu_ and read by the
+  // admin thread without it.
+  struct PublishedStats {
+    std::atomic<uint32_t> key;
+    std::atomic<uint64_t> active;
+    std::atomic<uint64_t> inactive;
+    std::atomic<uint64_t> peak;
+  };
+  std::unique_ptr<PublishedStats[]> published_;
+  std::atomic<uint32_t> published_count_;
+  std::atomic<bool> published_standby_;
+
+  // Execute and registry op latency, by op code.
+  Histogram execute_latency_;
+  Histogram op_latency_[kOpCodes];
+
+  std::unique_ptr<AdminServer> admin_;
 
  public:
     static const int kSuccess = nic::ErrorCodes::Success;
@@ -115,7 +489,7 @@ class Context: public nic::CustomInstance {
     const int kInputName = RegisterError(
       "model inputs must be named 'CODE' and 'CORRELATION_ID'");
     const int kOutputName = RegisterError(
-      "model output must be named 'OUTPUT'");
+      "model outputs must be named 'OUTPUT' and 'TIMING'");
     const int kInputOutputDataType = RegisterError(
       "model inputs and output must have TYPE_INT32 data-type");
     const int kInputContents = RegisterError(
@@ -136,6 +510,40 @@ class Context: public nic::CustomInstance {
       "out of calid correlation id space); clients leaking");
     const int kDeleteWhileActive = RegisterError(
       "deleting corelation id mgr context while there are active contexts");
+    const int kInvalidParameter = RegisterError(
+      "invalid model configuration parameter value");
+    const int kSharedMemory = RegisterError(
+      "unable to create the shared memory registry");
+    const int kOutOfNamespaces = RegisterError(
+      "out of correlation id namespaces");
+    const int kTraceFile = RegisterError(
+      "unable to write the trace file");
+    const int kVariableSize = RegisterError(
+      "CIDMGR_VALIDATE and CIDMGR_RECONCILE of more than one id need "
+      "CORRELATION_ID and OUTPUT dims [ -1 ]");
+    const int kPackedConfig = RegisterError(
+      "packed models must have one UINT64 'REQUEST' input and one UINT64 "
+      "'RESPONSE' output with dims [ -1 ]");
+    const int kStandby = RegisterError(
+      "standby replica, only stats until promoted with CIDMGR_PROMOTE");
+    const int kNotSynced = RegisterError(
+      "standby has not synced with the primary yet, unable to promote");
+    const int kReplication = RegisterError(
+      "unable to listen on replication_listen");
+    const int kNoStandby = RegisterError(
+      "no replication standby is in sync and replication_require_standby "
+      "is set, refusing the op");
+    const int kNotReplicated = RegisterError(
+      "no replication standby in sync acknowledged the op, it took effect "
+      "on the primary only; RECONCILE once a standby is back");
+    const int kAdminSocket = RegisterError(
+      "unable to listen on admin_socket");
+    const int kInvalidPrefix = RegisterError(
+      "invalid CIDMGR_NEW argument, id prefixes need id_space \"sparse\" "
+      "and namespaces are not available with it");
+    const int kRangeInUse = RegisterError(
+      "another cidmgr model instance in this process allocates from the same "
+      "id range or shm_name, give each a distinct node_id (see node_id_bits)");
 
 };
 
@@ -143,13 +551,38 @@ Context::Context(
     const std::string& instance_name, const ni::ModelConfig& model_config,
     const int gpu_device)
     : CustomInstance(instance_name, model_config, gpu_device),
-      reserved_(), available_(), next_correlation_id_(1)
+      namespaces_(), namespace_numbers_(),
+      namespace_bits_(DEFAULT_NAMESPACE_BITS), node_(), range_claimed_(false),
+      sparse_(),
+      sparse_ids_(false),
+      variable_size_(false), packed_(false), verbose_(false), trace_(), trace_file_(), trace_thread_(),
+      trace_mu_(), trace_cv_(), trace_stop_(false),
+      max_ids_(MAX_CORRELATION_ID), prepare_ids_(0), huge_pages_(false),
+      prepared_bytes_(0), shm_(), shm_ids_(0), registry_mu_(), primary_(),
+      standby_(), replication_listen_(),
+      replication_max_unacked_(DEFAULT_REPLICATION_MAX_UNACKED),
+      replication_ack_timeout_ms_(DEFAULT_REPLICATION_ACK_TIMEOUT_MS),
+      replication_require_standby_(false),
+      published_(), published_count_(0), published_standby_(false),
+      execute_latency_(), op_latency_(), admin_()
 {
 }
 
 Context::~Context() 
 {
-
+  // The admin and replication threads use the registries, stop them first.
+  admin_.reset();
+  standby_.reset();
+  primary_.reset();
+  {
+    std::lock_guard<std::mutex> lock(trace_mu_);
+    trace_stop_ = true;
+  }
+  trace_cv_.notify_all();
+  if (trace_thread_.joinable()) {
+    trace_thread_.join();
+  }
+  ReleaseRange();
 }
 
 int
@@ -161,6 +594,61 @@ Context::Init()
     return kGpuNotSupported;
   }
 
+  // A single REQUEST input selects the packed request format.
+  packed_ = (model_config_.input_size() == 1) &&
+            (model_config_.input(0).name() == "REQUEST");
+  int err = packed_ ? InitPackedTensors() : InitTensors();
+  if (err != kSuccess) {
+    return err;
+  }
+
+  std::string verbose;
+  verbose_ = GetParameter("verbose", &verbose) && (verbose == "1");
+
+  err = InitTrace();
+  if (err != kSuccess) {
+    return err;
+  }
+  err = InitLayout();
+  if (err != kSuccess) {
+    return err;
+  }
+  err = ClaimRange();
+  if (err != kSuccess) {
+    return err;
+  }
+  err = InitSharedMemory();
+  if (err != kSuccess) {
+    return err;
+  }
+  err = InitCapacity();
+  if (err != kSuccess) {
+    return err;
+  }
+
+  const uint64_t warmup_start = MonotonicNanos();
+  err = InitNamespaces();
+  if ((err == kSuccess) && (prepare_ids_ != 0)) {
+    LOG_INFO << "Correlation ID Mgr warmed up " << namespaces_.size()
+             << " namespaces for " << prepare_ids_ << " id's each, "
+             << (prepared_bytes_ / (1024.0 * 1024.0)) << " MB"
+             << (huge_pages_ ? " on huge pages" : "") << " in "
+             << ((MonotonicNanos() - warmup_start) / 1e6) << " ms"
+             << std::endl;
+  }
+  if (err != kSuccess) {
+    return err;
+  }
+  err = InitReplication();
+  if (err != kSuccess) {
+    return err;
+  }
+  return InitAdmin();
+}
+
+int
+Context::InitTensors()
+{
   // The model configuration must specify the sequence batcher and
   // must use the START and READY input to indicate control values.
   if (!model_config_.has_sequence_batching()) {
@@ -206,9 +694,11 @@ Context::Init()
   }
 
   // There must be one uint64 input called CORRELATION_ID 
-  // defined in the model configuration with shape [1].
+  // defined in the model configuration with shape [1], or [-1] for the
+  // bulk ops.
   if ((model_config_.input(1).dims().size() != 1) ||
-      (model_config_.input(1).dims(0) != 1)) {
+      ((model_config_.input(1).dims(0) != 1) &&
+       (model_config_.input(1).dims(0) != -1))) {
     return kInputOutput;
   }
   if (model_config_.input(1).data_type() != ni::DataType::TYPE_UINT64) {
@@ -218,22 +708,448 @@ Context::Init()
     return kInputName;
   }
 
-  // There must be one uint64 output with shape [1]. The output must be
-  // named OUTPUT.
-  if (model_config_.output_size() != 1) {
+  // There must be one uint64 output with shape [1], or [-1] for the bulk
+  // ops. The output must be named OUTPUT. It may be followed by the
+  // optional uint64 TIMING output with shape [3].
+  if ((model_config_.output_size() != 1) &&
+      (model_config_.output_size() != 2)) {
     return kInputOutput;
   }
+  if (model_config_.output_size() == 2) {
+    if ((model_config_.output(1).dims().size() != 1) ||
+        (model_config_.output(1).dims(0) != 3)) {
+      return kInputOutput;
+    }
+    if (model_config_.output(1).data_type() != ni::DataType::TYPE_UINT64) {
+      return kInputOutputDataType;
+    }
+    if (model_config_.output(1).name() != "TIMING") {
+      return kOutputName;
+    }
+  }
   if ((model_config_.output(0).dims().size() != 1) ||
-      (model_config_.output(0).dims(0) != 1)) {
+      ((model_config_.output(0).dims(0) != 1) &&
+       (model_config_.output(0).dims(0) != -1))) {
     return kInputOutput;
   }
+  variable_size_ = (model_config_.input(1).dims(0) == -1) &&
+                   (model_config_.output(0).dims(0) == -1);
   if (model_config_.output(0).data_type() != ni::DataType::TYPE_UINT64) {
     return kInputOutputDataType;
   }
   if (model_config_.output(0).name() != "OUTPUT") {
     return kOutputName;
   }
+  return kSuccess;
+}
+
+int
+Context::InitPackedTensors()
+{
+  // One uint64 REQUEST input and one uint64 RESPONSE output, both [ -1 ]
+  // (see common/packed_request.h). No sequence batcher, so no controls;
+  // the single instance still serializes the requests.
+  if (model_config_.max_batch_size() != 1) {
+    return kBatchNotOne;
+  }
+  if ((model_config_.input_size() != 1) ||
+      (model_config_.output_size() != 1) ||
+      (model_config_.output(0).name() != "RESPONSE")) {
+    return kPackedConfig;
+  }
+  if ((model_config_.input(0).data_type() != ni::DataType::TYPE_UINT64) ||
+      (model_config_.input(0).dims().size() != 1) ||
+      (model_config_.input(0).dims(0) != -1)) {
+    return kPackedConfig;
+  }
+  if ((model_config_.output(0).data_type() != ni::DataType::TYPE_UINT64) ||
+      (model_config_.output(0).dims().size() != 1) ||
+      (model_config_.output(0).dims(0) != -1)) {
+    return kPackedConfig;
+  }
+  variable_size_ = true;
+  return kSuccess;
+}
+
+bool
+Context::GetParameter(const std::string& key, std::string* value) const
+{
+  const auto& params = model_config_.parameters();
+  auto it = params.find(key);
+  if (it == params.end()) {
+    return false;
+  }
+  *value = it->second.string_value();
+  return true;
+}
+
+namespace {
+
+// Bumped by every SIGUSR2, each Context writes its trace when it changes.
+std::atomic<uint32_t> trace_signals(0);
+
+void
+TraceSignalHandler(int signum)
+{
+  trace_signals.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Install the SIGUSR2 handler once, unless something else already has one.
+void
+InstallTraceSignal()
+{
+  static std::once_flag once;
+  std::call_once(once, []() {
+    struct sigaction current;
+    if ((sigaction(SIGUSR2, nullptr, &current) != 0) ||
+        (current.sa_handler != SIG_DFL)) {
+      LOG_ERROR << "Correlation ID Mgr SIGUSR2 already handled, "
+                << "trace dump by signal disabled" << std::endl;
+      return;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = TraceSignalHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &action, nullptr);
+  });
+}
+
+}  // namespace
+
+int
+Context::InitTrace()
+{
+  std::string value;
+  uint64_t events = DEFAULT_TRACE_EVENTS;
+  if (GetParameter("trace_events", &value)) {
+    try {
+      events = std::stoull(value);
+    } catch (const std::exception&) {
+      return kInvalidParameter;
+    }
+  }
+  if (events == 0) {
+    return kSuccess;
+  }
+  trace_.reset(new TraceRing(events));
+
+  if (!GetParameter("trace_file", &trace_file_) || trace_file_.empty()) {
+    std::stringstream path;
+    path << "/tmp/cidmgr_trace." << instance_name_ << "." << getpid()
+         << ".json";
+    trace_file_ = path.str();
+  }
+
+  if (GetParameter("trace_signal", &value) && (value == "0")) {
+    return kSuccess;
+  }
+  InstallTraceSignal();
+  trace_thread_ = std::thread([this]() {
+    uint32_t seen = trace_signals.load(std::memory_order_relaxed);
+    std::unique_lock<std::mutex> lock(trace_mu_);
+    while (!trace_stop_) {
+      trace_cv_.wait_for(
+          lock, std::chrono::milliseconds(TRACE_SIGNAL_POLL_MS));
+      const uint32_t signals = trace_signals.load(std::memory_order_relaxed);
+      if (signals != seen) {
+        seen = signals;
+        const int64_t written = WriteTrace();
+        LOG_INFO << "Correlation ID Mgr wrote " << written
+                 << " trace events to " << trace_file_ << std::endl;
+      }
+    }
+  });
+  return kSuccess;
+}
+
+int64_t
+Context::WriteTrace()
+{
+  if (!trace_) {
+    return -1;
+  }
+  return WriteChromeTrace(*trace_, trace_file_, "cidmgr " + instance_name_);
+}
+
+int
+Context::InitLayout()
+{
+  std::string value;
+  try {
+    if (GetParameter("namespace_bits", &value)) {
+      namespace_bits_ = std::stoul(value);
+    }
+    if (GetParameter("node_id_bits", &value)) {
+      node_.node_bits = std::stoul(value);
+    }
+    if (GetParameter("node_id", &value)) {
+      node_.node_id = std::stoul(value);
+    }
+    node_.node_shift = 63 - node_.node_bits;
+    if (GetParameter("node_stride_bits", &value)) {
+      node_.node_shift = std::stoul(value);
+    }
+  } catch (const std::exception&) {
+    return kInvalidParameter;
+  }
+
+  if (namespace_bits_ > MAX_NAMESPACE_BITS) {
+    return kInvalidParameter;
+  }
+  if (GetParameter("id_space", &value)) {
+    if ((value != "dense") && (value != "sparse")) {
+      return kInvalidParameter;
+    }
+    sparse_ids_ = (value == "sparse");
+  }
+  // A sparse id space has no namespaces to pre-register.
+  if (sparse_ids_ && GetParameter("namespaces", &value) && !value.empty()) {
+    return kInvalidParameter;
+  }
+  if (node_.node_bits == 0) {
+    // Unpartitioned, the layout is all zero.
+    if (node_.node_id != 0) {
+      return kInvalidParameter;
+    }
+    node_.node_shift = 0;
+    return kSuccess;
+  }
+  // The node field must fit below bit 63, above the namespace field (or at
+  // least CORRELATION_ID_BITS up for a sparse id space), and the node id
+  // inside it.
+  const uint32_t min_shift =
+      CORRELATION_ID_BITS + (sparse_ids_ ? 0 : namespace_bits_);
+  if ((node_.node_bits > 32) ||
+      ((node_.node_shift + node_.node_bits) > 63) ||
+      (node_.node_shift < min_shift) ||
+      (node_.node_id >= (1ull << node_.node_bits))) {
+    return kInvalidParameter;
+  }
+
+  LOG_INFO << "Correlation ID Mgr node " << node_.node_id << " of "
+           << (1ull << node_.node_bits) << ", id's from " << node_.Base()
+           << std::endl;
+  return kSuccess;
+}
+
+namespace {
+
+// Id ranges and shared memory names of the Contexts loaded in this
+// process. Two models, or two instances of one, allocating from the same
+// range would hand out the same id's, and a second shared memory block
+// under one name would close the first. Each model loads its own copy of
+// libcidmgr.so, so the claims can not live in this library's statics;
+// they are kept in a small shared memory table named for the process, and
+// flock() on it serializes the copies.
+const size_t kMaxRangeClaims = 64;
+
+struct RangeClaim {
+  uint64_t owner;
+  uint64_t first;
+  uint64_t last;
+  char shm_name[256];
+};
+
+struct RangeClaims {
+  // start time of the process that wrote the table, a table left behind
+  // by an earlier process with the same pid is reset.
+  uint64_t start_time;
+  uint64_t count;
+  RangeClaim claims[kMaxRangeClaims];
+};
+
+std::string
+RangeClaimsName()
+{
+  return "/cidmgr-claims." + std::to_string(getpid());
+}
+
+uint64_t
+ProcessStartTime()
+{
+  // field 22 of /proc/self/stat, counted after the parenthesized comm.
+  std::ifstream proc_stat("/proc/self/stat");
+  std::string line;
+  if (!std::getline(proc_stat, line) ||
+      (line.rfind(')') == std::string::npos)) {
+    return 0;
+  }
+  std::istringstream fields(line.substr(line.rfind(')') + 1));
+  std::string field;
+  int index = 2;
+  while ((index < 22) && (fields >> field)) {
+    ++index;
+  }
+  return (index == 22) ? std::strtoull(field.c_str(), nullptr, 10) : 0;
+}
+
+// Open and lock the table, returns the locked fd or -1.
+int
+OpenRangeClaims(RangeClaims** claims)
+{
+  const std::string name = RangeClaimsName();
+  for (;;) {
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+    if (fd < 0) {
+      return -1;
+    }
+    struct stat st;
+    if ((flock(fd, LOCK_EX) != 0) || (fstat(fd, &st) != 0)) {
+      close(fd);
+      return -1;
+    }
+    if (st.st_nlink == 0) {
+      // the last claim was released and the table unlinked while we
+      // waited for the lock, open the current one.
+      close(fd);
+      continue;
+    }
+    if ((static_cast<size_t>(st.st_size) < sizeof(RangeClaims)) &&
+        (ftruncate(fd, sizeof(RangeClaims)) != 0)) {
+      close(fd);
+      return -1;
+    }
+    void* addr = mmap(
+      nullptr, sizeof(RangeClaims), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    *claims = static_cast<RangeClaims*>(addr);
+    const uint64_t start_time = ProcessStartTime();
+    if (((*claims)->start_time != start_time) ||
+        ((*claims)->count > kMaxRangeClaims)) {
+      memset(*claims, 0, sizeof(RangeClaims));
+      (*claims)->start_time = start_time;
+    }
+    return fd;
+  }
+}
+
+// Unmap and unlock the table, unlinking it when no claims are left.
+void
+CloseRangeClaims(int fd, RangeClaims* claims)
+{
+  if (claims->count == 0) {
+    shm_unlink(RangeClaimsName().c_str());
+  }
+  munmap(claims, sizeof(RangeClaims));
+  close(fd);
+}
+
+}  // namespace
+
+int
+Context::ClaimRange()
+{
+  RangeClaim claim;
+  memset(&claim, 0, sizeof(claim));
+  claim.owner = reinterpret_cast<uintptr_t>(this);
+  claim.first = node_.Base();
+  claim.last = (node_.node_bits == 0)
+                   ? (CIDMGR_RELEASE_BIT - 1)
+                   : (claim.first + ((1ull << node_.node_shift) - 1));
+  std::string shm_name;
+  GetParameter("shm_name", &shm_name);
+  strncpy(claim.shm_name, shm_name.c_str(), sizeof(claim.shm_name) - 1);
+
+  RangeClaims* claims = nullptr;
+  int fd = OpenRangeClaims(&claims);
+  if (fd < 0) {
+    LOG_ERROR << "Correlation ID Mgr could not open the process range "
+              << "claims, overlapping models are not detected: "
+              << strerror(errno) << std::endl;
+    return kSuccess;
+  }
+  int err = kSuccess;
+  for (uint64_t i = 0; i < claims->count; ++i) {
+    const RangeClaim& other = claims->claims[i];
+    if (((claim.first <= other.last) && (other.first <= claim.last)) ||
+        ((claim.shm_name[0] != '\0') &&
+         (strcmp(claim.shm_name, other.shm_name) == 0))) {
+      err = kRangeInUse;
+      break;
+    }
+  }
+  if ((err == kSuccess) && (claims->count < kMaxRangeClaims)) {
+    claims->claims[claims->count++] = claim;
+    range_claimed_ = true;
+  } else if (err == kSuccess) {
+    LOG_ERROR << "Correlation ID Mgr process range claims are full ("
+              << kMaxRangeClaims << " models), models loaded from now on "
+              << "are not checked for overlaps" << std::endl;
+  }
+  CloseRangeClaims(fd, claims);
+  return err;
+}
+
+void
+Context::ReleaseRange()
+{
+  if (!range_claimed_) {
+    return;
+  }
+  range_claimed_ = false;
+  RangeClaims* claims = nullptr;
+  int fd = OpenRangeClaims(&claims);
+  if (fd < 0) {
+    return;
+  }
+  const uint64_t owner = reinterpret_cast<uintptr_t>(this);
+  for (uint64_t i = 0; i < claims->count; ++i) {
+    if (claims->claims[i].owner == owner) {
+      claims->claims[i] = claims->claims[--claims->count];
+      break;
+    }
+  }
+  CloseRangeClaims(fd, claims);
+}
+
+int
+Context::InitSharedMemory()
+{
+  std::string name, ids, group_name;
+  if (!GetParameter("shm_name", &name) || name.empty()) {
+    return kSuccess;
+  }
+  // The block is a dense range of the default namespace.
+  if (sparse_ids_) {
+    return kInvalidParameter;
+  }
+
+  uint64_t count = DEFAULT_SHM_IDS;
+  if (GetParameter("shm_ids", &ids)) {
+    try {
+      count = std::stoull(ids);
+    } catch (const std::exception&) {
+      return kInvalidParameter;
+    }
+  }
+  if ((count == 0) || (count >= MAX_CORRELATION_ID)) {
+    return kInvalidParameter;
+  }
+
+  int group = -1;
+  if (GetParameter("shm_group", &group_name) && !group_name.empty()) {
+    const struct group* entry = getgrnam(group_name.c_str());
+    if (entry == nullptr) {
+      return kInvalidParameter;
+    }
+    group = static_cast<int>(entry->gr_gid);
+  }
 
+  const uint64_t first = node_.Base() + 1;
+  shm_.reset(ShmRegistry::Create(name, first, count, group));
+  if (!shm_) {
+    return kSharedMemory;
+  }
+  shm_ids_ = count;
+
+  LOG_INFO << "Correlation ID Mgr shared memory registry " << name
+           << " publishing id's [" << first << ", " << (first + count - 1)
+           << "]" << std::endl;
   return kSuccess;
 }
 
@@ -260,13 +1176,18 @@ Context::GetInputTensor(
       break;
     }
 
-    LOG_INFO << std::string(name) << ": size " << content_byte_size << ", ";
-    if (std::string(name) == "CODE") {
-      LOG_INFO << (reinterpret_cast<const int8_t*>(content)[0]) << std::endl;
-    } else if (std::string(name) == "CORRELATION_ID") {
-      LOG_INFO << (reinterpret_cast<const uint64_t*>(content)[0]) << std::endl;
-    } else {
-      LOG_INFO << (reinterpret_cast<const int32_t*>(content)[0]) << std::endl;
+    if (verbose_) {
+      LOG_INFO << std::string(name) << ": size " << content_byte_size << ", ";
+      if (std::string(name) == "CODE") {
+        LOG_INFO << (reinterpret_cast<const int8_t*>(content)[0]) << std::endl;
+      } else if ((std::string(name) == "CORRELATION_ID") ||
+                 (std::string(name) == "REQUEST")) {
+        LOG_INFO << (reinterpret_cast<const uint64_t*>(content)[0])
+                 << std::endl;
+      } else {
+        LOG_INFO << (reinterpret_cast<const int32_t*>(content)[0])
+                 << std::endl;
+      }
     }
 
     // If the total amount of content received exceeds what we expect
@@ -289,73 +1210,1220 @@ Context::GetInputTensor(
   return kSuccess;
 }
 
-// generate a new correlation id, 0 is an error.
-uint64_t 
-Context::NewCorrelationID()
+int
+Context::InitCapacity()
 {
-  auto it = available_.upper_bound(0);
-  uint64_t new_id = next_correlation_id_;
-  if (available_.size() == 0 || it == available_.end()) {
-    if (next_correlation_id_ >= MAX_CORRELATION_ID) {
-      return 0;
+  std::string value;
+  bool expected = false;
+  try {
+    if (GetParameter("max_ids", &value)) {
+      max_ids_ = std::stoull(value);
+      prepare_ids_ = max_ids_;
+    }
+    if (GetParameter("expected_concurrency", &value)) {
+      prepare_ids_ = std::stoull(value);
+      expected = true;
     }
-    next_correlation_id_++;
-  } else {
-    new_id = *it;
-    available_.erase(it);
+  } catch (const std::exception&) {
+    return kInvalidParameter;
   }
-  reserved_.insert(new_id);
-  return new_id;
+  // A sparse id space only caps the id's in use, it may go past 2^30.
+  if ((max_ids_ == 0) || (!sparse_ids_ && (max_ids_ > MAX_CORRELATION_ID)) ||
+      (expected && ((prepare_ids_ == 0) || (prepare_ids_ > max_ids_)))) {
+    return kInvalidParameter;
+  }
+  huge_pages_ = GetParameter("huge_pages", &value) && (value == "1");
+  if (sparse_ids_) {
+    // Nothing to warm up, the tree grows a node at a time.
+    prepare_ids_ = 0;
+  }
+  return kSuccess;
 }
 
-// clear an already registered correlation id.
-int 
-Context::ClearCorrelationID(uint64_t id)
+Registry*
+Context::MakeRegistry(uint64_t base, uint64_t first)
 {
-  auto it = reserved_.find(id);
-  if (it == reserved_.end()) {
-    return kInvalidId;
+  Registry* registry = new Registry(base, first, max_ids_);
+  if (prepare_ids_ != 0) {
+    prepared_bytes_ += registry->Prepare(prepare_ids_, huge_pages_);
   }
-  reserved_.erase(it);
-  available_.insert(id);
-  return kSuccess;
+  return registry;
 }
 
 int
-Context::Execute(
-    const uint32_t payload_cnt, CustomPayload* payloads,
-    CustomGetNextInputFn_t input_fn, CustomGetOutputFn_t output_fn)
+Context::InitNamespaces()
 {
-  LOG_INFO << "Correlation ID Mgr executing " << payload_cnt << " payloads" << std::endl;
+  std::string value;
 
-  // Each payload represents different sequence. Each payload must have
-  // batch-size 1 inputs which is the next timestep for that
-  // sequence. The total number of payloads will not exceed the
-  // max-batch-size specified in the model configuration.
-  // The max-batch-size must be set to 1 in the model configuration.
-  // Each payload must have a batch side of 1.
+  // Registering a namespace never rehashes or reallocates.
+  namespace_numbers_.reserve(1ull << namespace_bits_);
+  namespaces_.reserve(1ull << namespace_bits_);
+  if (!published_) {
+    published_.reset(new PublishedStats[1ull << namespace_bits_]());
+  }
 
-  // We return kSuccess on most errors, and attempt to send back the message.
-  // We want the error on the payload. When that is not possible we return
-  // a real error.
+  if (sparse_ids_) {
+    sparse_.reset(new SparseRegistry(
+        node_.Base(), (node_.node_bits == 0) ? 63 : node_.node_shift,
+        max_ids_));
+    PublishAll();
+    return kSuccess;
+  }
 
-  if (payload_cnt != 1)
-  {
-    for (uint32_t pidx = 0; pidx < payload_cnt; ++pidx) {
-      CustomPayload& payload = payloads[pidx];
-      payload.error_code = kTimesteps;
+  // The default namespace starts after the shared memory block.
+  namespaces_.emplace_back(MakeRegistry(node_.Base(), shm_ids_ + 1));
+
+  if (GetParameter("namespaces", &value)) {
+    std::stringstream names(value);
+    std::string name;
+    while (std::getline(names, name, ',')) {
+      if (!name.empty() &&
+          (Namespace(NamespaceKey(name.data(), name.size()), true) ==
+           nullptr)) {
+        return kOutOfNamespaces;
+      }
     }
-    return kTimesteps;
   }
+  PublishAll();
+  return kSuccess;
+}
 
-  int err;
-
-  CustomPayload& payload = payloads[0];
-  if (payload.batch_size != 1) {
+Registry*
+Context::Namespace(uint32_t key, bool create)
+{
+  if (key == 0) {
+    return namespaces_[0].get();
+  }
+  auto it = namespace_numbers_.find(key);
+  if (it != namespace_numbers_.end()) {
+    return namespaces_[it->second].get();
+  }
+  if (!create || (namespaces_.size() >= (1ull << namespace_bits_))) {
+    return nullptr;
+  }
+  const uint32_t number = static_cast<uint32_t>(namespaces_.size());
+  namespaces_.emplace_back(MakeRegistry(
+      node_.Base() | (static_cast<uint64_t>(number) << CORRELATION_ID_BITS),
+      1));
+  namespace_numbers_[key] = number;
+  Replicate(kReplicateNamespace, key, number);
+  published_[number].key.store(key, std::memory_order_relaxed);
+  Publish(namespaces_.back().get());
+  published_count_.store(number + 1, std::memory_order_release);
+  return namespaces_.back().get();
+}
+
+uint64_t
+Context::Active(uint32_t key) const
+{
+  if (key == 0) {
+    uint64_t active = shm_ ? shm_->Active() : 0;
+    active += sparse_ ? sparse_->Active() : 0;
+    for (const auto& registry : namespaces_) {
+      active += registry->Active();
+    }
+    return active;
+  }
+  auto it = namespace_numbers_.find(key);
+  return (it == namespace_numbers_.end())
+             ? 0 : namespaces_[it->second]->Active();
+}
+
+uint64_t
+Context::Inactive(uint32_t key) const
+{
+  if (key == 0) {
+    uint64_t inactive = sparse_ ? sparse_->Inactive() : 0;
+    for (const auto& registry : namespaces_) {
+      inactive += registry->Inactive();
+    }
+    return inactive;
+  }
+  auto it = namespace_numbers_.find(key);
+  return (it == namespace_numbers_.end())
+             ? 0 : namespaces_[it->second]->Inactive();
+}
+
+uint64_t
+Context::Peak(uint32_t key) const
+{
+  if (key == 0) {
+    uint64_t peak = shm_ ? shm_->Peak() : 0;
+    peak += sparse_ ? sparse_->Peak() : 0;
+    for (const auto& registry : namespaces_) {
+      peak += registry->Peak();
+    }
+    return peak;
+  }
+  auto it = namespace_numbers_.find(key);
+  return (it == namespace_numbers_.end())
+             ? 0 : namespaces_[it->second]->Peak();
+}
+
+bool
+Context::ValidNewArg(uint64_t arg) const
+{
+  // Namespace keys are 32 bits, prefixes have CIDMGR_PREFIX_BIT set.
+  if (!sparse_) {
+    return arg <= 0xffffffffull;
+  }
+  if (arg == 0) {
+    return true;
+  }
+  const uint32_t width = (node_.node_bits == 0) ? 63 : node_.node_shift;
+  return ((arg & CIDMGR_PREFIX_BIT) != 0) &&
+         (PrefixBitsOf(arg) < width) &&
+         ValidPrefix(PrefixOf(arg), PrefixBitsOf(arg));
+}
+
+// generate a new correlation id, 0 is an error.
+uint64_t 
+Context::NewCorrelationID(uint64_t arg)
+{
+  if (sparse_) {
+    const uint64_t id =
+        sparse_->NewCorrelationID(PrefixOf(arg), PrefixBitsOf(arg));
+    if (id != 0) {
+      Replicate(kReplicateReserve, 0, id);
+      Publish(sparse_.get());
+    }
+    return id;
+  }
+  Registry* registry = Namespace(static_cast<uint32_t>(arg), true);
+  if (registry == nullptr) {
+    return 0;
+  }
+  const uint64_t id = registry->NewCorrelationID();
+  if (id != 0) {
+    Replicate(kReplicateReserve, 0, id);
+    Publish(registry);
+  }
+  return id;
+}
+
+// clear an already registered correlation id.
+int 
+Context::ClearCorrelationID(uint64_t id)
+{
+  // Id's from the shared memory block are normally released by the
+  // same-host client directly, but remote deletes are honored as well.
+  if (shm_ && shm_->Contains(id)) {
+    return shm_->Release(id) ? kSuccess : kInvalidId;
+  }
+  if (sparse_) {
+    if (!sparse_->ClearCorrelationID(id)) {
+      return kInvalidId;
+    }
+    Replicate(kReplicateClear, 0, id);
+    Publish(sparse_.get());
+    return kSuccess;
+  }
+
+  Registry* registry = Owner(id);
+  if ((registry == nullptr) || !registry->ClearCorrelationID(id)) {
+    return kInvalidId;
+  }
+  Replicate(kReplicateClear, 0, id);
+  Publish(registry);
+  return kSuccess;
+}
+
+Registry*
+Context::Owner(uint64_t id) const
+{
+  // Id's from other nodes (or outside any node range) are not ours.
+  if ((id & ~((1ull << (CORRELATION_ID_BITS + namespace_bits_)) - 1)) !=
+      node_.Base()) {
+    return nullptr;
+  }
+  const uint64_t number =
+      (id >> CORRELATION_ID_BITS) & ((1ull << namespace_bits_) - 1);
+  if (number >= namespaces_.size()) {
+    return nullptr;
+  }
+  return namespaces_[number].get();
+}
+
+uint64_t
+Context::Live(uint64_t id) const
+{
+  if (shm_ && shm_->Contains(id)) {
+    return shm_->Reserved(id) ? 1 : 0;
+  }
+  if (sparse_) {
+    return sparse_->Live(id);
+  }
+  const Registry* registry = Owner(id);
+  return (registry == nullptr) ? 0 : registry->Live(id);
+}
+
+void
+Context::Probe(
+    const uint64_t* ids, size_t count, bool reconcile, uint64_t* bits)
+{
+  // Build each output word from up to 64 probes. Releases and re-reserves
+  // change the registries and go one id at a time; the plain validations
+  // of the block are gathered together by ProbeLive().
+  for (size_t w = 0; (w * 64) < count; ++w) {
+    const uint64_t* block = ids + (w * 64);
+    const size_t n = std::min<size_t>(64, count - (w * 64));
+    uint64_t word = 0;
+    uint64_t plain = 0;
+    for (size_t i = 0; i < n; ++i) {
+      const uint64_t id = block[i];
+      uint64_t bit;
+      if (id & CIDMGR_RELEASE_BIT) {
+        bit = (ClearCorrelationID(id & ~CIDMGR_RELEASE_BIT) == kSuccess);
+      } else if (!reconcile) {
+        plain |= 1ull << i;
+        continue;
+      } else if (shm_ && shm_->Contains(id)) {
+        // No owner pid is known for a remote re-reserve.
+        bit = shm_->Reserve(id, 0);
+      } else if (sparse_) {
+        bit = sparse_->ReserveCorrelationID(id);
+        if (bit) {
+          Replicate(kReplicateReserve, 0, id);
+          Publish(sparse_.get());
+        }
+      } else {
+        Registry* registry = Owner(id);
+        bit = (registry != nullptr) && registry->ReserveCorrelationID(id);
+        if (bit) {
+          Replicate(kReplicateReserve, 0, id);
+          Publish(registry);
+        }
+      }
+      word |= bit << i;
+    }
+    if (plain != 0) {
+      word |= ProbeLive(block, n, plain);
+    }
+    bits[w] = word;
+  }
+}
+
+uint64_t
+Context::ProbeLive(const uint64_t* block, size_t n, uint64_t select) const
+{
+  uint64_t word = 0;
+  // The shared memory block and the sparse tree are probed one id at a
+  // time.
+  if (shm_ || sparse_) {
+    for (uint64_t rest = select; rest != 0; rest &= rest - 1) {
+      const size_t i = __builtin_ctzll(rest);
+      if (sparse_ || shm_->Contains(block[i])) {
+        word |= Live(block[i]) << i;
+        select &= ~(1ull << i);
+      }
+    }
+  }
+
+  // Group the rest by namespace, namespaces_.size() for ids that are not
+  // this node's, and gather each group from its registry's bitmap.
+  const uint64_t none = namespaces_.size();
+  const uint64_t node_mask =
+      ~((1ull << (CORRELATION_ID_BITS + namespace_bits_)) - 1);
+  uint64_t number[64];
+  for (size_t i = 0; i < n; ++i) {
+    const uint64_t id = block[i];
+    const uint64_t ns =
+        (id >> CORRELATION_ID_BITS) & ((1ull << namespace_bits_) - 1);
+    const bool ours = ((id & node_mask) == node_.Base()) && (ns < none);
+    number[i] = ours ? ns : none;
+  }
+  while (select != 0) {
+    const uint64_t ns = number[__builtin_ctzll(select)];
+    uint64_t group = 0;
+    for (size_t i = 0; i < n; ++i) {
+      group |= static_cast<uint64_t>(number[i] == ns) << i;
+    }
+    group &= select;
+    select &= ~group;
+    if ((ns != none) && namespaces_[ns]) {
+      word |= namespaces_[ns]->Gather(block, n, group);
+    }
+  }
+  return word;
+}
+
+size_t
+Context::InputElementCount(
+    const CustomPayload& payload, const char* name) const
+{
+  for (uint32_t i = 0; i < payload.input_cnt; ++i) {
+    if (strcmp(payload.input_names[i], name) == 0) {
+      size_t count = 1;
+      for (size_t d = 0; d < payload.input_shape_dim_cnts[i]; ++d) {
+        count *= static_cast<size_t>(payload.input_shape_dims[i][d]);
+      }
+      return count;
+    }
+  }
+  return 1;
+}
+
+int
+Context::WriteOutput(
+    CustomPayload& payload, CustomGetOutputFn_t output_fn,
+    const char* output_name, const uint64_t* values, size_t count)
+{
+  const size_t byte_size = count * GetDataTypeByteSize(ni::TYPE_UINT64);
+  std::vector<int64_t> shape;
+  shape.push_back(payload.batch_size);
+  shape.push_back(count);
+
+  void* obuffer;
+  if (!output_fn(
+          payload.output_context, output_name,
+          shape.size(), &shape[0], byte_size, &obuffer)) {
+    return kOutputBuffer;
+  }
+  // If no error but the 'obuffer' is returned as nullptr, then
+  // skip writing this output.
+  if (obuffer != nullptr) {
+    memcpy(obuffer, values, byte_size);
+  }
+  return kSuccess;
+}
+
+namespace {
+
+// Trace event name of an op code.
+const char*
+TraceName(int8_t code)
+{
+  static const char* trace_names[] = {
+      "cidmgr.new",  "cidmgr.delete",   "cidmgr.active",    "cidmgr.inactive",
+      "cidmgr.peak", "cidmgr.node",     "cidmgr.validate",  "cidmgr.reconcile",
+      "cidmgr.trace", "cidmgr.promote"};
+  if ((code >= 0) && (static_cast<size_t>(code) <
+                      (sizeof(trace_names) / sizeof(trace_names[0])))) {
+    return trace_names[code];
+  }
+  return "cidmgr.invalid";
+}
+
+// Op name for the admin stats, the trace name without "cidmgr.".
+const char*
+OpName(int8_t code)
+{
+  return TraceName(code) + strlen("cidmgr.");
+}
+
+// Quantiles reported by the admin stats.
+const double kAdminQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+// One histogram as a Prometheus summary of seconds with the given labels.
+void
+PrometheusSummary(
+    std::ostringstream& out, const char* metric, const std::string& labels,
+    const HistogramSnapshot& h)
+{
+  const std::string sep = labels.empty() ? "" : ",";
+  for (double q : kAdminQuantiles) {
+    out << metric << "{" << labels << sep << "quantile=\"" << q << "\"} "
+        << (h.Percentile(q) * 1e-9) << std::endl;
+  }
+  const std::string braces = labels.empty() ? "" : "{" + labels + "}";
+  out << metric << "_sum" << braces << " " << (h.sum * 1e-9) << std::endl;
+  out << metric << "_count" << braces << " " << h.count << std::endl;
+}
+
+// One histogram as a JSON object of nanoseconds.
+void
+JsonLatency(std::ostringstream& out, const HistogramSnapshot& h)
+{
+  out << "{\"count\":" << h.count << ",\"mean_ns\":" << h.Mean();
+  for (double q : kAdminQuantiles) {
+    out << ",\"p" << (q * 100) << "_ns\":" << h.Percentile(q);
+  }
+  out << ",\"max_ns\":" << h.max << "}";
+}
+
+// Prometheus HELP and TYPE lines.
+void
+PrometheusHeader(
+    std::ostringstream& out, const char* metric, const char* type,
+    const char* help)
+{
+  out << "# HELP " << metric << " " << help << std::endl;
+  out << "# TYPE " << metric << " " << type << std::endl;
+}
+
+}  // namespace
+
+int
+Context::RunOp(
+    int8_t code, uint64_t arg, const uint64_t* ids, size_t count,
+    uint64_t* value, std::vector<uint64_t>* words, ScopedTrace* trace)
+{
+  if (code == CIDMGR_PROMOTE) {
+    return Promote(value);
+  }
+  if (standby_ && ((code == CIDMGR_NEW) || (code == CIDMGR_DELETE) ||
+                   (code == CIDMGR_VALIDATE) || (code == CIDMGR_RECONCILE))) {
+    return kStandby;
+  }
+
+  // A VALIDATE with the release bit on any id frees those ids.
+  bool write = (code == CIDMGR_NEW) || (code == CIDMGR_DELETE) ||
+               (code == CIDMGR_RECONCILE);
+  if (code == CIDMGR_VALIDATE) {
+    uint64_t any = 0;
+    for (size_t i = 0; i < count; ++i) {
+      any |= ids[i];
+    }
+    write = (any & CIDMGR_RELEASE_BIT) != 0;
+  }
+  if (write) {
+    const int err = BeginWrite();
+    if (err != kSuccess) {
+      return err;
+    }
+  }
+
+  int err;
+  {
+    std::lock_guard<std::mutex> lock(registry_mu_);
+    err = RunRegistryOp(code, arg, ids, count, value, words, trace);
+  }
+  return write ? EndWrite(err) : err;
+}
+
+int
+Context::BeginWrite()
+{
+  if (primary_ && replication_require_standby_ && !primary_->InSync()) {
+    return kNoStandby;
+  }
+  return kSuccess;
+}
+
+int
+Context::EndWrite(int err)
+{
+  if (primary_ && !primary_->WaitForAcks() && (err == kSuccess)) {
+    return kNotReplicated;
+  }
+  return err;
+}
+
+int
+Context::RunRegistryOp(
+    int8_t code, uint64_t arg, const uint64_t* ids, size_t count,
+    uint64_t* value, std::vector<uint64_t>* words, ScopedTrace* trace)
+{
+  switch (code) {
+    case CIDMGR_NEW:
+      if (!ValidNewArg(arg)) {
+        return kInvalidPrefix;
+      }
+      if (count == 1) {
+        *value = NewCorrelationID(arg);
+        trace->SetArg(*value);
+        return (*value == 0) ? kOutOfIDS : kSuccess;
+      }
+      // All or nothing, give back what we got if the space runs out.
+      words->resize(count);
+      for (size_t i = 0; i < count; ++i) {
+        (*words)[i] = NewCorrelationID(arg);
+        if ((*words)[i] == 0) {
+          for (size_t j = 0; j < i; ++j) {
+            ClearCorrelationID((*words)[j]);
+          }
+          words->clear();
+          return kOutOfIDS;
+        }
+      }
+      trace->SetArg(count);
+      return kSuccess;
+    case CIDMGR_DELETE:
+      return ClearCorrelationID(arg);
+    case CIDMGR_ACTIVE:
+      *value = Active(static_cast<uint32_t>(arg));
+      return kSuccess;
+    case CIDMGR_INACTIVE:
+      *value = Inactive(static_cast<uint32_t>(arg));
+      return kSuccess;
+    case CIDMGR_PEAK:
+      *value = Peak(static_cast<uint32_t>(arg));
+      return kSuccess;
+    case CIDMGR_NODE:
+      *value = node_.Pack();
+      return kSuccess;
+    case CIDMGR_VALIDATE:
+    case CIDMGR_RECONCILE:
+      // The default config's [ 1 ] CORRELATION_ID takes one id at a time.
+      if (!variable_size_ && (count > 1)) {
+        return kVariableSize;
+      }
+      words->resize((count + 63) / 64);
+      Probe(ids, count, code == CIDMGR_RECONCILE, words->data());
+      trace->SetArg(count);
+      return kSuccess;
+    case CIDMGR_TRACE: {
+      const int64_t written = WriteTrace();
+      if (written < 0) {
+        return kTraceFile;
+      }
+      *value = static_cast<uint64_t>(written);
+      return kSuccess;
+    }
+    default:
+      return kInvalidCode;
+  }
+}
+
+int
+Context::InitReplication()
+{
+  std::string primary, value;
+  GetParameter("replication_listen", &replication_listen_);
+  try {
+    if (GetParameter("replication_max_unacked", &value)) {
+      replication_max_unacked_ = std::stoull(value);
+    }
+    if (GetParameter("replication_ack_timeout_ms", &value)) {
+      replication_ack_timeout_ms_ = std::stoul(value);
+    }
+    if (GetParameter("replication_require_standby", &value)) {
+      replication_require_standby_ = (value == "1");
+    }
+  } catch (const std::exception&) {
+    return kInvalidParameter;
+  }
+  if (replication_max_unacked_ >= MAX_CORRELATION_ID) {
+    return kInvalidParameter;
+  }
+
+  if (!GetParameter("replication_primary", &primary) || primary.empty()) {
+    int listen_fd = -1;
+    const int err = ListenReplication(&listen_fd);
+    if (err == kSuccess) {
+      StartPrimary(0, listen_fd);
+    }
+    return err;
+  }
+  standby_.reset(new ReplicationStandby(
+      primary, [this](
+                   bool reset, const ReplicationRecord* records,
+                   size_t count, uint64_t seq) {
+        ApplyReplication(reset, records, count);
+      }));
+  standby_->Start();
+  published_standby_.store(true, std::memory_order_relaxed);
+  LOG_INFO << "Correlation ID Mgr standby of " << primary << std::endl;
+  return kSuccess;
+}
+
+int
+Context::ListenReplication(int* listen_fd)
+{
+  *listen_fd = -1;
+  if (replication_listen_.empty()) {
+    return kSuccess;
+  }
+  *listen_fd = ReplicationListen(replication_listen_);
+  if (*listen_fd < 0) {
+    LOG_ERROR << "Correlation ID Mgr replication_listen "
+              << replication_listen_ << ": " << strerror(errno) << std::endl;
+    return kReplication;
+  }
+  return kSuccess;
+}
+
+void
+Context::StartPrimary(uint64_t seq, int listen_fd)
+{
+  if (listen_fd < 0) {
+    return;
+  }
+  primary_.reset(new ReplicationPrimary(
+      &registry_mu_,
+      [this](std::vector<ReplicationRecord>* records) { Snapshot(records); },
+      seq, replication_max_unacked_, replication_ack_timeout_ms_,
+      replication_require_standby_));
+  primary_->Listen(listen_fd);
+  LOG_INFO << "Correlation ID Mgr replication primary on "
+           << replication_listen_ << ", at most " << replication_max_unacked_
+           << " ops unacknowledged"
+           << (replication_require_standby_ ? ", standby required" : "")
+           << std::endl;
+}
+
+int
+Context::Promote(uint64_t* value)
+{
+  if (!standby_) {
+    // Already the primary.
+    *value = primary_ ? primary_->Sequence() : 0;
+    return kSuccess;
+  }
+  if (!standby_->Synced()) {
+    return kNotSynced;
+  }
+  // Bind the listener while still a standby, so if that fails the node
+  // stays a standby and the promotion can be retried.
+  int listen_fd = -1;
+  const int err = ListenReplication(&listen_fd);
+  if (err != kSuccess) {
+    return err;
+  }
+  // Stop applying before taking the lock, the standby thread needs it.
+  standby_->Stop();
+  *value = standby_->Applied();
+  std::lock_guard<std::mutex> lock(registry_mu_);
+  standby_.reset();
+  published_standby_.store(false, std::memory_order_relaxed);
+  for (auto& registry : namespaces_) {
+    registry->Fence(replication_max_unacked_);
+  }
+  if (sparse_) {
+    sparse_->Fence(replication_max_unacked_);
+  }
+  PublishAll();
+  LOG_INFO << "Correlation ID Mgr promoted to primary at sequence " << *value
+           << ", fenced " << replication_max_unacked_
+           << " id's per namespace" << std::endl;
+  StartPrimary(*value, listen_fd);
+  return kSuccess;
+}
+
+void
+Context::Replicate(uint32_t op, uint32_t key, uint64_t id)
+{
+  if (primary_) {
+    primary_->Append(op, key, id);
+  }
+}
+
+void
+Context::Snapshot(std::vector<ReplicationRecord>* records)
+{
+  // Namespaces in number order so the standby assigns the same numbers,
+  // then every live id.
+  std::vector<uint32_t> keys(namespaces_.size(), 0);
+  for (const auto& number : namespace_numbers_) {
+    keys[number.second] = number.first;
+  }
+  ReplicationRecord record;
+  for (size_t number = 1; number < keys.size(); ++number) {
+    record.op = kReplicateNamespace;
+    record.key = keys[number];
+    record.id = number;
+    records->push_back(record);
+  }
+  record.op = kReplicateReserve;
+  record.key = 0;
+  for (const auto& registry : namespaces_) {
+    registry->ForEachLive([records, &record](uint64_t id) {
+      record.id = id;
+      records->push_back(record);
+    });
+  }
+  if (sparse_) {
+    sparse_->ForEachLive([records, &record](uint64_t id) {
+      record.id = id;
+      records->push_back(record);
+    });
+  }
+}
+
+void
+Context::ApplyReplication(
+    bool reset, const ReplicationRecord* records, size_t count)
+{
+  std::lock_guard<std::mutex> lock(registry_mu_);
+  if (reset) {
+    published_count_.store(0, std::memory_order_release);
+    namespaces_.clear();
+    namespace_numbers_.clear();
+    sparse_.reset();
+    prepared_bytes_ = 0;
+    InitNamespaces();
+  }
+  for (size_t i = 0; i < count; ++i) {
+    const ReplicationRecord& record = records[i];
+    if (record.op == kReplicateNamespace) {
+      if ((record.id == 0) || (record.id >= (1ull << namespace_bits_))) {
+        continue;
+      }
+      while (namespaces_.size() <= record.id) {
+        namespaces_.emplace_back(MakeRegistry(
+            node_.Base() | (static_cast<uint64_t>(namespaces_.size())
+                            << CORRELATION_ID_BITS),
+            1));
+      }
+      namespace_numbers_[record.key] = static_cast<uint32_t>(record.id);
+      published_[record.id].key.store(record.key, std::memory_order_relaxed);
+      continue;
+    }
+    if (sparse_) {
+      if (record.op == kReplicateReserve) {
+        sparse_->ReserveCorrelationID(record.id);
+      } else if (record.op == kReplicateClear) {
+        sparse_->ClearCorrelationID(record.id);
+      }
+      continue;
+    }
+    Registry* registry = Owner(record.id);
+    if (registry == nullptr) {
+      continue;
+    }
+    if (record.op == kReplicateReserve) {
+      // The primary's high water mark may be anywhere, take the id as is.
+      registry->ReserveCorrelationID(record.id, MAX_CORRELATION_ID);
+    } else if (record.op == kReplicateClear) {
+      registry->ClearCorrelationID(record.id);
+    }
+  }
+  PublishAll();
+}
+
+int
+Context::InitAdmin()
+{
+  std::string path;
+  if (!GetParameter("admin_socket", &path) || path.empty()) {
+    return kSuccess;
+  }
+  admin_.reset(new AdminServer(
+      [this](const std::string& line) { return Admin(line); }));
+  if (!admin_->Listen(path)) {
+    LOG_ERROR << "Correlation ID Mgr admin socket " << path << ": "
+              << strerror(errno) << std::endl;
+    admin_.reset();
+    return kAdminSocket;
+  }
+  LOG_INFO << "Correlation ID Mgr admin socket " << path << std::endl;
+  return kSuccess;
+}
+
+void
+Context::Publish(const Registry* registry)
+{
+  const uint64_t number = (registry->Base() >> CORRELATION_ID_BITS) &
+                          ((1ull << namespace_bits_) - 1);
+  PublishedStats& stats = published_[number];
+  stats.active.store(registry->Active(), std::memory_order_relaxed);
+  stats.inactive.store(registry->Inactive(), std::memory_order_relaxed);
+  stats.peak.store(registry->Peak(), std::memory_order_relaxed);
+}
+
+void
+Context::Publish(const SparseRegistry* registry)
+{
+  // The only "namespace" of a sparse id space.
+  PublishedStats& stats = published_[0];
+  stats.active.store(registry->Active(), std::memory_order_relaxed);
+  stats.inactive.store(registry->Inactive(), std::memory_order_relaxed);
+  stats.peak.store(registry->Peak(), std::memory_order_relaxed);
+}
+
+void
+Context::PublishAll()
+{
+  published_[0].key.store(0, std::memory_order_relaxed);
+  for (const auto& number : namespace_numbers_) {
+    published_[number.second].key.store(
+        number.first, std::memory_order_relaxed);
+  }
+  for (const auto& registry : namespaces_) {
+    Publish(registry.get());
+  }
+  if (sparse_) {
+    Publish(sparse_.get());
+  }
+  published_count_.store(
+      static_cast<uint32_t>(sparse_ ? 1 : namespaces_.size()),
+      std::memory_order_release);
+}
+
+std::string
+Context::Admin(const std::string& line)
+{
+  std::stringstream words(line);
+  std::string command, word;
+  std::vector<std::string> args;
+  words >> command;
+  while (words >> word) {
+    args.push_back(word);
+  }
+  const bool json = !args.empty() && (args[0] == "json");
+
+  if (command == "stats") {
+    return AdminStats(json);
+  }
+  if (command == "holdings") {
+    return AdminHoldings(json);
+  }
+  if (command == "release") {
+    return AdminRelease(args);
+  }
+  if (command == "reap") {
+    return AdminReap();
+  }
+  if (command.empty() || (command == "help")) {
+    return "stats [json]       registry counts and latency\n"
+           "holdings [json]    shared memory id's held per owner pid\n"
+           "release ID...      force release id's\n"
+           "reap               release shared memory id's of exited pids\n";
+  }
+  return "error: unknown command '" + command + "', try help\n";
+}
+
+std::string
+Context::AdminStats(bool json)
+{
+  struct Counts {
+    uint32_t number;
+    uint32_t key;
+    uint64_t active;
+    uint64_t inactive;
+    uint64_t peak;
+  };
+  std::vector<Counts> namespaces(
+      published_count_.load(std::memory_order_acquire));
+  Counts total = {0, 0, 0, 0, 0};
+  for (uint32_t n = 0; n < namespaces.size(); ++n) {
+    const PublishedStats& stats = published_[n];
+    namespaces[n] = {n, stats.key.load(std::memory_order_relaxed),
+                     stats.active.load(std::memory_order_relaxed),
+                     stats.inactive.load(std::memory_order_relaxed),
+                     stats.peak.load(std::memory_order_relaxed)};
+    total.active += namespaces[n].active;
+    total.inactive += namespaces[n].inactive;
+    total.peak += namespaces[n].peak;
+  }
+  const uint64_t shm_active = shm_ ? shm_->Active() : 0;
+  const uint64_t shm_peak = shm_ ? shm_->Peak() : 0;
+  total.active += shm_active;
+  total.peak += shm_peak;
+  const bool standby = published_standby_.load(std::memory_order_relaxed);
+
+  HistogramSnapshot execute;
+  execute_latency_.Snapshot(&execute);
+  std::vector<HistogramSnapshot> ops(kOpCodes);
+  for (int code = 0; code < kOpCodes; ++code) {
+    op_latency_[code].Snapshot(&ops[code]);
+  }
+
+  std::ostringstream out;
+  if (json) {
+    out << "{\"active\":" << total.active << ",\"inactive\":"
+        << total.inactive << ",\"peak\":" << total.peak
+        << ",\"standby\":" << (standby ? "true" : "false")
+        << ",\"namespaces\":[";
+    for (const Counts& counts : namespaces) {
+      out << ((counts.number == 0) ? "" : ",") << "{\"number\":"
+          << counts.number << ",\"key\":" << counts.key
+          << ",\"active\":" << counts.active << ",\"inactive\":"
+          << counts.inactive << ",\"peak\":" << counts.peak << "}";
+    }
+    out << "]";
+    if (shm_) {
+      out << ",\"shm\":{\"active\":" << shm_active << ",\"peak\":"
+          << shm_peak << ",\"capacity\":" << shm_->Capacity() << "}";
+    }
+    out << ",\"latency\":{\"execute\":";
+    JsonLatency(out, execute);
+    for (int code = 0; code < kOpCodes; ++code) {
+      if (ops[code].count != 0) {
+        out << ",\"" << OpName(code) << "\":";
+        JsonLatency(out, ops[code]);
+      }
+    }
+    out << "}}" << std::endl;
+    return out.str();
+  }
+
+  PrometheusHeader(
+      out, "cidmgr_active", "gauge", "Correlation id's in use");
+  out << "cidmgr_active " << total.active << std::endl;
+  PrometheusHeader(
+      out, "cidmgr_inactive", "gauge", "Created correlation id's not in use");
+  out << "cidmgr_inactive " << total.inactive << std::endl;
+  PrometheusHeader(
+      out, "cidmgr_peak", "gauge", "Peak correlation id's in use at once");
+  out << "cidmgr_peak " << total.peak << std::endl;
+  PrometheusHeader(
+      out, "cidmgr_standby", "gauge", "1 while a replication standby");
+  out << "cidmgr_standby " << (standby ? 1 : 0) << std::endl;
+  PrometheusHeader(
+      out, "cidmgr_namespace_active", "gauge",
+      "Correlation id's in use per namespace");
+  for (const Counts& counts : namespaces) {
+    out << "cidmgr_namespace_active{namespace=\"" << counts.number
+        << "\",key=\"" << counts.key << "\"} " << counts.active
+        << std::endl;
+  }
+  PrometheusHeader(
+      out, "cidmgr_namespace_peak", "gauge",
+      "Peak correlation id's in use at once per namespace");
+  for (const Counts& counts : namespaces) {
+    out << "cidmgr_namespace_peak{namespace=\"" << counts.number
+        << "\",key=\"" << counts.key << "\"} " << counts.peak
+        << std::endl;
+  }
+  if (shm_) {
+    PrometheusHeader(
+        out, "cidmgr_shm_active", "gauge",
+        "Shared memory block id's in use");
+    out << "cidmgr_shm_active " << shm_active << std::endl;
+    PrometheusHeader(
+        out, "cidmgr_shm_capacity", "gauge", "Shared memory block id's");
+    out << "cidmgr_shm_capacity " << shm_->Capacity() << std::endl;
+  }
+  PrometheusHeader(
+      out, "cidmgr_execute_seconds", "summary", "Backend Execute time");
+  PrometheusSummary(out, "cidmgr_execute_seconds", "", execute);
+  PrometheusHeader(
+      out, "cidmgr_op_seconds", "summary", "Registry op time by op code");
+  for (int code = 0; code < kOpCodes; ++code) {
+    if (ops[code].count != 0) {
+      PrometheusSummary(
+          out, "cidmgr_op_seconds",
+          std::string("op=\"") + OpName(code) + "\"", ops[code]);
+    }
+  }
+  return out.str();
+}
+
+std::string
+Context::AdminHoldings(bool json)
+{
+  // Owner pids of the shared memory block, straight from the block's
+  // atomics. Owner 0 holds the id's re-reserved by RECONCILE.
+  std::map<uint32_t, uint64_t> owners;
+  if (shm_) {
+    const uint64_t first = shm_->BaseID();
+    for (uint64_t id = first; id < first + shm_->Capacity(); ++id) {
+      if (shm_->Reserved(id)) {
+        ++owners[shm_->Owner(id)];
+      }
+    }
+  }
+
+  std::ostringstream out;
+  if (json) {
+    out << "{\"owners\":[";
+    bool first = true;
+    for (const auto& owner : owners) {
+      out << (first ? "" : ",") << "{\"pid\":" << owner.first
+          << ",\"alive\":"
+          << (((owner.first == 0) || (kill(owner.first, 0) == 0) ||
+               (errno != ESRCH))
+                  ? "true"
+                  : "false")
+          << ",\"ids\":" << owner.second << "}";
+      first = false;
+    }
+    out << "]}" << std::endl;
+    return out.str();
+  }
+  PrometheusHeader(
+      out, "cidmgr_shm_owner_active", "gauge",
+      "Shared memory block id's held per owner pid");
+  for (const auto& owner : owners) {
+    const bool alive = (owner.first == 0) || (kill(owner.first, 0) == 0) ||
+                       (errno != ESRCH);
+    out << "cidmgr_shm_owner_active{pid=\"" << owner.first
+        << "\",alive=\"" << (alive ? 1 : 0) << "\"} " << owner.second
+        << std::endl;
+  }
+  return out.str();
+}
+
+std::string
+Context::AdminRelease(const std::vector<std::string>& ids)
+{
+  // Parse them all first, so a bad id releases none.
+  std::vector<uint64_t> values;
+  values.reserve(ids.size());
+  for (const std::string& id : ids) {
+    try {
+      values.push_back(std::stoull(id, nullptr, 0));
+    } catch (const std::exception&) {
+      return "error: invalid id '" + id + "'\n";
+    }
+  }
+
+  // Gated like the releases of Execute.
+  int err = BeginWrite();
+  if (err != kSuccess) {
+    return std::string("error: ") + ErrorString(err) + "\n";
+  }
+  size_t released = 0;
+  {
+    std::lock_guard<std::mutex> lock(registry_mu_);
+    if (standby_) {
+      return "error: standby replica, release on the primary\n";
+    }
+    for (uint64_t value : values) {
+      if (ClearCorrelationID(value) == kSuccess) {
+        ++released;
+      }
+    }
+  }
+  err = EndWrite(kSuccess);
+  LOG_INFO << "Correlation ID Mgr admin released " << released << " of "
+           << ids.size() << " id's" << std::endl;
+  std::ostringstream out;
+  if (err != kSuccess) {
+    out << "error: " << ErrorString(err) << ", ";
+  }
+  out << "released " << released << " of " << ids.size() << std::endl;
+  return out.str();
+}
+
+std::string
+Context::AdminReap()
+{
+  // Id's the backend re-reserved have owner 0 and no process to check.
+  uint64_t reaped = 0;
+  std::unordered_set<uint32_t> exited;
+  if (shm_) {
+    const uint64_t first = shm_->BaseID();
+    for (uint64_t id = first; id < first + shm_->Capacity(); ++id) {
+      const uint32_t owner = shm_->Owner(id);
+      if ((owner == 0) || !shm_->Reserved(id)) {
+        continue;
+      }
+      if (exited.count(owner) ||
+          ((kill(owner, 0) != 0) && (errno == ESRCH))) {
+        exited.insert(owner);
+        reaped += shm_->ReleaseOwned(id, owner) ? 1 : 0;
+      }
+    }
+  }
+  LOG_INFO << "Correlation ID Mgr admin reaped " << reaped << " id's of "
+           << exited.size() << " exited processes" << std::endl;
+  std::ostringstream out;
+  out << "reaped " << reaped << " id's of " << exited.size()
+      << " exited processes" << std::endl;
+  return out.str();
+}
+
+int
+Context::ExecutePacked(
+    CustomPayload& payload, CustomGetNextInputFn_t input_fn,
+    CustomGetOutputFn_t output_fn, uint64_t execute_start)
+{
+  // The whole request is one input_fn read.
+  const size_t request_count = InputElementCount(payload, "REQUEST");
+  if (request_count < CIDMGR_PACKED_HEADER_WORDS) {
+    payload.error_code = kInputSize;
+    return kSuccess;
+  }
+  std::vector<uint8_t> request_buffer;
+  int err = GetInputTensor(
+      input_fn, payload.input_context, "REQUEST",
+      request_count * GetDataTypeByteSize(ni::TYPE_UINT64), &request_buffer);
+  if (err != kSuccess) {
+    payload.error_code = err;
+    return kSuccess;
+  }
+  const uint64_t* request =
+      reinterpret_cast<const uint64_t*>(&request_buffer[0]);
+
+  const int8_t code = PackedCode(request[0]);
+  const bool timing = (PackedFlags(request[0]) & CIDMGR_PACKED_TIMING) != 0;
+  const uint64_t* ids = request + CIDMGR_PACKED_HEADER_WORDS;
+  const size_t id_count = request_count - CIDMGR_PACKED_HEADER_WORDS;
+  size_t count = 1;
+  if (code == CIDMGR_NEW) {
+    count = std::max<uint64_t>(request[1], 1);
+    if (count > CIDMGR_PACKED_MAX_NEW) {
+      payload.error_code = kInputSize;
+      return kSuccess;
+    }
+  } else if ((code == CIDMGR_VALIDATE) || (code == CIDMGR_RECONCILE)) {
+    count = id_count;
+    if ((count == 0) || (request[1] != count)) {
+      payload.error_code = kInputSize;
+      return kSuccess;
+    }
+  }
+
+  uint64_t value = request[2];
+  std::vector<uint64_t> response;
+  {
+    ScopedTrace op_trace(trace_.get(), TraceName(code), request[2]);
+    const uint64_t op_start = MonotonicNanos();
+    payload.error_code =
+        RunOp(code, request[2], ids, count, &value, &response, &op_trace);
+    const uint64_t op_end = MonotonicNanos();
+    if ((code >= 0) && (code < kOpCodes)) {
+      op_latency_[code].Record(op_end - op_start);
+    }
+    if (payload.error_code != kSuccess) {
+      return kSuccess;
+    }
+    if (response.empty()) {
+      response.push_back(value);
+    }
+    if (timing) {
+      response.push_back(execute_start);
+      response.push_back(op_start);
+      response.push_back(op_end);
+    }
+  }
+
+  for (uint32_t o = 0;
+       (payload.error_code == 0) && (o < payload.output_cnt); ++o) {
+    payload.error_code = WriteOutput(
+        payload, output_fn, payload.required_output_names[o],
+        response.data(), response.size());
+  }
+  return kSuccess;
+}
+
+int
+Context::Execute(
+    const uint32_t payload_cnt, CustomPayload* payloads,
+    CustomGetNextInputFn_t input_fn, CustomGetOutputFn_t output_fn)
+{
+  const uint64_t execute_start = MonotonicNanos();
+  ScopedLatency execute_latency(&execute_latency_);
+  ScopedTrace execute_trace(trace_.get(), "cidmgr.execute", payload_cnt);
+  if (verbose_) {
+    LOG_INFO << "Correlation ID Mgr executing " << payload_cnt << " payloads"
+             << std::endl;
+  }
+
+  // Each payload represents different sequence. Each payload must have
+  // batch-size 1 inputs which is the next timestep for that
+  // sequence. The total number of payloads will not exceed the
+  // max-batch-size specified in the model configuration.
+  // The max-batch-size must be set to 1 in the model configuration.
+  // Each payload must have a batch side of 1.
+
+  // We return kSuccess on most errors, and attempt to send back the message.
+  // We want the error on the payload. When that is not possible we return
+  // a real error.
+
+  if (payload_cnt != 1)
+  {
+    for (uint32_t pidx = 0; pidx < payload_cnt; ++pidx) {
+      CustomPayload& payload = payloads[pidx];
+      payload.error_code = kTimesteps;
+    }
+    return kTimesteps;
+  }
+
+  int err;
+
+  CustomPayload& payload = payloads[0];
+  if (payload.batch_size != 1) {
     payload.error_code = kTimesteps;
     return kTimesteps;
   }
 
+  if (packed_) {
+    return ExecutePacked(payload, input_fn, output_fn, execute_start);
+  }
+
   const size_t batch1_int32_size = GetDataTypeByteSize(ni::TYPE_INT32);
   const size_t batch1_int8_size  = GetDataTypeByteSize(ni::TYPE_INT8);
   const size_t batch1_uint64_size = GetDataTypeByteSize(ni::TYPE_UINT64);
@@ -387,9 +2455,15 @@ Context::Execute(
     return kSuccess;
   }
 
+  const size_t correlation_id_count =
+      InputElementCount(payload, "CORRELATION_ID");
+  if (correlation_id_count == 0) {
+    payload.error_code = kInputSize;
+    return kSuccess;
+  }
   err = GetInputTensor(
-      input_fn, payload.input_context, "CORRELATION_ID", batch1_uint64_size,
-      &correlation_id_buffer);
+      input_fn, payload.input_context, "CORRELATION_ID",
+      correlation_id_count * batch1_uint64_size, &correlation_id_buffer);
   if (err != kSuccess) {
     payload.error_code = err;
     return kSuccess;
@@ -408,54 +2482,38 @@ Context::Execute(
   }
 
   uint64_t output_correlation_id = correlation_id[0];
+  std::vector<uint64_t> bulk_output;
+
+  ScopedTrace op_trace(trace_.get(), TraceName(code[0]), correlation_id[0]);
+  const uint64_t op_start = MonotonicNanos();
+  payload.error_code = RunOp(
+      code[0], correlation_id[0], correlation_id,
+      (code[0] == CIDMGR_NEW) ? 1 : correlation_id_count,
+      &output_correlation_id, &bulk_output, &op_trace);
+  const uint64_t op_end = MonotonicNanos();
+  if ((code[0] >= 0) && (code[0] < kOpCodes)) {
+    op_latency_[code[0]].Record(op_end - op_start);
+  }
 
-  switch (code[0]) {
-    case CIDMGR_NEW:
-      output_correlation_id = NewCorrelationID();
-      if (output_correlation_id == 0)
-      {
-        payload.error_code = kOutOfIDS;
-      }
-      break;
-    case CIDMGR_DELETE:
-      payload.error_code = ClearCorrelationID(output_correlation_id);
-      break;
-    case CIDMGR_ACTIVE:
-      output_correlation_id = Active();
-      break;
-    case CIDMGR_INACTIVE:
-      output_correlation_id = Inactive();
-      break;
-    case CIDMGR_PEAK:
-      output_correlation_id = Peak();
-      break;
-    default:
-      payload.error_code = kInvalidCode;
-  }
-
-  // If the output is requested, copy the calculated output value
-  // into the output buffer.
-  if ((payload.error_code == 0) && (payload.output_cnt > 0)) {
-    const char* output_name = payload.required_output_names[0];
-    
-    // The output shape is [1]
-    std::vector<int64_t> shape;
-    shape.push_back(payload.batch_size);
-    shape.push_back(1);
-    
-    void* obuffer;
-    if (!output_fn(
-            payload.output_context, output_name, 
-            shape.size(), &shape[0],
-            batch1_uint64_size, &obuffer)) {
-      payload.error_code = kOutputBuffer;
-      return kSuccess;
-    }
-    //std::cout << "writing out: " << output_correlation_id << std::endl;
-    // If no error but the 'obuffer' is returned as nullptr, then
-    // skip writing this output.
-    if (obuffer != nullptr) {
-      memcpy(obuffer, &output_correlation_id, batch1_uint64_size);
+  // The output shape is [1], or [words] for the bulk ops.
+  const uint64_t* output = &output_correlation_id;
+  size_t output_count = 1;
+  if (!bulk_output.empty()) {
+    output = bulk_output.data();
+    output_count = bulk_output.size();
+  }
+  const uint64_t timing[3] = {execute_start, op_start, op_end};
+
+  // Copy the calculated values into the requested output buffers.
+  for (uint32_t o = 0;
+       (payload.error_code == 0) && (o < payload.output_cnt); ++o) {
+    const char* output_name = payload.required_output_names[o];
+    if (strcmp(output_name, "TIMING") == 0) {
+      payload.error_code = WriteOutput(
+          payload, output_fn, output_name, timing, 3);
+    } else {
+      payload.error_code = WriteOutput(
+          payload, output_fn, output_name, output, output_count);
     }
   }
 
@@ -0,0 +1,180 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#include "registry.h"
+
+#include <algorithm>
+#include <functional>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
+namespace backend {
+
+namespace {
+
+// Ask for transparent huge pages over the 2MB aligned part of the buffer.
+// Must be called before the memory is first touched to have any effect.
+void
+AdviseHugePages(void* data, size_t bytes)
+{
+#if defined(MADV_HUGEPAGE)
+  const uintptr_t huge_page = 2 * 1024 * 1024;
+  const uintptr_t begin =
+      (reinterpret_cast<uintptr_t>(data) + huge_page - 1) & ~(huge_page - 1);
+  const uintptr_t end =
+      (reinterpret_cast<uintptr_t>(data) + bytes) & ~(huge_page - 1);
+  if (end > begin) {
+    madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE);
+  }
+#endif
+}
+
+}  // namespace
+
+Registry::Registry(uint64_t base, uint64_t first, uint64_t max_ids)
+    : reserved_(), active_(0), available_(), next_correlation_id_(first),
+      first_(first),
+      limit_(std::min<uint64_t>(first + max_ids, MAX_CORRELATION_ID)),
+      base_(base)
+{
+}
+
+size_t
+Registry::Prepare(uint64_t ids, bool huge_pages)
+{
+  ids = std::min(ids, limit_ - first_);
+  const size_t words = (first_ + ids + 63) / 64;
+
+  // Allocate without touching, advise, then touch every page by zero
+  // filling. The heap keeps its capacity when cleared.
+  if (words > reserved_.size()) {
+    reserved_.reserve(words);
+    if (huge_pages) {
+      AdviseHugePages(reserved_.data(), words * sizeof(uint64_t));
+    }
+    reserved_.resize(words, 0);
+  }
+  if (ids > available_.capacity()) {
+    std::vector<uint64_t> available;
+    available.reserve(ids);
+    if (huge_pages) {
+      AdviseHugePages(available.data(), ids * sizeof(uint64_t));
+    }
+    available.assign(available_.begin(), available_.end());
+    available.resize(ids, 0);
+    available.resize(available_.size());
+    available_.swap(available);
+  }
+  return (reserved_.capacity() + available_.capacity()) * sizeof(uint64_t);
+}
+
+uint64_t
+Registry::NewCorrelationID()
+{
+  // Skip heap entries for id's re-reserved since they were cleared.
+  while (!available_.empty()) {
+    std::pop_heap(
+        available_.begin(), available_.end(), std::greater<uint64_t>());
+    const uint64_t new_id = available_.back();
+    available_.pop_back();
+    if (!Live(new_id)) {
+      SetReserved(new_id);
+      return base_ | new_id;
+    }
+  }
+  if (next_correlation_id_ >= limit_) {
+    return 0;
+  }
+  const uint64_t new_id = next_correlation_id_++;
+  SetReserved(new_id);
+  return base_ | new_id;
+}
+
+void
+Registry::SetReserved(uint64_t local)
+{
+  const uint64_t word = local >> 6;
+  if (word >= reserved_.size()) {
+    // Grow geometrically to keep the amortized cost constant.
+    reserved_.resize(std::max<size_t>(word + 1, reserved_.size() * 2), 0);
+  }
+  reserved_[word] |= 1ull << (local & 63);
+  active_++;
+}
+
+void
+Registry::PushAvailable(uint64_t local)
+{
+  // Re-reserves leave stale entries behind, drop them once they are half
+  // the heap. A sorted vector is a valid min-heap.
+  if (available_.size() > (2 * Inactive()) + 64) {
+    available_.erase(
+        std::remove_if(
+            available_.begin(), available_.end(),
+            [this](uint64_t id) { return Live(id) != 0; }),
+        available_.end());
+    std::sort(available_.begin(), available_.end());
+    available_.erase(
+        std::unique(available_.begin(), available_.end()), available_.end());
+  }
+  available_.push_back(local);
+  std::push_heap(
+      available_.begin(), available_.end(), std::greater<uint64_t>());
+}
+
+bool
+Registry::ClearCorrelationID(uint64_t id)
+{
+  if (!Live(id)) {
+    return false;
+  }
+  const uint64_t local = id & (MAX_CORRELATION_ID - 1);
+  reserved_[local >> 6] &= ~(1ull << (local & 63));
+  active_--;
+  PushAvailable(local);
+  return true;
+}
+
+bool
+Registry::ReserveCorrelationID(uint64_t id, uint64_t max_gap)
+{
+  if (Live(id)) {
+    return true;
+  }
+  const uint64_t local = id & (MAX_CORRELATION_ID - 1);
+  if ((local < first_) || (local >= limit_)) {
+    return false;
+  }
+  if (local >= next_correlation_id_) {
+    if (local - next_correlation_id_ > max_gap) {
+      return false;
+    }
+    // The id's skipped over become available.
+    for (; next_correlation_id_ < local; ++next_correlation_id_) {
+      PushAvailable(next_correlation_id_);
+    }
+    next_correlation_id_ = local + 1;
+  }
+  // Below the high water mark the id's heap entry is left in place, and
+  // skipped by NewCorrelationID() while the id is reserved.
+  SetReserved(local);
+  return true;
+}
+
+void
+Registry::Fence(uint64_t count)
+{
+  for (uint64_t held = 0; (held < count) && !available_.empty();) {
+    std::pop_heap(
+        available_.begin(), available_.end(), std::greater<uint64_t>());
+    if (!Live(available_.back())) {
+      ++held;
+    }
+    available_.pop_back();
+  }
+  next_correlation_id_ = std::min(next_correlation_id_ + count, limit_);
+}
+
+}}}}  // namespace dnapoleone::inferenceserver::correlation_id_mgr::backend
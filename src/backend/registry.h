@@ -0,0 +1,135 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Just to be sane, we will set the max to be well below the uint64 max.
+// We will only hit this if contexts are not being cleaned up. 
+// trtis will clean up stale contexts, but this is really a bug in client
+// code, or clients are dying. We want to know about this happening.
+// However we don't want undue errors, or runaway allocation. 
+// This gives us space to see the problem via Peak() stat always increasing 
+// before we get close to an overflow or insane amounts of memory allocated. 
+// This will reach ~4GB of memory allocated before we run out of ID's.
+#define CORRELATION_ID_BITS 30
+#define MAX_CORRELATION_ID (1<<CORRELATION_ID_BITS)
+
+// Re-reserving a local id further than this above the high water mark is
+// refused, so a bogus id can not force the whole range to be created.
+#define MAX_RESERVE_GAP (1<<20)
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
+namespace backend {
+
+// Dense allocator for one id namespace.
+//
+// Local id's are handed out lowest first from [first, first + max_ids),
+// capped at MAX_CORRELATION_ID, and reused lowest first once cleared. Every
+// id handed out has 'base' OR'ed in, which carries the namespace bits above
+// CORRELATION_ID_BITS.
+//
+// Reserved id's are tracked in a flat bitmap over [0, high water mark), so
+// a liveness probe is a shift and a mask with no hashing or branches.
+// Cleared id's wait in a min-heap in a flat vector. Neither allocates per
+// id, and Prepare() sizes and faults in both up front.
+class Registry {
+ public:
+  explicit Registry(
+      uint64_t base = 0, uint64_t first = 1,
+      uint64_t max_ids = MAX_CORRELATION_ID);
+
+  // Allocate and touch the memory for 'ids' id's in use at once, so the
+  // first NEWs do not grow the bitmap or heap or take page faults. With
+  // 'huge_pages' the memory is advised to be backed by transparent huge
+  // pages. Returns the bytes prepared.
+  size_t Prepare(uint64_t ids, bool huge_pages);
+
+  // generate a new correlation id, 0 when the namespace is exhausted.
+  uint64_t NewCorrelationID();
+
+  // clear an already registered correlation id, false if not registered.
+  bool ClearCorrelationID(uint64_t id);
+
+  // reserve the given correlation id again, e.g. after a backend restart.
+  // true if the id is reserved afterwards. Id's more than 'max_gap' above
+  // the high water mark are refused.
+  bool ReserveCorrelationID(uint64_t id, uint64_t max_gap = MAX_RESERVE_GAP);
+
+  // Hold back the next 'count' id's NEW would hand out, from the free id
+  // heap and from above the high water mark, without reserving them. A
+  // promoted standby fences off the id's the ops it never got may have
+  // handed out. Held back id's come back once reserved and cleared.
+  void Fence(uint64_t count);
+
+  // Call fn(id) for every reserved id, lowest first, with 'base' OR'ed in.
+  template <typename Fn>
+  void ForEachLive(Fn fn) const
+  {
+    for (size_t word = 0; word < reserved_.size(); ++word) {
+      for (uint64_t bits = reserved_[word]; bits != 0; bits &= bits - 1) {
+        fn(base_ | ((word << 6) + __builtin_ctzll(bits)));
+      }
+    }
+  }
+
+  // Is the correlation id reserved, 0 or 1.
+  uint64_t Live(uint64_t id) const
+  {
+    const uint64_t local = id & (MAX_CORRELATION_ID - 1);
+    const uint64_t word = local >> 6;
+    return (word < reserved_.size()) ? ((reserved_[word] >> (local & 63)) & 1)
+                                     : 0;
+  }
+
+  // Liveness of up to 64 id's of this namespace, ids[i] as bit i, masked
+  // by 'select'. Every id is probed with the same load, shift and mask;
+  // an index past the bitmap reads word 0 and is masked out.
+  uint64_t Gather(const uint64_t* ids, size_t count, uint64_t select) const
+  {
+    const uint64_t words = reserved_.size();
+    if (words == 0) {
+      return 0;
+    }
+    uint64_t live = 0;
+    for (size_t i = 0; i < count; ++i) {
+      const uint64_t local = ids[i] & (MAX_CORRELATION_ID - 1);
+      const uint64_t word = local >> 6;
+      const uint64_t in = (word < words);
+      live |= ((reserved_[word * in] >> (local & 63)) & in) << i;
+    }
+    return live & select;
+  }
+
+  // Stats
+  // In use reserved context id's
+  uint64_t Active() const { return active_; }
+  // No longer in use, created id's
+  uint64_t Inactive() const { return Peak() - active_; }
+  // Peak number of contexts in use at one time
+  uint64_t Peak() const { return next_correlation_id_ - first_; }
+
+  // The namespace bits OR'ed into every id.
+  uint64_t Base() const { return base_; }
+
+ private:
+  void SetReserved(uint64_t local);
+
+  // Add a cleared local id to the available heap.
+  void PushAvailable(uint64_t local);
+
+  // registry of active local ID's, one bit per id.
+  std::vector<uint64_t> reserved_;
+  uint64_t active_;
+  // min-heap of cleared local id's. An id re-reserved by
+  // ReserveCorrelationID() stays in the heap and is skipped once popped.
+  std::vector<uint64_t> available_;
+  uint64_t next_correlation_id_;
+  uint64_t first_;
+  uint64_t limit_;
+  uint64_t base_;
+};
+
+}}}}  // namespace dnapoleone::inferenceserver::correlation_id_mgr::backend
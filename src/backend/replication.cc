@@ -0,0 +1,679 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#include "replication.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include "common/unix_listener.h"
+
+#define LOG_ERROR std::cerr
+#define LOG_INFO std::cout
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
+namespace backend {
+
+static_assert(sizeof(ReplicationRecord) == 16, "ReplicationRecord is packed");
+static_assert(sizeof(ReplicationFrame) == 24, "ReplicationFrame is packed");
+
+namespace {
+
+const char kUnixPrefix[] = "unix:";
+
+bool
+SendAll(int fd, const void* data, size_t bytes)
+{
+  const char* p = static_cast<const char*>(data);
+  while (bytes > 0) {
+    const ssize_t sent = send(fd, p, bytes, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += sent;
+    bytes -= sent;
+  }
+  return true;
+}
+
+bool
+RecvAll(int fd, void* data, size_t bytes)
+{
+  char* p = static_cast<char*>(data);
+  while (bytes > 0) {
+    const ssize_t got = recv(fd, p, bytes, 0);
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (got == 0) {
+      return false;
+    }
+    p += got;
+    bytes -= got;
+  }
+  return true;
+}
+
+bool
+SendFrame(
+    int fd, uint64_t first_seq, uint32_t flags,
+    const ReplicationRecord* records, size_t count)
+{
+  ReplicationFrame frame;
+  frame.magic = CIDMGR_REPLICATION_MAGIC;
+  frame.first_seq = first_seq;
+  frame.flags = flags;
+  frame.count = static_cast<uint32_t>(count);
+  return SendAll(fd, &frame, sizeof(frame)) &&
+         SendAll(fd, records, count * sizeof(ReplicationRecord));
+}
+
+bool
+IsUnix(const std::string& address)
+{
+  return address.compare(0, sizeof(kUnixPrefix) - 1, kUnixPrefix) == 0;
+}
+
+// Unix socket address of "unix:/path", false if the path does not fit.
+bool
+UnixAddress(const std::string& address, struct sockaddr_un* addr)
+{
+  const std::string path = address.substr(sizeof(kUnixPrefix) - 1);
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.empty() || (path.size() >= sizeof(addr->sun_path))) {
+    return false;
+  }
+  memcpy(addr->sun_path, path.data(), path.size());
+  return true;
+}
+
+// Resolve "host:port"; an empty host is any address when 'passive'.
+struct addrinfo*
+TcpAddress(const std::string& address, bool passive)
+{
+  const size_t colon = address.rfind(':');
+  if (colon == std::string::npos) {
+    return nullptr;
+  }
+  const std::string host = address.substr(0, colon);
+  const std::string port = address.substr(colon + 1);
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  struct addrinfo* result = nullptr;
+  if (getaddrinfo(
+          host.empty() ? nullptr : host.c_str(), port.c_str(), &hints,
+          &result) != 0) {
+    return nullptr;
+  }
+  return result;
+}
+
+void
+SetNoDelay(int fd)
+{
+  // Frames are written whole, do not hold them back for more.
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+}  // namespace
+
+int
+ReplicationListen(const std::string& address)
+{
+  if (IsUnix(address)) {
+    // The op log holds every live id, keep other users out.
+    return UnixListen(address.substr(sizeof(kUnixPrefix) - 1), 0660);
+  }
+
+  struct addrinfo* result = TcpAddress(address, true);
+  int fd = -1;
+  for (struct addrinfo* ai = result; ai != nullptr; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if ((bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) &&
+        (listen(fd, 16) == 0)) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  if (result != nullptr) {
+    freeaddrinfo(result);
+  }
+  return fd;
+}
+
+int
+ReplicationConnect(const std::string& address)
+{
+  if (IsUnix(address)) {
+    struct sockaddr_un addr;
+    if (!UnixAddress(address, &addr)) {
+      return -1;
+    }
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) !=
+        0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  struct addrinfo* result = TcpAddress(address, false);
+  int fd = -1;
+  for (struct addrinfo* ai = result; ai != nullptr; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      SetNoDelay(fd);
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  if (result != nullptr) {
+    freeaddrinfo(result);
+  }
+  return fd;
+}
+
+//
+// ReplicationPrimary
+//
+
+ReplicationPrimary::ReplicationPrimary(
+    std::mutex* registry_mu, SnapshotFn snapshot, uint64_t first_seq,
+    size_t max_unacked, uint32_t ack_timeout_ms, bool require_standby)
+    : registry_mu_(registry_mu), snapshot_(snapshot),
+      max_unacked_(max_unacked), ack_timeout_ms_(ack_timeout_ms),
+      require_standby_(require_standby), mu_(),
+      cv_(), stop_(false), listen_fd_(-1), accept_thread_(), standbys_(),
+      live_(0), log_(), log_first_(first_seq + 1), seq_(first_seq)
+{
+}
+
+ReplicationPrimary::~ReplicationPrimary()
+{
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stop_ = true;
+    if (listen_fd_ >= 0) {
+      // Wakes the blocked accept().
+      shutdown(listen_fd_, SHUT_RDWR);
+    }
+    for (auto& standby : standbys_) {
+      Drop(standby.get());
+    }
+  }
+  cv_.notify_all();
+  if (accept_thread_.joinable()) {
+    accept_thread_.join();
+  }
+  for (auto& standby : standbys_) {
+    standby->sender.join();
+    standby->reader.join();
+    close(standby->fd);
+  }
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+  }
+}
+
+void
+ReplicationPrimary::Listen(int listen_fd)
+{
+  listen_fd_ = listen_fd;
+  accept_thread_ = std::thread(&ReplicationPrimary::AcceptLoop, this);
+}
+
+void
+ReplicationPrimary::Append(uint32_t op, uint32_t key, uint64_t id)
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  ++seq_;
+  if (live_ == 0) {
+    // Nobody to ship to, a standby connecting later gets a snapshot.
+    log_first_ = seq_ + 1;
+    return;
+  }
+  ReplicationRecord record;
+  record.op = op;
+  record.key = key;
+  record.id = id;
+  log_.push_back(record);
+  cv_.notify_all();
+}
+
+bool
+ReplicationPrimary::WaitForAcks()
+{
+  std::unique_lock<std::mutex> lock(mu_);
+  if (live_ == 0) {
+    return !require_standby_;
+  }
+  DropStalled();
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(ack_timeout_ms_);
+  while (true) {
+    bool behind = false;
+    for (auto& standby : standbys_) {
+      behind |= Lagging(*standby);
+    }
+    if (!behind) {
+      return !require_standby_ || AnyInSync();
+    }
+    if (cv_.wait_until(lock, deadline) == std::cv_status::timeout) {
+      break;
+    }
+  }
+  for (auto& standby : standbys_) {
+    if (Lagging(*standby)) {
+      LOG_ERROR << "Correlation ID Mgr replication dropping standby "
+                << (seq_ - standby->acked) << " ops behind, no ack in "
+                << ack_timeout_ms_ << " ms" << std::endl;
+      Drop(standby.get());
+    }
+  }
+  return !require_standby_ || AnyInSync();
+}
+
+bool
+ReplicationPrimary::InSync()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  return AnyInSync();
+}
+
+uint64_t
+ReplicationPrimary::Sequence()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  return seq_;
+}
+
+size_t
+ReplicationPrimary::Standbys()
+{
+  std::lock_guard<std::mutex> lock(mu_);
+  return live_;
+}
+
+void
+ReplicationPrimary::AcceptLoop()
+{
+  while (true) {
+    const int fd = accept(listen_fd_, nullptr, nullptr);
+    if (fd < 0) {
+      if ((errno == EINTR) || (errno == ECONNABORTED)) {
+        continue;
+      }
+      return;
+    }
+    SetNoDelay(fd);
+    Reap();
+
+    // The snapshot and the standby's place in the log are taken together
+    // under the registry mutex, so no op falls between them.
+    std::unique_ptr<Standby> standby(new Standby());
+    standby->fd = fd;
+    standby->dead = false;
+    standby->synced = false;
+    {
+      std::lock_guard<std::mutex> registry_lock(*registry_mu_);
+      snapshot_(&standby->snapshot);
+      std::lock_guard<std::mutex> lock(mu_);
+      if (stop_) {
+        close(fd);
+        return;
+      }
+      standby->sent = seq_;
+      standby->acked = seq_;
+      standby->progress = std::chrono::steady_clock::now();
+      LOG_INFO << "Correlation ID Mgr replication standby connected, "
+               << standby->snapshot.size() << " record snapshot at sequence "
+               << seq_ << std::endl;
+      Standby* s = standby.get();
+      s->sender = std::thread(&ReplicationPrimary::SendLoop, this, s);
+      s->reader = std::thread(&ReplicationPrimary::ReadLoop, this, s);
+      standbys_.push_back(std::move(standby));
+      ++live_;
+    }
+  }
+}
+
+void
+ReplicationPrimary::SendLoop(Standby* standby)
+{
+  std::unique_lock<std::mutex> lock(mu_);
+  std::vector<ReplicationRecord> records;
+  records.swap(standby->snapshot);
+  const uint64_t snapshot_seq = standby->sent;
+  lock.unlock();
+
+  // The snapshot, in frames all numbered with its sequence number.
+  size_t offset = 0;
+  do {
+    const size_t count =
+        std::min<size_t>(REPLICATION_FRAME_RECORDS, records.size() - offset);
+    uint32_t flags = kReplicationSnapshot;
+    if (offset == 0) {
+      flags |= kReplicationSnapshotBegin;
+    }
+    if (offset + count == records.size()) {
+      flags |= kReplicationSnapshotEnd;
+    }
+    const bool sent = SendFrame(
+        standby->fd, snapshot_seq, flags, records.data() + offset, count);
+    lock.lock();
+    if (!sent) {
+      Drop(standby);
+      return;
+    }
+    standby->progress = std::chrono::steady_clock::now();
+    lock.unlock();
+    offset += count;
+  } while (offset < records.size());
+
+  // Then everything appended since, batched by what piled up while the
+  // last frame was being written.
+  lock.lock();
+  while (true) {
+    cv_.wait(lock, [this, standby]() {
+      return stop_ || standby->dead || (seq_ > standby->sent);
+    });
+    if (stop_ || standby->dead) {
+      return;
+    }
+    const uint64_t first = standby->sent + 1;
+    const size_t count =
+        std::min<uint64_t>(seq_ - standby->sent, REPLICATION_FRAME_RECORDS);
+    const auto begin = log_.begin() + (first - log_first_);
+    records.assign(begin, begin + count);
+    lock.unlock();
+    const bool sent =
+        SendFrame(standby->fd, first, 0, records.data(), records.size());
+    lock.lock();
+    if (!sent) {
+      Drop(standby);
+      return;
+    }
+    standby->sent = first + count - 1;
+    standby->progress = std::chrono::steady_clock::now();
+  }
+}
+
+void
+ReplicationPrimary::ReadLoop(Standby* standby)
+{
+  uint64_t acked;
+  while (RecvAll(standby->fd, &acked, sizeof(acked))) {
+    std::lock_guard<std::mutex> lock(mu_);
+    // The first ack is for the whole snapshot.
+    if ((acked > standby->acked) && (acked <= standby->sent)) {
+      standby->acked = acked;
+      standby->progress = std::chrono::steady_clock::now();
+      Trim();
+    }
+    // The log piled up while the snapshot loaded; count the standby only
+    // once it has caught up, or waiting on it would time out and drop it
+    // into another snapshot.
+    if (!standby->synced &&
+        ((seq_ - standby->acked) <=
+         std::max<uint64_t>(max_unacked_, REPLICATION_FRAME_RECORDS))) {
+      standby->synced = true;
+      LOG_INFO << "Correlation ID Mgr replication standby in sync at "
+               << "sequence " << standby->acked << std::endl;
+    }
+    cv_.notify_all();
+  }
+  std::lock_guard<std::mutex> lock(mu_);
+  Drop(standby);
+}
+
+void
+ReplicationPrimary::Drop(Standby* standby)
+{
+  if (!standby->dead) {
+    standby->dead = true;
+    --live_;
+    shutdown(standby->fd, SHUT_RDWR);
+    Trim();
+    if (!stop_) {
+      LOG_ERROR << "Correlation ID Mgr replication standby disconnected at "
+                << "sequence " << standby->acked << std::endl;
+    }
+  }
+  cv_.notify_all();
+}
+
+void
+ReplicationPrimary::Trim()
+{
+  uint64_t acked = seq_;
+  for (auto& standby : standbys_) {
+    if (!standby->dead) {
+      acked = std::min(acked, standby->acked);
+    }
+  }
+  if (acked >= log_first_) {
+    const uint64_t count = std::min<uint64_t>(acked - log_first_ + 1, log_.size());
+    log_.erase(log_.begin(), log_.begin() + count);
+    log_first_ = acked + 1;
+  }
+}
+
+bool
+ReplicationPrimary::Lagging(const Standby& standby) const
+{
+  return !standby.dead && standby.synced &&
+         ((seq_ - standby.acked) > max_unacked_);
+}
+
+bool
+ReplicationPrimary::AnyInSync() const
+{
+  for (const auto& standby : standbys_) {
+    if (!standby->dead && standby->synced) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+ReplicationPrimary::DropStalled()
+{
+  const auto now = std::chrono::steady_clock::now();
+  const uint64_t max_behind =
+      std::max<uint64_t>(max_unacked_, REPLICATION_MAX_CATCHUP);
+  for (auto& standby : standbys_) {
+    if (standby->dead || standby->synced) {
+      continue;
+    }
+    const bool stalled =
+        (now - standby->progress) >
+        std::chrono::milliseconds(ack_timeout_ms_);
+    if (stalled || ((seq_ - standby->acked) > max_behind)) {
+      LOG_ERROR << "Correlation ID Mgr replication dropping standby not in "
+                << "sync, " << (seq_ - standby->acked) << " ops behind, "
+                << (stalled ? "no progress within the ack timeout"
+                            : "too far behind")
+                << std::endl;
+      Drop(standby.get());
+    }
+  }
+}
+
+void
+ReplicationPrimary::Reap()
+{
+  std::list<std::unique_ptr<Standby>> dead;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    for (auto it = standbys_.begin(); it != standbys_.end();) {
+      auto next = std::next(it);
+      if ((*it)->dead) {
+        dead.splice(dead.end(), standbys_, it);
+      }
+      it = next;
+    }
+  }
+  for (auto& standby : dead) {
+    standby->sender.join();
+    standby->reader.join();
+    close(standby->fd);
+  }
+}
+
+//
+// ReplicationStandby
+//
+
+ReplicationStandby::ReplicationStandby(
+    const std::string& address, ApplyFn apply)
+    : address_(address), apply_(apply), applied_(0), synced_(false), mu_(),
+      cv_(), stop_(false), fd_(-1), thread_()
+{
+}
+
+ReplicationStandby::~ReplicationStandby()
+{
+  Stop();
+}
+
+void
+ReplicationStandby::Start()
+{
+  thread_ = std::thread(&ReplicationStandby::Run, this);
+}
+
+void
+ReplicationStandby::Stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stop_ = true;
+    if (fd_ >= 0) {
+      shutdown(fd_, SHUT_RDWR);
+    }
+  }
+  cv_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void
+ReplicationStandby::Run()
+{
+  bool reported = false;
+  std::unique_lock<std::mutex> lock(mu_);
+  while (!stop_) {
+    lock.unlock();
+    const int fd = ReplicationConnect(address_);
+    lock.lock();
+    if (fd >= 0) {
+      if (stop_) {
+        close(fd);
+        break;
+      }
+      fd_ = fd;
+      lock.unlock();
+      LOG_INFO << "Correlation ID Mgr replication following primary "
+               << address_ << std::endl;
+      Follow(fd);
+      lock.lock();
+      fd_ = -1;
+      close(fd);
+      if (!stop_) {
+        LOG_ERROR << "Correlation ID Mgr replication lost primary "
+                  << address_ << " at sequence " << applied_.load()
+                  << std::endl;
+      }
+      reported = false;
+    } else if (!reported) {
+      LOG_ERROR << "Correlation ID Mgr replication unable to reach primary "
+                << address_ << ", retrying" << std::endl;
+      reported = true;
+    }
+    cv_.wait_for(
+        lock, std::chrono::milliseconds(REPLICATION_RETRY_MS),
+        [this]() { return stop_; });
+  }
+}
+
+void
+ReplicationStandby::Follow(int fd)
+{
+  ReplicationFrame frame;
+  std::vector<ReplicationRecord> records;
+  while (RecvAll(fd, &frame, sizeof(frame))) {
+    if ((frame.magic != CIDMGR_REPLICATION_MAGIC) ||
+        (frame.count > REPLICATION_FRAME_RECORDS)) {
+      LOG_ERROR << "Correlation ID Mgr replication bad frame from primary"
+                << std::endl;
+      return;
+    }
+    records.resize(frame.count);
+    if ((frame.count != 0) &&
+        !RecvAll(fd, records.data(), frame.count * sizeof(ReplicationRecord))) {
+      return;
+    }
+
+    const bool snapshot = (frame.flags & kReplicationSnapshot) != 0;
+    const bool reset = (frame.flags & kReplicationSnapshotBegin) != 0;
+    if (!snapshot && (!synced_.load() || (frame.first_seq != applied_ + 1))) {
+      // A gap, resync from a new snapshot.
+      LOG_ERROR << "Correlation ID Mgr replication expected sequence "
+                << (applied_ + 1) << ", got " << frame.first_seq << std::endl;
+      return;
+    }
+    if (reset) {
+      synced_ = false;
+    }
+    const uint64_t seq =
+        snapshot ? frame.first_seq : (frame.first_seq + frame.count - 1);
+    apply_(reset, records.data(), records.size(), seq);
+    applied_ = seq;
+    if (frame.flags & kReplicationSnapshotEnd) {
+      synced_ = true;
+    }
+    // The primary takes the first ack as the whole snapshot's.
+    if ((!snapshot || (frame.flags & kReplicationSnapshotEnd)) &&
+        !SendAll(fd, &seq, sizeof(seq))) {
+      return;
+    }
+  }
+}
+
+}}}}  // namespace dnapoleone::inferenceserver::correlation_id_mgr::backend
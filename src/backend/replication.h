@@ -0,0 +1,256 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Warm-standby replication of the registry by op log shipping.
+//
+// The primary backend appends every registry change to a sequence
+// numbered op log. Each connected standby gets a snapshot of the live id's
+// first, then the log in batches. Standbys apply it to their own registry
+// and acknowledge the last sequence number applied. A standby is in sync
+// once it has loaded the snapshot and caught up to within a frame (or
+// max_unacked ops) of the log; until then the primary does not wait on
+// it. The primary holds Execute's response while any standby in sync is
+// more than max_unacked ops behind. A standby that does not acknowledge
+// within the ack timeout is dropped and resyncs from a new snapshot when
+// it reconnects. So is a standby not yet in sync that makes no progress,
+// reading frames or acknowledging, within the ack timeout or falls more
+// than REPLICATION_MAX_CATCHUP ops behind, so the log it holds back stays
+// bounded.
+//
+// A standby promoted while it was in sync has lost at most max_unacked
+// acknowledged ops. Once it is dropped the primary carries on without it,
+// and it misses every op from then on, unless require_standby is set: the
+// primary then refuses writes while no standby is in sync, and fails the
+// ones no standby in sync acknowledged.
+//
+// Wire format, little endian, over a TCP ("host:port") or Unix
+// ("unix:/path") stream socket:
+//
+//   primary -> standby: ReplicationFrame, then count ReplicationRecords
+//   standby -> primary: uint64_t last applied sequence number, after the
+//                       last snapshot frame and after every log frame
+//
+// Log records carry sequence numbers first_seq .. first_seq + count - 1.
+// Snapshot frames are all numbered first_seq, the sequence number the
+// snapshot was taken at. The first of them has kReplicationSnapshotBegin
+// set and resets the standby's registry, the last has
+// kReplicationSnapshotEnd set; the standby is in sync from then on.
+//
+// Only the Execute registries are replicated, the same-host shared memory
+// block lives and dies with its host.
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
+namespace backend {
+
+#define CIDMGR_REPLICATION_MAGIC 0x6369646d67726570ull  // "perg mdic"
+
+// Default most ops the primary may run ahead of a standby.
+#define DEFAULT_REPLICATION_MAX_UNACKED 1024
+
+// Default time a standby has to acknowledge before it is dropped.
+#define DEFAULT_REPLICATION_ACK_TIMEOUT_MS 1000
+
+// Most records sent in one frame.
+#define REPLICATION_FRAME_RECORDS 4096
+
+// Most ops a standby not yet in sync may fall behind before it is
+// dropped, at least max_unacked.
+#define REPLICATION_MAX_CATCHUP (1 << 20)
+
+// Time between a standby's attempts to reach the primary.
+#define REPLICATION_RETRY_MS 100
+
+enum ReplicationOp {
+  // key is the namespace key, id the namespace number.
+  kReplicateNamespace = 1,
+  // id is reserved.
+  kReplicateReserve = 2,
+  // id is cleared.
+  kReplicateClear = 3
+};
+
+enum ReplicationFrameFlags {
+  kReplicationSnapshot = 0x1,
+  kReplicationSnapshotBegin = 0x2,
+  kReplicationSnapshotEnd = 0x4
+};
+
+struct ReplicationRecord {
+  uint32_t op;
+  uint32_t key;
+  uint64_t id;
+};
+
+struct ReplicationFrame {
+  uint64_t magic;
+  uint64_t first_seq;
+  uint32_t flags;
+  uint32_t count;
+};
+
+// Listening and connected sockets for a "host:port" or "unix:/path"
+// address, -1 on error.
+int ReplicationListen(const std::string& address);
+int ReplicationConnect(const std::string& address);
+
+class ReplicationPrimary {
+ public:
+  // Fill records with the current registry state. Called with the
+  // registry mutex held.
+  typedef std::function<void(std::vector<ReplicationRecord>*)> SnapshotFn;
+
+  // 'registry_mu' is the mutex Append() is called under, held while a
+  // snapshot is taken so it lines up with the log.
+  ReplicationPrimary(
+      std::mutex* registry_mu, SnapshotFn snapshot, uint64_t first_seq,
+      size_t max_unacked, uint32_t ack_timeout_ms, bool require_standby);
+  ~ReplicationPrimary();
+
+  // Start accepting standbys on a socket from ReplicationListen(), which
+  // is closed with the primary.
+  void Listen(int listen_fd);
+
+  // Append an op to the log. Call with the registry mutex held, so the
+  // log order is the order the ops were applied in.
+  void Append(uint32_t op, uint32_t key, uint64_t id);
+
+  // Wait until no standby in sync is more than max_unacked ops behind,
+  // dropping the ones that do not catch up within the ack timeout, and
+  // the standbys not yet in sync that have stalled or fallen too far
+  // behind. Call
+  // without the registry mutex held. False if require_standby is set and
+  // no standby in sync is left, i.e. the ops appended so far may be lost
+  // on failover.
+  bool WaitForAcks();
+
+  // Is any connected standby in sync.
+  bool InSync();
+
+  // Sequence number of the last op appended.
+  uint64_t Sequence();
+
+  // Number of connected standbys.
+  size_t Standbys();
+
+ private:
+  struct Standby {
+    int fd;
+    bool dead;
+    // Snapshot still to send, and the sequence number it was taken at.
+    std::vector<ReplicationRecord> snapshot;
+    uint64_t sent;
+    uint64_t acked;
+    // The snapshot has been acknowledged, and the standby has caught up
+    // with the log since. Not waited on until then.
+    bool synced;
+    // Last time a frame was sent or an ack advanced.
+    std::chrono::steady_clock::time_point progress;
+    std::thread sender;
+    std::thread reader;
+  };
+
+  void AcceptLoop();
+  void SendLoop(Standby* standby);
+  void ReadLoop(Standby* standby);
+
+  // Mark the standby dead and wake its threads. Requires mu_.
+  void Drop(Standby* standby);
+
+  // Drop log records every live standby has acknowledged. Requires mu_.
+  void Trim();
+
+  // Is the standby in sync and more than max_unacked ops behind. Requires
+  // mu_.
+  bool Lagging(const Standby& standby) const;
+
+  // InSync(). Requires mu_.
+  bool AnyInSync() const;
+
+  // Drop the standbys not yet in sync that made no progress within the
+  // ack timeout or are more than REPLICATION_MAX_CATCHUP ops behind.
+  // Requires mu_.
+  void DropStalled();
+
+  // Join the threads of dead standbys and forget them. Requires mu_
+  // not held.
+  void Reap();
+
+  std::mutex* registry_mu_;
+  SnapshotFn snapshot_;
+  size_t max_unacked_;
+  uint32_t ack_timeout_ms_;
+  bool require_standby_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool stop_;
+  int listen_fd_;
+  std::thread accept_thread_;
+  std::list<std::unique_ptr<Standby>> standbys_;
+  size_t live_;
+
+  // log_[i] has sequence number log_first_ + i. seq_ is the last one.
+  std::deque<ReplicationRecord> log_;
+  uint64_t log_first_;
+  uint64_t seq_;
+};
+
+class ReplicationStandby {
+ public:
+  // Apply a batch of records; 'reset' clears the registry first. 'seq' is
+  // the sequence number the registry is at once the batch is applied.
+  typedef std::function<void(
+      bool reset, const ReplicationRecord* records, size_t count,
+      uint64_t seq)>
+      ApplyFn;
+
+  ReplicationStandby(const std::string& address, ApplyFn apply);
+  ~ReplicationStandby();
+
+  // Connect to the primary in the background, reconnecting as needed.
+  void Start();
+
+  // Disconnect and stop following the primary.
+  void Stop();
+
+  // Sequence number of the last op applied.
+  uint64_t Applied() const { return applied_.load(); }
+
+  // Has a whole snapshot been applied, i.e. is the registry a copy of the
+  // primary's as of Applied().
+  bool Synced() const { return synced_.load(); }
+
+ private:
+  void Run();
+
+  // Read frames and apply them until the connection fails.
+  void Follow(int fd);
+
+  std::string address_;
+  ApplyFn apply_;
+  std::atomic<uint64_t> applied_;
+  std::atomic<bool> synced_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool stop_;
+  int fd_;
+  std::thread thread_;
+};
+
+}}}}  // namespace dnapoleone::inferenceserver::correlation_id_mgr::backend
@@ -0,0 +1,371 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#include "sparse_registry.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
+namespace backend {
+
+namespace {
+
+// Most levels, for a 63 bit range.
+const uint32_t kMaxLevels = 10;
+
+// Slot of the id at the level.
+inline uint32_t
+SlotOf(uint64_t local, uint32_t level)
+{
+  return static_cast<uint32_t>((local >> (6 * (level + 1))) & 63);
+}
+
+// Index of the slot in a node's slots.
+inline uint32_t
+IndexOf(uint64_t present, uint32_t slot)
+{
+  return __builtin_popcountll(present & ((1ull << slot) - 1));
+}
+
+// Bits first..last.
+inline uint64_t
+BitRange(uint32_t first, uint32_t last)
+{
+  const uint64_t upto = (last == 63) ? ~0ull : ((1ull << (last + 1)) - 1);
+  return upto & ~((1ull << first) - 1);
+}
+
+}  // namespace
+
+SparseRegistry::SparseRegistry(
+    uint64_t base, uint32_t width, uint64_t max_ids)
+    : root_(nullptr), levels_(std::max<uint32_t>((width + 5) / 6, 2) - 1),
+      width_(width),
+      mask_((width >= 64) ? ~0ull : ((1ull << width) - 1)),
+      base_(base & ~mask_), max_ids_(max_ids), active_(0), peak_(0),
+      bytes_(0), fenced_(), fence_(0)
+{
+}
+
+SparseRegistry::~SparseRegistry()
+{
+  FreeTree(root_, levels_ - 1);
+}
+
+uint64_t
+SparseRegistry::AllSlots(uint32_t level) const
+{
+  // Only the root may be narrower than 64 slots.
+  const uint32_t shift = 6 * (level + 1);
+  return ((width_ - shift) >= 6) ? ~0ull : ((1ull << (width_ - shift)) - 1);
+}
+
+SparseRegistry::Node*
+SparseRegistry::AllocNode(uint32_t capacity)
+{
+  const size_t size = sizeof(Node) + ((capacity - 1) * sizeof(Slot));
+  Node* node = static_cast<Node*>(malloc(size));
+  node->present = 0;
+  node->full = 0;
+  node->capacity = capacity;
+  bytes_ += size;
+  return node;
+}
+
+void
+SparseRegistry::FreeNode(Node* node)
+{
+  bytes_ -= sizeof(Node) + ((node->capacity - 1) * sizeof(Slot));
+  free(node);
+}
+
+void
+SparseRegistry::FreeTree(Node* node, uint32_t level)
+{
+  if (node == nullptr) {
+    return;
+  }
+  if (level != 0) {
+    const uint32_t count = __builtin_popcountll(node->present);
+    for (uint32_t i = 0; i < count; ++i) {
+      FreeTree(node->slots[i].child, level - 1);
+    }
+  }
+  FreeNode(node);
+}
+
+SparseRegistry::Slot*
+SparseRegistry::AddSlot(Node** link, uint32_t slot)
+{
+  Node* node = *link;
+  const uint32_t count = __builtin_popcountll(node->present);
+  if (count == node->capacity) {
+    // Grow geometrically, a node never needs more than 64.
+    Node* grown = AllocNode(std::min<uint32_t>(node->capacity * 2, 64));
+    grown->present = node->present;
+    grown->full = node->full;
+    memcpy(grown->slots, node->slots, count * sizeof(Slot));
+    FreeNode(node);
+    *link = node = grown;
+  }
+  const uint32_t index = IndexOf(node->present, slot);
+  memmove(
+      node->slots + index + 1, node->slots + index,
+      (count - index) * sizeof(Slot));
+  node->slots[index].bits = 0;
+  node->present |= 1ull << slot;
+  return node->slots + index;
+}
+
+void
+SparseRegistry::RemoveSlot(Node** link, uint32_t slot)
+{
+  Node* node = *link;
+  const uint32_t count = __builtin_popcountll(node->present) - 1;
+  const uint32_t index = IndexOf(node->present, slot);
+  memmove(
+      node->slots + index, node->slots + index + 1,
+      (count - index) * sizeof(Slot));
+  node->present &= ~(1ull << slot);
+  node->full &= ~(1ull << slot);
+  if (count == 0) {
+    FreeNode(node);
+    *link = nullptr;
+  } else if ((node->capacity >= 8) && ((count * 4) <= node->capacity)) {
+    Node* shrunk = AllocNode(node->capacity / 2);
+    shrunk->present = node->present;
+    shrunk->full = node->full;
+    memcpy(shrunk->slots, node->slots, count * sizeof(Slot));
+    FreeNode(node);
+    *link = shrunk;
+  }
+}
+
+bool
+SparseRegistry::Reserved(uint64_t local) const
+{
+  const Node* node = root_;
+  for (uint32_t level = levels_; (level-- > 0) && (node != nullptr);) {
+    const uint32_t slot = SlotOf(local, level);
+    if (((node->present >> slot) & 1) == 0) {
+      return false;
+    }
+    const Slot& child = node->slots[IndexOf(node->present, slot)];
+    if (level == 0) {
+      return ((child.bits >> (local & 63)) & 1) != 0;
+    }
+    node = child.child;
+  }
+  return false;
+}
+
+bool
+SparseRegistry::Insert(uint64_t local)
+{
+  Node** links[kMaxLevels];
+  uint32_t slots[kMaxLevels];
+  Node** link = &root_;
+  for (uint32_t level = levels_; level-- > 0;) {
+    if (*link == nullptr) {
+      *link = AllocNode(1);
+    }
+    const uint32_t slot = SlotOf(local, level);
+    links[level] = link;
+    slots[level] = slot;
+    Node* node = *link;
+    Slot* child;
+    if ((node->present >> slot) & 1) {
+      child = node->slots + IndexOf(node->present, slot);
+    } else {
+      child = AddSlot(link, slot);
+      if (level != 0) {
+        child->child = nullptr;
+      }
+    }
+    if (level != 0) {
+      link = &child->child;
+      continue;
+    }
+
+    const uint64_t bit = 1ull << (local & 63);
+    if (child->bits & bit) {
+      return false;
+    }
+    child->bits |= bit;
+    if (child->bits != ~0ull) {
+      return true;
+    }
+    // The word filled up, mark it and every ancestor that is now full.
+    (*links[0])->full |= 1ull << slots[0];
+    for (uint32_t up = 0; (up + 1) < levels_; ++up) {
+      if ((*links[up])->full != AllSlots(up)) {
+        break;
+      }
+      (*links[up + 1])->full |= 1ull << slots[up + 1];
+    }
+    return true;
+  }
+  return false;
+}
+
+bool
+SparseRegistry::FindFree(
+    const Node* node, uint32_t level, uint64_t lo, uint64_t hi,
+    uint64_t* local) const
+{
+  if (node == nullptr) {
+    *local = lo;
+    return true;
+  }
+  // Only the slots at the ends of the range are clipped, any slot in
+  // between that is not full has a free id.
+  const uint32_t shift = 6 * (level + 1);
+  const uint32_t first = SlotOf(lo, level);
+  const uint32_t last = SlotOf(hi, level);
+  for (uint64_t candidates = ~node->full & BitRange(first, last);
+       candidates != 0; candidates &= candidates - 1) {
+    const uint32_t slot = __builtin_ctzll(candidates);
+    const uint64_t slot_start = ((lo >> shift) - first + slot) << shift;
+    const uint64_t slot_lo = (slot == first) ? lo : slot_start;
+    const uint64_t slot_hi =
+        (slot == last) ? hi : (slot_start | ((1ull << shift) - 1));
+    if (((node->present >> slot) & 1) == 0) {
+      *local = slot_lo;
+      return true;
+    }
+    const Slot& child = node->slots[IndexOf(node->present, slot)];
+    if (level != 0) {
+      if (FindFree(child.child, level - 1, slot_lo, slot_hi, local)) {
+        return true;
+      }
+      continue;
+    }
+    const uint64_t free_bits =
+        ~child.bits & BitRange(slot_lo & 63, slot_hi & 63);
+    if (free_bits != 0) {
+      *local = (slot_lo & ~63ull) | __builtin_ctzll(free_bits);
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t
+SparseRegistry::NewCorrelationID(uint64_t prefix, uint32_t prefix_bits)
+{
+  if ((prefix_bits >= width_) || ((prefix >> prefix_bits) != 0) ||
+      (active_ >= max_ids_)) {
+    return 0;
+  }
+  const uint32_t free_bits = width_ - prefix_bits;
+  const uint64_t lo = std::max<uint64_t>(prefix << free_bits, 1);
+  const uint64_t hi = (prefix << free_bits) | ((1ull << free_bits) - 1);
+
+  uint64_t local;
+  uint64_t from = lo;
+  if (fence_ != 0) {
+    auto fenced = fenced_.emplace(std::make_pair(prefix, prefix_bits), lo);
+    uint64_t& cursor = fenced.first->second;
+    if (fenced.second) {
+      // First NEW under the prefix since the promotion, skip the fence_
+      // lowest free id's.
+      for (uint64_t i = 0; i < fence_; ++i) {
+        if ((cursor > hi) ||
+            !FindFree(root_, levels_ - 1, cursor, hi, &local)) {
+          cursor = hi + 1;
+          break;
+        }
+        cursor = local + 1;
+      }
+      from = cursor;
+    } else if (
+        (cursor > lo) &&
+        !FindFree(root_, levels_ - 1, lo, cursor - 1, &local)) {
+      // Every held back id was reserved again, nothing left to fence.
+      fenced_.erase(fenced.first);
+    } else {
+      from = cursor;
+    }
+  }
+  if ((from > hi) || !FindFree(root_, levels_ - 1, from, hi, &local)) {
+    return 0;
+  }
+  Insert(local);
+  active_++;
+  peak_ = std::max(peak_, active_);
+  return base_ | local;
+}
+
+bool
+SparseRegistry::ClearCorrelationID(uint64_t id)
+{
+  if (!Contains(id)) {
+    return false;
+  }
+  const uint64_t local = id & mask_;
+  Node** links[kMaxLevels];
+  uint32_t slots[kMaxLevels];
+  Node** link = &root_;
+  for (uint32_t level = levels_; level-- > 0;) {
+    Node* node = *link;
+    const uint32_t slot = SlotOf(local, level);
+    if ((node == nullptr) || (((node->present >> slot) & 1) == 0)) {
+      return false;
+    }
+    links[level] = link;
+    slots[level] = slot;
+    Slot* child = node->slots + IndexOf(node->present, slot);
+    if (level != 0) {
+      link = &child->child;
+      continue;
+    }
+
+    const uint64_t bit = 1ull << (local & 63);
+    if ((child->bits & bit) == 0) {
+      return false;
+    }
+    child->bits &= ~bit;
+    // Nothing on the path is full any more, and empty nodes go.
+    bool empty = (child->bits == 0);
+    for (uint32_t up = 0; up < levels_; ++up) {
+      (*links[up])->full &= ~(1ull << slots[up]);
+      if (!empty) {
+        continue;
+      }
+      RemoveSlot(links[up], slots[up]);
+      empty = (*links[up] == nullptr);
+    }
+    active_--;
+    return true;
+  }
+  return false;
+}
+
+bool
+SparseRegistry::ReserveCorrelationID(uint64_t id)
+{
+  const uint64_t local = id & mask_;
+  if (!Contains(id) || (local == 0)) {
+    return false;
+  }
+  if (Reserved(local)) {
+    return true;
+  }
+  if (active_ >= max_ids_) {
+    return false;
+  }
+  Insert(local);
+  active_++;
+  peak_ = std::max(peak_, active_);
+  return true;
+}
+
+void
+SparseRegistry::Fence(uint64_t count)
+{
+  fence_ = count;
+  fenced_.clear();
+}
+
+}}}}  // namespace dnapoleone::inferenceserver::correlation_id_mgr::backend
@@ -0,0 +1,166 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <utility>
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
+namespace backend {
+
+// Sparse allocator over a node's whole range of the 64 bit id space.
+//
+// Id's are [base + 1, base + 2^width), where base carries the node bits
+// above width (see NodeLayout). Callers may ask for an id under a prefix,
+// the top prefix_bits bits of the width bit local id, so id's can carry
+// tenant, shard or time bits for downstream routing. The lowest free id
+// under the prefix is handed out.
+//
+// Reserved id's are kept in a radix tree of 6 bit levels. An inner node
+// only stores the children it has, in slot order behind a bitmap of the
+// slots present, and the bottom level stores the 64 id bitmap words
+// inline, so memory follows the live id's rather than how high they go.
+// Empty nodes are freed. A second bitmap per node marks the slots with no
+// free id left, so finding the lowest free id under a prefix skips whole
+// full subtrees. Lookup, reserve, clear and NEW walk one node per level,
+// O(key length).
+class SparseRegistry {
+ public:
+  SparseRegistry(uint64_t base, uint32_t width, uint64_t max_ids);
+  ~SparseRegistry();
+
+  SparseRegistry(const SparseRegistry&) = delete;
+  SparseRegistry& operator=(const SparseRegistry&) = delete;
+
+  // generate a new correlation id under the prefix, 0 when there is no
+  // free id under it or max_ids are reserved.
+  uint64_t NewCorrelationID(uint64_t prefix, uint32_t prefix_bits);
+
+  // clear an already registered correlation id, false if not registered.
+  bool ClearCorrelationID(uint64_t id);
+
+  // reserve the given correlation id again, e.g. after a backend restart.
+  // true if the id is reserved afterwards, false if it is not in range or
+  // max_ids are reserved.
+  bool ReserveCorrelationID(uint64_t id);
+
+  // Hold back the 'count' lowest free id's under each prefix from NEWs
+  // under it. A promoted standby fences off the id's the ops it never got
+  // may have handed out. On the first NEW under a prefix its cursor is
+  // set past them, and NEWs there only search above it; nothing is
+  // reserved. Held back id's come back once reserved (RECONCILE). The
+  // cursor is dropped when none is left free below it, the next NEW there
+  // then holds back the 'count' lowest free id's again.
+  void Fence(uint64_t count);
+
+  // Call fn(id) for every reserved id, lowest first.
+  template <typename Fn>
+  void ForEachLive(Fn fn) const
+  {
+    ForEachLive(root_, levels_ - 1, 0, fn);
+  }
+
+  // Is the correlation id reserved, 0 or 1.
+  uint64_t Live(uint64_t id) const
+  {
+    return (Contains(id) && Reserved(id & mask_)) ? 1 : 0;
+  }
+
+  // Is the id in this registry's range.
+  bool Contains(uint64_t id) const { return (id & ~mask_) == base_; }
+
+  // Stats
+  // In use reserved context id's
+  uint64_t Active() const { return active_; }
+  // No longer in use, created id's
+  uint64_t Inactive() const { return peak_ - active_; }
+  // Peak number of contexts in use at one time
+  uint64_t Peak() const { return peak_; }
+
+  // Bytes held by the tree.
+  size_t Bytes() const { return bytes_; }
+
+ private:
+  struct Node;
+
+  // A child of an inner node, or a bitmap word of 64 id's at the bottom.
+  union Slot {
+    Node* child;
+    uint64_t bits;
+  };
+
+  struct Node {
+    // Slots with a child, and those with no free id left.
+    uint64_t present;
+    uint64_t full;
+    uint32_t capacity;
+    // popcount(present) slots in slot order, room for capacity.
+    Slot slots[1];
+  };
+
+  // Is the local id in the tree.
+  bool Reserved(uint64_t local) const;
+
+  // Put the local id in the tree, false if it already was.
+  bool Insert(uint64_t local);
+
+  // Lowest local id in [lo, hi] not in the tree, false if none.
+  bool FindFree(
+      const Node* node, uint32_t level, uint64_t lo, uint64_t hi,
+      uint64_t* local) const;
+
+  // Slots of a full node at the level.
+  uint64_t AllSlots(uint32_t level) const;
+
+  // Add or remove slot 'slot' of *link, reallocating it as needed.
+  Slot* AddSlot(Node** link, uint32_t slot);
+  void RemoveSlot(Node** link, uint32_t slot);
+
+  Node* AllocNode(uint32_t capacity);
+  void FreeNode(Node* node);
+  void FreeTree(Node* node, uint32_t level);
+
+  template <typename Fn>
+  void ForEachLive(
+      const Node* node, uint32_t level, uint64_t local, Fn& fn) const
+  {
+    if (node == nullptr) {
+      return;
+    }
+    for (uint64_t present = node->present; present != 0;
+         present &= present - 1) {
+      const uint32_t slot = __builtin_ctzll(present);
+      const Slot& child = node->slots[__builtin_popcountll(
+          node->present & ((1ull << slot) - 1))];
+      const uint64_t next = local | (static_cast<uint64_t>(slot)
+                                     << (6 * (level + 1)));
+      if (level != 0) {
+        ForEachLive(child.child, level - 1, next, fn);
+        continue;
+      }
+      for (uint64_t bits = child.bits; bits != 0; bits &= bits - 1) {
+        fn(base_ | next | __builtin_ctzll(bits));
+      }
+    }
+  }
+
+  Node* root_;
+  uint32_t levels_;
+  uint32_t width_;
+  uint64_t mask_;
+  uint64_t base_;
+  uint64_t max_ids_;
+  uint64_t active_;
+  uint64_t peak_;
+  size_t bytes_;
+
+  // Fencing after a promotion: the lowest local id NEW may hand out under
+  // each prefix fenced so far, and how many to hold back under each new
+  // one.
+  std::map<std::pair<uint64_t, uint32_t>, uint64_t> fenced_;
+  uint64_t fence_;
+};
+
+}}}}  // namespace dnapoleone::inferenceserver::correlation_id_mgr::backend
@@ -1,32 +1,68 @@
 // Copyright (c) 2019 Doug Napoleone, All rights reserved.
 
 #include "cidmgr_client.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <cidmgr_codes.h>
 #include <request_grpc.h>
+#include "cidmgr_slab.h"
+#include "common/packed_request.h"
+#include "common/shm_registry.h"
+#include "common/sidecar.h"
+#include "common/trace.h"
 
 namespace ni = nvidia::inferenceserver;
 namespace nic = nvidia::inferenceserver::client;
 
 namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr { namespace client {
 
+// Trace event names of the CIDMGR_Op's.
+const char* kTraceNames[CIDMGR_OP_COUNT] = {
+  "client.new", "client.delete", "client.stats", "client.create"};
+
 class CIDMgrImpl : public CIDMgr
 {
  public:
-  CIDMgrImpl(): ctx_(nullptr), correlation_ids_()
+  CIDMgrImpl(): nodes_(), node_index_(), layout_(), next_node_(0),
+    correlation_ids_(), shm_(), pid_(0),
+    histograms_(), server_execute_(), server_registry_(), overhead_(),
+    dump_mu_(), dump_cv_(), dump_thread_(),
+    dump_path_(), dump_interval_ms_(0), trace_()
   {
 
   }
   virtual ~CIDMgrImpl()
   {
+    DumpMetrics("", 0);
     DeleteAllCorrelationIDs();
+    for (Node& node : nodes_) {
+      if (node.sidecar >= 0) {
+        close(node.sidecar);
+      }
+    }
   }
 
   nic::Error Init(
-    const std::string& server_url, 
+    const std::vector<std::string>& server_urls, 
     const std::string& model_name,
     int64_t model_version, 
     bool verbose,
-    bool streaming);
+    bool streaming,
+    const std::string& shm_name);
+
+  // Connect to the cidmgr_sidecar on socket_path as the only node.
+  nic::Error InitSidecar(const std::string& socket_path);
   
   virtual nic::Error Create(
     std::unique_ptr<nic::InferContext>* ctx, 
@@ -38,85 +74,444 @@ class CIDMgrImpl : public CIDMgr
 
   virtual nic::Error NewCorrelationID(ni::CorrelationID* correlation_id)
   {
-    nic::Error err = Run(static_cast<uint64_t*>(correlation_id), CIDMGR_NEW, 0);
+    return NewCorrelationID(correlation_id, std::string());
+  }
+
+  virtual nic::Error NewCorrelationID(CorrelationIDLease* lease)
+  {
+    return NewCorrelationID(lease, std::string());
+  }
+
+  virtual nic::Error NewCorrelationID(
+    ni::CorrelationID* correlation_id, const std::string& ns)
+  {
+    ScopedLatency latency(&histograms_[CIDMGR_OP_NEW]);
+    ScopedTrace trace(trace_.get(), kTraceNames[CIDMGR_OP_NEW]);
+    nic::Error err = nic::Error::Success;
+    // The shared memory block belongs to the default namespace.
+    if (!ns.empty() || !shm_ || !shm_->Allocate(correlation_id, pid_)) {
+      err = RunNew(static_cast<uint64_t*>(correlation_id), NamespaceKey(ns));
+    }
+    if (err.IsOk())
+    {
+      correlation_ids_.Insert(*correlation_id);
+      trace.SetArg(*correlation_id);
+    }
+    return err;
+  }
+
+  virtual nic::Error NewCorrelationID(
+    CorrelationIDLease* lease, const std::string& ns)
+  {
+    ni::CorrelationID correlation_id = 0;
+    nic::Error err = NewCorrelationID(&correlation_id, ns);
     if (err.IsOk())
     {
-      correlation_ids_.insert(*correlation_id);
+      uint32_t slot = correlation_ids_.Find(correlation_id);
+      *lease = MakeLease(
+        this, correlation_id, slot, correlation_ids_.Generation(slot));
     }
     return err;
   }
 
+  virtual nic::Error NewCorrelationIDs(
+    size_t count, std::vector<ni::CorrelationID>* correlation_ids,
+    const std::string& ns)
+  {
+    return NewCorrelationIDs(count, correlation_ids, NamespaceKey(ns));
+  }
+
+  virtual nic::Error NewCorrelationIDs(
+    size_t count, std::vector<ni::CorrelationID>* correlation_ids,
+    uint32_t key)
+  {
+    return NewCorrelationIDsArg(count, correlation_ids, key);
+  }
+
+  virtual nic::Error NewCorrelationID(
+    ni::CorrelationID* correlation_id, uint64_t prefix, uint32_t prefix_bits)
+  {
+    if (!ValidPrefix(prefix, prefix_bits)) {
+      return InvalidPrefix();
+    }
+    ScopedLatency latency(&histograms_[CIDMGR_OP_NEW]);
+    ScopedTrace trace(trace_.get(), kTraceNames[CIDMGR_OP_NEW]);
+    nic::Error err = RunNew(
+      static_cast<uint64_t*>(correlation_id), PrefixArg(prefix, prefix_bits));
+    if (err.IsOk())
+    {
+      correlation_ids_.Insert(*correlation_id);
+      trace.SetArg(*correlation_id);
+    }
+    return err;
+  }
+
+  virtual nic::Error NewCorrelationIDs(
+    size_t count, std::vector<ni::CorrelationID>* correlation_ids,
+    uint64_t prefix, uint32_t prefix_bits)
+  {
+    if (!ValidPrefix(prefix, prefix_bits)) {
+      return InvalidPrefix();
+    }
+    return NewCorrelationIDsArg(
+      count, correlation_ids, PrefixArg(prefix, prefix_bits));
+  }
+
   virtual nic::Error DeleteCorrelationID(ni::CorrelationID correlation_id)
   {
-    nic::Error err = Run(nullptr, CIDMGR_DELETE, correlation_id);
-    auto it = correlation_ids_.find(correlation_id);
-    if (it != correlation_ids_.end()) {
-      correlation_ids_.erase(it);
+    nic::Error err = Release(correlation_id);
+    uint32_t slot = correlation_ids_.Find(correlation_id);
+    if (slot != CorrelationIDSlab::kNoSlot) {
+      correlation_ids_.Erase(slot);
     }
     return err;
   }
 
+  virtual nic::Error DeleteCorrelationIDs(
+    const std::vector<ni::CorrelationID>& correlation_ids)
+  {
+    std::vector<ni::CorrelationID> not_deleted;
+    nic::Error err = DeleteCorrelationIDs(correlation_ids, &not_deleted);
+    if (err.IsOk() && !not_deleted.empty()) {
+      return nic::Error(
+        ni::RequestStatusCode::NOT_FOUND,
+        std::to_string(not_deleted.size()) +
+          " CorrelationIds were not released by the server and are "
+          "still in use");
+    }
+    return err;
+  }
+
+  virtual nic::Error DeleteCorrelationIDs(
+    const std::vector<ni::CorrelationID>& correlation_ids,
+    std::vector<ni::CorrelationID>* not_deleted);
+
   virtual nic::Error Active(uint64_t *active)
   {
-    return Run(active, CIDMGR_ACTIVE, 0);
+    ScopedLatency latency(&histograms_[CIDMGR_OP_STATS]);
+    ScopedTrace trace(trace_.get(), kTraceNames[CIDMGR_OP_STATS]);
+    return RunAll(active, CIDMGR_ACTIVE, 0);
   }
 
   virtual nic::Error InActive(uint64_t *inactive)
   {
-    return Run(inactive, CIDMGR_INACTIVE, 0);
+    ScopedLatency latency(&histograms_[CIDMGR_OP_STATS]);
+    ScopedTrace trace(trace_.get(), kTraceNames[CIDMGR_OP_STATS]);
+    return RunAll(inactive, CIDMGR_INACTIVE, 0);
   }
 
   virtual nic::Error Peak(uint64_t *peak)
   {
-    return Run(peak, CIDMGR_PEAK, 0);
+    ScopedLatency latency(&histograms_[CIDMGR_OP_STATS]);
+    ScopedTrace trace(trace_.get(), kTraceNames[CIDMGR_OP_STATS]);
+    return RunAll(peak, CIDMGR_PEAK, 0);
   }
 
-  virtual nic::Error CorrelationIDs(std::unique_ptr<CorrelationIDSet> correlation_ids)
+  virtual nic::Error Stats(
+    const std::string& ns,
+    uint64_t* active, uint64_t* inactive, uint64_t* peak)
+  {
+    return Stats(NamespaceKey(ns), active, inactive, peak);
+  }
+
+  virtual nic::Error Stats(
+    uint32_t key,
+    uint64_t* active, uint64_t* inactive, uint64_t* peak)
+  {
+    ScopedLatency latency(&histograms_[CIDMGR_OP_STATS]);
+    ScopedTrace trace(trace_.get(), kTraceNames[CIDMGR_OP_STATS]);
+    nic::Error err = RunAll(active, CIDMGR_ACTIVE, key);
+    if (err.IsOk()) {
+      err = RunAll(inactive, CIDMGR_INACTIVE, key);
+    }
+    if (err.IsOk()) {
+      err = RunAll(peak, CIDMGR_PEAK, key);
+    }
+    return err;
+  }
+
+  virtual nic::Error CorrelationIDs(CorrelationIDSet* correlation_ids)
   {
     correlation_ids->clear();
-    *correlation_ids = correlation_ids_;
+    correlation_ids_.ForEach([correlation_ids](uint64_t correlation_id) {
+      correlation_ids->insert(correlation_id);
+    });
     return nic::Error::Success;
   }
 
+  virtual nic::Error ForEachCorrelationID(
+    const std::function<void(ni::CorrelationID)>& fn)
+  {
+    correlation_ids_.ForEach(fn);
+    return nic::Error::Success;
+  }
+
+  virtual size_t CorrelationIDCount() const
+  {
+    return correlation_ids_.Size();
+  }
+
   virtual nic::Error DeleteAllCorrelationIDs()
   {
     nic::Error err = nic::Error::Success;
-    for (auto it = correlation_ids_.begin(); it != correlation_ids_.end(); )
-    {
-      err = Run(nullptr, CIDMGR_DELETE, *it);
-      it = correlation_ids_.erase(it);
-      if (!err.IsOk())
-      {
-        return err;
+    correlation_ids_.EraseIf([this, &err](uint64_t correlation_id) {
+      if (!err.IsOk()) {
+        return false;
       }
-    }
+      err = Release(correlation_id);
+      return true;
+    });
     return err;
   }
 
+  virtual nic::Error Validate(
+    const std::vector<ni::CorrelationID>& correlation_ids,
+    std::vector<bool>* live);
+
+  virtual nic::Error Reconcile(
+    bool reserve = false,
+    const CorrelationIDSet* release = nullptr,
+    size_t* dropped = nullptr);
+
+  virtual nic::Error Metrics(CIDMgrMetrics* metrics)
+  {
+    for (int op = 0; op < CIDMGR_OP_COUNT; ++op) {
+      histograms_[op].Snapshot(&metrics->ops[op]);
+      server_execute_[op].Snapshot(&metrics->server_execute[op]);
+      server_registry_[op].Snapshot(&metrics->server_registry[op]);
+      overhead_[op].Snapshot(&metrics->overhead[op]);
+    }
+    return nic::Error::Success;
+  }
+
+  virtual nic::Error DumpMetrics(
+    const std::string& path, uint32_t interval_ms);
+
+  virtual nic::Error EnableTrace(size_t events)
+  {
+    trace_.reset(events ? new TraceRing(events) : nullptr);
+    return nic::Error::Success;
+  }
+
+  virtual nic::Error WriteTrace(const std::string& path)
+  {
+    if (!trace_) {
+      return nic::Error(
+        ni::RequestStatusCode::INVALID_ARG, "tracing is not enabled");
+    }
+    if (WriteChromeTrace(*trace_, path, "cidmgr client") < 0) {
+      return nic::Error(
+        ni::RequestStatusCode::INTERNAL, "unable to write trace " + path);
+    }
+    return nic::Error::Success;
+  }
+
+  virtual nic::Error WriteServerTrace(uint64_t* events)
+  {
+    return RunAll(events, CIDMGR_TRACE, 0);
+  }
+
+  virtual nic::Error Promote(uint64_t* sequence)
+  {
+    return RunAll(sequence, CIDMGR_PROMOTE, 0);
+  }
+
+  virtual nic::Error Create(
+    std::unique_ptr<nic::InferContext>* ctx, 
+    CorrelationIDLease* lease,
+    const std::string& server_url, 
+    const std::string& model_name,
+    int64_t model_version = -1, 
+    bool verbose = false,
+    bool streaming = true);
+
  protected:
+  virtual nic::Error ReleaseLease(uint32_t slot, uint32_t generation)
+  {
+    if (!correlation_ids_.Holds(slot, generation)) {
+      // Already deleted by value or by DeleteAllCorrelationIDs.
+      return nic::Error::Success;
+    }
+    nic::Error err = Release(correlation_ids_.ID(slot));
+    correlation_ids_.Erase(slot);
+    return err;
+  }
+
+  // One cidmgr node. A CIDMgr created for a single server has one node
+  // with an unpartitioned layout.
+  struct Node {
+    std::unique_ptr<nic::InferContext> ctx;
+    uint32_t node_id;
+    // The model takes the packed REQUEST / RESPONSE format.
+    bool packed;
+    // CORRELATION_ID is variable length (config_bulk.pbtxt.in), so the
+    // bulk ops take all their id's in one request.
+    bool bulk;
+    // Socket to the cidmgr_sidecar in place of ctx, or -1. The sidecar
+    // always takes the packed format.
+    int sidecar;
+  };
+
   nic::Error GetInput(
+    nic::InferContext* ctx,
     std::shared_ptr<nic::InferContext::Input>* input,
     const std::string& name,
     uint8_t* value,
-    size_t size);
+    size_t size,
+    int64_t count = 1);
 
   nic::Error Run(
+    Node& node,
     uint64_t *result, 
     CIDMGR_Code code, 
     ni::CorrelationID correlation_id);
 
-  std::unique_ptr<nic::InferContext> ctx_;
-  CorrelationIDSet correlation_ids_;
+  // Run a request in the packed format, see common/packed_request.h.
+  // response gets the result words, without the timing.
+  nic::Error RunPacked(
+    Node& node,
+    CIDMGR_Code code,
+    uint64_t count,
+    uint64_t arg,
+    const std::vector<uint64_t>* correlation_ids,
+    std::vector<uint64_t>* response);
+
+  // Send a packed request to the server, or to the sidecar. response gets
+  // the expected number of RESPONSE words, including the timing, and start
+  // the time the request went out.
+  nic::Error RunPackedContext(
+    Node& node,
+    const std::vector<uint64_t>& request,
+    size_t expected,
+    uint64_t* start,
+    std::vector<uint64_t>* response);
+  nic::Error RunSidecar(
+    Node& node,
+    const std::vector<uint64_t>& request,
+    size_t expected,
+    uint64_t* start,
+    std::vector<uint64_t>* response);
+
+  // Run a bulk CIDMGR_VALIDATE or CIDMGR_RECONCILE, one bit per id.
+  nic::Error RunBulk(
+    Node& node,
+    CIDMGR_Code code,
+    const std::vector<uint64_t>& correlation_ids,
+    std::vector<uint64_t>* bits);
+
+  // Index of the node owning the id, false if no node does.
+  bool NodeIndex(ni::CorrelationID correlation_id, size_t* index) const;
+
+  // Bulk op for ids spread over the nodes, in one request per node.
+  // result[i] is the bit for correlation_ids[i].
+  nic::Error RunBulkAll(
+    CIDMGR_Code code,
+    const std::vector<uint64_t>& correlation_ids,
+    std::vector<bool>* result);
+
+  // Record the server side split of a request's round trip, if the
+  // results carry the TIMING output.
+  void RecordTiming(
+    CIDMGR_Code code,
+    uint64_t start,
+    std::map<std::string, std::unique_ptr<nic::InferContext::Result>>& results);
+
+  // Record the server side split given the three TIMING words.
+  void RecordTiming(CIDMGR_Code code, uint64_t start, const uint64_t* timing);
+
+  // count NEWs with the namespace key or prefix argument, all or nothing.
+  nic::Error NewCorrelationIDsArg(
+    size_t count, std::vector<ni::CorrelationID>* correlation_ids,
+    uint64_t arg);
+
+  // Namespace Create() allocates from for model_name. The shared memory
+  // block only serves the default namespace, so with one open the context
+  // gets its id from the block instead of the model's namespace.
+  std::string CreateNamespace(const std::string& model_name) const
+  {
+    return shm_ ? std::string() : model_name;
+  }
+
+  static nic::Error InvalidPrefix()
+  {
+    return nic::Error(
+      ni::RequestStatusCode::INVALID_ARG,
+      "the prefix must fit in prefix_bits, at most " +
+        std::to_string(CIDMGR_MAX_PREFIX_BITS));
+  }
+
+  // NEW round robin over the nodes, failing over to the next node on error.
+  // arg is the namespace key or a PrefixArg().
+  nic::Error RunNew(uint64_t *result, uint64_t arg);
+
+  // count NEWs appended to ids, as few requests as the nodes allow. On
+  // error ids holds the ones created so far.
+  nic::Error RunNewMany(
+    size_t count, uint64_t arg, std::vector<uint64_t>* ids);
+
+  // Run a stat on every node, summing the results.
+  nic::Error RunAll(
+    uint64_t *result, 
+    CIDMGR_Code code, 
+    ni::CorrelationID correlation_id);
+
+  // Discover the id layout of every node and check they partition the id
+  // space.
+  nic::Error InitLayout();
+
+  // Release the CorrelationID on the shared memory registry or the server.
+  nic::Error Release(ni::CorrelationID correlation_id);
+
+  // Create the inference context for an already reserved CorrelationID.
+  nic::Error CreateContext(
+    std::unique_ptr<nic::InferContext>* ctx, 
+    ni::CorrelationID correlation_id,
+    const std::string& server_url, 
+    const std::string& model_name,
+    int64_t model_version, 
+    bool verbose,
+    bool streaming);
+
+  // cidmgr nodes, and the index into nodes_ for each node id.
+  std::vector<Node> nodes_;
+  std::unordered_map<uint32_t, size_t> node_index_;
+  NodeLayout layout_;
+  size_t next_node_;
+
+  CorrelationIDSlab correlation_ids_;
+
+  // Write the current Metrics() to path.
+  void WriteMetrics(const std::string& path);
+
+  // same-host shared memory registry, if the backend publishes one.
+  std::unique_ptr<ShmRegistry> shm_;
+  uint32_t pid_;
+
+  // per operation latency and the optional periodic dump of them.
+  Histogram histograms_[CIDMGR_OP_COUNT];
+  Histogram server_execute_[CIDMGR_OP_COUNT];
+  Histogram server_registry_[CIDMGR_OP_COUNT];
+  Histogram overhead_[CIDMGR_OP_COUNT];
+  std::mutex dump_mu_;
+  std::condition_variable dump_cv_;
+  std::thread dump_thread_;
+  std::string dump_path_;
+  uint32_t dump_interval_ms_;
+
+  // optional event trace ring.
+  std::unique_ptr<TraceRing> trace_;
 
 };
 
 nic::Error CIDMgrImpl::GetInput(
+  nic::InferContext* ctx,
   std::shared_ptr<nic::InferContext::Input>* input,
   const std::string& name,
   uint8_t* value,
-  size_t size)
+  size_t size,
+  int64_t count)
 {
-  nic::Error err = ctx_->GetInput(name, input);
+  nic::Error err = ctx->GetInput(name, input);
   if (!err.IsOk())
   {
     return err;
@@ -126,16 +521,39 @@ nic::Error CIDMgrImpl::GetInput(
   {
     return err;
   }
+  // Variable size inputs need their shape for every request.
+  const auto& dims = (*input)->Dims();
+  for (int d = 0; d < dims.size(); ++d) {
+    if (dims[d] == -1) {
+      err = (*input)->SetShape(std::vector<int64_t>(1, count));
+      if (!err.IsOk())
+      {
+        return err;
+      }
+      break;
+    }
+  }
   err = (*input)->SetRaw(reinterpret_cast<uint8_t*>(value), size);
   return err;
 }
 
 nic::Error 
 CIDMgrImpl::Run(
+  Node& node,
   uint64_t *result, 
   CIDMGR_Code code, 
   ni::CorrelationID correlation_id)
 {
+  if (node.packed) {
+    std::vector<uint64_t> response;
+    nic::Error err = RunPacked(node, code, 1, correlation_id, nullptr, &response);
+    if (err.IsOk() && (result != nullptr)) {
+      *result = response[0];
+    }
+    return err;
+  }
+
+  nic::InferContext* ctx = node.ctx.get();
   nic::Error err = nic::Error::Success;
   int8_t vcode = code;
   uint64_t vcorrelation_id = correlation_id;
@@ -149,28 +567,30 @@ CIDMgrImpl::Run(
     options->SetFlag(ni::InferRequestHeader::FLAG_SEQUENCE_START, true);
   }
   options->SetBatchSize(1);
-  for (const auto& output : ctx_->Outputs()) {
+  for (const auto& output : ctx->Outputs()) {
     options->AddRawResult(output);
   }
 
-  err = ctx_->SetRunOptions(*options);
+  err = ctx->SetRunOptions(*options);
   if (!err.IsOk()) { return err; }
 
 
   // Initialize the inputs with the data.
   std::shared_ptr<nic::InferContext::Input> icode;
   std::shared_ptr<nic::InferContext::Input> icorrelation_id;
-  err = GetInput(&icode, "CODE", 
+  err = GetInput(ctx, &icode, "CODE", 
                  reinterpret_cast<uint8_t*>(&vcode), sizeof(int8_t));
   if (!err.IsOk()) { return err; }
-  err = GetInput(&icorrelation_id, "CORRELATION_ID", 
+  err = GetInput(ctx, &icorrelation_id, "CORRELATION_ID", 
                  reinterpret_cast<uint8_t*>(&vcorrelation_id), sizeof(uint64_t));
   if (!err.IsOk()) { return err; }
 
   // Send inference request to the inference server.
   std::map<std::string, std::unique_ptr<nic::InferContext::Result>> results;
-  err = ctx_->Run(&results);
+  const uint64_t start = MonotonicNanos();
+  err = ctx->Run(&results);
   if (!err.IsOk()) { return err; }
+  RecordTiming(code, start, results);
 
   uint64_t r = 0;
   err = results["OUTPUT"]->GetRawAtCursor(0 /* batch idx */, &r);
@@ -182,8 +602,834 @@ CIDMgrImpl::Run(
   return err;
 }
 
+nic::Error 
+CIDMgrImpl::RunPacked(
+  Node& node,
+  CIDMGR_Code code,
+  uint64_t count,
+  uint64_t arg,
+  const std::vector<uint64_t>* correlation_ids,
+  std::vector<uint64_t>* response)
+{
+  // Header, then the ids of the bulk ops. Always ask for the timing, it is
+  // three words on the response.
+  std::vector<uint64_t> request;
+  request.reserve(
+    CIDMGR_PACKED_HEADER_WORDS +
+    ((correlation_ids != nullptr) ? correlation_ids->size() : 0));
+  request.push_back(PackRequestWord(code, CIDMGR_PACKED_TIMING));
+  request.push_back(count);
+  request.push_back(arg);
+  if (correlation_ids != nullptr) {
+    request.insert(
+      request.end(), correlation_ids->begin(), correlation_ids->end());
+  }
+
+  const size_t words = PackedResultWords(
+    code == CIDMGR_NEW,
+    (code == CIDMGR_VALIDATE) || (code == CIDMGR_RECONCILE), count);
+  uint64_t start = 0;
+  nic::Error err = (node.sidecar >= 0) ?
+    RunSidecar(
+      node, request, words + CIDMGR_PACKED_TIMING_WORDS, &start, response) :
+    RunPackedContext(
+      node, request, words + CIDMGR_PACKED_TIMING_WORDS, &start, response);
+  if (!err.IsOk()) { return err; }
+  RecordTiming(code, start, response->data() + words);
+  response->resize(words);
+  return nic::Error::Success;
+}
+
+nic::Error 
+CIDMgrImpl::RunPackedContext(
+  Node& node,
+  const std::vector<uint64_t>& request,
+  size_t expected,
+  uint64_t* start,
+  std::vector<uint64_t>* response)
+{
+  nic::InferContext* ctx = node.ctx.get();
+
+  std::unique_ptr<nic::InferContext::Options> options;
+  nic::Error err = nic::InferContext::Options::Create(&options);
+  if (!err.IsOk()) { return err; }
+  options->SetFlags(0);
+  options->SetBatchSize(1);
+  for (const auto& output : ctx->Outputs()) {
+    options->AddRawResult(output);
+  }
+  err = ctx->SetRunOptions(*options);
+  if (!err.IsOk()) { return err; }
+
+  std::shared_ptr<nic::InferContext::Input> irequest;
+  err = GetInput(
+    ctx, &irequest, "REQUEST",
+    reinterpret_cast<uint8_t*>(const_cast<uint64_t*>(request.data())),
+    request.size() * sizeof(uint64_t), request.size());
+  if (!err.IsOk()) { return err; }
+
+  std::map<std::string, std::unique_ptr<nic::InferContext::Result>> results;
+  *start = MonotonicNanos();
+  err = ctx->Run(&results);
+  if (!err.IsOk()) { return err; }
+
+  const std::vector<uint8_t>* buf = nullptr;
+  err = results["RESPONSE"]->GetRaw(0 /* batch idx */, &buf);
+  if (!err.IsOk()) { return err; }
+  if (buf->size() != (expected * sizeof(uint64_t))) {
+    return nic::Error(
+      ni::RequestStatusCode::INTERNAL,
+      "unexpected RESPONSE size for packed cidmgr request");
+  }
+  response->resize(expected);
+  memcpy(response->data(), buf->data(), buf->size());
+  return nic::Error::Success;
+}
+
+nic::Error 
+CIDMgrImpl::RunSidecar(
+  Node& node,
+  const std::vector<uint64_t>& request,
+  size_t expected,
+  uint64_t* start,
+  std::vector<uint64_t>* response)
+{
+  if (request.size() > CIDMGR_SIDECAR_MAX_WORDS) {
+    return nic::Error(
+      ni::RequestStatusCode::INVALID_ARG,
+      "request is too large for the cidmgr sidecar");
+  }
+  const uint32_t words = static_cast<uint32_t>(request.size());
+  SidecarResponseHeader header;
+  *start = MonotonicNanos();
+  if (!SidecarWrite(node.sidecar, &words, sizeof(words)) ||
+      !SidecarWrite(
+        node.sidecar, request.data(), request.size() * sizeof(uint64_t)) ||
+      !SidecarRead(node.sidecar, &header, sizeof(header))) {
+    return nic::Error(
+      ni::RequestStatusCode::UNAVAILABLE,
+      "lost the connection to the cidmgr sidecar");
+  }
+  std::vector<char> payload(header.bytes);
+  if (!SidecarRead(node.sidecar, payload.data(), payload.size())) {
+    return nic::Error(
+      ni::RequestStatusCode::UNAVAILABLE,
+      "lost the connection to the cidmgr sidecar");
+  }
+
+  if (header.status != CIDMGR_SIDECAR_OK) {
+    const std::string message(payload.begin(), payload.end());
+    if (header.status == CIDMGR_SIDECAR_INVALID_ARG) {
+      return nic::Error(ni::RequestStatusCode::INVALID_ARG, message);
+    } else if (header.status == CIDMGR_SIDECAR_UNSUPPORTED) {
+      return nic::Error(ni::RequestStatusCode::UNSUPPORTED, message);
+    } else if (header.status == CIDMGR_SIDECAR_UNAVAILABLE) {
+      return nic::Error(ni::RequestStatusCode::UNAVAILABLE, message);
+    }
+    return nic::Error(ni::RequestStatusCode::INTERNAL, message);
+  }
+  if (payload.size() != (expected * sizeof(uint64_t))) {
+    return nic::Error(
+      ni::RequestStatusCode::INTERNAL,
+      "unexpected response size from the cidmgr sidecar");
+  }
+  response->resize(expected);
+  memcpy(response->data(), payload.data(), payload.size());
+  return nic::Error::Success;
+}
+
+void
+CIDMgrImpl::RecordTiming(
+  CIDMGR_Code code,
+  uint64_t start,
+  std::map<std::string, std::unique_ptr<nic::InferContext::Result>>& results)
+{
+  auto it = results.find("TIMING");
+  if (it == results.end()) {
+    return;
+  }
+  const std::vector<uint8_t>* buf = nullptr;
+  if (!it->second->GetRaw(0 /* batch idx */, &buf).IsOk() ||
+      (buf->size() != (3 * sizeof(uint64_t)))) {
+    return;
+  }
+  uint64_t timing[3];
+  memcpy(timing, buf->data(), sizeof(timing));
+  RecordTiming(code, start, timing);
+}
+
+void
+CIDMgrImpl::RecordTiming(
+  CIDMGR_Code code, uint64_t start, const uint64_t* timing)
+{
+  const uint64_t roundtrip = MonotonicNanos() - start;
+  // Execute entry, registry op start and registry op end, on the server's
+  // clock, so only their differences are meaningful here.
+  if ((timing[1] < timing[0]) || (timing[2] < timing[1])) {
+    return;
+  }
+
+  CIDMGR_Op op = CIDMGR_OP_STATS;
+  if (code == CIDMGR_NEW) {
+    op = CIDMGR_OP_NEW;
+  } else if (code == CIDMGR_DELETE) {
+    op = CIDMGR_OP_DELETE;
+  }
+  const uint64_t execute = timing[2] - timing[0];
+  server_execute_[op].Record(execute);
+  server_registry_[op].Record(timing[2] - timing[1]);
+  overhead_[op].Record((roundtrip > execute) ? roundtrip - execute : 0);
+}
+
+// Render one set of per op histograms as a Prometheus summary.
+static void
+PrometheusSummary(
+  std::ostringstream& out,
+  const char* metric,
+  const char* help,
+  const HistogramSnapshot* snapshots,
+  bool server)
+{
+  static const char* names[CIDMGR_OP_COUNT] = {
+    "new", "delete", "stats", "create"};
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+  out << "# HELP " << metric << " " << help << std::endl;
+  out << "# TYPE " << metric << " summary" << std::endl;
+  for (int op = 0; op < CIDMGR_OP_COUNT; ++op) {
+    const HistogramSnapshot& h = snapshots[op];
+    if (server && (op == CIDMGR_OP_CREATE)) {
+      // CREATE is client side only, it never has server timings.
+      continue;
+    }
+    for (double q : quantiles) {
+      out << metric << "{op=\"" << names[op]
+          << "\",quantile=\"" << q << "\"} " << (h.Percentile(q) * 1e-9)
+          << std::endl;
+    }
+    out << metric << "_sum{op=\"" << names[op] << "\"} "
+        << (h.sum * 1e-9) << std::endl;
+    out << metric << "_count{op=\"" << names[op]
+        << "\"} " << h.count << std::endl;
+  }
+}
+
+std::string
+CIDMgrMetrics::Prometheus() const
+{
+  std::ostringstream out;
+  PrometheusSummary(
+    out, "cidmgr_client_latency_seconds", "CIDMgr client operation latency",
+    ops, false);
+  PrometheusSummary(
+    out, "cidmgr_server_execute_seconds",
+    "cidmgr backend Execute time per request", server_execute, true);
+  PrometheusSummary(
+    out, "cidmgr_server_registry_seconds",
+    "cidmgr backend registry op time per request", server_registry, true);
+  PrometheusSummary(
+    out, "cidmgr_client_overhead_seconds",
+    "CIDMgr request round trip outside the backend Execute", overhead, true);
+  return out.str();
+}
+
+void
+CIDMgrImpl::WriteMetrics(const std::string& path)
+{
+  CIDMgrMetrics metrics;
+  Metrics(&metrics);
+
+  // Write then rename so scrapers never see a partial file.
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp.c_str(), std::ios::trunc);
+    if (!out) {
+      return;
+    }
+    out << metrics.Prometheus();
+  }
+  std::rename(tmp.c_str(), path.c_str());
+}
+
+nic::Error
+CIDMgrImpl::DumpMetrics(const std::string& path, uint32_t interval_ms)
+{
+  // Stop any running dump first.
+  {
+    std::lock_guard<std::mutex> lock(dump_mu_);
+    dump_interval_ms_ = 0;
+  }
+  dump_cv_.notify_all();
+  if (dump_thread_.joinable()) {
+    dump_thread_.join();
+  }
+
+  if (interval_ms == 0) {
+    return nic::Error::Success;
+  }
+  if (path.empty()) {
+    return nic::Error(
+      ni::RequestStatusCode::INVALID_ARG, "metrics dump path is empty");
+  }
+
+  dump_path_ = path;
+  dump_interval_ms_ = interval_ms;
+  dump_thread_ = std::thread([this]() {
+    std::unique_lock<std::mutex> lock(dump_mu_);
+    while (dump_interval_ms_ != 0) {
+      dump_cv_.wait_for(
+        lock, std::chrono::milliseconds(dump_interval_ms_));
+      WriteMetrics(dump_path_);
+    }
+  });
+  return nic::Error::Success;
+}
+
+nic::Error 
+CIDMgrImpl::Release(ni::CorrelationID correlation_id)
+{
+  ScopedLatency latency(&histograms_[CIDMGR_OP_DELETE]);
+  ScopedTrace trace(
+    trace_.get(), kTraceNames[CIDMGR_OP_DELETE], correlation_id);
+  // Ids of the shared memory block re-reserved by the server have no
+  // owner, only the server releases those.
+  if (shm_ && shm_->Contains(correlation_id) &&
+      (shm_->Owner(correlation_id) != 0)) {
+    if (!shm_->ReleaseOwned(correlation_id, pid_)) {
+      return nic::Error(
+        ni::RequestStatusCode::INVALID_ARG,
+        "invalid CORRELATION_ID given for deletion");
+    }
+    return nic::Error::Success;
+  }
+  size_t index = 0;
+  if (nodes_.size() > 1) {
+    auto it = node_index_.find(layout_.NodeOf(correlation_id));
+    if (it == node_index_.end()) {
+      return nic::Error(
+        ni::RequestStatusCode::INVALID_ARG,
+        "CORRELATION_ID does not belong to any cidmgr node");
+    }
+    index = it->second;
+  }
+  return Run(nodes_[index], nullptr, CIDMGR_DELETE, correlation_id);
+}
+
+nic::Error 
+CIDMgrImpl::NewCorrelationIDsArg(
+  size_t count,
+  std::vector<ni::CorrelationID>* correlation_ids,
+  uint64_t arg)
+{
+  ScopedLatency latency(&histograms_[CIDMGR_OP_NEW]);
+  ScopedTrace trace(trace_.get(), kTraceNames[CIDMGR_OP_NEW], count);
+  std::vector<uint64_t> ids;
+  ids.reserve(count);
+  // The shared memory block belongs to the default namespace.
+  if ((arg == 0) && shm_) {
+    uint64_t id = 0;
+    while ((ids.size() < count) && shm_->Allocate(&id, pid_)) {
+      ids.push_back(id);
+    }
+  }
+  nic::Error err = RunNewMany(count, arg, &ids);
+  if (!err.IsOk()) {
+    // All or nothing, give back the ones we got.
+    for (uint64_t id : ids) {
+      Release(id);
+    }
+    return err;
+  }
+  correlation_ids->clear();
+  correlation_ids->reserve(count);
+  for (uint64_t id : ids) {
+    correlation_ids_.Insert(id);
+    correlation_ids->push_back(id);
+  }
+  return nic::Error::Success;
+}
+
+nic::Error 
+CIDMgrImpl::DeleteCorrelationIDs(
+  const std::vector<ni::CorrelationID>& correlation_ids,
+  std::vector<ni::CorrelationID>* not_deleted)
+{
+  not_deleted->clear();
+  ScopedLatency latency(&histograms_[CIDMGR_OP_DELETE]);
+  ScopedTrace trace(
+    trace_.get(), kTraceNames[CIDMGR_OP_DELETE], correlation_ids.size());
+  // Ids from the shared memory block are released locally, the rest and
+  // the block's ids without an owner with the release bit in one bulk
+  // request per node.
+  std::vector<uint64_t> request;
+  request.reserve(correlation_ids.size());
+  for (ni::CorrelationID correlation_id : correlation_ids) {
+    uint32_t slot = correlation_ids_.Find(correlation_id);
+    if (slot == CorrelationIDSlab::kNoSlot) {
+      continue;
+    }
+    if (shm_ && shm_->Contains(correlation_id) &&
+        (shm_->Owner(correlation_id) != 0)) {
+      if (shm_->ReleaseOwned(correlation_id, pid_)) {
+        correlation_ids_.Erase(slot);
+      } else {
+        not_deleted->push_back(correlation_id);
+      }
+    } else {
+      request.push_back(correlation_id | CIDMGR_RELEASE_BIT);
+    }
+  }
+  if (request.empty()) {
+    return nic::Error::Success;
+  }
+
+  std::vector<bool> released;
+  nic::Error err = RunBulkAll(CIDMGR_VALIDATE, request, &released);
+  if (!err.IsOk()) {
+    return err;
+  }
+  for (size_t i = 0; i < request.size(); ++i) {
+    const ni::CorrelationID correlation_id = request[i] & ~CIDMGR_RELEASE_BIT;
+    if (!released[i]) {
+      not_deleted->push_back(correlation_id);
+      continue;
+    }
+    uint32_t slot = correlation_ids_.Find(correlation_id);
+    if (slot != CorrelationIDSlab::kNoSlot) {
+      correlation_ids_.Erase(slot);
+    }
+  }
+  return nic::Error::Success;
+}
+
+nic::Error 
+CIDMgrImpl::RunBulk(
+  Node& node,
+  CIDMGR_Code code,
+  const std::vector<uint64_t>& correlation_ids,
+  std::vector<uint64_t>* bits)
+{
+  if ((node.sidecar >= 0) &&
+      (correlation_ids.size() > CIDMGR_SIDECAR_MAX_IDS)) {
+    // CIDMGR_SIDECAR_MAX_IDS is a multiple of 64, so the chunks' bitmasks
+    // line up.
+    bits->clear();
+    std::vector<uint64_t> chunk;
+    std::vector<uint64_t> chunk_bits;
+    for (size_t offset = 0; offset < correlation_ids.size();
+         offset += CIDMGR_SIDECAR_MAX_IDS) {
+      const size_t n = std::min<size_t>(
+        correlation_ids.size() - offset, CIDMGR_SIDECAR_MAX_IDS);
+      chunk.assign(
+        correlation_ids.begin() + offset,
+        correlation_ids.begin() + offset + n);
+      nic::Error err = RunPacked(node, code, n, 0, &chunk, &chunk_bits);
+      if (!err.IsOk()) {
+        return err;
+      }
+      bits->insert(bits->end(), chunk_bits.begin(), chunk_bits.end());
+    }
+    return nic::Error::Success;
+  }
+  if (node.packed) {
+    return RunPacked(
+      node, code, correlation_ids.size(), 0, &correlation_ids, bits);
+  }
+  if (!node.bulk && (correlation_ids.size() > 1)) {
+    // CORRELATION_ID is [ 1 ] in the default config, one request per id.
+    bits->assign((correlation_ids.size() + 63) / 64, 0);
+    std::vector<uint64_t> one(1);
+    std::vector<uint64_t> one_bits;
+    for (size_t i = 0; i < correlation_ids.size(); ++i) {
+      one[0] = correlation_ids[i];
+      nic::Error err = RunBulk(node, code, one, &one_bits);
+      if (!err.IsOk()) {
+        return err;
+      }
+      (*bits)[i / 64] |= (one_bits[0] & 1) << (i % 64);
+    }
+    return nic::Error::Success;
+  }
+
+  nic::InferContext* ctx = node.ctx.get();
+  int8_t vcode = code;
+
+  std::unique_ptr<nic::InferContext::Options> options;
+  nic::Error err = nic::InferContext::Options::Create(&options);
+  if (!err.IsOk()) { return err; }
+  options->SetFlags(0);
+  options->SetBatchSize(1);
+  for (const auto& output : ctx->Outputs()) {
+    options->AddRawResult(output);
+  }
+  err = ctx->SetRunOptions(*options);
+  if (!err.IsOk()) { return err; }
+
+  std::shared_ptr<nic::InferContext::Input> icode;
+  std::shared_ptr<nic::InferContext::Input> icorrelation_ids;
+  err = GetInput(ctx, &icode, "CODE", 
+                 reinterpret_cast<uint8_t*>(&vcode), sizeof(int8_t));
+  if (!err.IsOk()) { return err; }
+  err = GetInput(
+    ctx, &icorrelation_ids, "CORRELATION_ID",
+    reinterpret_cast<uint8_t*>(const_cast<uint64_t*>(correlation_ids.data())),
+    correlation_ids.size() * sizeof(uint64_t), correlation_ids.size());
+  if (!err.IsOk()) { return err; }
+
+  std::map<std::string, std::unique_ptr<nic::InferContext::Result>> results;
+  const uint64_t start = MonotonicNanos();
+  err = ctx->Run(&results);
+  if (!err.IsOk()) { return err; }
+  RecordTiming(code, start, results);
+
+  const std::vector<uint8_t>* buf = nullptr;
+  err = results["OUTPUT"]->GetRaw(0 /* batch idx */, &buf);
+  if (!err.IsOk()) { return err; }
+  const size_t words = (correlation_ids.size() + 63) / 64;
+  if (buf->size() != (words * sizeof(uint64_t))) {
+    return nic::Error(
+      ni::RequestStatusCode::INTERNAL,
+      "unexpected OUTPUT size for bulk cidmgr request");
+  }
+  bits->resize(words);
+  memcpy(bits->data(), buf->data(), buf->size());
+  return nic::Error::Success;
+}
+
+bool
+CIDMgrImpl::NodeIndex(ni::CorrelationID correlation_id, size_t* index) const
+{
+  if (nodes_.size() == 1) {
+    *index = 0;
+    return true;
+  }
+  auto it = node_index_.find(layout_.NodeOf(correlation_id));
+  if (it == node_index_.end()) {
+    return false;
+  }
+  *index = it->second;
+  return true;
+}
+
+nic::Error 
+CIDMgrImpl::RunBulkAll(
+  CIDMGR_Code code,
+  const std::vector<uint64_t>& correlation_ids,
+  std::vector<bool>* result)
+{
+  result->assign(correlation_ids.size(), false);
+
+  // Split the ids by node, remembering where each came from.
+  std::vector<std::vector<uint64_t>> ids(nodes_.size());
+  std::vector<std::vector<size_t>> positions(nodes_.size());
+  for (size_t i = 0; i < correlation_ids.size(); ++i) {
+    size_t index;
+    if (NodeIndex(correlation_ids[i] & ~CIDMGR_RELEASE_BIT, &index)) {
+      ids[index].push_back(correlation_ids[i]);
+      positions[index].push_back(i);
+    }
+  }
+
+  std::vector<uint64_t> bits;
+  for (size_t index = 0; index < nodes_.size(); ++index) {
+    if (ids[index].empty()) {
+      continue;
+    }
+    nic::Error err = RunBulk(nodes_[index], code, ids[index], &bits);
+    if (!err.IsOk()) {
+      return err;
+    }
+    for (size_t i = 0; i < ids[index].size(); ++i) {
+      (*result)[positions[index][i]] = (bits[i / 64] >> (i % 64)) & 1;
+    }
+  }
+  return nic::Error::Success;
+}
+
+nic::Error 
+CIDMgrImpl::Validate(
+  const std::vector<ni::CorrelationID>& correlation_ids,
+  std::vector<bool>* live)
+{
+  ScopedLatency latency(&histograms_[CIDMGR_OP_STATS]);
+  ScopedTrace trace(trace_.get(), kTraceNames[CIDMGR_OP_STATS]);
+  std::vector<uint64_t> remote;
+  remote.reserve(correlation_ids.size());
+  for (ni::CorrelationID correlation_id : correlation_ids) {
+    remote.push_back(correlation_id & ~CIDMGR_RELEASE_BIT);
+  }
+  nic::Error err = RunBulkAll(CIDMGR_VALIDATE, remote, live);
+  if (!err.IsOk()) {
+    return err;
+  }
+  // The shared memory block answers for its own ids.
+  if (shm_) {
+    for (size_t i = 0; i < correlation_ids.size(); ++i) {
+      if (shm_->Contains(correlation_ids[i])) {
+        (*live)[i] = shm_->Reserved(correlation_ids[i]);
+      }
+    }
+  }
+  return nic::Error::Success;
+}
+
+nic::Error 
+CIDMgrImpl::Reconcile(
+  bool reserve,
+  const CorrelationIDSet* release,
+  size_t* dropped)
+{
+  ScopedLatency latency(&histograms_[CIDMGR_OP_STATS]);
+  ScopedTrace trace(trace_.get(), kTraceNames[CIDMGR_OP_STATS]);
+
+  // Releases first, so they are never re-reserved below.
+  std::vector<uint64_t> request;
+  if (release != nullptr) {
+    for (ni::CorrelationID correlation_id : *release) {
+      uint32_t slot = correlation_ids_.Find(correlation_id);
+      if (slot != CorrelationIDSlab::kNoSlot) {
+        correlation_ids_.Erase(slot);
+      }
+      if (shm_ && shm_->Contains(correlation_id) &&
+          (shm_->Owner(correlation_id) != 0)) {
+        shm_->ReleaseOwned(correlation_id, pid_);
+      } else {
+        request.push_back(correlation_id | CIDMGR_RELEASE_BIT);
+      }
+    }
+  }
+  const size_t releases = request.size();
+
+  // Ids from the shared memory block are reconciled locally.
+  size_t local_dropped = 0;
+  correlation_ids_.EraseIf([&](uint64_t correlation_id) {
+    if (shm_ && shm_->Contains(correlation_id)) {
+      if (shm_->Reserved(correlation_id) ||
+          (reserve && shm_->Reserve(correlation_id, pid_))) {
+        return false;
+      }
+      local_dropped++;
+      return true;
+    }
+    request.push_back(correlation_id);
+    return false;
+  });
+
+  std::vector<bool> held;
+  nic::Error err = RunBulkAll(
+    reserve ? CIDMGR_RECONCILE : CIDMGR_VALIDATE, request, &held);
+  if (!err.IsOk()) {
+    return err;
+  }
+  for (size_t i = releases; i < request.size(); ++i) {
+    if (!held[i]) {
+      correlation_ids_.Erase(correlation_ids_.Find(request[i]));
+      local_dropped++;
+    }
+  }
+  if (dropped != nullptr) {
+    *dropped = local_dropped;
+  }
+  return nic::Error::Success;
+}
+
+nic::Error 
+CIDMgrImpl::RunNew(uint64_t *result, uint64_t arg)
+{
+  nic::Error err = nic::Error::Success;
+  for (size_t tries = 0; tries < nodes_.size(); ++tries) {
+    Node& node = nodes_[next_node_];
+    next_node_ = (next_node_ + 1) % nodes_.size();
+    err = Run(node, result, CIDMGR_NEW, arg);
+    if (err.IsOk()) {
+      break;
+    }
+  }
+  return err;
+}
+
+nic::Error 
+CIDMgrImpl::RunNewMany(
+  size_t count, uint64_t arg, std::vector<uint64_t>* ids)
+{
+  nic::Error err = nic::Error::Success;
+  std::vector<uint64_t> response;
+  while (ids->size() < count) {
+    for (size_t tries = 0; tries < nodes_.size(); ++tries) {
+      Node& node = nodes_[next_node_];
+      next_node_ = (next_node_ + 1) % nodes_.size();
+      if (node.packed) {
+        const size_t n = std::min<size_t>(
+          count - ids->size(), CIDMGR_PACKED_MAX_NEW);
+        err = RunPacked(node, CIDMGR_NEW, n, arg, nullptr, &response);
+        if (err.IsOk()) {
+          ids->insert(ids->end(), response.begin(), response.end());
+        }
+      } else {
+        uint64_t id = 0;
+        err = Run(node, &id, CIDMGR_NEW, arg);
+        if (err.IsOk()) {
+          ids->push_back(id);
+        }
+      }
+      if (err.IsOk()) {
+        break;
+      }
+    }
+    if (!err.IsOk()) {
+      return err;
+    }
+  }
+  return nic::Error::Success;
+}
+
+nic::Error 
+CIDMgrImpl::RunAll(
+  uint64_t *result, 
+  CIDMGR_Code code, 
+  ni::CorrelationID correlation_id)
+{
+  uint64_t total = 0;
+  for (Node& node : nodes_) {
+    uint64_t value = 0;
+    nic::Error err = Run(node, &value, code, correlation_id);
+    if (!err.IsOk()) {
+      return err;
+    }
+    total += value;
+  }
+  if (result != nullptr) {
+    *result = total;
+  }
+  return nic::Error::Success;
+}
+
+nic::Error 
+CIDMgrImpl::InitLayout()
+{
+  for (size_t index = 0; index < nodes_.size(); ++index) {
+    uint64_t packed = 0;
+    nic::Error err = Run(nodes_[index], &packed, CIDMGR_NODE, 0);
+    if (!err.IsOk()) {
+      return err;
+    }
+    NodeLayout layout = NodeLayout::Unpack(packed);
+    if (layout.node_bits == 0) {
+      return nic::Error(
+        ni::RequestStatusCode::INVALID_ARG,
+        "cidmgr node is not configured with node_id_bits");
+    }
+    if ((index > 0) && ((layout.node_bits != layout_.node_bits) ||
+                        (layout.node_shift != layout_.node_shift))) {
+      return nic::Error(
+        ni::RequestStatusCode::INVALID_ARG,
+        "cidmgr nodes are configured with different id layouts");
+    }
+    if (!node_index_.emplace(layout.node_id, index).second) {
+      return nic::Error(
+        ni::RequestStatusCode::INVALID_ARG,
+        "cidmgr nodes are configured with the same node_id");
+    }
+    layout_ = layout;
+    nodes_[index].node_id = layout.node_id;
+  }
+  return nic::Error::Success;
+}
+
 nic::Error 
 CIDMgrImpl::Init(
+  const std::vector<std::string>& server_urls, 
+  const std::string& model_name,
+  int64_t model_version, 
+  bool verbose,
+  bool streaming,
+  const std::string& shm_name)
+{
+  nic::Error err = nic::Error::Success;
+  if (!shm_name.empty()) {
+    // Not finding the region is not an error, the backend is remote
+    // or not publishing one.
+    shm_.reset(ShmRegistry::Open(shm_name));
+    pid_ = static_cast<uint32_t>(getpid());
+  }
+  if (server_urls.empty()) {
+    return nic::Error(
+      ni::RequestStatusCode::INVALID_ARG, "no cidmgr server url given");
+  }
+  nodes_.resize(server_urls.size());
+  for (size_t index = 0; index < server_urls.size(); ++index) {
+    Node& node = nodes_[index];
+    node.node_id = 0;
+    node.packed = false;
+    node.bulk = false;
+    node.sidecar = -1;
+    if (streaming) {
+      err = nic::InferGrpcStreamContext::Create(
+        &node.ctx, 1, server_urls[index], model_name, model_version, verbose);
+    } else {
+      err = nic::InferGrpcContext::Create(
+        &node.ctx, 1, server_urls[index], model_name, model_version, verbose);
+    }
+    if (!err.IsOk()) {
+      return err;
+    }
+    const auto& inputs = node.ctx->Inputs();
+    node.packed = (inputs.size() == 1) && (inputs[0]->Name() == "REQUEST");
+    for (const auto& input : inputs) {
+      if (input->Name() == "CORRELATION_ID") {
+        const auto& dims = input->Dims();
+        for (int d = 0; d < dims.size(); ++d) {
+          node.bulk = node.bulk || (dims[d] == -1);
+        }
+      }
+    }
+  }
+  // A single server needs no routing, and may be an older backend
+  // without CIDMGR_NODE.
+  if (nodes_.size() > 1) {
+    err = InitLayout();
+  }
+  return err;
+}
+
+nic::Error 
+CIDMgrImpl::InitSidecar(const std::string& socket_path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    return nic::Error(
+      ni::RequestStatusCode::INVALID_ARG,
+      "cidmgr sidecar socket path is too long: " + socket_path);
+  }
+  memcpy(addr.sun_path, socket_path.data(), socket_path.size());
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return nic::Error(
+      ni::RequestStatusCode::INTERNAL, "unable to create a unix socket");
+  }
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+              sizeof(addr)) != 0) {
+    close(fd);
+    return nic::Error(
+      ni::RequestStatusCode::UNAVAILABLE,
+      "unable to connect to the cidmgr sidecar at " + socket_path);
+  }
+
+  nodes_.resize(1);
+  nodes_[0].node_id = 0;
+  nodes_[0].packed = true;
+  nodes_[0].bulk = false;
+  nodes_[0].sidecar = fd;
+  return nic::Error::Success;
+}
+
+nic::Error 
+CIDMgrImpl::CreateContext(
+  std::unique_ptr<nic::InferContext>* ctx, 
+  ni::CorrelationID correlation_id,
   const std::string& server_url, 
   const std::string& model_name,
   int64_t model_version, 
@@ -193,10 +1439,10 @@ CIDMgrImpl::Init(
   nic::Error err = nic::Error::Success;
   if (streaming) {
     err = nic::InferGrpcStreamContext::Create(
-      &ctx_, 1, server_url, model_name, model_version, verbose);
+      ctx, correlation_id, server_url, model_name, model_version, verbose);
   } else {
     err = nic::InferGrpcContext::Create(
-      &ctx_, 1, server_url, model_name, model_version, verbose);
+      ctx, correlation_id, server_url, model_name, model_version, verbose);
   }
   return err;
 }
@@ -210,17 +1456,45 @@ CIDMgrImpl::Create(
   bool verbose,
   bool streaming)
 {
+  ScopedLatency latency(&histograms_[CIDMGR_OP_CREATE]);
+  ScopedTrace trace(trace_.get(), kTraceNames[CIDMGR_OP_CREATE]);
   ni::CorrelationID correlation_id = 0;
-  nic::Error err = NewCorrelationID(&correlation_id);
+  nic::Error err =
+    NewCorrelationID(&correlation_id, CreateNamespace(model_name));
   if(!err.IsOk()){
     return err;
   }
-  if (streaming) {
-    err = nic::InferGrpcStreamContext::Create(
-      ctx, correlation_id, server_url, model_name, model_version, verbose);
-  } else {
-    err = nic::InferGrpcContext::Create(
-      ctx, correlation_id, server_url, model_name, model_version, verbose);
+  err = CreateContext(
+    ctx, correlation_id, server_url, model_name, model_version, verbose,
+    streaming);
+  if (!err.IsOk()) {
+    DeleteCorrelationID(correlation_id);
+  }
+  return err;
+}
+
+nic::Error 
+CIDMgrImpl::Create(
+  std::unique_ptr<nic::InferContext>* ctx, 
+  CorrelationIDLease* lease,
+  const std::string& server_url, 
+  const std::string& model_name,
+  int64_t model_version, 
+  bool verbose,
+  bool streaming)
+{
+  ScopedLatency latency(&histograms_[CIDMGR_OP_CREATE]);
+  ScopedTrace trace(trace_.get(), kTraceNames[CIDMGR_OP_CREATE]);
+  CorrelationIDLease new_lease;
+  nic::Error err = NewCorrelationID(&new_lease, CreateNamespace(model_name));
+  if(!err.IsOk()){
+    return err;
+  }
+  err = CreateContext(
+    ctx, new_lease.CorrelationID(), server_url, model_name, model_version,
+    verbose, streaming);
+  if (err.IsOk()) {
+    *lease = std::move(new_lease);
   }
   return err;
 }
@@ -233,12 +1507,59 @@ CIDMgr::Create(
   int64_t model_version, 
   bool verbose,
   bool streaming)
+{
+  return Create(
+    cidmgr, server_url, model_name, model_version, verbose, streaming,
+    std::string());
+}
+
+nic::Error 
+CIDMgr::Create(
+  std::unique_ptr<CIDMgr>* cidmgr,
+  const std::string& server_url, 
+  const std::string& model_name,
+  int64_t model_version, 
+  bool verbose,
+  bool streaming,
+  const std::string& shm_name)
+{
+  return CreateMultiNode(
+    cidmgr, std::vector<std::string>(1, server_url), model_name,
+    model_version, verbose, streaming, shm_name);
+}
+
+nic::Error 
+CIDMgr::CreateMultiNode(
+  std::unique_ptr<CIDMgr>* cidmgr,
+  const std::vector<std::string>& server_urls, 
+  const std::string& model_name,
+  int64_t model_version, 
+  bool verbose,
+  bool streaming,
+  const std::string& shm_name)
 {
   CIDMgrImpl* cidmgr_ptr = new CIDMgrImpl();
   cidmgr->reset(static_cast<CIDMgr*>(cidmgr_ptr));
 
   nic::Error err = cidmgr_ptr->Init(
-    server_url, model_name, model_version, verbose, streaming);
+    server_urls, model_name, model_version, verbose, streaming, shm_name);
+
+  if (!err.IsOk()) {
+    cidmgr->reset();
+  }
+
+  return err;
+}
+
+nic::Error 
+CIDMgr::CreateSidecar(
+  std::unique_ptr<CIDMgr>* cidmgr,
+  const std::string& socket_path)
+{
+  CIDMgrImpl* cidmgr_ptr = new CIDMgrImpl();
+  cidmgr->reset(static_cast<CIDMgr*>(cidmgr_ptr));
+
+  nic::Error err = cidmgr_ptr->InitSidecar(socket_path);
 
   if (!err.IsOk()) {
     cidmgr->reset();
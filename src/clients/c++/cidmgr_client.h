@@ -2,7 +2,15 @@
 
 #pragma once
 
+#include <functional>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
 #include <request.h>
+#include "common/histogram.h"
+#include "common/id_layout.h"
+#include "common/sidecar.h"
 
 namespace ni = nvidia::inferenceserver;
 namespace nic = nvidia::inferenceserver::client;
@@ -11,10 +19,103 @@ namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr
 
 using CorrelationIDSet = std::set<ni::CorrelationID>;
 
+// Operations instrumented by the CIDMgr latency histograms.
+typedef enum cidmgr_op_enum {
+  CIDMGR_OP_NEW = 0,
+  CIDMGR_OP_DELETE,
+  CIDMGR_OP_STATS,
+  CIDMGR_OP_CREATE,
+  CIDMGR_OP_COUNT
+} CIDMGR_Op;
+
+// Point in time copy of the client side latency histograms, in nanoseconds.
+// When the cidmgr model is configured with the TIMING output, every request
+// also splits its round trip into the time spent in the backend's Execute,
+// the part of that spent in the registry op, and the overhead outside
+// Execute (network, gRPC and the server's scheduling).
+struct CIDMgrMetrics {
+  HistogramSnapshot ops[CIDMGR_OP_COUNT];
+  HistogramSnapshot server_execute[CIDMGR_OP_COUNT];
+  HistogramSnapshot server_registry[CIDMGR_OP_COUNT];
+  HistogramSnapshot overhead[CIDMGR_OP_COUNT];
+
+  // Render as a Prometheus text format summary.
+  std::string Prometheus() const;
+};
+
+class CIDMgr;
+
+// Move-only ownership of a CorrelationID reserved through a CIDMgr.
+// The CorrelationID is deleted when the lease is destroyed or reset.
+// A lease must not outlive the CIDMgr that issued it.
+class CorrelationIDLease {
+ public:
+  CorrelationIDLease()
+    : cidmgr_(nullptr), correlation_id_(0), slot_(0), generation_(0) {}
+  ~CorrelationIDLease() { Release(); }
+
+  CorrelationIDLease(CorrelationIDLease&& other) noexcept
+    : cidmgr_(other.cidmgr_), correlation_id_(other.correlation_id_),
+      slot_(other.slot_), generation_(other.generation_)
+  {
+    other.cidmgr_ = nullptr;
+    other.correlation_id_ = 0;
+  }
+
+  CorrelationIDLease& operator=(CorrelationIDLease&& other) noexcept
+  {
+    if (this != &other) {
+      Release();
+      cidmgr_ = other.cidmgr_;
+      correlation_id_ = other.correlation_id_;
+      slot_ = other.slot_;
+      generation_ = other.generation_;
+      other.cidmgr_ = nullptr;
+      other.correlation_id_ = 0;
+    }
+    return *this;
+  }
+
+  CorrelationIDLease(const CorrelationIDLease&) = delete;
+  CorrelationIDLease& operator=(const CorrelationIDLease&) = delete;
+
+  ni::CorrelationID CorrelationID() const { return correlation_id_; }
+  explicit operator bool() const { return correlation_id_ != 0; }
+
+  // Delete the CorrelationID now.
+  nic::Error Release();
+
+  // Give up the lease without deleting the CorrelationID. It stays
+  // registered with the CIDMgr until deleted or the CIDMgr is destroyed.
+  ni::CorrelationID Detach()
+  {
+    ni::CorrelationID correlation_id = correlation_id_;
+    cidmgr_ = nullptr;
+    correlation_id_ = 0;
+    return correlation_id;
+  }
+
+ private:
+  friend class CIDMgr;
+  CorrelationIDLease(
+    CIDMgr* cidmgr, ni::CorrelationID correlation_id,
+    uint32_t slot, uint32_t generation)
+    : cidmgr_(cidmgr), correlation_id_(correlation_id),
+      slot_(slot), generation_(generation) {}
+
+  CIDMgr* cidmgr_;
+  ni::CorrelationID correlation_id_;
+  uint32_t slot_;
+  uint32_t generation_;
+};
+
 class CIDMgr {
  public:
   virtual ~CIDMgr() = default;
 
+  // The original interface, kept first and in its original order so the
+  // vtable slots of code built against it do not move.
+
   // Get a new unique CorrelationId from the server
   virtual nic::Error NewCorrelationID(ni::CorrelationID* correlation_id) = 0;
 
@@ -29,15 +130,22 @@ class CIDMgr {
 
   // Get the peak number of CorrelationIDs reserved
   virtual nic::Error Peak(uint64_t *peak) = 0;
-  
-  // Get all the CorrelationIDs currently in use by this context
-  virtual nic::Error CorrelationIDs(std::unique_ptr<CorrelationIDSet> correlation_ids) = 0;
+
+  // Get all the CorrelationIDs currently in use by this context.
+  // Deprecated, the set is gone once this returns; use the
+  // CorrelationIDSet* overload.
+  virtual nic::Error CorrelationIDs(
+    std::unique_ptr<CorrelationIDSet> correlation_ids)
+  {
+    return CorrelationIDs(correlation_ids.get());
+  }
 
   // Remove all the CorrelationIDs in use by this context
   virtual nic::Error DeleteAllCorrelationIDs() = 0;
 
   // Create the InferGrpcContext or InferGrpcStreamContext with
-  // a unique ni::CorrelationID
+  // a unique ni::CorrelationID, from the model_name namespace or the
+  // shared memory block as for the lease overload
   virtual nic::Error Create(
     std::unique_ptr<nic::InferContext>* ctx, 
     const std::string& server_url, 
@@ -46,6 +154,207 @@ class CIDMgr {
     bool verbose = false,
     bool streaming = true) = 0;
 
+  // Everything below was added later. Each has a default returning
+  // UNSUPPORTED, so CIDMgr implementations written against the original
+  // interface still compile.
+
+  // Get a new unique CorrelationId from the server, owned by the lease.
+  virtual nic::Error NewCorrelationID(CorrelationIDLease* lease)
+  {
+    return Unsupported();
+  }
+
+  // Get a new unique CorrelationId from the namespace on the server.
+  // Each namespace, normally the downstream model name, has its own dense
+  // id space and stats. An empty namespace is the default namespace.
+  virtual nic::Error NewCorrelationID(
+    ni::CorrelationID* correlation_id, const std::string& ns)
+  {
+    return Unsupported();
+  }
+
+  // Get a new unique CorrelationId from the namespace, owned by the lease.
+  virtual nic::Error NewCorrelationID(
+    CorrelationIDLease* lease, const std::string& ns)
+  {
+    return Unsupported();
+  }
+
+  // Get count new unique CorrelationIds from the namespace, all or
+  // nothing. A packed cidmgr model creates them in one round-trip per
+  // CIDMGR_PACKED_MAX_NEW, otherwise it is one round-trip each.
+  virtual nic::Error NewCorrelationIDs(
+    size_t count, std::vector<ni::CorrelationID>* correlation_ids,
+    const std::string& ns)
+  {
+    return Unsupported();
+  }
+
+  // As above for the namespace's 32 bit key, see NamespaceKey().
+  virtual nic::Error NewCorrelationIDs(
+    size_t count, std::vector<ni::CorrelationID>* correlation_ids,
+    uint32_t key)
+  {
+    return Unsupported();
+  }
+
+  // Get a new unique CorrelationId whose top prefix_bits bits of the
+  // node's id range are the low prefix_bits bits of prefix, e.g. a tenant
+  // or shard for downstream routing. The cidmgr model must be configured
+  // with id_space "sparse", which has no namespaces. prefix_bits of 0 is
+  // anywhere in the range, at most CIDMGR_MAX_PREFIX_BITS.
+  virtual nic::Error NewCorrelationID(
+    ni::CorrelationID* correlation_id,
+    uint64_t prefix, uint32_t prefix_bits)
+  {
+    return Unsupported();
+  }
+
+  // Get count new unique CorrelationIds under the prefix, all or nothing.
+  virtual nic::Error NewCorrelationIDs(
+    size_t count, std::vector<ni::CorrelationID>* correlation_ids,
+    uint64_t prefix, uint32_t prefix_bits)
+  {
+    return Unsupported();
+  }
+
+  // Remove the CorrelationIds from use, in one round-trip per node.
+  // CorrelationIds not in use by this context are skipped. On error the
+  // ones not yet deleted stay in use. CorrelationIds the server did not
+  // release also stay in use, and NOT_FOUND is returned; see the overload
+  // below to get them.
+  virtual nic::Error DeleteCorrelationIDs(
+    const std::vector<ni::CorrelationID>& correlation_ids)
+  {
+    return Unsupported();
+  }
+
+  // Get the active, inactive and peak stats for the namespace. An empty
+  // namespace gives the totals across all namespaces.
+  virtual nic::Error Stats(
+    const std::string& ns,
+    uint64_t* active, uint64_t* inactive, uint64_t* peak)
+  {
+    return Unsupported();
+  }
+
+  // As above for the namespace's 32 bit key, 0 for the totals.
+  virtual nic::Error Stats(
+    uint32_t key,
+    uint64_t* active, uint64_t* inactive, uint64_t* peak)
+  {
+    return Unsupported();
+  }
+  
+  // Get a copy of all the CorrelationIDs currently in use by this context
+  virtual nic::Error CorrelationIDs(CorrelationIDSet* correlation_ids)
+  {
+    return Unsupported();
+  }
+
+  // Visit all the CorrelationIDs currently in use by this context without
+  // copying them. fn must not create or delete CorrelationIDs.
+  virtual nic::Error ForEachCorrelationID(
+    const std::function<void(ni::CorrelationID)>& fn)
+  {
+    return Unsupported();
+  }
+
+  // Number of CorrelationIDs currently in use by this context, 0 if the
+  // CIDMgr does not keep count.
+  virtual size_t CorrelationIDCount() const { return 0; }
+
+  // Find which of the CorrelationIDs are still reserved on the server, in
+  // one round-trip per node. live[i] is for correlation_ids[i].
+  virtual nic::Error Validate(
+    const std::vector<ni::CorrelationID>& correlation_ids,
+    std::vector<bool>* live)
+  {
+    return Unsupported();
+  }
+
+  // Bring the CorrelationIDs in use by this context in line with the
+  // server, in one round-trip per node, e.g. after a reconnect or a server
+  // restart. CorrelationIDs in 'release' are deleted. If 'reserve', the
+  // server re-reserves the ones it no longer holds, otherwise they are
+  // dropped locally. CorrelationIDs the server can not hold are always
+  // dropped. 'dropped' gets the number of local CorrelationIDs dropped.
+  virtual nic::Error Reconcile(
+    bool reserve = false,
+    const CorrelationIDSet* release = nullptr,
+    size_t* dropped = nullptr)
+  {
+    return Unsupported();
+  }
+
+  // Get a snapshot of the per operation latency histograms
+  virtual nic::Error Metrics(CIDMgrMetrics* metrics) { return Unsupported(); }
+
+  // Write Metrics() to path in the Prometheus text format every
+  // interval_ms. An interval_ms of 0 stops the periodic dump.
+  virtual nic::Error DumpMetrics(
+    const std::string& path, uint32_t interval_ms)
+  {
+    return Unsupported();
+  }
+
+  // Record begin and end events of every operation into a ring of the
+  // given number of events, 0 turns tracing off. Call before using the
+  // CIDMgr from other threads.
+  virtual nic::Error EnableTrace(size_t events) { return Unsupported(); }
+
+  // Write the trace ring to path in the Chrome trace-event JSON format.
+  // Timestamps are on the same clock as the backend trace, so the two can
+  // be merged into one timeline (see test/merge_traces.py).
+  virtual nic::Error WriteTrace(const std::string& path)
+  {
+    return Unsupported();
+  }
+
+  // Have every cidmgr server write its own trace ring to its trace_file.
+  // events gets the total number of events written.
+  virtual nic::Error WriteServerTrace(uint64_t* events)
+  {
+    return Unsupported();
+  }
+
+  // Promote standby cidmgr servers to primary (see replication_primary in
+  // the backend). sequence gets the sum of the last op log sequence
+  // numbers applied, for one server the op it took over at.
+  virtual nic::Error Promote(uint64_t* sequence) { return Unsupported(); }
+
+  // Create the InferGrpcContext or InferGrpcStreamContext with a unique
+  // ni::CorrelationID from the model_name namespace owned by lease.
+  // Destroy ctx before the lease. With a shared memory block open (see
+  // the static Create) the id comes from the block, which only serves the
+  // default namespace, instead of from the model_name namespace.
+  virtual nic::Error Create(
+    std::unique_ptr<nic::InferContext>* ctx, 
+    CorrelationIDLease* lease,
+    const std::string& server_url, 
+    const std::string& model_name,
+    int64_t model_version = -1, 
+    bool verbose = false,
+    bool streaming = true)
+  {
+    return Unsupported();
+  }
+
+  // DeleteCorrelationIDs(), returning in not_deleted the CorrelationIds
+  // the server did not release (e.g. no longer reserved there after a
+  // failover, or on a node this context does not know). Those stay in use
+  // by this context; succeeds if the requests to the server did.
+  virtual nic::Error DeleteCorrelationIDs(
+    const std::vector<ni::CorrelationID>& correlation_ids,
+    std::vector<ni::CorrelationID>* not_deleted)
+  {
+    return Unsupported();
+  }
+
+  // Create the CIDMgr for the cidmgr model on the server. The model may
+  // use either the CODE / CORRELATION_ID format (config.pbtxt.in) or the
+  // packed REQUEST / RESPONSE format (config_packed.pbtxt.in), which is
+  // detected from the model's inputs.
   static nic::Error Create(
     std::unique_ptr<CIDMgr>* cidmgr,
     const std::string& server_url, 
@@ -54,6 +363,84 @@ class CIDMgr {
     bool verbose = false,
     bool streaming = false);
 
+  // As above. If the backend publishes a shared memory registry under
+  // shm_name on this host, CorrelationIDs are allocated from it directly,
+  // falling back to the server when it is missing or exhausted.
+  // The block only serves the default namespace: contexts made with
+  // Create() then use the default namespace instead of their model's,
+  // while NewCorrelationID() with a namespace still goes to the server.
+  static nic::Error Create(
+    std::unique_ptr<CIDMgr>* cidmgr,
+    const std::string& server_url, 
+    const std::string& model_name,
+    int64_t model_version, 
+    bool verbose,
+    bool streaming,
+    const std::string& shm_name);
+
+  // Create a CIDMgr routing over several partitioned cidmgr nodes, each
+  // configured with the same node_id_bits and a distinct node_id. NEW is
+  // sent round robin, failing over to the next node on error. DELETE goes
+  // to the node owning the id by its node id bits. Stats are the sums over
+  // all the nodes.
+  static nic::Error CreateMultiNode(
+    std::unique_ptr<CIDMgr>* cidmgr,
+    const std::vector<std::string>& server_urls, 
+    const std::string& model_name="cidmgr",
+    int64_t model_version = -1, 
+    bool verbose = false,
+    bool streaming = false,
+    const std::string& shm_name = "");
+
+  // Create a CIDMgr talking to the cidmgr_sidecar on this host over its
+  // Unix socket instead of to the server. The sidecar batches the requests
+  // of all its local processes into server calls and releases the
+  // CorrelationIDs of a process that exits without deleting them. NODE,
+  // TRACE and PROMOTE are not available through the sidecar.
+  static nic::Error CreateSidecar(
+    std::unique_ptr<CIDMgr>* cidmgr,
+    const std::string& socket_path = CIDMGR_SIDECAR_DEFAULT_SOCKET);
+
+  // The 32 bit key the namespace is sent to the server as, 0 for the
+  // default namespace.
+  static uint32_t NamespaceKey(const std::string& ns)
+  {
+    return correlation_id_mgr::NamespaceKey(ns.data(), ns.size());
+  }
+
+ protected:
+  friend class CorrelationIDLease;
+
+  // Delete the CorrelationID held by a lease, if the slot still holds it.
+  virtual nic::Error ReleaseLease(uint32_t slot, uint32_t generation)
+  {
+    return Unsupported();
+  }
+
+  static CorrelationIDLease MakeLease(
+    CIDMgr* cidmgr, ni::CorrelationID correlation_id,
+    uint32_t slot, uint32_t generation)
+  {
+    return CorrelationIDLease(cidmgr, correlation_id, slot, generation);
+  }
+
+  static nic::Error Unsupported()
+  {
+    return nic::Error(
+      ni::RequestStatusCode::UNSUPPORTED, "not supported by this CIDMgr");
+  }
 };
 
+inline nic::Error
+CorrelationIDLease::Release()
+{
+  nic::Error err = nic::Error::Success;
+  if (cidmgr_ != nullptr) {
+    err = cidmgr_->ReleaseLease(slot_, generation_);
+  }
+  cidmgr_ = nullptr;
+  correlation_id_ = 0;
+  return err;
+}
+
 }}}} // namespace dnapoleone::inferenceserver::correlation_id_mgr::client
@@ -24,9 +24,14 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#include <sys/resource.h>
 #include <unistd.h>
+#include <atomic>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include "request_grpc.h"
 #include "request_http.h"
@@ -34,6 +39,7 @@
 
 namespace ni = nvidia::inferenceserver;
 namespace nic = nvidia::inferenceserver::client;
+namespace dic = dnapoleone::inferenceserver::correlation_id_mgr;
 namespace dicc = dnapoleone::inferenceserver::correlation_id_mgr::client;
 
 #define FAIL_IF_ERR(X, MSG)                                        \
@@ -45,8 +51,80 @@ namespace dicc = dnapoleone::inferenceserver::correlation_id_mgr::client;
     }                                                              \
   }
 
+// Load generator for stateful sequence models using cidmgr for the
+// correlation ids, along the lines of the TRTIS perf_client.
+//
+// Each worker thread owns a CIDMgr and drives a number of concurrent
+// sequences against the simple_sequence model. For every sequence it
+// gets a new correlation id, creates the inference context, sends the
+// sequence and releases the id. The time spent in each phase is recorded
+// so the cidmgr share of the sequence time can be reported.
+//
+// With -i only the correlation id churn is run (NEW/DELETE), which
+// isolates the cost of the cidmgr round-trip. It also reports the client
+// CPU and the backend Execute time per id op, e.g. to compare the cidmgr
+// and cidmgr_packed models with -g.
+
 namespace {
 
+// Latency phases recorded for every sequence.
+typedef enum phase_enum {
+  PHASE_ID_NEW = 0,
+  PHASE_CONTEXT,
+  PHASE_INFER,
+  PHASE_ID_DELETE,
+  PHASE_SEQUENCE,
+  PHASE_COUNT
+} Phase;
+
+const char* kPhaseNames[PHASE_COUNT] = {
+  "id new", "context create", "infer request", "id delete", "sequence"};
+
+struct Options {
+  Options()
+      : verbose(false), async(false), streaming(true), id_only(false),
+        url("localhost:8001"), model_name("simple_sequence"),
+        cidmgr_name("cidmgr"), shm_name(), cidmgr_urls(), trace_file(),
+        threads(1),
+        concurrency(1),
+        sequences(100), length(8)
+  {
+  }
+
+  bool verbose;
+  bool async;
+  bool streaming;
+  bool id_only;
+  std::string url;
+  std::string model_name;
+  std::string cidmgr_name;
+  std::string shm_name;
+  std::vector<std::string> cidmgr_urls;
+  std::string trace_file;
+  uint32_t threads;
+  uint32_t concurrency;
+  uint32_t sequences;
+  uint32_t length;
+};
+
+struct Stats {
+  Stats()
+      : workers(0), sequences(0), requests(0), errors(0), server_ops(0),
+        server_execute(0)
+  {
+  }
+
+  dic::Histogram phases[PHASE_COUNT];
+  std::atomic<uint32_t> workers;
+  std::atomic<uint64_t> sequences;
+  std::atomic<uint64_t> requests;
+  std::atomic<uint64_t> errors;
+
+  // id ops timed by the backend, and their summed Execute nanoseconds.
+  std::atomic<uint64_t> server_ops;
+  std::atomic<uint64_t> server_execute;
+};
+
 void
 Usage(char** argv, const std::string& msg = std::string())
 {
@@ -56,23 +134,39 @@ Usage(char** argv, const std::string& msg = std::string())
 
   std::cerr << "Usage: " << argv[0] << " [options]" << std::endl;
   std::cerr << "\t-v" << std::endl;
-  std::cerr << "\t-r" << std::endl;
   std::cerr << "\t-a" << std::endl;
+  std::cerr << "\t-i" << std::endl;
+  std::cerr << "\t-s <streaming: 0 or 1 (default 1)>" << std::endl;
+  std::cerr << "\t-t <number of worker threads (default 1)>" << std::endl;
+  std::cerr << "\t-c <concurrent sequences per thread (default 1)>"
+            << std::endl;
+  std::cerr << "\t-n <total number of sequences (default 100)>" << std::endl;
+  std::cerr << "\t-l <sequence length (default 8)>" << std::endl;
+  std::cerr << "\t-m <sequence model name (default simple_sequence)>"
+            << std::endl;
+  std::cerr << "\t-g <cidmgr model name (default cidmgr)>" << std::endl;
+  std::cerr << "\t-x <cidmgr shared memory name>" << std::endl;
+  std::cerr << "\t-r <comma separated URLs of partitioned cidmgr nodes>"
+            << std::endl;
+  std::cerr << "\t-T <client trace file, also triggers the server trace>"
+            << std::endl;
   std::cerr << "\t-u <URL for inference service and its gRPC port>"
             << std::endl;
   std::cerr << std::endl;
-  std::cerr << "For -r, the client will run non-streaming context first."
-            << std::endl;
   std::cerr << "For -a, the client will send asynchronous requests."
             << std::endl;
+  std::cerr << "For -i, only correlation id NEW/DELETE churn is measured."
+            << std::endl;
+  std::cerr << "For -r, correlation ids come from the cidmgr nodes instead "
+            << "of the -u server." << std::endl;
 
   exit(1);
 }
 
-int32_t
-Send(
+void
+SetOptions(
     const std::unique_ptr<nic::InferContext>& ctx, int32_t value,
-    bool start_of_sequence = false, bool end_of_sequence = false)
+    bool start_of_sequence, bool end_of_sequence)
 {
   // Set the context options to do batch-size 1 requests. Also request
   // that all output tensors be returned.
@@ -94,7 +188,7 @@ Send(
     options->AddRawResult(output);
   }
 
-  FAIL_IF_ERR(ctx->SetRunOptions(*options), "unable to set context 0 options");
+  FAIL_IF_ERR(ctx->SetRunOptions(*options), "unable to set context options");
 
   // Initialize the inputs with the data.
   std::shared_ptr<nic::InferContext::Input> ivalue;
@@ -103,11 +197,12 @@ Send(
   FAIL_IF_ERR(
       ivalue->SetRaw(reinterpret_cast<uint8_t*>(&value), sizeof(int32_t)),
       "unable to set data for INPUT");
+}
 
-  // Send inference request to the inference server.
-  std::map<std::string, std::unique_ptr<nic::InferContext::Result>> results;
-  FAIL_IF_ERR(ctx->Run(&results), "unable to run model");
-
+int32_t
+GetOutput(std::map<std::string, std::unique_ptr<nic::InferContext::Result>>&
+              results)
+{
   // We expect there to be 1 result value, return it...
   if (results.size() != 1) {
     std::cerr << "error: expected 1 result, got " << results.size()
@@ -122,42 +217,27 @@ Send(
   return r;
 }
 
-std::shared_ptr<nic::InferContext::Request>
-AsyncSend(
+int32_t
+Send(
     const std::unique_ptr<nic::InferContext>& ctx, int32_t value,
     bool start_of_sequence = false, bool end_of_sequence = false)
 {
-  std::shared_ptr<nic::InferContext::Request> request;
-
-  // Set the context options to do batch-size 1 requests. Also request
-  // that all output tensors be returned.
-  std::unique_ptr<nic::InferContext::Options> options;
-  FAIL_IF_ERR(
-      nic::InferContext::Options::Create(&options),
-      "unable to create inference options");
+  SetOptions(ctx, value, start_of_sequence, end_of_sequence);
 
-  options->SetFlags(0);
-  if (start_of_sequence) {
-    options->SetFlag(ni::InferRequestHeader::FLAG_SEQUENCE_START, true);
-  }
-  if (end_of_sequence) {
-    options->SetFlag(ni::InferRequestHeader::FLAG_SEQUENCE_END, true);
-  }
-
-  options->SetBatchSize(1);
-  for (const auto& output : ctx->Outputs()) {
-    options->AddRawResult(output);
-  }
+  // Send inference request to the inference server.
+  std::map<std::string, std::unique_ptr<nic::InferContext::Result>> results;
+  FAIL_IF_ERR(ctx->Run(&results), "unable to run model");
 
-  FAIL_IF_ERR(ctx->SetRunOptions(*options), "unable to set context 0 options");
+  return GetOutput(results);
+}
 
-  // Initialize the inputs with the data.
-  std::shared_ptr<nic::InferContext::Input> ivalue;
-  FAIL_IF_ERR(ctx->GetInput("INPUT", &ivalue), "unable to get INPUT");
-  FAIL_IF_ERR(ivalue->Reset(), "unable to reset INPUT");
-  FAIL_IF_ERR(
-      ivalue->SetRaw(reinterpret_cast<uint8_t*>(&value), sizeof(int32_t)),
-      "unable to set data for INPUT");
+std::shared_ptr<nic::InferContext::Request>
+AsyncSend(
+    const std::unique_ptr<nic::InferContext>& ctx, int32_t value,
+    bool start_of_sequence = false, bool end_of_sequence = false)
+{
+  std::shared_ptr<nic::InferContext::Request> request;
+  SetOptions(ctx, value, start_of_sequence, end_of_sequence);
 
   // Send inference request to the inference server.
   FAIL_IF_ERR(ctx->AsyncRun(&request), "unable to run model");
@@ -177,45 +257,316 @@ AsyncReceive(
       ctx->GetAsyncRunResults(&results, &is_ready, request, true),
       "unable to get results");
 
-  // We expect there to be 1 result value, return it...
-  if (results.size() != 1) {
-    std::cerr << "error: expected 1 result, got " << results.size()
-              << std::endl;
+  return GetOutput(results);
+}
+
+// A sequence in flight on a worker thread.
+struct Sequence {
+  Sequence() : correlation_id(0), ctx(), start(0), expected(0) {}
+
+  ni::CorrelationID correlation_id;
+  std::unique_ptr<nic::InferContext> ctx;
+  uint64_t start;
+  int32_t expected;
+};
+
+// Claim up to 'want' sequences from the shared budget.
+uint32_t
+Claim(std::atomic<int64_t>* remaining, uint32_t want)
+{
+  int64_t left = remaining->fetch_sub(want);
+  if (left <= 0) {
+    return 0;
   }
+  return (left < want) ? static_cast<uint32_t>(left) : want;
+}
 
-  int32_t r = 0;
-  FAIL_IF_ERR(
-      results["OUTPUT"]->GetRawAtCursor(0 /* batch idx */, &r),
-      "unable to get OUTPUT result");
+void
+Worker(
+    const Options& opts, std::atomic<int64_t>* remaining, Stats* stats)
+{
+  std::unique_ptr<dicc::CIDMgr> cidmgr;
+  if (opts.cidmgr_urls.empty()) {
+    FAIL_IF_ERR(
+        dicc::CIDMgr::Create(
+            &cidmgr, opts.url, opts.cidmgr_name, -1, opts.verbose, false,
+            opts.shm_name),
+        "unable to create cidmgr context");
+  } else {
+    FAIL_IF_ERR(
+        dicc::CIDMgr::CreateMultiNode(
+            &cidmgr, opts.cidmgr_urls, opts.cidmgr_name, -1, opts.verbose,
+            false, opts.shm_name),
+        "unable to create multi-node cidmgr context");
+  }
+  const uint32_t worker = stats->workers++;
+  if (!opts.trace_file.empty()) {
+    cidmgr->EnableTrace(1 << 16);
+  }
 
-  return r;
+  std::vector<Sequence> seqs(opts.concurrency);
+  uint32_t count;
+  while ((count = Claim(remaining, opts.concurrency)) != 0) {
+    // Get the correlation ids and contexts for the batch of sequences.
+    for (uint32_t s = 0; s < count; ++s) {
+      Sequence& seq = seqs[s];
+      seq.start = dic::MonotonicNanos();
+      seq.expected = 0;
+      nic::Error err = cidmgr->NewCorrelationID(&seq.correlation_id);
+      uint64_t t = dic::MonotonicNanos();
+      stats->phases[PHASE_ID_NEW].Record(t - seq.start);
+      if (!err.IsOk()) {
+        std::cerr << "error: unable to get correlation id: " << err
+                  << std::endl;
+        exit(1);
+      }
+      if (opts.id_only) {
+        continue;
+      }
+      if (opts.streaming) {
+        err = nic::InferGrpcStreamContext::Create(
+            &seq.ctx, seq.correlation_id, opts.url, opts.model_name, -1,
+            opts.verbose);
+      } else {
+        err = nic::InferGrpcContext::Create(
+            &seq.ctx, seq.correlation_id, opts.url, opts.model_name, -1,
+            opts.verbose);
+      }
+      stats->phases[PHASE_CONTEXT].Record(dic::MonotonicNanos() - t);
+      if (!err.IsOk()) {
+        std::cerr << "error: unable to create inference context: " << err
+                  << std::endl;
+        exit(1);
+      }
+    }
+
+    // Step every sequence in the batch through its values. The sequence
+    // model accumulates the inputs, so every output can be checked.
+    for (uint32_t step = 0; !opts.id_only && (step < opts.length); ++step) {
+      const bool start = (step == 0);
+      const bool end = (step + 1 == opts.length);
+      const int32_t value = static_cast<int32_t>(step);
+      if (opts.async) {
+        std::vector<std::shared_ptr<nic::InferContext::Request>> requests;
+        std::vector<uint64_t> sent;
+        for (uint32_t s = 0; s < count; ++s) {
+          sent.push_back(dic::MonotonicNanos());
+          requests.emplace_back(AsyncSend(seqs[s].ctx, value, start, end));
+        }
+        for (uint32_t s = 0; s < count; ++s) {
+          int32_t r = AsyncReceive(seqs[s].ctx, requests[s]);
+          stats->phases[PHASE_INFER].Record(dic::MonotonicNanos() - sent[s]);
+          seqs[s].expected += value;
+          if (r != seqs[s].expected) {
+            stats->errors++;
+          }
+        }
+      } else {
+        for (uint32_t s = 0; s < count; ++s) {
+          uint64_t t = dic::MonotonicNanos();
+          int32_t r = Send(seqs[s].ctx, value, start, end);
+          stats->phases[PHASE_INFER].Record(dic::MonotonicNanos() - t);
+          seqs[s].expected += value;
+          if (r != seqs[s].expected) {
+            stats->errors++;
+          }
+        }
+      }
+      stats->requests += count;
+    }
+
+    // Release the correlation ids.
+    for (uint32_t s = 0; s < count; ++s) {
+      Sequence& seq = seqs[s];
+      seq.ctx.reset();
+      uint64_t t = dic::MonotonicNanos();
+      nic::Error err = cidmgr->DeleteCorrelationID(seq.correlation_id);
+      uint64_t end = dic::MonotonicNanos();
+      stats->phases[PHASE_ID_DELETE].Record(end - t);
+      stats->phases[PHASE_SEQUENCE].Record(end - seq.start);
+      if (!err.IsOk()) {
+        std::cerr << "error: unable to delete correlation id: " << err
+                  << std::endl;
+        exit(1);
+      }
+    }
+    stats->sequences += count;
+  }
+
+  dicc::CIDMgrMetrics metrics;
+  cidmgr->Metrics(&metrics);
+  for (int op : {dicc::CIDMGR_OP_NEW, dicc::CIDMGR_OP_DELETE}) {
+    stats->server_ops += metrics.server_execute[op].count;
+    stats->server_execute += metrics.server_execute[op].sum;
+  }
+
+  // Each worker writes its own trace, the first one also has the servers
+  // write theirs. Merge them with test/merge_traces.py.
+  if (!opts.trace_file.empty()) {
+    FAIL_IF_ERR(
+        cidmgr->WriteTrace(opts.trace_file + "." + std::to_string(worker)),
+        "unable to write the client trace");
+    if (worker == 0) {
+      uint64_t events = 0;
+      FAIL_IF_ERR(
+          cidmgr->WriteServerTrace(&events),
+          "unable to write the server trace");
+    }
+  }
+}
+
+// CPU seconds used by this process so far.
+double
+CpuSeconds()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         1e-6 * (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
 }
 
+void
+Report(
+    const Options& opts, const Stats& stats, double seconds,
+    double cpu_seconds)
+{
+  dic::HistogramSnapshot phases[PHASE_COUNT];
+  for (int p = 0; p < PHASE_COUNT; ++p) {
+    stats.phases[p].Snapshot(&phases[p]);
+  }
+
+  std::cout << "mode: " << (opts.id_only ? "id churn" : opts.model_name)
+            << (opts.async ? ", async" : ", sync")
+            << (opts.id_only ? "" : (opts.streaming ? ", streaming"
+                                                    : ", non-streaming"))
+            << std::endl;
+  std::cout << "threads: " << opts.threads
+            << ", concurrent sequences per thread: " << opts.concurrency
+            << ", sequence length: " << opts.length << std::endl;
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "sequences: " << stats.sequences << " in " << seconds << "s ("
+            << (stats.sequences / seconds) << " seq/s)" << std::endl;
+  if (!opts.id_only) {
+    std::cout << "requests: " << stats.requests << " ("
+              << (stats.requests / seconds) << " infer/s), "
+              << stats.errors << " bad outputs" << std::endl;
+  }
+  std::cout << "id ops: "
+            << (phases[PHASE_ID_NEW].count + phases[PHASE_ID_DELETE].count)
+            << " (" << ((phases[PHASE_ID_NEW].count +
+                         phases[PHASE_ID_DELETE].count) / seconds)
+            << " op/s)" << std::endl;
+  const uint64_t id_ops =
+      phases[PHASE_ID_NEW].count + phases[PHASE_ID_DELETE].count;
+  if (opts.id_only && (id_ops > 0)) {
+    std::cout << "client cpu: " << (1e6 * cpu_seconds / id_ops)
+              << " us per id op" << std::endl;
+  }
+  if (stats.server_ops > 0) {
+    std::cout << "server execute: "
+              << (stats.server_execute / 1e3 / stats.server_ops)
+              << " us per id op (" << stats.server_ops << " timed)"
+              << std::endl;
+  }
+
+  std::cout << std::endl
+            << std::left << std::setw(16) << "latency (us)" << std::right
+            << std::setw(10) << "count" << std::setw(10) << "mean"
+            << std::setw(10) << "p50" << std::setw(10) << "p90"
+            << std::setw(10) << "p99" << std::setw(10) << "p99.9"
+            << std::setw(10) << "max" << std::endl;
+  for (int p = 0; p < PHASE_COUNT; ++p) {
+    const dic::HistogramSnapshot& h = phases[p];
+    if (h.count == 0) {
+      continue;
+    }
+    std::cout << std::left << std::setw(16) << kPhaseNames[p] << std::right
+              << std::setw(10) << h.count << std::setw(10)
+              << (h.Mean() / 1e3) << std::setw(10)
+              << (h.Percentile(0.5) / 1e3) << std::setw(10)
+              << (h.Percentile(0.9) / 1e3) << std::setw(10)
+              << (h.Percentile(0.99) / 1e3) << std::setw(10)
+              << (h.Percentile(0.999) / 1e3) << std::setw(10)
+              << (h.max / 1e3) << std::endl;
+  }
+
+  // Share of the time in the phases spent on correlation id management.
+  // With -c > 1 the sequences of a batch overlap, so their end to end
+  // times add up to about c times the wall time; the phases don't.
+  const double ids = static_cast<double>(
+      phases[PHASE_ID_NEW].sum + phases[PHASE_ID_DELETE].sum);
+  const double total =
+      ids + phases[PHASE_CONTEXT].sum + phases[PHASE_INFER].sum;
+  if (total > 0) {
+    std::cout << std::endl
+              << "time share: id new/delete "
+              << (100.0 * ids / total) << "%, context create "
+              << (100.0 * phases[PHASE_CONTEXT].sum / total)
+              << "%, inference "
+              << (100.0 * phases[PHASE_INFER].sum / total) << "%"
+              << std::endl;
+  }
 }
 
+}  // namespace
+
 int
 main(int argc, char** argv)
 {
-  bool verbose = false;
-  bool async = false;
-  bool reverse = false;
-  std::string url("localhost:8001");
+  Options opts;
 
   // Parse commandline...
   int opt;
-  while ((opt = getopt(argc, argv, "vrau:")) != -1) {
+  while ((opt = getopt(argc, argv, "vais:t:c:n:l:m:g:x:r:T:u:")) != -1) {
     switch (opt) {
       case 'v':
-        verbose = true;
-        break;
-      case 'r':
-        reverse = true;
+        opts.verbose = true;
         break;
       case 'a':
-        async = true;
+        opts.async = true;
+        break;
+      case 'i':
+        opts.id_only = true;
+        break;
+      case 's':
+        opts.streaming = (std::stoi(optarg) != 0);
+        break;
+      case 't':
+        opts.threads = std::stoul(optarg);
+        break;
+      case 'c':
+        opts.concurrency = std::stoul(optarg);
+        break;
+      case 'n':
+        opts.sequences = std::stoul(optarg);
+        break;
+      case 'l':
+        opts.length = std::stoul(optarg);
+        break;
+      case 'm':
+        opts.model_name = optarg;
+        break;
+      case 'g':
+        opts.cidmgr_name = optarg;
+        break;
+      case 'x':
+        opts.shm_name = optarg;
+        break;
+      case 'r': {
+        std::stringstream urls(optarg);
+        std::string url;
+        while (std::getline(urls, url, ',')) {
+          if (!url.empty()) {
+            opts.cidmgr_urls.push_back(url);
+          }
+        }
+        break;
+      }
+      case 'T':
+        opts.trace_file = optarg;
         break;
       case 'u':
-        url = optarg;
+        opts.url = optarg;
         break;
       case '?':
         Usage(argv);
@@ -223,118 +574,31 @@ main(int argc, char** argv)
     }
   }
 
-  nic::Error err;
-
-  // We use the custom "sequence" model which takes 1 input value. The
-  // output is the accumulated value of the inputs. See
-  // src/custom/sequence.
-  std::string model_name = "simple_sequence";
-
-  // Create 2 inference context with different correlation ID. We will
-  // use these to send to sequences of inference requests. Must use a
-  // non-zero correlation ID since zero indicates no correlation ID.
-  std::unique_ptr<dicc::CIDMgr> cidmgr;
-  std::unique_ptr<nic::InferContext> ctx0, ctx1;
-  
-  // Create two different contexts, one is using streaming while the other
-  // isn't. Then we can compare their difference in sync/async runs
-  err = dicc::CIDMgr::Create(&cidmgr, url, "cidmgr", -1, verbose);
-
-  if (err.IsOk()) {
-    err = cidmgr->Create(
-        &ctx0, url, model_name, -1 /* model_version */, verbose, true /* streaming */);
+  if (opts.threads == 0) {
+    Usage(argv, "number of threads must be > 0");
   }
-  if (err.IsOk()) {
-    err = cidmgr->Create(
-        &ctx1, url, model_name, -1 /* model_version */, verbose, false /* streaming */);
+  if (opts.concurrency == 0) {
+    Usage(argv, "concurrent sequences must be > 0");
   }
-
-  if (!err.IsOk()) {
-    std::cerr << "error: unable to create inference contexts: " << err
-              << std::endl;
-    exit(1);
+  if (opts.length == 0) {
+    Usage(argv, "sequence length must be > 0");
   }
 
-  // Now send the inference sequences..
-  //
-  std::vector<int32_t> values{11, 7, 5, 3, 2, 0, 1};
-  std::vector<int32_t> result0_list;
-  std::vector<int32_t> result1_list;
+  Stats stats;
+  std::atomic<int64_t> remaining(opts.sequences);
 
-  std::vector<std::unique_ptr<nic::InferContext>> ctxs;
-  if (!reverse) {
-    ctxs.emplace_back(std::move(ctx0));
-    ctxs.emplace_back(std::move(ctx1));
-  } else {
-    ctxs.emplace_back(std::move(ctx1));
-    ctxs.emplace_back(std::move(ctx0));
+  uint64_t start = dic::MonotonicNanos();
+  const double cpu_start = CpuSeconds();
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < opts.threads; ++t) {
+    workers.emplace_back(Worker, std::cref(opts), &remaining, &stats);
   }
-
-  if (async) {
-    std::vector<std::shared_ptr<nic::InferContext::Request>> request0_list;
-    std::vector<std::shared_ptr<nic::InferContext::Request>> request1_list;
-
-    // Send requests, first reset accumulator for the sequence.
-    request0_list.emplace_back(
-        AsyncSend(ctxs[0], 0, true /* start-of-sequence */));
-    request1_list.emplace_back(
-        AsyncSend(ctxs[1], 100, true /* start-of-sequence */));
-    // Now send a sequence of values...
-    for (int32_t v : values) {
-      request0_list.emplace_back(AsyncSend(
-          ctxs[0], v, false /* start-of-sequence */,
-          (v == 1) /* end-of-sequence */));
-      request1_list.emplace_back(AsyncSend(
-          ctxs[1], -v, false /* start-of-sequence */,
-          (v == 1) /* end-of-sequence */));
-    }
-    // Get results
-    for (size_t i = 0; i < request0_list.size(); i++) {
-      result0_list.push_back(AsyncReceive(ctxs[0], request0_list[i]));
-    }
-    for (size_t i = 0; i < request1_list.size(); i++) {
-      result1_list.push_back(AsyncReceive(ctxs[1], request1_list[i]));
-    }
-  } else {
-    // Send requests, first reset accumulator for the sequence.
-    result0_list.push_back(Send(ctxs[0], 0, true /* start-of-sequence */));
-    result1_list.push_back(Send(ctxs[1], 100, true /* start-of-sequence */));
-    // Now send a sequence of values...
-    for (int32_t v : values) {
-      result0_list.push_back(Send(
-          ctxs[0], v, false /* start-of-sequence */,
-          (v == 1) /* end-of-sequence */));
-      result1_list.push_back(Send(
-          ctxs[1], -v, false /* start-of-sequence */,
-          (v == 1) /* end-of-sequence */));
-    }
+  for (auto& worker : workers) {
+    worker.join();
   }
+  double seconds = (dic::MonotonicNanos() - start) * 1e-9;
 
-  if (!reverse) {
-    std::cout << "streaming : non-streaming" << std::endl;
-  } else {
-    std::cout << "non-streaming : streaming" << std::endl;
-  }
-
-  int32_t seq0_expected = 0;
-  int32_t seq1_expected = 100;
-
-  for (size_t i = 0; i < result0_list.size(); i++) {
-    std::cout << "[" << i << "] " << result0_list[i] << " : " << result1_list[i]
-              << std::endl;
-
-    if ((seq0_expected != result0_list[i]) ||
-        (seq1_expected != result1_list[i])) {
-      std::cout << "[ expected ] " << seq0_expected << " : " << seq1_expected
-                << std::endl;
-      return 1;
-    }
-
-    if (i < values.size()) {
-      seq0_expected += values[i];
-      seq1_expected -= values[i];
-    }
-  }
+  Report(opts, stats, seconds, CpuSeconds() - cpu_start);
 
-  return 0;
+  return (stats.errors == 0) ? 0 : 1;
 }
@@ -0,0 +1,187 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#pragma once
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr { namespace client {
+
+// Registry of the CorrelationIDs held by a CIDMgr.
+//
+// Ids live in a slab of slots threaded onto an intrusive free list, and an
+// open addressing index maps an id back to its slot for deletes by value.
+// Both only grow (geometrically), so once a process reaches its working set
+// inserts and erases never allocate. Each slot carries a generation so a
+// stale CorrelationIDLease can not release an id that was re-issued into
+// the same slot.
+class CorrelationIDSlab {
+ public:
+  static const uint32_t kNoSlot = UINT32_MAX;
+
+  CorrelationIDSlab()
+      : slots_(), free_head_(kNoSlot), size_(0), index_(), mask_(0)
+  {
+  }
+
+  size_t Size() const { return size_; }
+
+  // Track the id, returns its slot. The id must be non-zero.
+  uint32_t Insert(uint64_t id)
+  {
+    if (free_head_ == kNoSlot) {
+      Grow();
+    }
+    const uint32_t slot = free_head_;
+    Slot& s = slots_[slot];
+    free_head_ = s.next_free;
+    s.id = id;
+    s.next_free = kNoSlot;
+    size_++;
+
+    if ((size_ * 2) > index_.size()) {
+      Rehash(index_.empty() ? 16 : index_.size() * 2);
+    }
+    IndexInsert(slot);
+    return slot;
+  }
+
+  // Slot holding the id, kNoSlot if not tracked.
+  uint32_t Find(uint64_t id) const
+  {
+    if (index_.empty()) {
+      return kNoSlot;
+    }
+    for (size_t i = Hash(id);; i = (i + 1) & mask_) {
+      const uint32_t entry = index_[i];
+      if (entry == 0) {
+        return kNoSlot;
+      }
+      if (slots_[entry - 1].id == id) {
+        return entry - 1;
+      }
+    }
+  }
+
+  uint64_t ID(uint32_t slot) const { return slots_[slot].id; }
+  uint32_t Generation(uint32_t slot) const { return slots_[slot].generation; }
+
+  // Is the slot still holding the id it held at 'generation'.
+  bool Holds(uint32_t slot, uint32_t generation) const
+  {
+    return (slot < slots_.size()) && (slots_[slot].id != 0) &&
+           (slots_[slot].generation == generation);
+  }
+
+  void Erase(uint32_t slot)
+  {
+    IndexErase(slots_[slot].id);
+    Slot& s = slots_[slot];
+    s.id = 0;
+    s.generation++;
+    s.next_free = free_head_;
+    free_head_ = slot;
+    size_--;
+  }
+
+  // Visit every tracked id without copying.
+  template <typename Fn>
+  void ForEach(Fn fn) const
+  {
+    for (const Slot& s : slots_) {
+      if (s.id != 0) {
+        fn(s.id);
+      }
+    }
+  }
+
+  // Visit every tracked slot, erasing the ones fn returns true for.
+  template <typename Fn>
+  void EraseIf(Fn fn)
+  {
+    for (uint32_t slot = 0; slot < slots_.size(); ++slot) {
+      if ((slots_[slot].id != 0) && fn(slots_[slot].id)) {
+        Erase(slot);
+      }
+    }
+  }
+
+ private:
+  struct Slot {
+    uint64_t id;
+    uint32_t generation;
+    uint32_t next_free;
+  };
+
+  size_t Hash(uint64_t id) const
+  {
+    return static_cast<size_t>((id * 0x9E3779B97F4A7C15ull) >> 32) & mask_;
+  }
+
+  void Grow()
+  {
+    const uint32_t old_size = static_cast<uint32_t>(slots_.size());
+    const uint32_t new_size = old_size ? old_size * 2 : 16;
+    slots_.resize(new_size);
+    for (uint32_t slot = new_size; slot-- > old_size;) {
+      slots_[slot].id = 0;
+      slots_[slot].generation = 0;
+      slots_[slot].next_free = free_head_;
+      free_head_ = slot;
+    }
+  }
+
+  void Rehash(size_t capacity)
+  {
+    index_.assign(capacity, 0);
+    mask_ = capacity - 1;
+    for (uint32_t slot = 0; slot < slots_.size(); ++slot) {
+      if (slots_[slot].id != 0) {
+        IndexInsert(slot);
+      }
+    }
+  }
+
+  void IndexInsert(uint32_t slot)
+  {
+    size_t i = Hash(slots_[slot].id);
+    while (index_[i] != 0) {
+      if (index_[i] == slot + 1) {
+        return;
+      }
+      i = (i + 1) & mask_;
+    }
+    index_[i] = slot + 1;
+  }
+
+  // Linear probing delete with backward shift, no tombstones.
+  void IndexErase(uint64_t id)
+  {
+    size_t i = Hash(id);
+    while ((index_[i] != 0) && (slots_[index_[i] - 1].id != id)) {
+      i = (i + 1) & mask_;
+    }
+    if (index_[i] == 0) {
+      return;
+    }
+    for (size_t j = (i + 1) & mask_; index_[j] != 0; j = (j + 1) & mask_) {
+      const size_t home = Hash(slots_[index_[j] - 1].id);
+      // Move j back into the hole at i if its home is not in (i, j].
+      if (((j - home) & mask_) >= ((j - i) & mask_)) {
+        index_[i] = index_[j];
+        i = j;
+      }
+    }
+    index_[i] = 0;
+  }
+
+  std::vector<Slot> slots_;
+  uint32_t free_head_;
+  size_t size_;
+  std::vector<uint32_t> index_;
+  size_t mask_;
+};
+
+}}}} // namespace dnapoleone::inferenceserver::correlation_id_mgr::client
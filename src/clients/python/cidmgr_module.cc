@@ -0,0 +1,617 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+// trtis_cidmgr._cidmgr: native Python bindings for libcidmgr_client.
+//
+// Wraps the C++ CIDMgr so Python workers get correlation id's without
+// building numpy tensors and running the generic InferContext path for
+// every call. The GIL is released for the duration of every RPC. Each
+// CIDMgr object serializes its own calls, so it may be shared between
+// threads.
+
+#include <Python.h>
+
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cidmgr_client.h"
+
+namespace dicc = dnapoleone::inferenceserver::correlation_id_mgr::client;
+
+namespace {
+
+PyObject* CIDMgrError = nullptr;
+
+typedef struct {
+  PyObject_HEAD
+  dicc::CIDMgr* cidmgr;
+  std::mutex* mu;
+} CIDMgrObject;
+
+PyObject*
+SetError(const nic::Error& err)
+{
+  PyErr_SetString(CIDMgrError, err.Message().c_str());
+  return nullptr;
+}
+
+// Error of a call on a closed CIDMgr. close() may run on another thread,
+// so every call checks self->cidmgr again once it holds self->mu.
+nic::Error
+ClosedError()
+{
+  return nic::Error(ni::RequestStatusCode::UNAVAILABLE, "CIDMgr is closed");
+}
+
+void
+CIDMgr_dealloc(CIDMgrObject* self)
+{
+  if (self->cidmgr != nullptr) {
+    Py_BEGIN_ALLOW_THREADS
+    delete self->cidmgr;
+    Py_END_ALLOW_THREADS
+  }
+  delete self->mu;
+  Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+PyObject*
+CIDMgr_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+  CIDMgrObject* self =
+      reinterpret_cast<CIDMgrObject*>(type->tp_alloc(type, 0));
+  if (self != nullptr) {
+    self->cidmgr = nullptr;
+    self->mu = new std::mutex();
+  }
+  return reinterpret_cast<PyObject*>(self);
+}
+
+int
+CIDMgr_init(CIDMgrObject* self, PyObject* args, PyObject* kwds)
+{
+  static const char* kwlist[] = {"url",       "model_name", "model_version",
+                                 "verbose",   "streaming",  "shm_name",
+                                 "sidecar",   nullptr};
+  const char* url = nullptr;
+  const char* model_name = "cidmgr";
+  long long model_version = -1;
+  PyObject* verbose = Py_False;
+  PyObject* streaming = Py_False;
+  const char* shm_name = "";
+  const char* sidecar = nullptr;
+  if (!PyArg_ParseTupleAndKeywords(
+          args, kwds, "z|sLOOsz", const_cast<char**>(kwlist), &url,
+          &model_name, &model_version, &verbose, &streaming, &shm_name,
+          &sidecar)) {
+    return -1;
+  }
+  // The sidecar talks to the server itself, no url needed.
+  if ((url == nullptr) && (sidecar == nullptr)) {
+    PyErr_SetString(PyExc_ValueError, "url or sidecar is required");
+    return -1;
+  }
+
+  std::string surl(url ? url : ""), smodel(model_name), sshm(shm_name);
+  std::string ssidecar(sidecar ? sidecar : "");
+  bool bverbose = PyObject_IsTrue(verbose);
+  bool bstreaming = PyObject_IsTrue(streaming);
+  std::unique_ptr<dicc::CIDMgr> cidmgr;
+  nic::Error err;
+  Py_BEGIN_ALLOW_THREADS
+  if (!ssidecar.empty()) {
+    err = dicc::CIDMgr::CreateSidecar(&cidmgr, ssidecar);
+  } else {
+    err = dicc::CIDMgr::Create(
+        &cidmgr, surl, smodel, model_version, bverbose, bstreaming, sshm);
+  }
+  if (err.IsOk()) {
+    // __init__ may run again on an object in use, swap under the lock.
+    dicc::CIDMgr* previous = cidmgr.release();
+    {
+      std::lock_guard<std::mutex> lock(*self->mu);
+      std::swap(previous, self->cidmgr);
+    }
+    delete previous;
+  }
+  Py_END_ALLOW_THREADS
+  if (!err.IsOk()) {
+    SetError(err);
+    return -1;
+  }
+  return 0;
+}
+
+PyObject*
+CIDMgr_new_id(CIDMgrObject* self, PyObject* args)
+{
+  const char* ns = nullptr;
+  if (!PyArg_ParseTuple(args, "|z", &ns)) {
+    return nullptr;
+  }
+  const std::string sns(ns ? ns : "");
+  ni::CorrelationID correlation_id = 0;
+  nic::Error err = ClosedError();
+  Py_BEGIN_ALLOW_THREADS
+  {
+    std::lock_guard<std::mutex> lock(*self->mu);
+    if (self->cidmgr != nullptr) {
+      err = self->cidmgr->NewCorrelationID(&correlation_id, sns);
+    }
+  }
+  Py_END_ALLOW_THREADS
+  if (!err.IsOk()) {
+    return SetError(err);
+  }
+  return PyLong_FromUnsignedLongLong(correlation_id);
+}
+
+PyObject*
+CIDMgr_new_many(CIDMgrObject* self, PyObject* args)
+{
+  Py_ssize_t count = 0;
+  const char* ns = nullptr;
+  if (!PyArg_ParseTuple(args, "n|z", &count, &ns)) {
+    return nullptr;
+  }
+  const std::string sns(ns ? ns : "");
+  if (count < 0) {
+    PyErr_SetString(PyExc_ValueError, "count must be >= 0");
+    return nullptr;
+  }
+
+  std::vector<ni::CorrelationID> correlation_ids;
+  nic::Error err = ClosedError();
+  Py_BEGIN_ALLOW_THREADS
+  {
+    std::lock_guard<std::mutex> lock(*self->mu);
+    if (self->cidmgr != nullptr) {
+      err = self->cidmgr->NewCorrelationIDs(count, &correlation_ids, sns);
+    }
+  }
+  Py_END_ALLOW_THREADS
+  if (!err.IsOk()) {
+    return SetError(err);
+  }
+
+  PyObject* result = PyList_New(correlation_ids.size());
+  if (result == nullptr) {
+    return nullptr;
+  }
+  for (size_t i = 0; i < correlation_ids.size(); ++i) {
+    PyList_SET_ITEM(
+        result, i, PyLong_FromUnsignedLongLong(correlation_ids[i]));
+  }
+  return result;
+}
+
+PyObject*
+CIDMgr_new_prefixed(CIDMgrObject* self, PyObject* args)
+{
+  unsigned long long prefix = 0;
+  unsigned int prefix_bits = 0;
+  if (!PyArg_ParseTuple(args, "KI", &prefix, &prefix_bits)) {
+    return nullptr;
+  }
+  ni::CorrelationID correlation_id = 0;
+  nic::Error err = ClosedError();
+  Py_BEGIN_ALLOW_THREADS
+  {
+    std::lock_guard<std::mutex> lock(*self->mu);
+    if (self->cidmgr != nullptr) {
+      err = self->cidmgr->NewCorrelationID(&correlation_id, prefix, prefix_bits);
+    }
+  }
+  Py_END_ALLOW_THREADS
+  if (!err.IsOk()) {
+    return SetError(err);
+  }
+  return PyLong_FromUnsignedLongLong(correlation_id);
+}
+
+PyObject*
+CIDMgr_new_many_prefixed(CIDMgrObject* self, PyObject* args)
+{
+  Py_ssize_t count = 0;
+  unsigned long long prefix = 0;
+  unsigned int prefix_bits = 0;
+  if (!PyArg_ParseTuple(args, "nKI", &count, &prefix, &prefix_bits)) {
+    return nullptr;
+  }
+  if (count < 0) {
+    PyErr_SetString(PyExc_ValueError, "count must be >= 0");
+    return nullptr;
+  }
+
+  std::vector<ni::CorrelationID> correlation_ids;
+  nic::Error err = ClosedError();
+  Py_BEGIN_ALLOW_THREADS
+  {
+    std::lock_guard<std::mutex> lock(*self->mu);
+    if (self->cidmgr != nullptr) {
+      err = self->cidmgr->NewCorrelationIDs(
+          count, &correlation_ids, prefix, prefix_bits);
+    }
+  }
+  Py_END_ALLOW_THREADS
+  if (!err.IsOk()) {
+    return SetError(err);
+  }
+
+  PyObject* result = PyList_New(correlation_ids.size());
+  if (result == nullptr) {
+    return nullptr;
+  }
+  for (size_t i = 0; i < correlation_ids.size(); ++i) {
+    PyList_SET_ITEM(
+        result, i, PyLong_FromUnsignedLongLong(correlation_ids[i]));
+  }
+  return result;
+}
+
+PyObject*
+CIDMgr_delete_id(CIDMgrObject* self, PyObject* args)
+{
+  unsigned long long correlation_id = 0;
+  if (!PyArg_ParseTuple(args, "K", &correlation_id)) {
+    return nullptr;
+  }
+  nic::Error err = ClosedError();
+  Py_BEGIN_ALLOW_THREADS
+  {
+    std::lock_guard<std::mutex> lock(*self->mu);
+    if (self->cidmgr != nullptr) {
+      err = self->cidmgr->DeleteCorrelationID(correlation_id);
+    }
+  }
+  Py_END_ALLOW_THREADS
+  if (!err.IsOk()) {
+    return SetError(err);
+  }
+  Py_RETURN_NONE;
+}
+
+typedef nic::Error (dicc::CIDMgr::*StatFn)(uint64_t*);
+
+PyObject*
+Stat(CIDMgrObject* self, StatFn fn)
+{
+  uint64_t value = 0;
+  nic::Error err = ClosedError();
+  Py_BEGIN_ALLOW_THREADS
+  {
+    std::lock_guard<std::mutex> lock(*self->mu);
+    if (self->cidmgr != nullptr) {
+      err = (self->cidmgr->*fn)(&value);
+    }
+  }
+  Py_END_ALLOW_THREADS
+  if (!err.IsOk()) {
+    return SetError(err);
+  }
+  return PyLong_FromUnsignedLongLong(value);
+}
+
+PyObject*
+CIDMgr_active(CIDMgrObject* self, PyObject* unused)
+{
+  return Stat(self, &dicc::CIDMgr::Active);
+}
+
+PyObject*
+CIDMgr_inactive(CIDMgrObject* self, PyObject* unused)
+{
+  return Stat(self, &dicc::CIDMgr::InActive);
+}
+
+PyObject*
+CIDMgr_peak(CIDMgrObject* self, PyObject* unused)
+{
+  return Stat(self, &dicc::CIDMgr::Peak);
+}
+
+PyObject*
+CIDMgr_stats(CIDMgrObject* self, PyObject* args)
+{
+  const char* ns = nullptr;
+  if (!PyArg_ParseTuple(args, "|z", &ns)) {
+    return nullptr;
+  }
+  const std::string sns(ns ? ns : "");
+  uint64_t active = 0, inactive = 0, peak = 0;
+  nic::Error err = ClosedError();
+  Py_BEGIN_ALLOW_THREADS
+  {
+    std::lock_guard<std::mutex> lock(*self->mu);
+    if (self->cidmgr != nullptr) {
+      err = self->cidmgr->Stats(sns, &active, &inactive, &peak);
+    }
+  }
+  Py_END_ALLOW_THREADS
+  if (!err.IsOk()) {
+    return SetError(err);
+  }
+  return Py_BuildValue(
+      "{s:K,s:K,s:K}", "active", static_cast<unsigned long long>(active),
+      "inactive", static_cast<unsigned long long>(inactive), "peak",
+      static_cast<unsigned long long>(peak));
+}
+
+PyObject*
+CIDMgr_correlation_ids(CIDMgrObject* self, PyObject* unused)
+{
+  // Copy the id's out under the lock, the list is built with the GIL.
+  std::vector<ni::CorrelationID> correlation_ids;
+  bool open = false;
+  Py_BEGIN_ALLOW_THREADS
+  {
+    std::lock_guard<std::mutex> lock(*self->mu);
+    if (self->cidmgr != nullptr) {
+      open = true;
+      self->cidmgr->ForEachCorrelationID(
+          [&correlation_ids](ni::CorrelationID correlation_id) {
+            correlation_ids.push_back(correlation_id);
+          });
+    }
+  }
+  Py_END_ALLOW_THREADS
+  if (!open) {
+    return SetError(ClosedError());
+  }
+
+  PyObject* result = PyList_New(correlation_ids.size());
+  if (result == nullptr) {
+    return nullptr;
+  }
+  for (size_t i = 0; i < correlation_ids.size(); ++i) {
+    PyList_SET_ITEM(
+        result, i, PyLong_FromUnsignedLongLong(correlation_ids[i]));
+  }
+  return result;
+}
+
+PyObject*
+CIDMgr_validate(CIDMgrObject* self, PyObject* args)
+{
+  PyObject* ids = nullptr;
+  if (!PyArg_ParseTuple(args, "O", &ids)) {
+    return nullptr;
+  }
+  PyObject* seq = PySequence_Fast(ids, "correlation_ids must be a sequence");
+  if (seq == nullptr) {
+    return nullptr;
+  }
+  std::vector<ni::CorrelationID> correlation_ids;
+  const Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+  correlation_ids.reserve(count);
+  for (Py_ssize_t i = 0; i < count; ++i) {
+    correlation_ids.push_back(
+        PyLong_AsUnsignedLongLong(PySequence_Fast_GET_ITEM(seq, i)));
+  }
+  Py_DECREF(seq);
+  if (PyErr_Occurred()) {
+    return nullptr;
+  }
+
+  std::vector<bool> live;
+  nic::Error err = ClosedError();
+  Py_BEGIN_ALLOW_THREADS
+  {
+    std::lock_guard<std::mutex> lock(*self->mu);
+    if (self->cidmgr != nullptr) {
+      err = self->cidmgr->Validate(correlation_ids, &live);
+    }
+  }
+  Py_END_ALLOW_THREADS
+  if (!err.IsOk()) {
+    return SetError(err);
+  }
+
+  PyObject* result = PyList_New(live.size());
+  if (result == nullptr) {
+    return nullptr;
+  }
+  for (size_t i = 0; i < live.size(); ++i) {
+    PyObject* item = live[i] ? Py_True : Py_False;
+    Py_INCREF(item);
+    PyList_SET_ITEM(result, i, item);
+  }
+  return result;
+}
+
+PyObject*
+CIDMgr_reconcile(CIDMgrObject* self, PyObject* args)
+{
+  int reserve = 0;
+  PyObject* ids = nullptr;
+  if (!PyArg_ParseTuple(args, "|iO", &reserve, &ids)) {
+    return nullptr;
+  }
+  dicc::CorrelationIDSet release;
+  if (ids != nullptr) {
+    PyObject* seq = PySequence_Fast(ids, "release must be a sequence");
+    if (seq == nullptr) {
+      return nullptr;
+    }
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); ++i) {
+      release.insert(
+          PyLong_AsUnsignedLongLong(PySequence_Fast_GET_ITEM(seq, i)));
+    }
+    Py_DECREF(seq);
+    if (PyErr_Occurred()) {
+      return nullptr;
+    }
+  }
+
+  size_t dropped = 0;
+  nic::Error err = ClosedError();
+  Py_BEGIN_ALLOW_THREADS
+  {
+    std::lock_guard<std::mutex> lock(*self->mu);
+    if (self->cidmgr != nullptr) {
+      err = self->cidmgr->Reconcile(reserve != 0, &release, &dropped);
+    }
+  }
+  Py_END_ALLOW_THREADS
+  if (!err.IsOk()) {
+    return SetError(err);
+  }
+  return PyLong_FromSize_t(dropped);
+}
+
+PyObject*
+CIDMgr_close(CIDMgrObject* self, PyObject* unused)
+{
+  // Take the CIDMgr under the lock, calls on other threads then see it
+  // closed. Deleting it deletes all the correlation id's it holds.
+  Py_BEGIN_ALLOW_THREADS
+  dicc::CIDMgr* cidmgr = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(*self->mu);
+    std::swap(cidmgr, self->cidmgr);
+  }
+  delete cidmgr;
+  Py_END_ALLOW_THREADS
+  Py_RETURN_NONE;
+}
+
+PyObject*
+CIDMgr_timings(CIDMgrObject* self, PyObject* unused)
+{
+  static const char* names[] = {"new", "delete", "stats"};
+  dicc::CIDMgrMetrics metrics;
+  bool open = false;
+  Py_BEGIN_ALLOW_THREADS
+  {
+    std::lock_guard<std::mutex> lock(*self->mu);
+    if (self->cidmgr != nullptr) {
+      open = true;
+      self->cidmgr->Metrics(&metrics);
+    }
+  }
+  Py_END_ALLOW_THREADS
+  if (!open) {
+    return SetError(ClosedError());
+  }
+  PyObject* result = PyDict_New();
+  if (result == nullptr) {
+    return nullptr;
+  }
+  for (int op = dicc::CIDMGR_OP_NEW; op <= dicc::CIDMGR_OP_STATS; ++op) {
+    PyObject* timing = Py_BuildValue(
+        "{s:K,s:d,s:d,s:d}", "count",
+        static_cast<unsigned long long>(metrics.server_execute[op].count),
+        "execute", metrics.server_execute[op].sum * 1e-9, "registry",
+        metrics.server_registry[op].sum * 1e-9, "overhead",
+        metrics.overhead[op].sum * 1e-9);
+    if ((timing == nullptr) ||
+        (PyDict_SetItemString(result, names[op], timing) != 0)) {
+      Py_XDECREF(timing);
+      Py_DECREF(result);
+      return nullptr;
+    }
+    Py_DECREF(timing);
+  }
+  return result;
+}
+
+PyMethodDef CIDMgr_methods[] = {
+    {"new", reinterpret_cast<PyCFunction>(CIDMgr_new_id), METH_VARARGS,
+     "Get a new unique correlation_id from the server, optionally from a "
+     "namespace."},
+    {"new_many", reinterpret_cast<PyCFunction>(CIDMgr_new_many), METH_VARARGS,
+     "Get a list of count new unique correlation_ids from the server, "
+     "optionally from a namespace."},
+    {"new_prefixed", reinterpret_cast<PyCFunction>(CIDMgr_new_prefixed),
+     METH_VARARGS,
+     "Get a new unique correlation_id under prefix, of prefix_bits bits, "
+     "from a sparse id space."},
+    {"new_many_prefixed",
+     reinterpret_cast<PyCFunction>(CIDMgr_new_many_prefixed), METH_VARARGS,
+     "Get a list of count new unique correlation_ids under prefix, of "
+     "prefix_bits bits, from a sparse id space."},
+    {"delete", reinterpret_cast<PyCFunction>(CIDMgr_delete_id), METH_VARARGS,
+     "Remove the correlation_id from use."},
+    {"active", reinterpret_cast<PyCFunction>(CIDMgr_active), METH_NOARGS,
+     "Number of active reserved correlation id's on the server."},
+    {"inactive", reinterpret_cast<PyCFunction>(CIDMgr_inactive), METH_NOARGS,
+     "Number of inactive id's in the reserved space on the server."},
+    {"peak", reinterpret_cast<PyCFunction>(CIDMgr_peak), METH_NOARGS,
+     "Peak number of parallel correlation id's reserved by the server."},
+    {"stats", reinterpret_cast<PyCFunction>(CIDMgr_stats), METH_VARARGS,
+     "Dict of the active, inactive and peak server stats, optionally for a "
+     "namespace."},
+    {"correlation_ids", reinterpret_cast<PyCFunction>(CIDMgr_correlation_ids),
+     METH_NOARGS, "List of the correlation_ids held by this CIDMgr."},
+    {"validate", reinterpret_cast<PyCFunction>(CIDMgr_validate), METH_VARARGS,
+     "List of bools, which of the correlation_ids are still reserved."},
+    {"reconcile", reinterpret_cast<PyCFunction>(CIDMgr_reconcile),
+     METH_VARARGS,
+     "Reconcile the held correlation_ids with the server, returns the "
+     "number dropped."},
+    {"timings", reinterpret_cast<PyCFunction>(CIDMgr_timings), METH_NOARGS,
+     "Dict of the summed server side timings per op, in seconds."},
+    {"close", reinterpret_cast<PyCFunction>(CIDMgr_close), METH_NOARGS,
+     "Delete all held correlation_ids and close the connection."},
+    {nullptr, nullptr, 0, nullptr}};
+
+PyTypeObject CIDMgrType = {PyVarObject_HEAD_INIT(nullptr, 0)};
+
+#if PY_MAJOR_VERSION >= 3
+PyModuleDef cidmgr_module = {
+    PyModuleDef_HEAD_INIT, "_cidmgr",
+    "Native bindings for the cidmgr C++ client.", -1, nullptr};
+#endif
+
+PyObject*
+InitModule()
+{
+  CIDMgrType.tp_name = "trtis_cidmgr._cidmgr.CIDMgr";
+  CIDMgrType.tp_basicsize = sizeof(CIDMgrObject);
+  CIDMgrType.tp_flags = Py_TPFLAGS_DEFAULT;
+  CIDMgrType.tp_doc = "Native cidmgr correlation id manager.";
+  CIDMgrType.tp_methods = CIDMgr_methods;
+  CIDMgrType.tp_new = CIDMgr_new;
+  CIDMgrType.tp_init = reinterpret_cast<initproc>(CIDMgr_init);
+  CIDMgrType.tp_dealloc = reinterpret_cast<destructor>(CIDMgr_dealloc);
+  if (PyType_Ready(&CIDMgrType) < 0) {
+    return nullptr;
+  }
+
+#if PY_MAJOR_VERSION >= 3
+  PyObject* module = PyModule_Create(&cidmgr_module);
+#else
+  PyObject* module = Py_InitModule3(
+      "_cidmgr", nullptr, "Native bindings for the cidmgr C++ client.");
+#endif
+  if (module == nullptr) {
+    return nullptr;
+  }
+
+  CIDMgrError = PyErr_NewException(
+      const_cast<char*>("trtis_cidmgr._cidmgr.Error"), PyExc_RuntimeError,
+      nullptr);
+  Py_INCREF(CIDMgrError);
+  PyModule_AddObject(module, "Error", CIDMgrError);
+  Py_INCREF(&CIDMgrType);
+  PyModule_AddObject(
+      module, "CIDMgr", reinterpret_cast<PyObject*>(&CIDMgrType));
+  return module;
+}
+
+}  // namespace
+
+#if PY_MAJOR_VERSION >= 3
+PyMODINIT_FUNC
+PyInit__cidmgr()
+{
+  return InitModule();
+}
+#else
+PyMODINIT_FUNC
+init_cidmgr()
+{
+  InitModule();
+}
+#endif
@@ -1,7 +1,20 @@
 # Copyright (c) 2019 Doug Napoleone, All rights reserved.
 from setuptools import setup, find_packages
+from setuptools.dist import Distribution
+import glob
+import os
 import version
 
+# optional native extension built by cmake into the package directory.
+_native = [os.path.basename(p) for p in
+           glob.glob(os.path.join('trtis_cidmgr', '_cidmgr*.so')) +
+           glob.glob(os.path.join('trtis_cidmgr', '_cidmgr*.pyd'))]
+
+class BinaryDistribution(Distribution):
+    """Build a platform wheel when the native extension is present."""
+    def has_ext_modules(self):
+        return bool(_native)
+
 setup(
     name="trtis_cidmgr",
     version=version.__version__,
@@ -12,6 +25,10 @@ setup(
     author_email=version.__email__,
     license="BSD",
     packages=["trtis_cidmgr"],
+    package_data={"trtis_cidmgr": ["config.pbtxt.in",
+                                   "config_bulk.pbtxt.in",
+                                   "config_packed.pbtxt.in"] + _native},
+    distclass=BinaryDistribution,
     entry_points = {
         'console_scripts': [
             'trtis-cidmgr-model=trtis_cidmgr.model:main',
@@ -36,5 +53,5 @@ setup(
         'grpcio-tools==1.19.0', # limit to 1.19 due to trtserver issues
         'tensorrtserver>=1.5.0.dev0'],
     keywords="tensorrt inference server service client".split(),
-    zip_safe=True
+    zip_safe=not _native
 )
@@ -1,3 +1,6 @@
 # Copyright (c) 2019, Doug Napoleone. All rights reserved.
 from .version import *
 from .context import *
+import sys as _sys
+if _sys.version_info >= (3, 5):
+    from .aio import *
@@ -0,0 +1,298 @@
+# Copyright (c) 2019 Doug Napoleone, All rights reserved.
+"""asyncio client for the cidmgr custom backend (python 3.5+).
+
+All requests from an AsyncCIDMgrContext are pipelined over a single gRPC
+StreamInfer stream. Requests are tagged with an id which the server echoes
+back in the response header, so any number of calls may be in flight at
+once from the same event loop without a thread per call.
+
+.. code::
+    async with AsyncCIDMgrContext('localhost:8001') as cidmgr:
+        async with cidmgr.stateful('localhost:8001', 'simple_sequence') as seq:
+            result = await seq.run(
+                {'INPUT' : (tensor,)},
+                {'OUTPUT': InferContext.ResultFormat.RAW },
+                flags=InferRequestHeader.FLAG_SEQUENCE_START)
+"""
+import asyncio
+import itertools
+import struct
+import threading
+
+try:
+    import queue
+except ImportError:
+    import Queue as queue
+
+import grpc
+from tensorrtserver.api import (grpc_service_pb2, grpc_service_pb2_grpc,
+                                request_status_pb2)
+from tensorrtserver.api import ProtocolType, InferContext, InferRequestHeader
+from .codes import *
+from .context import namespace_key, prefix_arg, CIDMGR_PACKED_HEADER_WORDS
+
+__all__ = ['AsyncCIDMgrContext', 'AsyncStatefulContext', 'CIDMgrError']
+
+_CODE = struct.Struct('<b')
+_UINT64 = struct.Struct('<Q')
+_PACKED = struct.Struct('<%dQ' % CIDMGR_PACKED_HEADER_WORDS)
+_CLOSE = object()
+
+
+class CIDMgrError(Exception):
+    """Error returned by the cidmgr backend or the stream."""
+
+
+class AsyncCIDMgrContext(object):
+    """asyncio version of CIDMgrContext.
+
+    new(), delete() and the stats are awaitable. Correlation ids held by the
+    context are deleted on close(). Pass packed=True for a cidmgr model with
+    the packed REQUEST / RESPONSE format (config_packed.pbtxt.in).
+    """
+    def __init__(self, url, model_name='cidmgr', model_version=-1,
+                 correlation_id=1, loop=None, packed=False):
+        self._url = url
+        self._packed = packed
+        self._model_name = model_name
+        self._model_version = model_version
+        self._correlation_id = correlation_id
+        self._loop = loop or asyncio.get_event_loop()
+        self._id_registry = set()
+        self._pending = {}
+        self._lock = threading.Lock()
+        self._ids = itertools.count(1)
+        self._requests = None
+        self._channel = None
+        self._reader = None
+        self._error = None
+
+    def _request_iter(self):
+        while True:
+            request = self._requests.get()
+            if request is _CLOSE:
+                return
+            yield request
+
+    def _read(self, responses):
+        try:
+            for response in responses:
+                self._complete(response)
+            error = CIDMgrError('cidmgr stream closed')
+        except grpc.RpcError as e:
+            error = CIDMgrError('cidmgr stream failed: ' + str(e))
+        # Fail anything still waiting on the stream.
+        with self._lock:
+            self._error = error
+            pending, self._pending = self._pending, {}
+        for future in pending.values():
+            self._loop.call_soon_threadsafe(_set_exception, future, error)
+
+    def _complete(self, response):
+        with self._lock:
+            future = self._pending.pop(response.meta_data.id, None)
+        if future is None:
+            return
+        status = response.request_status
+        if status.code != request_status_pb2.SUCCESS:
+            self._loop.call_soon_threadsafe(
+                _set_exception, future, CIDMgrError(status.msg))
+        elif not response.raw_output:
+            self._loop.call_soon_threadsafe(_set_result, future, 0)
+        else:
+            value = _UINT64.unpack_from(response.raw_output[0])[0]
+            self._loop.call_soon_threadsafe(_set_result, future, value)
+
+    async def connect(self):
+        """Open the stream to the server. Called implicitly on first use.
+        """
+        if self._requests is not None:
+            return
+        self._requests = queue.Queue()
+        self._channel = grpc.insecure_channel(self._url)
+        stub = grpc_service_pb2_grpc.GRPCServiceStub(self._channel)
+        responses = stub.StreamInfer(self._request_iter())
+        self._reader = threading.Thread(
+            target=self._read, args=(responses,), name='cidmgr-aio-reader')
+        self._reader.daemon = True
+        self._reader.start()
+
+    async def _cidmgr_run(self, code, cid=0, start=False):
+        await self.connect()
+        request_id = next(self._ids)
+        request = grpc_service_pb2.InferRequest()
+        request.model_name = self._model_name
+        request.model_version = self._model_version
+        header = request.meta_data
+        header.id = request_id
+        header.correlation_id = self._correlation_id
+        header.batch_size = 1
+        header.flags = InferRequestHeader.FLAG_NONE
+        if start:
+            header.flags |= InferRequestHeader.FLAG_SEQUENCE_START
+        if self._packed:
+            tensor = header.input.add()
+            tensor.name = 'REQUEST'
+            tensor.dims.append(CIDMGR_PACKED_HEADER_WORDS)
+            tensor.batch_byte_size = _PACKED.size
+            header.output.add().name = 'RESPONSE'
+            request.raw_input.append(_PACKED.pack(code, 1, cid))
+        else:
+            for name, size in (('CODE', 1), ('CORRELATION_ID', 8)):
+                tensor = header.input.add()
+                tensor.name = name
+                tensor.dims.append(1)
+                tensor.batch_byte_size = size
+            header.output.add().name = 'OUTPUT'
+            request.raw_input.append(_CODE.pack(code))
+            request.raw_input.append(_UINT64.pack(cid))
+
+        future = self._loop.create_future()
+        with self._lock:
+            if self._error is not None:
+                raise self._error
+            self._pending[request_id] = future
+        self._requests.put(request)
+        return await future
+
+    async def new(self, namespace=None):
+        """Get a new unique correlation_id from the server, optionally from
+        a namespace.
+        """
+        correlation_id = await self._cidmgr_run(
+            CIDMGR_NEW, namespace_key(namespace), start=True)
+        self._id_registry.add(correlation_id)
+        return correlation_id
+
+    async def new_many(self, count, namespace=None):
+        """Get a list of count new unique correlation_ids, pipelined.
+        """
+        return list(await asyncio.gather(
+            *[self.new(namespace) for i in range(count)]))
+
+    async def new_prefixed(self, prefix, prefix_bits):
+        """Get a new unique correlation_id from a sparse id space whose top
+        prefix_bits bits are prefix. The cidmgr model must have id_space
+        "sparse".
+        """
+        correlation_id = await self._cidmgr_run(
+            CIDMGR_NEW, prefix_arg(prefix, prefix_bits), start=True)
+        self._id_registry.add(correlation_id)
+        return correlation_id
+
+    async def delete(self, correlation_id):
+        """Remove the correlation_id from the active reserved list on the server.
+        """
+        if correlation_id in self._id_registry:
+            self._id_registry.remove(correlation_id)
+            await self._cidmgr_run(CIDMGR_DELETE, correlation_id)
+
+    async def active(self, namespace=None):
+        """Return the number of active reserved correlation id's on the server.
+        """
+        return await self._cidmgr_run(CIDMGR_ACTIVE, namespace_key(namespace))
+
+    async def inactive(self, namespace=None):
+        """Return the number of inactive id's in the reserved space on the server.
+        """
+        return await self._cidmgr_run(
+            CIDMGR_INACTIVE, namespace_key(namespace))
+
+    async def peak(self, namespace=None):
+        """Return the peak number of parallel correlation id's reserved by the server.
+        """
+        return await self._cidmgr_run(CIDMGR_PEAK, namespace_key(namespace))
+
+    async def stats(self, namespace=None):
+        """Return a dict of the active, inactive and peak server stats, for
+        the namespace if given, otherwise the totals.
+        """
+        active, inactive, peak = await asyncio.gather(
+            self.active(namespace), self.inactive(namespace),
+            self.peak(namespace))
+        return {'active': active, 'inactive': inactive, 'peak': peak}
+
+    def correlation_ids(self):
+        """Return the list of correlation_id's registered with this context.
+        """
+        return list(self._id_registry)
+
+    async def close(self):
+        """Delete any held correlation_ids, and then close the stream.
+        """
+        if self._requests is None:
+            return
+        if self._id_registry and self._error is None:
+            await asyncio.gather(
+                *[self.delete(cid) for cid in self.correlation_ids()])
+        self._requests.put(_CLOSE)
+        reader, self._reader = self._reader, None
+        await self._loop.run_in_executor(None, reader.join)
+        self._channel.close()
+        self._requests = None
+
+    def stateful(self, url, model_name, model_version=-1,
+                 verbose=False, streaming=False):
+        return AsyncStatefulContext(
+            url, model_name, model_version, verbose, self, streaming)
+
+    async def __aenter__(self):
+        await self.connect()
+        return self
+
+    async def __aexit__(self, exc_type, exc, tb):
+        await self.close()
+
+
+class AsyncStatefulContext(object):
+    """Async context manager for a stateful sequence.
+
+    Gets a unique correlation_id from the AsyncCIDMgrContext on entry and
+    deletes it on exit. The InferContext for the sequence model is blocking,
+    so it is created and run on the loop's default executor.
+    """
+    def __init__(self, url, model_name, model_version=-1, verbose=False,
+                 cidmgr_context=None, streaming=False):
+        self.cidmgr = cidmgr_context or AsyncCIDMgrContext(url)
+        self._owns_cidmgr = cidmgr_context is None
+        self._args = (url, model_name, model_version, verbose, streaming)
+        self._loop = self.cidmgr._loop
+        self.correlation_id = 0
+        self.context = None
+
+    async def __aenter__(self):
+        url, model_name, model_version, verbose, streaming = self._args
+        self.correlation_id = await self.cidmgr.new(model_name)
+        try:
+            self.context = await self._loop.run_in_executor(
+                None, lambda: InferContext(
+                    url, ProtocolType.from_str("grpc"), model_name,
+                    model_version, verbose, self.correlation_id, streaming))
+        except Exception:
+            await self.cidmgr.delete(self.correlation_id)
+            raise
+        return self
+
+    async def __aexit__(self, exc_type, exc, tb):
+        if self.context is not None:
+            await self._loop.run_in_executor(None, self.context.close)
+            self.context = None
+        await self.cidmgr.delete(self.correlation_id)
+        if self._owns_cidmgr:
+            await self.cidmgr.close()
+
+    async def run(self, *args, **kwargs):
+        """InferContext.run() on the default executor.
+        """
+        return await self._loop.run_in_executor(
+            None, lambda: self.context.run(*args, **kwargs))
+
+
+def _set_result(future, value):
+    if not future.done():
+        future.set_result(value)
+
+
+def _set_exception(future, error):
+    if not future.done():
+        future.set_exception(error)
@@ -1,9 +1,86 @@
 # Copyright (c) 2019 Doug Napoleone, All rights reserved.
-from tensorrtserver.api import ProtocolType, InferContext, InferRequestHeader
+from tensorrtserver.api import (
+    ProtocolType, InferContext, InferRequestHeader, ServerStatusContext)
 import numpy as np
 import contextlib
+import time
 from .codes import *
 
+try:
+    from . import _cidmgr
+except ImportError:
+    _cidmgr = None
+
+def namespace_key(namespace):
+    """Return the 32 bit key a correlation id namespace is sent to the
+    server as. The FNV-1a hash of the name, 0 for the default namespace.
+    Matches CIDMgr::NamespaceKey() in the C++ client.
+    """
+    if not namespace:
+        return 0
+    if not isinstance(namespace, bytes):
+        namespace = namespace.encode('utf-8')
+    key = 2166136261
+    for c in bytearray(namespace):
+        key = ((key ^ c) * 16777619) & 0xffffffff
+    return key or 1
+
+# Set on a correlation_id passed to CIDMGR_VALIDATE or CIDMGR_RECONCILE to
+# release it.
+CIDMGR_RELEASE_BIT = 1 << 63
+
+# Set on the CIDMGR_NEW argument to ask a sparse id space for an id under a
+# prefix, see common/id_layout.h.
+CIDMGR_PREFIX_BIT = 1 << 63
+CIDMGR_PREFIX_LENGTH_BITS = 6
+CIDMGR_MAX_PREFIX_BITS = 63 - CIDMGR_PREFIX_LENGTH_BITS
+
+def prefix_arg(prefix, prefix_bits):
+    """Return the CIDMGR_NEW argument for an id whose top prefix_bits bits
+    of the node's id range are the low prefix_bits bits of prefix. Needs a
+    cidmgr model with id_space "sparse". Matches PrefixArg() in
+    common/id_layout.h.
+    """
+    if not 0 <= prefix_bits <= CIDMGR_MAX_PREFIX_BITS:
+        raise ValueError("prefix_bits must be 0 to %d"
+                         % CIDMGR_MAX_PREFIX_BITS)
+    if not 0 <= prefix < (1 << prefix_bits):
+        raise ValueError("prefix must fit in %d bits" % prefix_bits)
+    return (CIDMGR_PREFIX_BIT | (prefix << CIDMGR_PREFIX_LENGTH_BITS) |
+            prefix_bits)
+
+# Packed single tensor request format, see common/packed_request.h:
+# REQUEST is [code | flags << 8, count, argument, id's...], RESPONSE the
+# result words followed by the timing when CIDMGR_PACKED_TIMING is set.
+CIDMGR_PACKED_HEADER_WORDS = 3
+CIDMGR_PACKED_TIMING = 0x1
+CIDMGR_PACKED_MAX_NEW = 65536
+
+# Default Unix socket of the cidmgr_sidecar, see common/sidecar.h.
+CIDMGR_SIDECAR_DEFAULT_SOCKET = '/tmp/cidmgr_sidecar.sock'
+
+def model_format(url, model_name='cidmgr', verbose=False):
+    """Return the request format of the cidmgr model on the server:
+    'packed' for the packed REQUEST / RESPONSE format, 'bulk' when
+    CORRELATION_ID is variable length (config_bulk.pbtxt.in), otherwise
+    'default' with one id per request.
+    """
+    ctx = ServerStatusContext(
+        url, ProtocolType.from_str("grpc"), model_name, verbose)
+    config = ctx.get_server_status().model_status[model_name].config
+    if len(config.input) == 1 and config.input[0].name == 'REQUEST':
+        return 'packed'
+    for tensor in config.input:
+        if tensor.name == 'CORRELATION_ID' and -1 in tensor.dims:
+            return 'bulk'
+    return 'default'
+
+def is_packed_model(url, model_name='cidmgr', verbose=False):
+    """Return True if the cidmgr model on the server takes the packed
+    REQUEST / RESPONSE format.
+    """
+    return model_format(url, model_name, verbose) == 'packed'
+
 class CIDMgrContext(InferContext):
     """Smart InferContext for the cidmgr custom backend.
 
@@ -34,28 +111,139 @@ class CIDMgrContext(InferContext):
                 results.append(result)
     """
     def __init__(self, url, model_name='cidmgr', model_version=-1,
-                 verbose=False, correlation_id=1, streaming=False):
+                 verbose=False, correlation_id=1, streaming=False,
+                 native=None, sidecar=None):
         protocol = ProtocolType.from_str("grpc")
         self._id_registry = set()
+        # Whether the model has the TIMING output, None until the first run.
+        self._timing = None
+        self._timings = dict((op, dict(count=0, execute=0.0, registry=0.0,
+                                       overhead=0.0))
+                             for op in ('new', 'delete', 'stats'))
+        # Use the compiled libcidmgr_client bindings when available, unless
+        # native=False. They skip the numpy tensors and generic run() path.
+        self._native = None
+        if native is None:
+            native = _cidmgr is not None
+        if sidecar:
+            # Correlation ids come from the cidmgr_sidecar on this host, which
+            # batches them with the other local processes' requests. There is
+            # no gRPC channel to the server, url is not used.
+            if sidecar is True:
+                sidecar = CIDMGR_SIDECAR_DEFAULT_SOCKET
+            if native:
+                if _cidmgr is None:
+                    raise ImportError("trtis_cidmgr._cidmgr is not available")
+                self._native = _cidmgr.CIDMgr(None, sidecar=sidecar)
+            else:
+                from .sidecar import SidecarClient
+                self._native = SidecarClient(sidecar)
+            self._packed = False
+            self._bulk = False
+            self._ctx = None
+            return
+        if native:
+            if _cidmgr is None:
+                raise ImportError("trtis_cidmgr._cidmgr is not available")
+            self._native = _cidmgr.CIDMgr(
+                url, model_name, model_version, verbose, streaming)
+        # The native bindings detect the model format themselves.
+        fmt = (model_format(url, model_name, verbose)
+               if self._native is None else None)
+        self._packed = fmt == 'packed'
+        self._bulk = fmt == 'bulk'
         # make it work with both 2 and 3 as InferContext does not
         # inherit from object, so super in broken in 2.
         InferContext.__init__(self,
             url, protocol, model_name, model_version, 
             verbose, correlation_id, streaming)
 
-    def _cidmgr_run(self, code, cid=0, start=False):
+    def _cidmgr_run(self, code, cid=0, start=False, namespace=None):
+        if self._native is not None:
+            if code == CIDMGR_NEW:
+                return self._native.new(namespace)
+            elif code == CIDMGR_DELETE:
+                return self._native.delete(cid)
+            elif code == CIDMGR_ACTIVE:
+                return self._native.active()
+            elif code == CIDMGR_INACTIVE:
+                return self._native.inactive()
+            elif code == CIDMGR_PEAK:
+                return self._native.peak()
+        if code != CIDMGR_DELETE and not cid:
+            cid = namespace_key(namespace)
+        if self._packed:
+            return self._packed_run(code, 1, cid)[0]
         tcode = np.full(shape=[1], fill_value=code, dtype=np.int8)
         tcid  = np.full(shape=[1], fill_value=cid,  dtype=np.uint64)
         flags = InferRequestHeader.FLAG_NONE
         if start:
             flags |= InferRequestHeader.FLAG_SEQUENCE_START
-        result = self.run(
-            { 'CODE' : (tcode,) , 'CORRELATION_ID': (tcid,) },
-            { 'OUTPUT' : InferContext.ResultFormat.RAW },
-            batch_size=1, flags=flags)
+        result = self._timed_run(
+            code, { 'CODE' : (tcode,) , 'CORRELATION_ID': (tcid,) }, flags)
     
         # get the correlaiton_id
         return result['OUTPUT'][0][0]
+
+    def _timed_run(self, code, inputs, flags):
+        """run() the request, also asking for the TIMING output if the
+        model has it, and add the server side timings to timings().
+        """
+        outputs = { 'OUTPUT' : InferContext.ResultFormat.RAW }
+        if self._timing is not False:
+            outputs['TIMING'] = InferContext.ResultFormat.RAW
+        start = time.time()
+        try:
+            result = self.run(inputs, outputs, batch_size=1, flags=flags)
+        except Exception as e:
+            if self._timing is not None or 'TIMING' not in str(e):
+                raise
+            # An older model config without TIMING, stop asking for it.
+            self._timing = False
+            return self._timed_run(code, inputs, flags)
+        roundtrip = time.time() - start
+        self._timing = 'TIMING' in outputs
+        if self._timing:
+            self._record_timing(code, roundtrip, result['TIMING'][0])
+        return result
+
+    def _packed_run(self, code, count, arg, cids=()):
+        """run() a packed REQUEST, returning the RESPONSE words without the
+        timing, which goes to timings().
+        """
+        request = np.array(
+            [code | (CIDMGR_PACKED_TIMING << 8), count, arg] + list(cids),
+            dtype=np.uint64)
+        start = time.time()
+        result = self.run({ 'REQUEST' : (request,) },
+                          { 'RESPONSE' : InferContext.ResultFormat.RAW },
+                          batch_size=1, flags=InferRequestHeader.FLAG_NONE)
+        roundtrip = time.time() - start
+        words = result['RESPONSE'][0]
+        self._record_timing(code, roundtrip, words[-3:])
+        return [int(w) for w in words[:-3]]
+
+    def _record_timing(self, code, roundtrip, timing):
+        entry, op_start, op_end = (int(t) for t in timing)
+        execute = (op_end - entry) * 1e-9
+        timings = self._timings[
+            {CIDMGR_NEW: 'new', CIDMGR_DELETE: 'delete'}.get(code, 'stats')]
+        timings['count'] += 1
+        timings['execute'] += execute
+        timings['registry'] += (op_end - op_start) * 1e-9
+        timings['overhead'] += max(roundtrip - execute, 0.0)
+
+    def timings(self):
+        """Return the server side timings of the requests made so far, per
+        op ('new', 'delete' and 'stats'): the number of timed requests and
+        the seconds summed over them spent in the backend's Execute, in the
+        registry op within it, and outside Execute (network, gRPC and the
+        server's scheduling). Counts stay 0 if the cidmgr model config has
+        no TIMING output.
+        """
+        if self._native is not None:
+            return self._native.timings()
+        return dict((op, dict(timing)) for op, timing in self._timings.items())
     
     def close(self):
         """Delete any held correlation_ids, and then close the context. 
@@ -63,47 +251,198 @@ class CIDMgrContext(InferContext):
         """
         for id in self.correlation_ids():
             self.delete(id)
+        if self._native is not None:
+            self._native.close()
+            self._native = None
         # make it work with both 2 and 3 as InferContext does not
         # inherit from object, so super in broken in 2.
         InferContext.close(self)
 
-    def new(self):
+    def new(self, namespace=None):
         """Get a new unique correlation_id from the server.
+
+        Each namespace, normally the sequence model name, has its own dense
+        id space and stats on the server. None is the default namespace.
         """
-        correlation_id = self._cidmgr_run(CIDMGR_NEW, start=True)
+        correlation_id = self._cidmgr_run(
+            CIDMGR_NEW, start=True, namespace=namespace)
         self._id_registry.add(correlation_id)
         return correlation_id
+
+    def new_prefixed(self, prefix, prefix_bits):
+        """Get a new unique correlation_id from a sparse id space whose top
+        prefix_bits bits are prefix, e.g. a tenant or shard for downstream
+        routing. The cidmgr model must have id_space "sparse".
+        """
+        if self._native is not None:
+            correlation_id = self._native.new_prefixed(prefix, prefix_bits)
+        else:
+            correlation_id = self._cidmgr_run(
+                CIDMGR_NEW, prefix_arg(prefix, prefix_bits), start=True)
+        self._id_registry.add(correlation_id)
+        return correlation_id
+
+    def new_many_prefixed(self, count, prefix, prefix_bits):
+        """Get a list of count new unique correlation_ids under the prefix,
+        as new_many() does for a namespace.
+        """
+        if self._native is not None:
+            correlation_ids = self._native.new_many_prefixed(
+                count, prefix, prefix_bits)
+            self._id_registry.update(correlation_ids)
+            return correlation_ids
+        return self._new_many(count, prefix_arg(prefix, prefix_bits))
+
+    def new_many(self, count, namespace=None):
+        """Get a list of count new unique correlation_ids from the server.
+
+        With a packed cidmgr model this is one request per
+        CIDMGR_PACKED_MAX_NEW id's, otherwise one request per id.
+        """
+        if self._native is not None:
+            correlation_ids = self._native.new_many(count, namespace)
+            self._id_registry.update(correlation_ids)
+            return correlation_ids
+        return self._new_many(count, namespace_key(namespace))
+
+    def _new_many(self, count, arg):
+        """new_many() for the namespace key or prefix_arg() arg."""
+        if self._packed:
+            # CIDMGR_PACKED_MAX_NEW at a time, each all or nothing.
+            correlation_ids = []
+            try:
+                while len(correlation_ids) < count:
+                    correlation_ids.extend(self._packed_run(
+                        CIDMGR_NEW,
+                        min(count - len(correlation_ids),
+                            CIDMGR_PACKED_MAX_NEW),
+                        arg))
+            except Exception:
+                for correlation_id in correlation_ids:
+                    self._cidmgr_run(CIDMGR_DELETE, correlation_id)
+                raise
+        else:
+            correlation_ids = []
+            try:
+                for i in range(count):
+                    correlation_ids.append(self._cidmgr_run(
+                        CIDMGR_NEW, arg, start=True))
+            except Exception:
+                for correlation_id in correlation_ids:
+                    self._cidmgr_run(CIDMGR_DELETE, correlation_id)
+                raise
+        self._id_registry.update(correlation_ids)
+        return correlation_ids
     
     def delete(self, correlation_id):
         """Remove the correlation_id from the active reserved list on the server.
         """
-        if self._ctx is not None and correlation_id in self._id_registry:
+        if ((self._ctx is not None or self._native is not None) and
+                correlation_id in self._id_registry):
             self._id_registry.remove(correlation_id)
             self._cidmgr_run(CIDMGR_DELETE, correlation_id)
     
-    def active(self):
+    def active(self, namespace=None):
         """Return the number of active reserved correlation id's on the server.
 
         If this number is always increasing, then there is a bug somewhere in client
         code where they are not properly deleting reserved id's.
         """
-        return self._cidmgr_run(CIDMGR_ACTIVE)
+        if self._native is not None and namespace:
+            return self._native.stats(namespace)['active']
+        return self._cidmgr_run(CIDMGR_ACTIVE, namespace=namespace)
 
-    def inactive(self):
+    def inactive(self, namespace=None):
         """Return the number of inactive id's in the reserved space on the server.
         """
-        return self._cidmgr_run(CIDMGR_INACTIVE)
+        if self._native is not None and namespace:
+            return self._native.stats(namespace)['inactive']
+        return self._cidmgr_run(CIDMGR_INACTIVE, namespace=namespace)
 
-    def peak(self):
+    def peak(self, namespace=None):
         """Return the peak number of parallel correlation id's reserved by the server.
         """
-        return self._cidmgr_run(CIDMGR_PEAK)
+        if self._native is not None and namespace:
+            return self._native.stats(namespace)['peak']
+        return self._cidmgr_run(CIDMGR_PEAK, namespace=namespace)
     
+    def promote(self):
+        """Promote a standby server to primary, return the last op log
+        sequence number it applied.
+        """
+        return self._cidmgr_run(CIDMGR_PROMOTE)
+
+    def stats(self, namespace=None):
+        """Return a dict of the active, inactive and peak server stats.
+
+        Stats are for the namespace if given, otherwise the totals across
+        all namespaces.
+        """
+        if self._native is not None:
+            return self._native.stats(namespace)
+        return {'active': self.active(namespace),
+                'inactive': self.inactive(namespace),
+                'peak': self.peak(namespace)}
+
     def correlation_ids(self):
         """Return the list of correlation_id's registered with this context.
         """
         return list(self._id_registry)
 
+    def _cidmgr_bulk(self, code, cids):
+        if not cids:
+            return []
+        if self._packed:
+            words = self._packed_run(code, len(cids), 0, cids)
+            return [bool((words[i // 64] >> (i % 64)) & 1)
+                    for i in range(len(cids))]
+        if not self._bulk and len(cids) > 1:
+            # CORRELATION_ID is [ 1 ], one request per id.
+            return [self._cidmgr_bulk(code, [cid])[0] for cid in cids]
+        tcode = np.full(shape=[1], fill_value=code, dtype=np.int8)
+        tcids = np.array(cids, dtype=np.uint64)
+        result = self._timed_run(
+            code, { 'CODE' : (tcode,) , 'CORRELATION_ID': (tcids,) },
+            InferRequestHeader.FLAG_NONE)
+        words = result['OUTPUT'][0]
+        return [bool((int(words[i // 64]) >> (i % 64)) & 1)
+                for i in range(len(cids))]
+
+    def validate(self, correlation_ids):
+        """Return a list of bools, which of the correlation_ids are still
+        reserved on the server. One round-trip for all of them with the
+        bulk or packed model config, otherwise one each.
+        """
+        if self._native is not None:
+            return self._native.validate(list(correlation_ids))
+        return self._cidmgr_bulk(CIDMGR_VALIDATE, list(correlation_ids))
+
+    def reconcile(self, reserve=False, release=()):
+        """Bring the correlation_ids held by this context in line with the
+        server in one round-trip (one per id with the default model
+        config), e.g. after a server restart.
+
+        correlation_ids in release are deleted. If reserve, the server
+        re-reserves the ones it no longer holds, otherwise they are dropped.
+        Returns the list of correlation_ids dropped.
+        """
+        release = [cid for cid in release]
+        self._id_registry.difference_update(release)
+        if self._native is not None:
+            self._native.reconcile(reserve, release)
+            dropped = self._id_registry.difference(
+                self._native.correlation_ids())
+            self._id_registry.difference_update(dropped)
+            return list(dropped)
+        held = list(self._id_registry)
+        bits = self._cidmgr_bulk(
+            CIDMGR_RECONCILE if reserve else CIDMGR_VALIDATE,
+            [cid | CIDMGR_RELEASE_BIT for cid in release] + held)
+        dropped = [cid for cid, live in zip(held, bits[len(release):])
+                   if not live]
+        self._id_registry.difference_update(dropped)
+        return dropped
+
     def stateful(self, 
         url, protocol, model_name, model_version=None,
         verbose=False, streaming=False):
@@ -144,7 +483,7 @@ class StatefulContext(InferContext):
             cidmgr_context = CIDMgrContext(url, verbose=verbose)
         self.cidmgr=cidmgr_context
         protocol = ProtocolType.from_str("grpc")
-        correlation_id = self.cidmgr.new()
+        correlation_id = self.cidmgr.new(model_name)
         # make it work with both 2 and 3 as InferContext does not
         # inherit from object, so super in broken in 2.
         InferContext.__init__(self,
@@ -10,6 +10,20 @@ _LIB= util.name2lib('cidmgr')
 
 _template = os.path.join(os.path.dirname(
                 os.path.abspath(__file__)), 'config.pbtxt.in')
+_packed_template = os.path.join(os.path.dirname(
+                os.path.abspath(__file__)), 'config_packed.pbtxt.in')
+_bulk_template = os.path.join(os.path.dirname(
+                os.path.abspath(__file__)), 'config_bulk.pbtxt.in')
+
+_node_parameters = '''parameters {
+  key: "node_id_bits"
+  value: { string_value: "%d" }
+}
+parameters {
+  key: "node_id"
+  value: { string_value: "%d" }
+}
+'''
 
 def dirtype(dirname):
     full_path = util.expand(dirname)
@@ -30,8 +44,18 @@ parser.add_argument("store", metavar='model-store', type=dirtype,
                     help="trtserver model repository directory")
 parser.add_argument("-o", "--overwrite", action='store_true',
                     help="overwrite to an existing model of NAME if present")
-parser.add_argument("-n", "--name", nargs='?', default="cidmgr", 
-                    help="model name (DEFAULT: cidmgr)")
+parser.add_argument("-n", "--name", nargs='?', default=None, 
+                    help="model name (DEFAULT: cidmgr, or cidmgr_packed with -k)")
+parser.add_argument("-k", "--packed", action='store_true',
+                    help="install the packed single tensor request model")
+parser.add_argument("-b", "--bulk", action='store_true',
+                    help="install the variable length bulk config, for "
+                         "one request VALIDATE and RECONCILE")
+parser.add_argument("-N", "--node", nargs=2, type=int, default=None,
+                    metavar=('NODE_ID_BITS', 'NODE_ID'),
+                    help="partition the id space, needed to load both "
+                         "cidmgr and cidmgr_packed in one trtserver "
+                         "(e.g. '-N 1 0' and '-k -N 1 1')")
 parser.add_argument("-m", "--modver", dest='version', 
                     nargs='?', type=int, default=1, 
                     help="model version (DEFAULT: 1)")
@@ -43,6 +67,8 @@ parser.add_argument("-p", "--path", nargs="+",  default=[],
                     help="additional search paths for finding LIBRARY (implicit '-i')")
 def main():
     args = parser.parse_args()
+    if not args.name:
+        args.name = "cidmgr_packed" if args.packed else "cidmgr"
     if args.path:
         args.install=True
     modeldir = os.path.join(args.store, args.name)
@@ -69,9 +95,17 @@ def main():
     if not os.path.exists(modelvdir):
         os.mkdir(modelvdir)
     _config = os.path.join(modeldir, 'config.pbtxt')
-    with open(_template, 'rU') as t:
+    if args.packed:
+        _in = _packed_template
+    elif args.bulk:
+        _in = _bulk_template
+    else:
+        _in = _template
+    with open(_in, 'rU') as t:
         template = t.read()
         config = template % (args.name, args.library)
+        if args.node:
+            config += _node_parameters % tuple(args.node)
         with open(_config, 'w') as c:
             c.write(config)
         print("Wrote config: "+_config)
@@ -0,0 +1,174 @@
+# Copyright (c) 2019, Doug Napoleone. All rights reserved.
+"""Pure Python client for the per-host cidmgr_sidecar.
+
+The sidecar batches the correlation id requests of all the processes on a
+host into calls to the cidmgr server, and releases the id's of a process
+that exits without deleting them. Requests are the packed REQUEST words
+framed by their count on a Unix socket, see common/sidecar.h.
+
+SidecarClient has the same methods as the native trtis_cidmgr._cidmgr.CIDMgr,
+so CIDMgrContext(sidecar=path) uses either one.
+"""
+import socket
+import struct
+import time
+
+from .codes import *
+from .context import (namespace_key, prefix_arg, CIDMGR_RELEASE_BIT,
+                      CIDMGR_PACKED_TIMING, CIDMGR_PACKED_MAX_NEW,
+                      CIDMGR_SIDECAR_DEFAULT_SOCKET)
+
+__all__ = ['SidecarClient', 'SidecarError']
+
+# Response status, see common/sidecar.h.
+CIDMGR_SIDECAR_OK = 0
+
+class SidecarError(RuntimeError):
+    """A request the sidecar refused or could not get the server to do."""
+    pass
+
+class SidecarClient(object):
+    """Connection to the cidmgr_sidecar on this host.
+
+    Every correlation id created through the connection is owned by it, and
+    released by the sidecar when the connection closes.
+    """
+    def __init__(self, path=CIDMGR_SIDECAR_DEFAULT_SOCKET):
+        self._socket = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            self._socket.connect(path)
+        except socket.error as e:
+            self._socket.close()
+            raise SidecarError(
+                "unable to connect to the cidmgr sidecar at %s: %s"
+                % (path, e))
+        self._id_registry = set()
+        self._timings = dict((op, dict(count=0, execute=0.0, registry=0.0,
+                                       overhead=0.0))
+                             for op in ('new', 'delete', 'stats'))
+
+    def _recv(self, size):
+        data = b''
+        while len(data) < size:
+            chunk = self._socket.recv(size - len(data))
+            if not chunk:
+                raise SidecarError("lost the connection to the cidmgr sidecar")
+            data += chunk
+        return data
+
+    def _run(self, code, count, arg, cids=()):
+        """Run a packed request, returning the response words without the
+        timing, which goes to timings().
+        """
+        if self._socket is None:
+            raise SidecarError("CIDMgr is closed")
+        words = [code | (CIDMGR_PACKED_TIMING << 8), count, arg] + list(cids)
+        start = time.time()
+        self._socket.sendall(
+            struct.pack('=I%dQ' % len(words), len(words), *words))
+        status, size = struct.unpack('=II', self._recv(8))
+        payload = self._recv(size)
+        roundtrip = time.time() - start
+        if status != CIDMGR_SIDECAR_OK:
+            raise SidecarError(payload.decode('utf-8', 'replace'))
+        result = struct.unpack('=%dQ' % (size // 8), payload)
+        self._record_timing(code, roundtrip, result[-3:])
+        return list(result[:-3])
+
+    def _record_timing(self, code, roundtrip, timing):
+        entry, op_start, op_end = timing
+        execute = (op_end - entry) * 1e-9
+        timings = self._timings[
+            {CIDMGR_NEW: 'new', CIDMGR_DELETE: 'delete'}.get(code, 'stats')]
+        timings['count'] += 1
+        timings['execute'] += execute
+        timings['registry'] += (op_end - op_start) * 1e-9
+        timings['overhead'] += max(roundtrip - execute, 0.0)
+
+    def _bulk(self, code, cids):
+        if not cids:
+            return []
+        words = self._run(code, len(cids), 0, cids)
+        return [bool((words[i // 64] >> (i % 64)) & 1)
+                for i in range(len(cids))]
+
+    def new(self, namespace=None):
+        correlation_id = self._run(CIDMGR_NEW, 1, namespace_key(namespace))[0]
+        self._id_registry.add(correlation_id)
+        return correlation_id
+
+    def new_prefixed(self, prefix, prefix_bits):
+        correlation_id = self._run(
+            CIDMGR_NEW, 1, prefix_arg(prefix, prefix_bits))[0]
+        self._id_registry.add(correlation_id)
+        return correlation_id
+
+    def new_many(self, count, namespace=None):
+        return self._new_many(count, namespace_key(namespace))
+
+    def new_many_prefixed(self, count, prefix, prefix_bits):
+        return self._new_many(count, prefix_arg(prefix, prefix_bits))
+
+    def _new_many(self, count, arg):
+        correlation_ids = []
+        try:
+            while len(correlation_ids) < count:
+                correlation_ids.extend(self._run(
+                    CIDMGR_NEW,
+                    min(count - len(correlation_ids), CIDMGR_PACKED_MAX_NEW),
+                    arg))
+        except Exception:
+            self._bulk(CIDMGR_VALIDATE,
+                       [cid | CIDMGR_RELEASE_BIT for cid in correlation_ids])
+            raise
+        self._id_registry.update(correlation_ids)
+        return correlation_ids
+
+    def delete(self, correlation_id):
+        self._id_registry.discard(correlation_id)
+        self._run(CIDMGR_DELETE, 1, correlation_id)
+
+    def active(self):
+        return self._run(CIDMGR_ACTIVE, 1, 0)[0]
+
+    def inactive(self):
+        return self._run(CIDMGR_INACTIVE, 1, 0)[0]
+
+    def peak(self):
+        return self._run(CIDMGR_PEAK, 1, 0)[0]
+
+    def stats(self, namespace=None):
+        key = namespace_key(namespace)
+        return {'active': self._run(CIDMGR_ACTIVE, 1, key)[0],
+                'inactive': self._run(CIDMGR_INACTIVE, 1, key)[0],
+                'peak': self._run(CIDMGR_PEAK, 1, key)[0]}
+
+    def correlation_ids(self):
+        return list(self._id_registry)
+
+    def validate(self, correlation_ids):
+        return self._bulk(CIDMGR_VALIDATE,
+                          [cid & ~CIDMGR_RELEASE_BIT
+                           for cid in correlation_ids])
+
+    def reconcile(self, reserve=False, release=()):
+        release = [cid for cid in release if cid in self._id_registry]
+        self._id_registry.difference_update(release)
+        held = list(self._id_registry)
+        bits = self._bulk(
+            CIDMGR_RECONCILE if reserve else CIDMGR_VALIDATE,
+            [cid | CIDMGR_RELEASE_BIT for cid in release] + held)
+        dropped = [cid for cid, live in zip(held, bits[len(release):])
+                   if not live]
+        self._id_registry.difference_update(dropped)
+        return len(dropped)
+
+    def timings(self):
+        return dict((op, dict(timing)) for op, timing in self._timings.items())
+
+    def close(self):
+        """Close the connection, the sidecar releases the held id's."""
+        if self._socket is not None:
+            self._socket.close()
+            self._socket = None
+        self._id_registry.clear()
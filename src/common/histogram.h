@@ -0,0 +1,176 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Lock-free log-linear (HDR style) latency histogram.
+//
+// Values are nanoseconds. Each power of two range is split into
+// 2^HISTOGRAM_SUB_BITS linear sub-buckets, which bounds the relative error
+// of any reported percentile to 1/128 (< 0.8%). Values above
+// 2^HISTOGRAM_MAX_BITS ns (~68s) are clamped into the last bucket.
+//
+// Record() is a handful of relaxed atomic adds and is safe to call from
+// any number of threads. Snapshot() copies the counters without stopping
+// writers, so a snapshot taken under load may be off by the few samples
+// in flight.
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
+
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_MAX_BITS 36
+#define HISTOGRAM_SUB_COUNT (1ull << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS \
+  ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_COUNT)
+
+inline uint64_t
+MonotonicNanos()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+struct HistogramSnapshot {
+  HistogramSnapshot() : count(0), sum(0), max(0), counts() {}
+
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  std::vector<uint64_t> counts;
+
+  double Mean() const { return count ? double(sum) / double(count) : 0.0; }
+
+  // Value (ns) at quantile q in [0, 1]; 0 when empty.
+  uint64_t Percentile(double q) const
+  {
+    if (count == 0) {
+      return 0;
+    }
+    uint64_t total = 0;
+    for (uint64_t c : counts) {
+      total += c;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * double(total) + 0.5);
+    if (rank == 0) {
+      rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+      seen += counts[i];
+      if (seen >= rank) {
+        uint64_t value = BucketMidpoint(i);
+        return (value > max) ? max : value;
+      }
+    }
+    return max;
+  }
+
+  // Fold another snapshot into this one.
+  void Merge(const HistogramSnapshot& other)
+  {
+    if (counts.size() < other.counts.size()) {
+      counts.resize(other.counts.size(), 0);
+    }
+    for (size_t i = 0; i < other.counts.size(); ++i) {
+      counts[i] += other.counts[i];
+    }
+    count += other.count;
+    sum += other.sum;
+    if (other.max > max) {
+      max = other.max;
+    }
+  }
+
+  static uint64_t BucketLow(size_t index)
+  {
+    if (index < HISTOGRAM_SUB_COUNT) {
+      return index;
+    }
+    const uint64_t shift = index / HISTOGRAM_SUB_COUNT - 1;
+    const uint64_t sub = index % HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_COUNT;
+    return sub << shift;
+  }
+
+  static uint64_t BucketMidpoint(size_t index)
+  {
+    if (index < HISTOGRAM_SUB_COUNT) {
+      return index;
+    }
+    const uint64_t shift = index / HISTOGRAM_SUB_COUNT - 1;
+    return BucketLow(index) + ((1ull << shift) >> 1);
+  }
+};
+
+class Histogram {
+ public:
+  Histogram() : count_(0), sum_(0), max_(0)
+  {
+    for (auto& c : counts_) {
+      c.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void Record(uint64_t nanos)
+  {
+    counts_[Index(nanos)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(nanos, std::memory_order_relaxed);
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while ((nanos > max) &&
+           !max_.compare_exchange_weak(max, nanos, std::memory_order_relaxed)) {
+    }
+  }
+
+  void Snapshot(HistogramSnapshot* snapshot) const
+  {
+    snapshot->counts.resize(HISTOGRAM_BUCKETS);
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+      snapshot->counts[i] = counts_[i].load(std::memory_order_relaxed);
+    }
+    snapshot->count = count_.load(std::memory_order_relaxed);
+    snapshot->sum = sum_.load(std::memory_order_relaxed);
+    snapshot->max = max_.load(std::memory_order_relaxed);
+  }
+
+  static size_t Index(uint64_t nanos)
+  {
+    if (nanos < HISTOGRAM_SUB_COUNT) {
+      return static_cast<size_t>(nanos);
+    }
+    const uint64_t msb = 63 - __builtin_clzll(nanos);
+    if (msb > HISTOGRAM_MAX_BITS) {
+      return HISTOGRAM_BUCKETS - 1;
+    }
+    const uint64_t shift = msb - HISTOGRAM_SUB_BITS;
+    return static_cast<size_t>(
+        (shift + 1) * HISTOGRAM_SUB_COUNT +
+        ((nanos >> shift) - HISTOGRAM_SUB_COUNT));
+  }
+
+ private:
+  std::atomic<uint64_t> counts_[HISTOGRAM_BUCKETS];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> max_;
+};
+
+// Records the scope's elapsed time into a histogram.
+class ScopedLatency {
+ public:
+  explicit ScopedLatency(Histogram* histogram)
+      : histogram_(histogram), start_(MonotonicNanos())
+  {
+  }
+  ~ScopedLatency() { histogram_->Record(MonotonicNanos() - start_); }
+
+ private:
+  Histogram* histogram_;
+  uint64_t start_;
+};
+
+}}}  // namespace dnapoleone::inferenceserver::correlation_id_mgr
@@ -0,0 +1,116 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
+
+// Key naming a correlation id namespace on the wire. The FNV-1a hash of the
+// namespace name (normally the downstream model name), never 0 since 0
+// selects the default namespace. Shared by the backend and the clients so
+// both sides agree on the key for a name.
+inline uint32_t
+NamespaceKey(const char* name, size_t size)
+{
+  if (size == 0) {
+    return 0;
+  }
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<unsigned char>(name[i]);
+    hash *= 16777619u;
+  }
+  return (hash == 0) ? 1 : hash;
+}
+
+// Set on an id passed to CIDMGR_VALIDATE or CIDMGR_RECONCILE to release it.
+// Bit 63 is never part of an id.
+#define CIDMGR_RELEASE_BIT (1ull << 63)
+
+// Set on the CIDMGR_NEW argument to ask a sparse id space (the backend's
+// id_space "sparse") for an id under a prefix instead of from a namespace.
+// The prefix bits are the top bits of the node's range of the id space,
+// the low ones of the argument give how many there are.
+#define CIDMGR_PREFIX_BIT (1ull << 63)
+#define CIDMGR_PREFIX_LENGTH_BITS 6
+
+// Most prefix bits a CIDMGR_NEW argument carries.
+#define CIDMGR_MAX_PREFIX_BITS (63 - CIDMGR_PREFIX_LENGTH_BITS)
+
+// CIDMGR_NEW argument for an id whose top prefix_bits bits are the low
+// prefix_bits bits of prefix. prefix_bits of 0 is anywhere in the range.
+inline uint64_t
+PrefixArg(uint64_t prefix, uint32_t prefix_bits)
+{
+  return CIDMGR_PREFIX_BIT | (prefix << CIDMGR_PREFIX_LENGTH_BITS) |
+         prefix_bits;
+}
+
+// Does the prefix fit the argument, and in its prefix_bits.
+inline bool
+ValidPrefix(uint64_t prefix, uint32_t prefix_bits)
+{
+  return (prefix_bits <= CIDMGR_MAX_PREFIX_BITS) &&
+         ((prefix >> prefix_bits) == 0);
+}
+
+inline uint64_t
+PrefixOf(uint64_t arg)
+{
+  return (arg & ~CIDMGR_PREFIX_BIT) >> CIDMGR_PREFIX_LENGTH_BITS;
+}
+
+inline uint32_t
+PrefixBitsOf(uint64_t arg)
+{
+  return static_cast<uint32_t>(arg & ((1u << CIDMGR_PREFIX_LENGTH_BITS) - 1));
+}
+
+// Partitioning of the 64 bit correlation id space between cidmgr nodes.
+//
+// Each node owns the range of id's with its node_id in the node_bits wide
+// field starting at bit node_shift, i.e. a stride of 2^node_shift id's per
+// node. Nodes allocate only inside their own range, so id's are unique
+// across nodes without any coordination. node_bits of 0 is unpartitioned.
+// Bit 63 is never used.
+struct NodeLayout {
+  uint32_t node_id;
+  uint32_t node_bits;
+  uint32_t node_shift;
+
+  // First id of this node's range.
+  uint64_t Base() const
+  {
+    return (node_bits == 0) ? 0 : (static_cast<uint64_t>(node_id) << node_shift);
+  }
+
+  // The node owning the id.
+  uint32_t NodeOf(uint64_t id) const
+  {
+    return (node_bits == 0)
+               ? 0
+               : static_cast<uint32_t>(
+                     (id >> node_shift) & ((1ull << node_bits) - 1));
+  }
+
+  // Packed form returned for CIDMGR_NODE.
+  uint64_t Pack() const
+  {
+    return static_cast<uint64_t>(node_id & 0xffffffffu) |
+           (static_cast<uint64_t>(node_bits & 0xff) << 32) |
+           (static_cast<uint64_t>(node_shift & 0xff) << 40);
+  }
+
+  static NodeLayout Unpack(uint64_t packed)
+  {
+    NodeLayout layout;
+    layout.node_id = static_cast<uint32_t>(packed);
+    layout.node_bits = static_cast<uint32_t>((packed >> 32) & 0xff);
+    layout.node_shift = static_cast<uint32_t>((packed >> 40) & 0xff);
+    return layout;
+  }
+};
+
+}}}  // namespace dnapoleone::inferenceserver::correlation_id_mgr
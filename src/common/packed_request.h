@@ -0,0 +1,73 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Packed single tensor request format.
+//
+// The packed model configuration (config_packed.pbtxt.in) replaces the
+// START and READY controls, CODE, CORRELATION_ID, OUTPUT and TIMING tensors
+// with one UINT64 REQUEST input and one UINT64 RESPONSE output, so a request
+// is a single input_fn read on the backend and a single named input on the
+// client:
+//
+//   REQUEST[0]   op code | flags << 8
+//   REQUEST[1]   count: id's to create for CIDMGR_NEW (0 is 1), or the
+//                number of id's after the header for VALIDATE and RECONCILE
+//   REQUEST[2]   argument: the namespace key for NEW and the stats, the id
+//                for DELETE
+//   REQUEST[3..] id's for VALIDATE and RECONCILE
+//
+//   RESPONSE     the result: one value, count id's for NEW, or
+//                ceil(count / 64) bitmask words for the bulk ops; followed
+//                by the three TIMING words when CIDMGR_PACKED_TIMING is set.
+//
+// NEW with a count > 1 creates the id's all or nothing.
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
+
+#define CIDMGR_PACKED_HEADER_WORDS 3
+#define CIDMGR_PACKED_TIMING_WORDS 3
+
+// Flags in REQUEST[0] bits 8..15.
+#define CIDMGR_PACKED_TIMING 0x1
+
+// Most id's a single packed NEW may create.
+#define CIDMGR_PACKED_MAX_NEW 65536
+
+inline uint64_t
+PackRequestWord(int code, uint32_t flags)
+{
+  return static_cast<uint64_t>(static_cast<uint8_t>(code)) |
+         (static_cast<uint64_t>(flags & 0xff) << 8);
+}
+
+inline int8_t
+PackedCode(uint64_t word)
+{
+  return static_cast<int8_t>(word & 0xff);
+}
+
+inline uint32_t
+PackedFlags(uint64_t word)
+{
+  return static_cast<uint32_t>((word >> 8) & 0xff);
+}
+
+// RESPONSE words before the timing for a NEW of count id's (is_new) or a
+// bulk op on count id's; 1 for the single value ops.
+inline size_t
+PackedResultWords(bool is_new, bool is_bulk, uint64_t count)
+{
+  if (is_new) {
+    return (count == 0) ? 1 : static_cast<size_t>(count);
+  }
+  if (is_bulk) {
+    return static_cast<size_t>((count + 63) / 64);
+  }
+  return 1;
+}
+
+}}}  // namespace dnapoleone::inferenceserver::correlation_id_mgr
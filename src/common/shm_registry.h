@@ -0,0 +1,376 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Same-host shared memory fast path for correlation id allocation.
+//
+// The cidmgr backend carves a contiguous block of correlation id's out of
+// its id space and publishes it as a POSIX shared memory region. Clients
+// on the same host map the region and allocate/free id's from the block
+// with atomic operations on a bitmap, without a round-trip through the
+// inference server. The backend never hands out id's in the block over
+// gRPC, so id's stay unique across local and remote callers.
+//
+// Region layout:
+//
+//   ShmRegistryHeader
+//   std::atomic<uint64_t> bitmap[words]    (bit set == id reserved)
+//   std::atomic<uint32_t> owners[capacity] (pid holding the id, 0 if free)
+//
+// When the backend goes away (or is restarted) the region is marked closed
+// before it is unlinked. Clients check the flag on every allocation and fall
+// back to the gRPC path once it is set.
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
+
+#define CIDMGR_SHM_MAGIC 0x7274697363696430ull  // "rtiscid0"
+#define CIDMGR_SHM_VERSION 1
+
+struct ShmRegistryHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t backend_pid;
+  uint64_t base_id;
+  uint64_t capacity;
+  uint64_t words;
+  std::atomic<uint32_t> closed;
+  std::atomic<uint64_t> hint;
+  std::atomic<uint64_t> active;
+  std::atomic<uint64_t> peak;
+};
+
+class ShmRegistry {
+ public:
+  ~ShmRegistry()
+  {
+#if !defined(_WIN32)
+    if (owner_) {
+      header_->closed.store(1, std::memory_order_release);
+      shm_unlink(name_.c_str());
+    }
+    munmap(region_, size_);
+#endif
+  }
+
+  // Create (backend side) the region 'name' holding 'capacity' id's
+  // starting at 'base_id'. A stale region left behind by a previous
+  // backend is closed and replaced. Any process that can write the region
+  // can take or release id's, so it is readable and writable by the owner
+  // only, or by the owner and 'group' when group is not -1. Returns
+  // nullptr on failure.
+  static ShmRegistry* Create(
+      const std::string& name, uint64_t base_id, uint64_t capacity,
+      int group = -1)
+  {
+#if defined(_WIN32)
+    return nullptr;
+#else
+    if ((capacity == 0) || (base_id == 0)) {
+      return nullptr;
+    }
+
+    // Close out any region from a backend that did not shut down cleanly,
+    // so clients still mapping it stop allocating from it.
+    ShmRegistry* stale = Open(name);
+    if (stale != nullptr) {
+      stale->header_->closed.store(1, std::memory_order_release);
+      delete stale;
+    }
+    shm_unlink(name.c_str());
+
+    const mode_t mode = (group < 0) ? 0600 : 0660;
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+      return nullptr;
+    }
+    // Hand the group access only once the region is theirs.
+    if (((group >= 0) && (fchown(fd, -1, static_cast<gid_t>(group)) != 0)) ||
+        (fchmod(fd, mode) != 0)) {
+      close(fd);
+      shm_unlink(name.c_str());
+      return nullptr;
+    }
+    const uint64_t words = (capacity + 63) / 64;
+    const size_t size = RegionSize(words, capacity);
+    if (ftruncate(fd, size) != 0) {
+      close(fd);
+      shm_unlink(name.c_str());
+      return nullptr;
+    }
+    void* region =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) {
+      shm_unlink(name.c_str());
+      return nullptr;
+    }
+
+    // ftruncate zero fills, so the bitmap and owners start out free.
+    ShmRegistryHeader* header = static_cast<ShmRegistryHeader*>(region);
+    header->version = CIDMGR_SHM_VERSION;
+    header->backend_pid = static_cast<uint32_t>(getpid());
+    header->base_id = base_id;
+    header->capacity = capacity;
+    header->words = words;
+    header->closed.store(0, std::memory_order_relaxed);
+    header->hint.store(0, std::memory_order_relaxed);
+    header->active.store(0, std::memory_order_relaxed);
+    header->peak.store(0, std::memory_order_relaxed);
+
+    // Mark the words tail past capacity as permanently reserved.
+    std::atomic<uint64_t>* bitmap = Bitmap(region);
+    const uint64_t tail = capacity % 64;
+    if (tail != 0) {
+      bitmap[words - 1].store(~((1ull << tail) - 1), std::memory_order_relaxed);
+    }
+
+    // Publish the magic last, clients will not map a half built region.
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = CIDMGR_SHM_MAGIC;
+
+    return new ShmRegistry(name, region, size, true);
+#endif
+  }
+
+  // Open (client side) an existing region. Returns nullptr when there is
+  // no usable region published under 'name'.
+  static ShmRegistry* Open(const std::string& name)
+  {
+#if defined(_WIN32)
+    return nullptr;
+#else
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+      return nullptr;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) ||
+        (static_cast<size_t>(st.st_size) < sizeof(ShmRegistryHeader))) {
+      close(fd);
+      return nullptr;
+    }
+    const size_t size = static_cast<size_t>(st.st_size);
+    void* region =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) {
+      return nullptr;
+    }
+
+    ShmRegistryHeader* header = static_cast<ShmRegistryHeader*>(region);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if ((header->magic != CIDMGR_SHM_MAGIC) ||
+        (header->version != CIDMGR_SHM_VERSION) ||
+        (RegionSize(header->words, header->capacity) > size)) {
+      munmap(region, size);
+      return nullptr;
+    }
+    return new ShmRegistry(name, region, size, false);
+#endif
+  }
+
+  // Reserve an id from the block. Returns false when the block is
+  // exhausted or closed, in which case the caller should use gRPC.
+  bool Allocate(uint64_t* id, uint32_t owner)
+  {
+    if (Closed()) {
+      return false;
+    }
+    std::atomic<uint64_t>* bitmap = Bitmap(region_);
+    const uint64_t words = header_->words;
+    const uint64_t start =
+        header_->hint.load(std::memory_order_relaxed) % words;
+    for (uint64_t n = 0; n < words; ++n) {
+      uint64_t w = (start + n) % words;
+      uint64_t bits = bitmap[w].load(std::memory_order_relaxed);
+      while (bits != ~0ull) {
+        const uint64_t free_bit = ~bits & (bits + 1);
+        if (bitmap[w].compare_exchange_weak(
+                bits, bits | free_bit, std::memory_order_acq_rel,
+                std::memory_order_relaxed)) {
+          const uint64_t index = w * 64 + __builtin_ctzll(free_bit);
+          Owners(region_, header_->words)[index].store(
+              owner, std::memory_order_relaxed);
+          if (w != start) {
+            header_->hint.store(w, std::memory_order_relaxed);
+          }
+          const uint64_t active =
+              header_->active.fetch_add(1, std::memory_order_relaxed) + 1;
+          uint64_t peak = header_->peak.load(std::memory_order_relaxed);
+          while ((active > peak) &&
+                 !header_->peak.compare_exchange_weak(
+                     peak, active, std::memory_order_relaxed)) {
+          }
+          *id = header_->base_id + index;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // Release an id previously reserved from the block. Returns false if
+  // the id is not in the block or was not reserved.
+  bool Release(uint64_t id)
+  {
+    if (!Contains(id)) {
+      return false;
+    }
+    const uint64_t index = id - header_->base_id;
+    const uint64_t bit = 1ull << (index % 64);
+    // A stray release of a free id must not wipe the owner of whoever
+    // reserves it next.
+    if ((Bitmap(region_)[index / 64].load(std::memory_order_acquire) & bit) ==
+        0) {
+      return false;
+    }
+    Owners(region_, header_->words)[index].store(0, std::memory_order_relaxed);
+    const uint64_t prev =
+        Bitmap(region_)[index / 64].fetch_and(~bit, std::memory_order_acq_rel);
+    if ((prev & bit) == 0) {
+      return false;
+    }
+    header_->active.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Release an id only if 'owner' still holds it, e.g. to reap the id's of
+  // an exited process without racing a new owner. Returns false if not.
+  bool ReleaseOwned(uint64_t id, uint32_t owner)
+  {
+    if (!Contains(id) || (owner == 0)) {
+      return false;
+    }
+    const uint64_t index = id - header_->base_id;
+    uint32_t expected = owner;
+    if (!Owners(region_, header_->words)[index].compare_exchange_strong(
+            expected, 0, std::memory_order_acq_rel)) {
+      return false;
+    }
+    const uint64_t bit = 1ull << (index % 64);
+    const uint64_t prev =
+        Bitmap(region_)[index / 64].fetch_and(~bit, std::memory_order_acq_rel);
+    if ((prev & bit) == 0) {
+      return false;
+    }
+    header_->active.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Reserve a specific id from the block, e.g. to restore a client's id
+  // after a backend restart. Returns false if the id is not in the block
+  // or the block is closed. Reserving an id already reserved is a no-op.
+  bool Reserve(uint64_t id, uint32_t owner)
+  {
+    if (Closed() || !Contains(id)) {
+      return false;
+    }
+    const uint64_t index = id - header_->base_id;
+    const uint64_t bit = 1ull << (index % 64);
+    const uint64_t prev =
+        Bitmap(region_)[index / 64].fetch_or(bit, std::memory_order_acq_rel);
+    if ((prev & bit) != 0) {
+      return true;
+    }
+    Owners(region_, header_->words)[index].store(
+        owner, std::memory_order_relaxed);
+    const uint64_t active =
+        header_->active.fetch_add(1, std::memory_order_relaxed) + 1;
+    uint64_t peak = header_->peak.load(std::memory_order_relaxed);
+    while ((active > peak) &&
+           !header_->peak.compare_exchange_weak(
+               peak, active, std::memory_order_relaxed)) {
+    }
+    return true;
+  }
+
+  // Is the id reserved in the block right now.
+  bool Reserved(uint64_t id) const
+  {
+    if (!Contains(id)) {
+      return false;
+    }
+    const uint64_t index = id - header_->base_id;
+    return (Bitmap(region_)[index / 64].load(std::memory_order_acquire) &
+            (1ull << (index % 64))) != 0;
+  }
+
+  // Pid holding the id, 0 if it is free.
+  uint32_t Owner(uint64_t id) const
+  {
+    if (!Contains(id)) {
+      return 0;
+    }
+    return Owners(region_, header_->words)[id - header_->base_id].load(
+        std::memory_order_relaxed);
+  }
+
+  bool Contains(uint64_t id) const
+  {
+    return (id >= header_->base_id) &&
+           (id - header_->base_id < header_->capacity);
+  }
+
+  bool Closed() const
+  {
+    return header_->closed.load(std::memory_order_acquire) != 0;
+  }
+
+  uint64_t BaseID() const { return header_->base_id; }
+  uint64_t Capacity() const { return header_->capacity; }
+  uint64_t Active() const
+  {
+    return header_->active.load(std::memory_order_relaxed);
+  }
+  uint64_t Peak() const
+  {
+    return header_->peak.load(std::memory_order_relaxed);
+  }
+
+ private:
+  ShmRegistry(const std::string& name, void* region, size_t size, bool owner)
+      : name_(name), region_(region), size_(size), owner_(owner),
+        header_(static_cast<ShmRegistryHeader*>(region))
+  {
+  }
+
+  static size_t RegionSize(uint64_t words, uint64_t capacity)
+  {
+    return sizeof(ShmRegistryHeader) + words * sizeof(uint64_t) +
+           capacity * sizeof(uint32_t);
+  }
+
+  static std::atomic<uint64_t>* Bitmap(void* region)
+  {
+    return reinterpret_cast<std::atomic<uint64_t>*>(
+        static_cast<uint8_t*>(region) + sizeof(ShmRegistryHeader));
+  }
+
+  static std::atomic<uint32_t>* Owners(void* region, uint64_t words)
+  {
+    return reinterpret_cast<std::atomic<uint32_t>*>(
+        reinterpret_cast<uint8_t*>(Bitmap(region)) +
+        words * sizeof(uint64_t));
+  }
+
+  std::string name_;
+  void* region_;
+  size_t size_;
+  bool owner_;
+  ShmRegistryHeader* header_;
+};
+
+}}}  // namespace dnapoleone::inferenceserver::correlation_id_mgr
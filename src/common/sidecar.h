@@ -0,0 +1,94 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#pragma once
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+
+#include "common/packed_request.h"
+
+// Wire format between a local process and the per-host cidmgr_sidecar.
+//
+// The sidecar listens on a Unix stream socket. Each request is a packed
+// request (see common/packed_request.h) framed by its word count:
+//
+//   uint32_t words       header and id words that follow
+//   uint64_t request[words]
+//
+// and each response carries a status and the RESPONSE words, or an error
+// message when the status is not CIDMGR_SIDECAR_OK:
+//
+//   uint32_t status
+//   uint32_t bytes       payload bytes that follow
+//   uint8_t  payload[bytes]
+//
+// Requests on a connection are answered in order. Every id a connection
+// creates is owned by it until it deletes the id or closes, when the
+// sidecar releases whatever it still holds.
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
+
+// Response status, the payload is the error message when not OK.
+#define CIDMGR_SIDECAR_OK 0
+#define CIDMGR_SIDECAR_INVALID_ARG 1
+#define CIDMGR_SIDECAR_UNSUPPORTED 2
+#define CIDMGR_SIDECAR_UNAVAILABLE 3
+
+// Most words in a request: a header and up to CIDMGR_SIDECAR_MAX_IDS id's.
+#define CIDMGR_SIDECAR_MAX_IDS (1 << 20)
+#define CIDMGR_SIDECAR_MAX_WORDS \
+  (CIDMGR_PACKED_HEADER_WORDS + CIDMGR_SIDECAR_MAX_IDS)
+
+// Default socket path of the sidecar.
+#define CIDMGR_SIDECAR_DEFAULT_SOCKET "/tmp/cidmgr_sidecar.sock"
+
+struct SidecarResponseHeader {
+  uint32_t status;
+  uint32_t bytes;
+};
+
+// Write all of buf to a blocking socket, false on error.
+inline bool
+SidecarWrite(int fd, const void* buf, size_t size)
+{
+  const char* p = static_cast<const char*>(buf);
+  while (size > 0) {
+    const ssize_t sent = send(fd, p, size, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+// Read exactly size bytes from a blocking socket, false on error or EOF.
+inline bool
+SidecarRead(int fd, void* buf, size_t size)
+{
+  char* p = static_cast<char*>(buf);
+  while (size > 0) {
+    const ssize_t got = recv(fd, p, size, 0);
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (got == 0) {
+      return false;
+    }
+    p += got;
+    size -= got;
+  }
+  return true;
+}
+
+}}}  // namespace dnapoleone::inferenceserver::correlation_id_mgr
@@ -0,0 +1,225 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#pragma once
+
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/histogram.h"
+
+// Fixed size, always-on event trace ring.
+//
+// Record() claims a slot with one relaxed fetch_add and writes the event
+// with relaxed stores, a few nanoseconds on top of reading the clock. When
+// the ring is full the oldest events are overwritten. Each slot carries a
+// sequence number, so Snapshot() can run at any time from any thread and
+// simply skips slots being written.
+//
+// Timestamps are MonotonicNanos(), so traces from the backend and clients
+// on the same host share a timeline and can be merged by concatenating the
+// traceEvents arrays of their Chrome trace JSON.
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
+
+struct TraceEvent {
+  uint64_t ts;       // MonotonicNanos()
+  const char* name;  // static string
+  uint64_t arg;
+  uint32_t tid;
+  char phase;        // 'B'egin, 'E'nd or 'i'nstant
+};
+
+// Kernel thread id of the caller, as shown by top and perf.
+inline uint32_t
+TraceThreadID()
+{
+  static thread_local uint32_t tid = 0;
+  if (tid == 0) {
+#if defined(__linux__)
+    tid = static_cast<uint32_t>(syscall(SYS_gettid));
+#else
+    tid = static_cast<uint32_t>(
+        std::hash<std::thread::id>()(std::this_thread::get_id()));
+#endif
+  }
+  return tid;
+}
+
+class TraceRing {
+ public:
+  // capacity is rounded up to a power of two.
+  explicit TraceRing(size_t capacity)
+      : head_(0), mask_(0), slots_(RoundUp(capacity))
+  {
+    mask_ = slots_.size() - 1;
+    for (Slot& slot : slots_) {
+      slot.seq.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  size_t Capacity() const { return slots_.size(); }
+
+  // Total events recorded, including the overwritten ones.
+  uint64_t Recorded() const { return head_.load(std::memory_order_relaxed); }
+
+  void Record(const char* name, char phase, uint64_t arg = 0)
+  {
+    const uint64_t n = head_.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = slots_[n & mask_];
+    // Odd while being written, 2 * (n + 1) once event n is complete.
+    slot.seq.store((2 * n) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.ts.store(MonotonicNanos(), std::memory_order_relaxed);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.arg.store(arg, std::memory_order_relaxed);
+    slot.tid.store(TraceThreadID(), std::memory_order_relaxed);
+    slot.phase.store(phase, std::memory_order_relaxed);
+    slot.seq.store(2 * (n + 1), std::memory_order_release);
+  }
+
+  // Copy out the events still in the ring, oldest first.
+  void Snapshot(std::vector<TraceEvent>* events) const
+  {
+    events->clear();
+    const uint64_t head = head_.load(std::memory_order_acquire);
+    const uint64_t first = (head > slots_.size()) ? head - slots_.size() : 0;
+    events->reserve(head - first);
+    for (uint64_t n = first; n < head; ++n) {
+      const Slot& slot = slots_[n & mask_];
+      const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+      if (seq != (2 * (n + 1))) {
+        continue;
+      }
+      TraceEvent event;
+      event.ts = slot.ts.load(std::memory_order_relaxed);
+      event.name = slot.name.load(std::memory_order_relaxed);
+      event.arg = slot.arg.load(std::memory_order_relaxed);
+      event.tid = slot.tid.load(std::memory_order_relaxed);
+      event.phase = slot.phase.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) == seq) {
+        events->push_back(event);
+      }
+    }
+  }
+
+ private:
+  struct Slot {
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> ts;
+    std::atomic<const char*> name;
+    std::atomic<uint64_t> arg;
+    std::atomic<uint32_t> tid;
+    std::atomic<char> phase;
+  };
+
+  static size_t RoundUp(size_t capacity)
+  {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+  std::atomic<uint64_t> head_;
+  size_t mask_;
+  std::vector<Slot> slots_;
+};
+
+// Begin and end events around a scope. A null ring records nothing.
+class ScopedTrace {
+ public:
+  ScopedTrace(TraceRing* ring, const char* name, uint64_t arg = 0)
+      : ring_(ring), name_(name), arg_(arg)
+  {
+    if (ring_ != nullptr) {
+      ring_->Record(name_, 'B', arg_);
+    }
+  }
+  ~ScopedTrace()
+  {
+    if (ring_ != nullptr) {
+      ring_->Record(name_, 'E', arg_);
+    }
+  }
+
+  // Argument recorded with the end event, e.g. the id a NEW returned.
+  void SetArg(uint64_t arg) { arg_ = arg; }
+
+ private:
+  TraceRing* ring_;
+  const char* name_;
+  uint64_t arg_;
+};
+
+// Render events in the Chrome trace-event JSON format, for chrome://tracing
+// or Perfetto.
+inline std::string
+ChromeTrace(
+    const std::vector<TraceEvent>& events, const std::string& process_name)
+{
+  const uint32_t pid = static_cast<uint32_t>(getpid());
+  std::ostringstream out;
+  out << "{\"traceEvents\":[" << std::endl;
+  out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid
+      << ",\"args\":{\"name\":\"" << process_name << "\"}}";
+  char ts[32];
+  for (const TraceEvent& event : events) {
+    // Microseconds with nanosecond precision.
+    snprintf(
+        ts, sizeof(ts), "%llu.%03llu",
+        static_cast<unsigned long long>(event.ts / 1000),
+        static_cast<unsigned long long>(event.ts % 1000));
+    out << "," << std::endl
+        << "{\"name\":\"" << event.name << "\",\"ph\":\"" << event.phase
+        << "\",\"ts\":" << ts << ",\"pid\":" << pid
+        << ",\"tid\":" << event.tid;
+    if (event.phase == 'i') {
+      out << ",\"s\":\"t\"";
+    }
+    out << ",\"args\":{\"arg\":" << event.arg << "}}";
+  }
+  out << std::endl << "],\"displayTimeUnit\":\"ns\"}" << std::endl;
+  return out.str();
+}
+
+// Write the ring to path as Chrome trace JSON. Writes a temporary file and
+// renames it, so readers never see a partial trace. Returns the number of
+// events written, or -1 on error.
+inline int64_t
+WriteChromeTrace(
+    const TraceRing& ring, const std::string& path,
+    const std::string& process_name)
+{
+  std::vector<TraceEvent> events;
+  ring.Snapshot(&events);
+  const std::string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp.c_str(), std::ios::trunc);
+    if (!out) {
+      return -1;
+    }
+    out << ChromeTrace(events, process_name);
+    if (!out) {
+      return -1;
+    }
+  }
+  if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+    return -1;
+  }
+  return static_cast<int64_t>(events.size());
+}
+
+}}}  // namespace dnapoleone::inferenceserver::correlation_id_mgr
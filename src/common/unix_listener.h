@@ -0,0 +1,81 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+#pragma once
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+
+// Listening Unix domain sockets for the admin, replication and sidecar
+// listeners.
+//
+// A path left behind by an earlier run is replaced only if it is a socket
+// nobody is listening on; any other file, or a live socket, is an error.
+// The socket gets 'mode' before listen(), so there is no window in which
+// a process the mode keeps out can connect. umask() would do the same but
+// is process wide, and the backend shares its process with trtserver's
+// other threads.
+
+namespace dnapoleone { namespace inferenceserver { namespace correlation_id_mgr {
+
+// Listening socket on path with the given mode, 'type_flags' is or'ed into
+// SOCK_STREAM (e.g. SOCK_NONBLOCK). -1 with errno set on error; EEXIST if
+// the path is not a socket, EADDRINUSE if something listens on it.
+inline int
+UnixListen(const std::string& path, mode_t mode, int type_flags = 0)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || (path.size() >= sizeof(addr.sun_path))) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memcpy(addr.sun_path, path.data(), path.size());
+
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      errno = EEXIST;
+      return -1;
+    }
+    const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe < 0) {
+      return -1;
+    }
+    const bool live =
+      connect(probe, reinterpret_cast<struct sockaddr*>(&addr),
+              sizeof(addr)) == 0;
+    close(probe);
+    if (live) {
+      errno = EADDRINUSE;
+      return -1;
+    }
+    unlink(path.c_str());
+  }
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | type_flags, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+    const int bind_errno = errno;
+    close(fd);
+    errno = bind_errno;
+    return -1;
+  }
+  if ((chmod(path.c_str(), mode) != 0) || (listen(fd, SOMAXCONN) != 0)) {
+    const int listen_errno = errno;
+    close(fd);
+    unlink(path.c_str());
+    errno = listen_errno;
+    return -1;
+  }
+  return fd;
+}
+
+}}}  // namespace dnapoleone::inferenceserver::correlation_id_mgr
@@ -0,0 +1,894 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+// Stand-in for trtserver to benchmark the cidmgr clients on one box.
+//
+// Serves the TRTIS GRPCService Status, Health, Infer and StreamInfer
+// endpoints for the models of a model repository, without TensorRT or a
+// TRTIS build:
+//
+//   * custom backend models (e.g. cidmgr) are run in-process by dlopen'ing
+//     their library from <repository>/<model>/1/ and calling the custom
+//     backend C interface, like trtserver does, with one instance per model
+//     and the sequence batcher START/READY control inputs filled in from
+//     the request flags.
+//   * the simple_sequence model is replaced by an in-process accumulator
+//     with the results of the TRTIS sequence backend (the running sum of
+//     the INPUT values of each sequence), so the sequence clients can run
+//     against it unchanged.
+//
+// Every request can be delayed by a fixed artificial latency to stand in
+// for the network and trtserver's scheduling.
+//
+// This is a load generator target, not a server: there is no dynamic or
+// sequence batching, every request is executed on the gRPC thread that
+// received it.
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <google/protobuf/text_format.h>
+#include <grpcpp/grpcpp.h>
+
+#include "src/backends/custom/custom.h"
+
+#include "grpc_service.grpc.pb.h"
+#include "common/histogram.h"
+
+namespace ni = nvidia::inferenceserver;
+namespace dic = dnapoleone::inferenceserver::correlation_id_mgr;
+
+namespace {
+
+struct Options {
+  Options()
+      : verbose(false), repository(), port(8001), latency_us(0),
+        sequence_model("simple_sequence")
+  {
+  }
+
+  bool verbose;
+  std::string repository;
+  uint32_t port;
+  uint32_t latency_us;
+  std::string sequence_model;
+};
+
+void
+Usage(char** argv, const std::string& msg = std::string())
+{
+  if (!msg.empty()) {
+    std::cerr << "error: " << msg << std::endl;
+  }
+
+  std::cerr << "Usage: " << argv[0] << " [options]" << std::endl;
+  std::cerr << "\t-v" << std::endl;
+  std::cerr << "\t-r <model repository>" << std::endl;
+  std::cerr << "\t-p <gRPC port (default 8001)>" << std::endl;
+  std::cerr << "\t-l <artificial latency added to every request in "
+            << "microseconds (default 0)>" << std::endl;
+  std::cerr << "\t-s <model served by the in-process sequence accumulator "
+            << "(default simple_sequence)>" << std::endl;
+  std::cerr << std::endl;
+  std::cerr << "The model repository has the trtserver layout, e.g. the "
+            << "build's install/model_repository." << std::endl;
+  std::cerr << "trtserver's --model-repository and --grpc-port are accepted "
+            << "for -r and -p, --http-port and --metrics-port are ignored, "
+            << "so scripts starting trtserver can start this instead."
+            << std::endl;
+
+  exit(1);
+}
+
+size_t
+DataTypeByteSize(ni::DataType data_type)
+{
+  switch (data_type) {
+    case ni::TYPE_BOOL:
+    case ni::TYPE_UINT8:
+    case ni::TYPE_INT8:
+      return 1;
+    case ni::TYPE_UINT16:
+    case ni::TYPE_INT16:
+    case ni::TYPE_FP16:
+      return 2;
+    case ni::TYPE_UINT32:
+    case ni::TYPE_INT32:
+    case ni::TYPE_FP32:
+      return 4;
+    case ni::TYPE_UINT64:
+    case ni::TYPE_INT64:
+    case ni::TYPE_FP64:
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+void
+SetStatus(
+    ni::RequestStatus* status, ni::RequestStatusCode::Code code,
+    const std::string& msg = std::string())
+{
+  status->set_code(code);
+  status->set_msg(msg);
+  status->set_server_id("cidmgr_test_server");
+}
+
+// An input of a request, as handed to a model.
+struct Tensor {
+  std::string name;
+  std::vector<int64_t> dims;  // without the batch dimension
+  const uint8_t* data;
+  size_t size;
+  size_t offset;  // read position for CustomGetNextInputFn_t
+};
+
+// An output produced by a model.
+struct Output {
+  std::string name;
+  std::vector<int64_t> dims;  // with the batch dimension
+  std::string data;
+};
+
+// One validated request.
+struct Request {
+  uint32_t batch_size;
+  uint32_t flags;
+  uint64_t correlation_id;
+  std::vector<Tensor> inputs;
+  std::vector<std::string> outputs;
+};
+
+class Model {
+ public:
+  explicit Model(const ni::ModelConfig& config) : config_(config) {}
+  virtual ~Model() = default;
+
+  const ni::ModelConfig& Config() const { return config_; }
+
+  // Run the request. Returns the error message, empty on success.
+  virtual std::string Execute(
+      Request& request, std::vector<Output>* outputs) = 0;
+
+ protected:
+  const ni::ModelConfig config_;
+};
+
+// A custom backend model, run through the custom backend C interface.
+class CustomModel : public Model {
+ public:
+  explicit CustomModel(const ni::ModelConfig& config)
+      : Model(config), handle_(nullptr), context_(nullptr),
+        initialize_(nullptr), finalize_(nullptr), error_string_(nullptr),
+        execute_(nullptr), mu_()
+  {
+  }
+  virtual ~CustomModel();
+
+  // Load the backend library at path and initialize an instance.
+  std::string Init(const std::string& path);
+
+  virtual std::string Execute(Request& request, std::vector<Output>* outputs);
+
+ private:
+  static bool GetNextInput(
+      void* input_context, const char* name, const void** content,
+      uint64_t* content_byte_size);
+  static bool GetOutput(
+      void* output_context, const char* name, size_t shape_dim_cnt,
+      int64_t* shape_dims, uint64_t content_byte_size, void** content);
+
+  std::string ErrorString(int err) const;
+
+  void* handle_;
+  void* context_;
+  CustomInitializeFn_t initialize_;
+  CustomFinalizeFn_t finalize_;
+  CustomErrorStringFn_t error_string_;
+  CustomExecuteFn_t execute_;
+
+  // trtserver runs each instance on its own thread, one request at a time.
+  std::mutex mu_;
+};
+
+CustomModel::~CustomModel()
+{
+  if (context_ != nullptr) {
+    finalize_(context_);
+  }
+  if (handle_ != nullptr) {
+    dlclose(handle_);
+  }
+}
+
+std::string
+CustomModel::Init(const std::string& path)
+{
+  handle_ = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (handle_ == nullptr) {
+    return "unable to load " + path + ": " + dlerror();
+  }
+  initialize_ = reinterpret_cast<CustomInitializeFn_t>(
+      dlsym(handle_, "CustomInitialize"));
+  finalize_ =
+      reinterpret_cast<CustomFinalizeFn_t>(dlsym(handle_, "CustomFinalize"));
+  error_string_ = reinterpret_cast<CustomErrorStringFn_t>(
+      dlsym(handle_, "CustomErrorString"));
+  execute_ =
+      reinterpret_cast<CustomExecuteFn_t>(dlsym(handle_, "CustomExecute"));
+  if ((initialize_ == nullptr) || (finalize_ == nullptr) ||
+      (error_string_ == nullptr) || (execute_ == nullptr)) {
+    return path + " is not a custom backend";
+  }
+
+  std::string serialized;
+  config_.SerializeToString(&serialized);
+  const std::string instance_name = config_.name() + "_0";
+
+  CustomInitializeData data;
+  memset(&data, 0, sizeof(data));
+  data.instance_name = instance_name.c_str();
+  data.serialized_model_config = serialized.data();
+  data.serialized_model_config_size = serialized.size();
+  data.gpu_device_id = CUSTOM_NO_GPU_DEVICE;
+
+  void* context = nullptr;
+  int err = initialize_(&data, &context);
+  if (err != 0) {
+    std::string msg = "unable to initialize " + config_.name();
+    if (context != nullptr) {
+      msg += ": " + std::string(error_string_(context, err));
+      finalize_(context);
+    }
+    return msg;
+  }
+  context_ = context;
+  return std::string();
+}
+
+std::string
+CustomModel::ErrorString(int err) const
+{
+  const char* msg = error_string_(context_, err);
+  return (msg != nullptr) ? std::string(msg) : "unknown error";
+}
+
+bool
+CustomModel::GetNextInput(
+    void* input_context, const char* name, const void** content,
+    uint64_t* content_byte_size)
+{
+  std::vector<Tensor>* inputs = static_cast<std::vector<Tensor>*>(input_context);
+  for (Tensor& input : *inputs) {
+    if (input.name != name) {
+      continue;
+    }
+    // The whole input is one chunk, handed out in as many pieces as asked.
+    const size_t n = std::min<size_t>(
+        *content_byte_size, input.size - input.offset);
+    if (n == 0) {
+      *content = nullptr;
+      *content_byte_size = 0;
+    } else {
+      *content = input.data + input.offset;
+      *content_byte_size = n;
+      input.offset += n;
+    }
+    return true;
+  }
+  return false;
+}
+
+bool
+CustomModel::GetOutput(
+    void* output_context, const char* name, size_t shape_dim_cnt,
+    int64_t* shape_dims, uint64_t content_byte_size, void** content)
+{
+  std::vector<Output>* outputs = static_cast<std::vector<Output>*>(output_context);
+  for (Output& output : *outputs) {
+    if (output.name != name) {
+      continue;
+    }
+    output.dims.assign(shape_dims, shape_dims + shape_dim_cnt);
+    output.data.resize(content_byte_size);
+    *content = &output.data[0];
+    return true;
+  }
+  // Not requested, the backend skips it.
+  *content = nullptr;
+  return true;
+}
+
+std::string
+CustomModel::Execute(Request& request, std::vector<Output>* outputs)
+{
+  // The sequence batcher's control inputs, READY is always true.
+  std::vector<std::pair<std::string, int32_t>> controls;
+  for (const auto& control_input :
+       config_.sequence_batching().control_input()) {
+    for (const auto& control : control_input.control()) {
+      bool value = true;
+      if (control.kind() ==
+          ni::ModelSequenceBatching::Control::CONTROL_SEQUENCE_START) {
+        value = (request.flags & ni::InferRequestHeader::FLAG_SEQUENCE_START);
+      }
+      controls.emplace_back(
+          control_input.name(), control.int32_false_true(value ? 1 : 0));
+    }
+  }
+  for (const auto& control : controls) {
+    Tensor tensor;
+    tensor.name = control.first;
+    tensor.dims.assign(1, 1);
+    tensor.data = reinterpret_cast<const uint8_t*>(&control.second);
+    tensor.size = sizeof(int32_t);
+    tensor.offset = 0;
+    request.inputs.push_back(tensor);
+  }
+
+  std::vector<const char*> input_names;
+  std::vector<size_t> input_dim_cnts;
+  std::vector<const int64_t*> input_dims;
+  for (const Tensor& input : request.inputs) {
+    input_names.push_back(input.name.c_str());
+    input_dim_cnts.push_back(input.dims.size());
+    input_dims.push_back(input.dims.data());
+  }
+  std::vector<const char*> output_names;
+  outputs->resize(request.outputs.size());
+  for (size_t o = 0; o < request.outputs.size(); ++o) {
+    (*outputs)[o].name = request.outputs[o];
+    output_names.push_back(request.outputs[o].c_str());
+  }
+
+  CustomPayload payload;
+  memset(&payload, 0, sizeof(payload));
+  payload.batch_size = request.batch_size;
+  payload.input_cnt = input_names.size();
+  payload.input_names = input_names.data();
+  payload.input_shape_dim_cnts = input_dim_cnts.data();
+  payload.input_shape_dims = input_dims.data();
+  payload.output_cnt = output_names.size();
+  payload.required_output_names = output_names.data();
+  payload.input_context = &request.inputs;
+  payload.output_context = outputs;
+  payload.error_code = 0;
+
+  int err;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    err = execute_(context_, 1, &payload, GetNextInput, GetOutput);
+  }
+  if (err != 0) {
+    return ErrorString(err);
+  }
+  if (payload.error_code != 0) {
+    return ErrorString(payload.error_code);
+  }
+  return std::string();
+}
+
+// The simple_sequence stand-in: OUTPUT is the running sum of the INPUT
+// values of the sequence, reset by START and forgotten after END.
+class SequenceModel : public Model {
+ public:
+  explicit SequenceModel(const ni::ModelConfig& config)
+      : Model(config), mu_(), sums_()
+  {
+  }
+
+  virtual std::string Execute(Request& request, std::vector<Output>* outputs);
+
+ private:
+  std::mutex mu_;
+  std::unordered_map<uint64_t, int32_t> sums_;
+};
+
+std::string
+SequenceModel::Execute(Request& request, std::vector<Output>* outputs)
+{
+  if ((request.inputs.size() != 1) ||
+      (request.inputs[0].size != sizeof(int32_t))) {
+    return "expected one INT32 input of shape [1]";
+  }
+  int32_t value;
+  memcpy(&value, request.inputs[0].data, sizeof(value));
+
+  int32_t sum;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = sums_.find(request.correlation_id);
+    if (request.flags & ni::InferRequestHeader::FLAG_SEQUENCE_START) {
+      it = sums_.emplace(request.correlation_id, 0).first;
+      it->second = 0;
+    } else if (it == sums_.end()) {
+      return "inference request for sequence " +
+             std::to_string(request.correlation_id) + " to model '" +
+             config_.name() + "' must specify the START flag on the first "
+             "request of the sequence";
+    }
+    it->second += value;
+    sum = it->second;
+    if (request.flags & ni::InferRequestHeader::FLAG_SEQUENCE_END) {
+      sums_.erase(it);
+    }
+  }
+
+  outputs->resize(request.outputs.size());
+  for (size_t o = 0; o < request.outputs.size(); ++o) {
+    Output& output = (*outputs)[o];
+    output.name = request.outputs[o];
+    output.dims.assign(1, 1);
+    output.dims.push_back(1);
+    output.data.assign(reinterpret_cast<const char*>(&sum), sizeof(sum));
+  }
+  return std::string();
+}
+
+class TestServer final : public ni::GRPCService::Service {
+ public:
+  explicit TestServer(const Options& opts)
+      : opts_(opts), models_(), start_ns_(dic::MonotonicNanos())
+  {
+  }
+
+  // Load the models of the repository. Returns the error message, empty on
+  // success.
+  std::string LoadRepository();
+
+  grpc::Status Status(
+      grpc::ServerContext* context, const ni::StatusRequest* request,
+      ni::StatusResponse* response) override;
+
+  grpc::Status Health(
+      grpc::ServerContext* context, const ni::HealthRequest* request,
+      ni::HealthResponse* response) override;
+
+  grpc::Status Infer(
+      grpc::ServerContext* context, const ni::InferRequest* request,
+      ni::InferResponse* response) override;
+
+  grpc::Status StreamInfer(
+      grpc::ServerContext* context,
+      grpc::ServerReaderWriter<ni::InferResponse, ni::InferRequest>* stream)
+      override;
+
+ private:
+  std::string LoadModel(const std::string& dir);
+
+  // Validate and run the request, the outcome is in the response status.
+  void Handle(const ni::InferRequest& request, ni::InferResponse* response);
+
+  // Check the request against the model config and collect its inputs.
+  std::string Validate(
+      const Model& model, const ni::InferRequest& request, Request* run);
+
+  const Options& opts_;
+  std::map<std::string, std::unique_ptr<Model>> models_;
+  const uint64_t start_ns_;
+};
+
+std::string
+TestServer::LoadRepository()
+{
+  DIR* repository = opendir(opts_.repository.c_str());
+  if (repository == nullptr) {
+    return "unable to open the model repository " + opts_.repository;
+  }
+  std::vector<std::string> dirs;
+  while (struct dirent* entry = readdir(repository)) {
+    if (entry->d_name[0] != '.') {
+      dirs.push_back(entry->d_name);
+    }
+  }
+  closedir(repository);
+  std::sort(dirs.begin(), dirs.end());
+
+  for (const std::string& dir : dirs) {
+    std::string err = LoadModel(opts_.repository + "/" + dir);
+    if (!err.empty()) {
+      return err;
+    }
+  }
+  if (models_.empty()) {
+    return "no models found in " + opts_.repository;
+  }
+  return std::string();
+}
+
+std::string
+TestServer::LoadModel(const std::string& dir)
+{
+  std::ifstream in((dir + "/config.pbtxt").c_str());
+  if (!in) {
+    // Not a model directory.
+    return std::string();
+  }
+  std::stringstream text;
+  text << in.rdbuf();
+  ni::ModelConfig config;
+  if (!google::protobuf::TextFormat::ParseFromString(text.str(), &config)) {
+    return "unable to parse " + dir + "/config.pbtxt";
+  }
+  if (config.name().empty()) {
+    config.set_name(dir.substr(dir.find_last_of('/') + 1));
+  }
+
+  std::unique_ptr<Model> model;
+  if (config.name() == opts_.sequence_model) {
+    model.reset(new SequenceModel(config));
+  } else if (config.platform() == "custom") {
+    std::string filename = config.default_model_filename();
+    if (filename.empty()) {
+      filename = "libcustom.so";
+    }
+    CustomModel* custom = new CustomModel(config);
+    model.reset(custom);
+    std::string err = custom->Init(dir + "/1/" + filename);
+    if (!err.empty()) {
+      return err;
+    }
+  } else {
+    std::cerr << "skipping " << config.name() << ", platform "
+              << config.platform() << " is not supported" << std::endl;
+    return std::string();
+  }
+
+  for (const auto& control_input :
+       config.sequence_batching().control_input()) {
+    for (const auto& control : control_input.control()) {
+      if (control.int32_false_true_size() != 2) {
+        return config.name() + ": only int32_false_true controls are "
+               "supported";
+      }
+    }
+  }
+
+  std::cout << "loaded " << config.name() << std::endl;
+  models_[config.name()] = std::move(model);
+  return std::string();
+}
+
+grpc::Status
+TestServer::Status(
+    grpc::ServerContext* context, const ni::StatusRequest* request,
+    ni::StatusResponse* response)
+{
+  ni::ServerStatus* status = response->mutable_server_status();
+  status->set_id("inference:0");
+  status->set_version("cidmgr_test_server");
+  status->set_ready_state(ni::SERVER_READY);
+  status->set_uptime_ns(dic::MonotonicNanos() - start_ns_);
+  for (const auto& entry : models_) {
+    if (!request->model_name().empty() &&
+        (request->model_name() != entry.first)) {
+      continue;
+    }
+    ni::ModelStatus& model_status =
+        (*status->mutable_model_status())[entry.first];
+    *model_status.mutable_config() = entry.second->Config();
+    (*model_status.mutable_version_status())[1].set_ready_state(
+        ni::MODEL_READY);
+  }
+  if (!request->model_name().empty() && status->model_status().empty()) {
+    SetStatus(
+        response->mutable_request_status(), ni::RequestStatusCode::NOT_FOUND,
+        "no status available for unknown model '" + request->model_name() +
+            "'");
+  } else {
+    SetStatus(response->mutable_request_status(), ni::RequestStatusCode::SUCCESS);
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status
+TestServer::Health(
+    grpc::ServerContext* context, const ni::HealthRequest* request,
+    ni::HealthResponse* response)
+{
+  response->set_health(true);
+  SetStatus(response->mutable_request_status(), ni::RequestStatusCode::SUCCESS);
+  return grpc::Status::OK;
+}
+
+grpc::Status
+TestServer::Infer(
+    grpc::ServerContext* context, const ni::InferRequest* request,
+    ni::InferResponse* response)
+{
+  Handle(*request, response);
+  return grpc::Status::OK;
+}
+
+grpc::Status
+TestServer::StreamInfer(
+    grpc::ServerContext* context,
+    grpc::ServerReaderWriter<ni::InferResponse, ni::InferRequest>* stream)
+{
+  // Responses go back in request order, which the streaming clients match
+  // on by the echoed request id anyway.
+  ni::InferRequest request;
+  ni::InferResponse response;
+  while (stream->Read(&request)) {
+    response.Clear();
+    Handle(request, &response);
+    if (!stream->Write(response)) {
+      break;
+    }
+  }
+  return grpc::Status::OK;
+}
+
+std::string
+TestServer::Validate(
+    const Model& model, const ni::InferRequest& request, Request* run)
+{
+  const ni::ModelConfig& config = model.Config();
+  const ni::InferRequestHeader& header = request.meta_data();
+
+  if ((request.model_version() != -1) && (request.model_version() != 1)) {
+    return "unknown version " + std::to_string(request.model_version()) +
+           " for model '" + config.name() + "'";
+  }
+  run->batch_size = std::max<uint32_t>(header.batch_size(), 1);
+  const uint32_t max_batch_size =
+      static_cast<uint32_t>(std::max(config.max_batch_size(), 1));
+  if (run->batch_size > max_batch_size) {
+    return "inference request batch-size must be <= " +
+           std::to_string(max_batch_size) + " for '" + config.name() + "'";
+  }
+  run->flags = header.flags();
+  run->correlation_id = header.correlation_id();
+  if (config.has_sequence_batching()) {
+    if (run->correlation_id == 0) {
+      return "inference request to model '" + config.name() +
+             "' must specify a non-zero correlation ID";
+    }
+    if (run->batch_size != 1) {
+      return "sequence model '" + config.name() +
+             "' only takes batch-size 1 requests here";
+    }
+  }
+
+  if (header.input_size() != request.raw_input_size()) {
+    return "expected " + std::to_string(header.input_size()) +
+           " raw inputs, got " + std::to_string(request.raw_input_size());
+  }
+  if (header.input_size() != config.input_size()) {
+    return "expected " + std::to_string(config.input_size()) +
+           " inputs for model '" + config.name() + "', got " +
+           std::to_string(header.input_size());
+  }
+  run->inputs.clear();
+  for (int i = 0; i < header.input_size(); ++i) {
+    const ni::InferRequestHeader::Input& input = header.input(i);
+    const ni::ModelInput* model_input = nullptr;
+    for (const ni::ModelInput& candidate : config.input()) {
+      if (candidate.name() == input.name()) {
+        model_input = &candidate;
+      }
+    }
+    if (model_input == nullptr) {
+      return "unexpected inference input '" + input.name() +
+             "' for model '" + config.name() + "'";
+    }
+
+    // Variable size dims come from the request.
+    Tensor tensor;
+    tensor.name = input.name();
+    if (input.dims_size() > 0) {
+      tensor.dims.assign(input.dims().begin(), input.dims().end());
+    } else {
+      tensor.dims.assign(model_input->dims().begin(), model_input->dims().end());
+    }
+    size_t elements = 1;
+    for (int64_t dim : tensor.dims) {
+      if (dim < 0) {
+        return "input '" + input.name() + "' has variable size dims, the "
+               "request must give its shape";
+      }
+      elements *= static_cast<size_t>(dim);
+    }
+    const std::string& raw = request.raw_input(i);
+    const size_t expected =
+        run->batch_size * elements * DataTypeByteSize(model_input->data_type());
+    if (raw.size() != expected) {
+      return "unexpected size " + std::to_string(raw.size()) +
+             " for input '" + input.name() + "', expecting " +
+             std::to_string(expected);
+    }
+    tensor.data = reinterpret_cast<const uint8_t*>(raw.data());
+    tensor.size = raw.size();
+    tensor.offset = 0;
+    run->inputs.push_back(tensor);
+  }
+
+  run->outputs.clear();
+  for (const ni::InferRequestHeader::Output& output : header.output()) {
+    bool found = false;
+    for (const ni::ModelOutput& model_output : config.output()) {
+      found = found || (model_output.name() == output.name());
+    }
+    if (!found) {
+      return "unexpected inference output '" + output.name() +
+             "' for model '" + config.name() + "'";
+    }
+    if (output.has_cls()) {
+      return "classification results are not supported here";
+    }
+    run->outputs.push_back(output.name());
+  }
+  return std::string();
+}
+
+void
+TestServer::Handle(const ni::InferRequest& request, ni::InferResponse* response)
+{
+  const ni::InferRequestHeader& header = request.meta_data();
+  ni::InferResponseHeader* response_header = response->mutable_meta_data();
+  response_header->set_id(header.id());
+  response_header->set_model_name(request.model_name());
+  response_header->set_model_version(1);
+  response_header->set_batch_size(header.batch_size());
+
+  auto it = models_.find(request.model_name());
+  if (it == models_.end()) {
+    SetStatus(
+        response->mutable_request_status(), ni::RequestStatusCode::NOT_FOUND,
+        "no model '" + request.model_name() + "'");
+    return;
+  }
+  Model& model = *it->second;
+
+  Request run;
+  std::string err = Validate(model, request, &run);
+  if (!err.empty()) {
+    SetStatus(
+        response->mutable_request_status(),
+        ni::RequestStatusCode::INVALID_ARG, err);
+    return;
+  }
+
+  if (opts_.latency_us > 0) {
+    std::this_thread::sleep_for(std::chrono::microseconds(opts_.latency_us));
+  }
+
+  std::vector<Output> outputs;
+  err = model.Execute(run, &outputs);
+  if (!err.empty()) {
+    SetStatus(
+        response->mutable_request_status(), ni::RequestStatusCode::INTERNAL,
+        err);
+    return;
+  }
+
+  // Raw outputs in the requested order, their dims without the batch
+  // dimension.
+  for (const Output& output : outputs) {
+    if (output.dims.empty()) {
+      SetStatus(
+          response->mutable_request_status(), ni::RequestStatusCode::INTERNAL,
+          "model '" + request.model_name() + "' did not produce output '" +
+              output.name + "'");
+      response_header->clear_output();
+      response->clear_raw_output();
+      return;
+    }
+    ni::InferResponseHeader::Output* header_output =
+        response_header->add_output();
+    header_output->set_name(output.name);
+    ni::InferResponseHeader::Output::Raw* raw = header_output->mutable_raw();
+    for (size_t d = 1; d < output.dims.size(); ++d) {
+      raw->add_dims(output.dims[d]);
+    }
+    raw->set_batch_byte_size(output.data.size());
+    response->add_raw_output(output.data);
+  }
+
+  if (opts_.verbose) {
+    std::cout << request.model_name() << " correlation_id "
+              << header.correlation_id() << " flags " << header.flags()
+              << std::endl;
+  }
+  SetStatus(response->mutable_request_status(), ni::RequestStatusCode::SUCCESS);
+}
+
+}  // namespace
+
+int
+main(int argc, char** argv)
+{
+  Options opts;
+
+  // Parse commandline...
+  static const struct option long_options[] = {
+      {"model-repository", required_argument, nullptr, 'r'},
+      {"grpc-port", required_argument, nullptr, 'p'},
+      {"http-port", required_argument, nullptr, 'H'},
+      {"metrics-port", required_argument, nullptr, 'M'},
+      {nullptr, 0, nullptr, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "vr:p:l:s:", long_options, nullptr)) !=
+         -1) {
+    switch (opt) {
+      case 'v':
+        opts.verbose = true;
+        break;
+      case 'r':
+        opts.repository = optarg;
+        break;
+      case 'p':
+        opts.port = std::stoul(optarg);
+        break;
+      case 'l':
+        opts.latency_us = std::stoul(optarg);
+        break;
+      case 's':
+        opts.sequence_model = optarg;
+        break;
+      case 'H':
+      case 'M':
+        // No HTTP or metrics endpoints.
+        break;
+      case '?':
+        Usage(argv);
+        break;
+    }
+  }
+
+  if (opts.repository.empty()) {
+    Usage(argv, "the model repository is required");
+  }
+
+  // Block the shutdown signals in every thread, the waiter below takes
+  // them.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  TestServer service(opts);
+  std::string err = service.LoadRepository();
+  if (!err.empty()) {
+    std::cerr << "error: " << err << std::endl;
+    return 1;
+  }
+
+  const std::string address = "0.0.0.0:" + std::to_string(opts.port);
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort(address, grpc::InsecureServerCredentials());
+  builder.SetMaxMessageSize(std::numeric_limits<int32_t>::max());
+  builder.RegisterService(&service);
+  std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
+  if (!server) {
+    std::cerr << "error: unable to listen on " << address << std::endl;
+    return 1;
+  }
+  std::cout << "cidmgr_test_server listening on " << address << std::endl;
+
+  std::thread waiter([&server, &signals]() {
+    int signum;
+    sigwait(&signals, &signum);
+    server->Shutdown();
+  });
+  server->Wait();
+  waiter.join();
+  return 0;
+}
@@ -0,0 +1,765 @@
+// Copyright (c) 2019 Doug Napoleone, All rights reserved.
+
+// Per-host aggregator between short lived local processes and cidmgr.
+//
+// Local processes connect over a Unix socket (see common/sidecar.h, and
+// CIDMgr::CreateSidecar() or CIDMgrContext(sidecar=...)) instead of each
+// opening a gRPC channel to the server. The sidecar runs a single threaded
+// poll loop over its connections; every request that is ready when it
+// wakes up goes into the same batch:
+//
+//   * NEW is served from a local reserve of id's per namespace, or per
+//     prefix with a sparse id space. The batch's NEWs and the reserve top
+//     up are one NewCorrelationIDs() call per namespace, and the reserve is
+//     refilled between batches once it drops below half its size.
+//   * DELETE is answered right away and the batch's deletes are released
+//     on the server in one bulk request at the end of the batch.
+//   * The stats are forwarded. The server counts the reserve as active.
+//   * VALIDATE answers for the connection's own id's. RECONCILE has the
+//     sidecar reconcile everything it holds once, and answers which of the
+//     connection's id's it still holds.
+//
+// Every id handed out is owned by the connection that created it. Only the
+// owner may delete it, and when a process exits or closes the connection
+// all the id's it still owns are released, so crashed workers do not leak
+// id's on the server.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "cidmgr_client.h"
+#include "cidmgr_codes.h"
+#include "common/histogram.h"
+#include "common/sidecar.h"
+#include "common/unix_listener.h"
+
+namespace dic = dnapoleone::inferenceserver::correlation_id_mgr;
+namespace dicc = dnapoleone::inferenceserver::correlation_id_mgr::client;
+
+namespace {
+
+// Time between attempts to flush deletes the server refused.
+#define SIDECAR_RETRY_MS 100
+
+// Is the NEW argument a namespace key, or a prefix for a sparse id space.
+bool
+ValidNewArg(uint64_t arg)
+{
+  if (arg & CIDMGR_PREFIX_BIT) {
+    return dic::ValidPrefix(dic::PrefixOf(arg), dic::PrefixBitsOf(arg));
+  }
+  return arg <= 0xffffffffull;
+}
+
+struct Options {
+  Options()
+      : verbose(false), urls(), model_name("cidmgr"), shm_name(),
+        socket_path(CIDMGR_SIDECAR_DEFAULT_SOCKET), reserve(256),
+        metrics_path()
+  {
+  }
+
+  bool verbose;
+  std::vector<std::string> urls;
+  std::string model_name;
+  std::string shm_name;
+  std::string socket_path;
+  size_t reserve;
+  std::string metrics_path;
+};
+
+void
+Usage(char** argv, const std::string& msg = std::string())
+{
+  if (!msg.empty()) {
+    std::cerr << "error: " << msg << std::endl;
+  }
+
+  std::cerr << "Usage: " << argv[0] << " [options]" << std::endl;
+  std::cerr << "\t-v" << std::endl;
+  std::cerr << "\t-u <cidmgr server URL, repeat for multiple nodes "
+            << "(default localhost:8001)>" << std::endl;
+  std::cerr << "\t-m <cidmgr model name (default cidmgr)>" << std::endl;
+  std::cerr << "\t-S <shared memory registry name>" << std::endl;
+  std::cerr << "\t-s <unix socket path (default "
+            << CIDMGR_SIDECAR_DEFAULT_SOCKET << ")>" << std::endl;
+  std::cerr << "\t-r <id's kept in reserve per namespace (default 256)>"
+            << std::endl;
+  std::cerr << "\t-d <file the sidecar's client metrics are written to "
+            << "every second>" << std::endl;
+
+  exit(1);
+}
+
+// A local process connected to the sidecar.
+struct Connection {
+  Connection() : fd(-1), pid(0), in(), out(), ids() {}
+
+  int fd;
+  pid_t pid;
+  // Received bytes not yet parsed, and response bytes not yet sent.
+  std::vector<uint8_t> in;
+  std::vector<uint8_t> out;
+  // The id's this connection owns.
+  std::unordered_set<uint64_t> ids;
+};
+
+// A request read in this batch.
+struct Request {
+  Connection* conn;
+  std::vector<uint64_t> words;
+};
+
+class Sidecar {
+ public:
+  Sidecar(const Options& opts, std::unique_ptr<dicc::CIDMgr> cidmgr)
+      : opts_(opts), cidmgr_(std::move(cidmgr)), listen_fd_(-1),
+        connections_(), reserves_(), releases_(), reconciled_(false),
+        reconcile_held_()
+  {
+  }
+  ~Sidecar();
+
+  // Listen on the socket path, replacing any stale socket. False on error.
+  bool Listen();
+
+  // Serve until a signal arrives on signal_fd.
+  void Run(int signal_fd);
+
+ private:
+  void Accept();
+
+  // Read what is available on the connection, false once it is closed.
+  bool Read(Connection* conn, std::vector<Request>* batch);
+
+  // Send what the connection's socket takes, false on error.
+  bool Write(Connection* conn);
+
+  // Release the connection's id's and forget it.
+  void Close(Connection* conn);
+
+  // Serve a batch of requests, in order.
+  void Serve(std::vector<Request>& batch);
+  void ServeOne(Request& request, uint64_t batch_start);
+
+  // Make sure the reserve for the NEW argument, a namespace key or a
+  // PrefixArg(), holds count id's on top of the reserve size. false if the
+  // server failed, leaving the error in *err.
+  bool Fill(uint64_t arg, size_t count, nic::Error* err);
+
+  // Top up the reserves that dropped below half.
+  void Refill();
+
+  // Release the batched deletes on the server.
+  void FlushReleases();
+
+  // Respond on the connection.
+  void Respond(Connection* conn, const std::vector<uint64_t>& words);
+  void RespondError(
+    Connection* conn, uint32_t status, const std::string& message);
+
+  // Bits for a VALIDATE or RECONCILE request from the connection.
+  bool Bulk(
+    Connection* conn, bool reconcile, const uint64_t* ids, size_t count,
+    std::vector<uint64_t>* bits, nic::Error* err);
+
+  const Options opts_;
+  std::unique_ptr<dicc::CIDMgr> cidmgr_;
+  int listen_fd_;
+  std::unordered_map<int, std::unique_ptr<Connection>> connections_;
+
+  // Unused id's per NEW argument, held by the sidecar's CIDMgr.
+  std::unordered_map<uint64_t, std::vector<uint64_t>> reserves_;
+
+  // Deleted id's not yet released on the server.
+  std::vector<ni::CorrelationID> releases_;
+
+  // Whether the sidecar already reconciled in this batch, and what it
+  // held afterwards.
+  bool reconciled_;
+  dicc::CorrelationIDSet reconcile_held_;
+};
+
+Sidecar::~Sidecar()
+{
+  while (!connections_.empty()) {
+    Close(connections_.begin()->second.get());
+  }
+  for (auto& reserve : reserves_) {
+    releases_.insert(
+      releases_.end(), reserve.second.begin(), reserve.second.end());
+  }
+  reserves_.clear();
+  FlushReleases();
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    unlink(opts_.socket_path.c_str());
+  }
+}
+
+bool
+Sidecar::Listen()
+{
+  // Local processes of the same user or group.
+  listen_fd_ = dic::UnixListen(opts_.socket_path, 0660, SOCK_NONBLOCK);
+  return listen_fd_ >= 0;
+}
+
+void
+Sidecar::Run(int signal_fd)
+{
+  std::vector<struct pollfd> fds;
+  std::vector<Connection*> polled;
+  std::vector<Request> batch;
+  while (true) {
+    fds.clear();
+    polled.clear();
+    fds.push_back({signal_fd, POLLIN, 0});
+    fds.push_back({listen_fd_, POLLIN, 0});
+    for (auto& it : connections_) {
+      Connection* conn = it.second.get();
+      fds.push_back(
+        {conn->fd,
+         static_cast<short>(POLLIN | (conn->out.empty() ? 0 : POLLOUT)), 0});
+      polled.push_back(conn);
+    }
+    const int timeout = releases_.empty() ? -1 : SIDECAR_RETRY_MS;
+    if (poll(fds.data(), fds.size(), timeout) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "error: poll: " << strerror(errno) << std::endl;
+      return;
+    }
+    if (fds[0].revents & POLLIN) {
+      return;
+    }
+    if (fds[1].revents & POLLIN) {
+      Accept();
+    }
+
+    batch.clear();
+    for (size_t i = 0; i < polled.size(); ++i) {
+      Connection* conn = polled[i];
+      const short revents = fds[i + 2].revents;
+      bool open = true;
+      if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        open = Read(conn, &batch);
+      }
+      if (open && (revents & POLLOUT)) {
+        open = Write(conn);
+      }
+      if (!open) {
+        // Drop its requests from the batch, nobody is there to answer.
+        batch.erase(
+          std::remove_if(
+            batch.begin(), batch.end(),
+            [conn](const Request& request) { return request.conn == conn; }),
+          batch.end());
+        Close(conn);
+      }
+    }
+
+    if (!batch.empty()) {
+      Serve(batch);
+    }
+    FlushReleases();
+    // Answer before refilling, the refill is off the requests' path.
+    for (auto& it : connections_) {
+      if (!it.second->out.empty()) {
+        Write(it.second.get());
+      }
+    }
+    Refill();
+  }
+}
+
+void
+Sidecar::Accept()
+{
+  while (true) {
+    const int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    std::unique_ptr<Connection> conn(new Connection());
+    conn->fd = fd;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+      conn->pid = cred.pid;
+    }
+    if (opts_.verbose) {
+      std::cout << "connected pid " << conn->pid << std::endl;
+    }
+    connections_[fd] = std::move(conn);
+  }
+}
+
+bool
+Sidecar::Read(Connection* conn, std::vector<Request>* batch)
+{
+  uint8_t buffer[65536];
+  while (true) {
+    const ssize_t got = recv(conn->fd, buffer, sizeof(buffer), 0);
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        break;
+      }
+      return false;
+    }
+    if (got == 0) {
+      return false;
+    }
+    conn->in.insert(conn->in.end(), buffer, buffer + got);
+  }
+
+  // Split off the complete frames.
+  size_t offset = 0;
+  while ((conn->in.size() - offset) >= sizeof(uint32_t)) {
+    uint32_t words;
+    memcpy(&words, conn->in.data() + offset, sizeof(words));
+    if ((words < CIDMGR_PACKED_HEADER_WORDS) ||
+        (words > CIDMGR_SIDECAR_MAX_WORDS)) {
+      // Not speaking the protocol, the stream can not be resynced.
+      return false;
+    }
+    const size_t bytes = words * sizeof(uint64_t);
+    if ((conn->in.size() - offset - sizeof(words)) < bytes) {
+      break;
+    }
+    batch->push_back(Request());
+    Request& request = batch->back();
+    request.conn = conn;
+    request.words.resize(words);
+    memcpy(
+      request.words.data(), conn->in.data() + offset + sizeof(words), bytes);
+    offset += sizeof(words) + bytes;
+  }
+  conn->in.erase(conn->in.begin(), conn->in.begin() + offset);
+  return true;
+}
+
+bool
+Sidecar::Write(Connection* conn)
+{
+  size_t offset = 0;
+  while (offset < conn->out.size()) {
+    const ssize_t sent = send(
+      conn->fd, conn->out.data() + offset, conn->out.size() - offset,
+      MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        break;
+      }
+      return false;
+    }
+    offset += sent;
+  }
+  conn->out.erase(conn->out.begin(), conn->out.begin() + offset);
+  return true;
+}
+
+void
+Sidecar::Close(Connection* conn)
+{
+  if (opts_.verbose) {
+    std::cout << "disconnected pid " << conn->pid << ", releasing "
+              << conn->ids.size() << " id's" << std::endl;
+  }
+  releases_.insert(releases_.end(), conn->ids.begin(), conn->ids.end());
+  close(conn->fd);
+  connections_.erase(conn->fd);
+}
+
+void
+Sidecar::Serve(std::vector<Request>& batch)
+{
+  const uint64_t batch_start = dic::MonotonicNanos();
+
+  // One server call per namespace for all the batch's NEWs.
+  std::unordered_map<uint64_t, size_t> news;
+  for (const Request& request : batch) {
+    const uint64_t* words = request.words.data();
+    if ((dic::PackedCode(words[0]) == dicc::CIDMGR_NEW) &&
+        ValidNewArg(words[2])) {
+      news[words[2]] += std::min<uint64_t>(
+        std::max<uint64_t>(words[1], 1), CIDMGR_PACKED_MAX_NEW);
+    }
+  }
+  for (const auto& it : news) {
+    nic::Error err;
+    // A short reserve fails the NEWs it can not serve below.
+    Fill(it.first, it.second, &err);
+  }
+
+  reconciled_ = false;
+  for (Request& request : batch) {
+    ServeOne(request, batch_start);
+  }
+  reconcile_held_.clear();
+}
+
+void
+Sidecar::ServeOne(Request& request, uint64_t batch_start)
+{
+  Connection* conn = request.conn;
+  const uint64_t* words = request.words.data();
+  const int8_t code = dic::PackedCode(words[0]);
+  const bool timing =
+    (dic::PackedFlags(words[0]) & CIDMGR_PACKED_TIMING) != 0;
+  const uint64_t* ids = words + CIDMGR_PACKED_HEADER_WORDS;
+  const size_t id_count = request.words.size() - CIDMGR_PACKED_HEADER_WORDS;
+  const uint64_t op_start = dic::MonotonicNanos();
+
+  std::vector<uint64_t> response;
+  nic::Error err;
+  switch (code) {
+    case dicc::CIDMGR_NEW: {
+      const size_t count = std::max<uint64_t>(words[1], 1);
+      if (count > CIDMGR_PACKED_MAX_NEW) {
+        RespondError(
+          conn, CIDMGR_SIDECAR_INVALID_ARG, "too many id's for one NEW");
+        return;
+      }
+      if (!ValidNewArg(words[2])) {
+        RespondError(
+          conn, CIDMGR_SIDECAR_INVALID_ARG,
+          "invalid namespace key or prefix for NEW");
+        return;
+      }
+      std::vector<uint64_t>& reserve = reserves_[words[2]];
+      if ((reserve.size() < count) && !Fill(words[2], count, &err)) {
+        RespondError(conn, CIDMGR_SIDECAR_UNAVAILABLE, err.Message());
+        return;
+      }
+      response.assign(reserve.end() - count, reserve.end());
+      reserve.resize(reserve.size() - count);
+      conn->ids.insert(response.begin(), response.end());
+      break;
+    }
+    case dicc::CIDMGR_DELETE: {
+      if (conn->ids.erase(words[2]) == 0) {
+        RespondError(
+          conn, CIDMGR_SIDECAR_INVALID_ARG,
+          "invalid CORRELATION_ID given for deletion");
+        return;
+      }
+      releases_.push_back(words[2]);
+      response.push_back(0);
+      break;
+    }
+    case dicc::CIDMGR_ACTIVE:
+    case dicc::CIDMGR_INACTIVE:
+    case dicc::CIDMGR_PEAK: {
+      uint64_t stats[3] = {0, 0, 0};
+      err = cidmgr_->Stats(
+        static_cast<uint32_t>(words[2]), &stats[0], &stats[1], &stats[2]);
+      if (!err.IsOk()) {
+        RespondError(conn, CIDMGR_SIDECAR_UNAVAILABLE, err.Message());
+        return;
+      }
+      response.push_back(stats[code - dicc::CIDMGR_ACTIVE]);
+      break;
+    }
+    case dicc::CIDMGR_VALIDATE:
+    case dicc::CIDMGR_RECONCILE: {
+      if ((id_count == 0) || (words[1] != id_count)) {
+        RespondError(
+          conn, CIDMGR_SIDECAR_INVALID_ARG,
+          "count does not match the number of id's");
+        return;
+      }
+      if (!Bulk(
+            conn, code == dicc::CIDMGR_RECONCILE, ids, id_count, &response,
+            &err)) {
+        RespondError(conn, CIDMGR_SIDECAR_UNAVAILABLE, err.Message());
+        return;
+      }
+      break;
+    }
+    case dicc::CIDMGR_NODE:
+    case dicc::CIDMGR_TRACE:
+    case dicc::CIDMGR_PROMOTE:
+      RespondError(
+        conn, CIDMGR_SIDECAR_UNSUPPORTED,
+        "not available through the cidmgr sidecar, ask the server");
+      return;
+    default:
+      RespondError(conn, CIDMGR_SIDECAR_INVALID_ARG, "unknown cidmgr code");
+      return;
+  }
+
+  if (timing) {
+    // The sidecar's batch stands in for the backend's Execute.
+    response.push_back(batch_start);
+    response.push_back(op_start);
+    response.push_back(dic::MonotonicNanos());
+  }
+  Respond(conn, response);
+}
+
+bool
+Sidecar::Bulk(
+  Connection* conn, bool reconcile, const uint64_t* ids, size_t count,
+  std::vector<uint64_t>* bits, nic::Error* err)
+{
+  bits->assign((count + 63) / 64, 0);
+
+  // Releases are deletes, the bit says if the connection held the id.
+  std::vector<ni::CorrelationID> held;
+  std::vector<size_t> positions;
+  for (size_t i = 0; i < count; ++i) {
+    if (ids[i] & CIDMGR_RELEASE_BIT) {
+      const uint64_t id = ids[i] & ~CIDMGR_RELEASE_BIT;
+      if (conn->ids.erase(id) != 0) {
+        releases_.push_back(id);
+        (*bits)[i / 64] |= 1ull << (i % 64);
+      }
+    } else if (conn->ids.count(ids[i]) != 0) {
+      held.push_back(ids[i]);
+      positions.push_back(i);
+    }
+  }
+  if (held.empty()) {
+    return true;
+  }
+
+  std::vector<bool> live(held.size(), false);
+  if (!reconcile) {
+    *err = cidmgr_->Validate(held, &live);
+    if (!err->IsOk()) {
+      return false;
+    }
+  } else {
+    // The sidecar owns the id's on the server, so it reconciles everything
+    // it holds, once per batch however many connections ask.
+    if (!reconciled_) {
+      *err = cidmgr_->Reconcile(true);
+      if (!err->IsOk()) {
+        return false;
+      }
+      cidmgr_->CorrelationIDs(&reconcile_held_);
+      reconciled_ = true;
+      // Forget the id's the server could not re-reserve.
+      for (auto& reserve : reserves_) {
+        std::vector<uint64_t>& unused = reserve.second;
+        unused.erase(
+          std::remove_if(
+            unused.begin(), unused.end(),
+            [this](uint64_t id) { return reconcile_held_.count(id) == 0; }),
+          unused.end());
+      }
+      for (auto& it : connections_) {
+        std::unordered_set<uint64_t>& owned = it.second->ids;
+        for (auto id = owned.begin(); id != owned.end();) {
+          id = (reconcile_held_.count(*id) == 0) ? owned.erase(id) : ++id;
+        }
+      }
+    }
+    for (size_t i = 0; i < held.size(); ++i) {
+      live[i] = (reconcile_held_.count(held[i]) != 0);
+    }
+  }
+  for (size_t i = 0; i < held.size(); ++i) {
+    if (live[i]) {
+      (*bits)[positions[i] / 64] |= 1ull << (positions[i] % 64);
+    }
+  }
+  return true;
+}
+
+bool
+Sidecar::Fill(uint64_t arg, size_t count, nic::Error* err)
+{
+  std::vector<uint64_t>& reserve = reserves_[arg];
+  const size_t target = count + opts_.reserve;
+  if (reserve.size() >= target) {
+    return true;
+  }
+  std::vector<ni::CorrelationID> ids;
+  if (arg & CIDMGR_PREFIX_BIT) {
+    *err = cidmgr_->NewCorrelationIDs(
+      target - reserve.size(), &ids, dic::PrefixOf(arg),
+      dic::PrefixBitsOf(arg));
+  } else {
+    *err = cidmgr_->NewCorrelationIDs(
+      target - reserve.size(), &ids, static_cast<uint32_t>(arg));
+  }
+  if (!err->IsOk()) {
+    if (opts_.verbose) {
+      std::cerr << "error: unable to fill the reserve for NEW argument "
+                << arg << ": " << err->Message() << std::endl;
+    }
+    return false;
+  }
+  reserve.insert(reserve.end(), ids.begin(), ids.end());
+  return true;
+}
+
+void
+Sidecar::Refill()
+{
+  for (auto& it : reserves_) {
+    if ((it.second.size() * 2) < opts_.reserve) {
+      nic::Error err;
+      Fill(it.first, 0, &err);
+    }
+  }
+}
+
+void
+Sidecar::FlushReleases()
+{
+  if (releases_.empty()) {
+    return;
+  }
+  std::vector<ni::CorrelationID> not_deleted;
+  nic::Error err = cidmgr_->DeleteCorrelationIDs(releases_, &not_deleted);
+  if (!err.IsOk()) {
+    // Still held by the sidecar's CIDMgr, retried on the next wake up.
+    if (opts_.verbose) {
+      std::cerr << "error: unable to release " << releases_.size()
+                << " id's: " << err.Message() << std::endl;
+    }
+    return;
+  }
+  // Only the ones the server did not release are still held, and retried.
+  if (opts_.verbose && !not_deleted.empty()) {
+    std::cerr << "error: server did not release " << not_deleted.size()
+              << " id's" << std::endl;
+  }
+  releases_.swap(not_deleted);
+}
+
+void
+Sidecar::Respond(Connection* conn, const std::vector<uint64_t>& words)
+{
+  dic::SidecarResponseHeader header;
+  header.status = CIDMGR_SIDECAR_OK;
+  header.bytes = static_cast<uint32_t>(words.size() * sizeof(uint64_t));
+  const uint8_t* h = reinterpret_cast<const uint8_t*>(&header);
+  const uint8_t* w = reinterpret_cast<const uint8_t*>(words.data());
+  conn->out.insert(conn->out.end(), h, h + sizeof(header));
+  conn->out.insert(conn->out.end(), w, w + header.bytes);
+}
+
+void
+Sidecar::RespondError(
+  Connection* conn, uint32_t status, const std::string& message)
+{
+  dic::SidecarResponseHeader header;
+  header.status = status;
+  header.bytes = static_cast<uint32_t>(message.size());
+  const uint8_t* h = reinterpret_cast<const uint8_t*>(&header);
+  conn->out.insert(conn->out.end(), h, h + sizeof(header));
+  conn->out.insert(conn->out.end(), message.begin(), message.end());
+}
+
+}  // namespace
+
+int
+main(int argc, char** argv)
+{
+  Options opts;
+
+  // Parse commandline...
+  int opt;
+  while ((opt = getopt(argc, argv, "vu:m:S:s:r:d:")) != -1) {
+    switch (opt) {
+      case 'v':
+        opts.verbose = true;
+        break;
+      case 'u':
+        opts.urls.push_back(optarg);
+        break;
+      case 'm':
+        opts.model_name = optarg;
+        break;
+      case 'S':
+        opts.shm_name = optarg;
+        break;
+      case 's':
+        opts.socket_path = optarg;
+        break;
+      case 'r':
+        opts.reserve = std::stoul(optarg);
+        break;
+      case 'd':
+        opts.metrics_path = optarg;
+        break;
+      case '?':
+        Usage(argv);
+        break;
+    }
+  }
+  if (opts.urls.empty()) {
+    opts.urls.push_back("localhost:8001");
+  }
+
+  // The shutdown signals are read from the poll loop.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigprocmask(SIG_BLOCK, &signals, nullptr);
+  const int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+  if (signal_fd < 0) {
+    std::cerr << "error: signalfd: " << strerror(errno) << std::endl;
+    return 1;
+  }
+
+  std::unique_ptr<dicc::CIDMgr> cidmgr;
+  nic::Error err = (opts.urls.size() == 1) ?
+    dicc::CIDMgr::Create(
+      &cidmgr, opts.urls[0], opts.model_name, -1, opts.verbose, false,
+      opts.shm_name) :
+    dicc::CIDMgr::CreateMultiNode(
+      &cidmgr, opts.urls, opts.model_name, -1, opts.verbose, false,
+      opts.shm_name);
+  if (!err.IsOk()) {
+    std::cerr << "error: unable to create the CIDMgr: " << err.Message()
+              << std::endl;
+    return 1;
+  }
+  if (!opts.metrics_path.empty()) {
+    cidmgr->DumpMetrics(opts.metrics_path, 1000);
+  }
+
+  Sidecar sidecar(opts, std::move(cidmgr));
+  if (!sidecar.Listen()) {
+    std::cerr << "error: unable to listen on " << opts.socket_path << ": "
+              << strerror(errno) << std::endl;
+    return 1;
+  }
+  std::cout << "cidmgr_sidecar listening on " << opts.socket_path
+            << std::endl;
+  sidecar.Run(signal_fd);
+  close(signal_fd);
+  return 0;
+}
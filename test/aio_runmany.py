@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+
+## run many concurrent cidmgr sequence setups from one asyncio event loop
+import argparse
+import asyncio
+import time
+
+from trtis_cidmgr import AsyncCIDMgrContext
+
+## asyncio replacement for runmany.py. Instead of forking a process per
+## client, every simulated client is a task on one event loop sharing a
+## single pipelined stream to the cidmgr model.
+
+
+def percentile(values, q):
+    if not values:
+        return 0.0
+    return values[min(len(values) - 1, int(q * len(values)))]
+
+
+async def client(cidmgr, sequences, hold, latencies):
+    for i in range(sequences):
+        start = time.monotonic()
+        correlation_id = await cidmgr.new()
+        latencies.append(time.monotonic() - start)
+        if hold:
+            await asyncio.sleep(hold)
+        await cidmgr.delete(correlation_id)
+
+
+async def runmany(url, model_name, clients, sequences, hold):
+    """Simulate many concurrent clients each setting up and tearing down
+    sequences. Every client gets a new correlation id, optionally holds it
+    for a while, and then deletes it. All of the clients share one
+    AsyncCIDMgrContext, so this measures how many concurrent sequence
+    setups a single event loop can sustain.
+    """
+    latencies = []
+    async with AsyncCIDMgrContext(url, model_name) as cidmgr:
+        start = time.monotonic()
+        await asyncio.gather(*[
+            client(cidmgr, sequences, hold, latencies)
+            for i in range(clients)])
+        elapsed = time.monotonic() - start
+        stats = await cidmgr.stats()
+
+    latencies.sort()
+    total = clients * sequences
+    print("clients: %d, sequences per client: %d, hold: %gs" % (
+        clients, sequences, hold))
+    print("sequence setups: %d in %.2fs (%.0f/s)" % (
+        total, elapsed, total / elapsed))
+    print("new latency (ms): p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f" % tuple(
+        1e3 * percentile(latencies, q) for q in (0.5, 0.9, 0.99, 0.999, 1.0)))
+    print("server: active %(active)d  inactive %(inactive)d  peak %(peak)d" % stats)
+
+
+parser = argparse.ArgumentParser(description=runmany.__doc__,
+    formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+parser.add_argument('-u', '--url', default='localhost:8001',
+    help="Inference server URL and its gRPC port.")
+parser.add_argument('-m', '--model', default='cidmgr',
+    help="cidmgr model name.")
+parser.add_argument('-c', '--clients', type=int, default=1000,
+    help="Number of concurrent clients (tasks).")
+parser.add_argument('-n', '--sequences', type=int, default=10,
+    help="Number of sequences each client sets up.")
+parser.add_argument('-t', '--hold', type=float, default=0.0,
+    help="Seconds each client holds its correlation id.")
+
+
+def main():
+    args = parser.parse_args()
+    loop = asyncio.get_event_loop()
+    loop.run_until_complete(runmany(
+        args.url, args.model, args.clients, args.sequences, args.hold))
+
+
+if __name__ == '__main__':
+    main()
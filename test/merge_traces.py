@@ -0,0 +1,47 @@
+#!/usr/bin/env python
+
+## merge cidmgr backend and client Chrome traces into one timeline
+import argparse
+import glob
+import json
+
+## The backend and the clients all stamp events with the host monotonic
+## clock, so traces from one host line up once their events are combined.
+## Open the result in chrome://tracing or https://ui.perfetto.dev
+
+
+def merge(paths):
+    """Merge Chrome trace-event JSON files written by the cidmgr backend
+    (CIDMGR_TRACE or SIGUSR2) and CIDMgr::WriteTrace() into one trace.
+    """
+    events = []
+    for path in paths:
+        with open(path) as trace:
+            events.extend(json.load(trace)['traceEvents'])
+    # Metadata first, then in time order.
+    events.sort(key=lambda event: (event['ph'] != 'M', event.get('ts', 0)))
+    return {'traceEvents': events, 'displayTimeUnit': 'ns'}
+
+
+parser = argparse.ArgumentParser(description=merge.__doc__,
+    formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+parser.add_argument('-o', '--output', default='cidmgr_trace.json',
+    help="Merged trace file.")
+parser.add_argument('traces', nargs='+',
+    help="Trace files or glob patterns, e.g. '/tmp/cidmgr_trace.*.json'.")
+
+
+def main():
+    args = parser.parse_args()
+    paths = []
+    for pattern in args.traces:
+        paths.extend(sorted(glob.glob(pattern)) or [pattern])
+    merged = merge(paths)
+    with open(args.output, 'w') as output:
+        json.dump(merged, output)
+    print("%d events from %d traces written to %s" % (
+        len(merged['traceEvents']), len(paths), args.output))
+
+
+if __name__ == '__main__':
+    main()
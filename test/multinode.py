@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+
+## start several local trtservers as partitioned cidmgr nodes and check
+## that the id's they issue never collide
+import argparse
+import os
+import shutil
+import subprocess
+import tempfile
+import time
+
+from trtis_cidmgr import CIDMgrContext
+from trtis_cidmgr.codes import CIDMGR_DELETE
+
+## Each node gets a copy of the model repository whose cidmgr config adds
+## the node_id_bits / node_id parameters, and its own set of ports.
+
+NODE_PARAMETERS = '''
+parameters {
+  key: "node_id_bits"
+  value: { string_value: "%d" }
+}
+parameters {
+  key: "node_id"
+  value: { string_value: "%d" }
+}
+'''
+
+
+def node_repository(repository, root, node_id, node_id_bits):
+    path = os.path.join(root, 'node%d' % node_id)
+    shutil.copytree(repository, path, symlinks=True)
+    with open(os.path.join(path, 'cidmgr', 'config.pbtxt'), 'a') as config:
+        config.write(NODE_PARAMETERS % (node_id_bits, node_id))
+    return path
+
+
+def start_nodes(trtserver, repository, nodes, node_id_bits, port):
+    root = tempfile.mkdtemp(prefix='cidmgr-nodes-')
+    servers, urls = [], []
+    for node_id in range(nodes):
+        base = port + 10 * node_id
+        servers.append(subprocess.Popen([
+            trtserver,
+            '--model-repository=' + node_repository(
+                repository, root, node_id, node_id_bits),
+            '--http-port=%d' % base,
+            '--grpc-port=%d' % (base + 1),
+            '--metrics-port=%d' % (base + 2)]))
+        urls.append('localhost:%d' % (base + 1))
+    return root, servers, urls
+
+
+def connect(url, timeout):
+    deadline = time.time() + timeout
+    while True:
+        try:
+            return CIDMgrContext(url)
+        except Exception:
+            if time.time() > deadline:
+                raise
+            time.sleep(0.5)
+
+
+def check(urls, count, node_id_bits, timeout):
+    """Allocate count id's from every node and check they are disjoint,
+    carry the owning node's id in the node id bits, and are rejected by the
+    other nodes on delete.
+    """
+    shift = 63 - node_id_bits
+    mask = (1 << node_id_bits) - 1
+    contexts = [connect(url, timeout) for url in urls]
+    seen = set()
+    for node_id, ctx in enumerate(contexts):
+        ids = ctx.new_many(count)
+        for correlation_id in ids:
+            owner = (correlation_id >> shift) & mask
+            assert owner == node_id, \
+                "id %d from node %d has node bits %d" % (
+                    correlation_id, node_id, owner)
+        assert seen.isdisjoint(ids), "node %d reissued an id" % node_id
+        seen.update(ids)
+        assert ctx.active() >= count
+    if len(contexts) > 1:
+        foreign = next(iter(contexts[0].correlation_ids()))
+        try:
+            contexts[1]._cidmgr_run(CIDMGR_DELETE, foreign)
+        except Exception:
+            pass
+        else:
+            raise AssertionError("node 1 deleted id %d of node 0" % foreign)
+    for ctx in contexts:
+        ctx.close()
+    print("%d nodes issued %d disjoint id's" % (len(urls), len(seen)))
+
+
+parser = argparse.ArgumentParser(description=check.__doc__,
+    formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+parser.add_argument('-t', '--trtserver', default='trtserver',
+    help="trtserver binary used to start the nodes.")
+parser.add_argument('-r', '--repository', default='../build/install/model_repository',
+    help="Model repository copied for every node.")
+parser.add_argument('-u', '--urls', default='',
+    help="Comma separated gRPC URLs of already running nodes, instead of starting them.")
+parser.add_argument('-n', '--nodes', type=int, default=3,
+    help="Number of nodes to start.")
+parser.add_argument('-b', '--node-id-bits', type=int, default=4,
+    help="node_id_bits the nodes are configured with.")
+parser.add_argument('-p', '--port', type=int, default=9000,
+    help="First port used by the started nodes.")
+parser.add_argument('-c', '--count', type=int, default=100,
+    help="Number of id's allocated from each node.")
+parser.add_argument('-w', '--wait', type=float, default=30.0,
+    help="Seconds to wait for the nodes to come up.")
+
+
+def main():
+    args = parser.parse_args()
+    root, servers = None, []
+    if args.urls:
+        urls = args.urls.split(',')
+    else:
+        root, servers, urls = start_nodes(
+            args.trtserver, args.repository, args.nodes, args.node_id_bits,
+            args.port)
+    try:
+        check(urls, args.count, args.node_id_bits, args.wait)
+    finally:
+        for server in servers:
+            server.terminate()
+            server.wait()
+        if root:
+            shutil.rmtree(root)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+
+## start a local primary and standby trtserver, fail the primary over to
+## the standby and check no id is issued twice
+import argparse
+import os
+import shutil
+import subprocess
+import tempfile
+import time
+
+from trtis_cidmgr import CIDMgrContext
+
+## The primary and standby get copies of the model repository whose cidmgr
+## config adds the replication parameters. The standby listens on its own
+## address too, for standbys of its own once promoted.
+
+REPLICATION_PARAMETERS = '''
+parameters {
+  key: "%s"
+  value: { string_value: "%s" }
+}
+parameters {
+  key: "replication_max_unacked"
+  value: { string_value: "%d" }
+}
+'''
+
+STANDBY_LISTEN = '''
+parameters {
+  key: "replication_listen"
+  value: { string_value: "%s" }
+}
+'''
+
+
+def server_repository(repository, root, name, parameters):
+    path = os.path.join(root, name)
+    shutil.copytree(repository, path, symlinks=True)
+    with open(os.path.join(path, 'cidmgr', 'config.pbtxt'), 'a') as config:
+        config.write(parameters)
+    return path
+
+
+def start_server(trtserver, repository, port):
+    server = subprocess.Popen([
+        trtserver,
+        '--model-repository=' + repository,
+        '--http-port=%d' % port,
+        '--grpc-port=%d' % (port + 1),
+        '--metrics-port=%d' % (port + 2)])
+    return server, 'localhost:%d' % (port + 1)
+
+
+def connect(url, timeout):
+    deadline = time.time() + timeout
+    while True:
+        try:
+            return CIDMgrContext(url)
+        except Exception:
+            if time.time() > deadline:
+                raise
+            time.sleep(0.5)
+
+
+def wait_for(condition, timeout, what):
+    deadline = time.time() + timeout
+    while not condition():
+        if time.time() > deadline:
+            raise AssertionError("timed out waiting for " + what)
+        time.sleep(0.1)
+
+
+def check(args, root):
+    """Allocate and delete id's on a primary, check a standby follows it,
+    rejects NEW until promoted, and once promoted never issues an id the
+    primary held.
+    """
+    primary_address = '127.0.0.1:%d' % (args.port + 5)
+    standby_address = '127.0.0.1:%d' % (args.port + 15)
+    servers = []
+    try:
+        server, primary_url = start_server(
+            args.trtserver,
+            server_repository(
+                args.repository, root, 'primary',
+                REPLICATION_PARAMETERS % (
+                    'replication_listen', primary_address, args.max_unacked)),
+            args.port)
+        servers.append(server)
+        primary = connect(primary_url, args.wait)
+
+        # Some state before the standby connects, to go in its snapshot.
+        held = set(primary.new_many(args.count))
+        for correlation_id in list(held)[:args.count // 4]:
+            primary.delete(correlation_id)
+            held.discard(correlation_id)
+
+        server, standby_url = start_server(
+            args.trtserver,
+            server_repository(
+                args.repository, root, 'standby',
+                REPLICATION_PARAMETERS % (
+                    'replication_primary', primary_address,
+                    args.max_unacked) +
+                STANDBY_LISTEN % standby_address),
+            args.port + 10)
+        servers.append(server)
+        standby = connect(standby_url, args.wait)
+        wait_for(lambda: standby.active() == primary.active(), args.wait,
+                 "the standby snapshot")
+
+        # And some after, to go through the op log.
+        held.update(primary.new_many(args.count))
+        wait_for(lambda: standby.active() == primary.active(), args.wait,
+                 "the standby op log")
+        try:
+            standby.new()
+        except Exception:
+            pass
+        else:
+            raise AssertionError("the standby issued an id before promotion")
+
+        servers[0].terminate()
+        servers[0].wait()
+        sequence = standby.promote()
+        issued = set(standby.new_many(args.count))
+        assert held.isdisjoint(issued), \
+            "the promoted standby reissued %d id's" % len(held & issued)
+        assert standby.active() == len(held) + len(issued)
+        standby.close()
+        print("standby took over at op %d holding %d id's, issued %d new ones"
+              % (sequence, len(held), len(issued)))
+    finally:
+        for server in servers:
+            if server.poll() is None:
+                server.terminate()
+                server.wait()
+
+
+parser = argparse.ArgumentParser(description=check.__doc__,
+    formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+parser.add_argument('-t', '--trtserver', default='trtserver',
+    help="trtserver binary used to start the primary and standby.")
+parser.add_argument('-r', '--repository', default='../build/install/model_repository',
+    help="Model repository copied for both servers.")
+parser.add_argument('-p', '--port', type=int, default=9100,
+    help="First port used by the started servers.")
+parser.add_argument('-c', '--count', type=int, default=100,
+    help="Number of id's allocated per step.")
+parser.add_argument('-m', '--max-unacked', type=int, default=16,
+    help="replication_max_unacked the servers are configured with.")
+parser.add_argument('-w', '--wait', type=float, default=30.0,
+    help="Seconds to wait for the servers and the standby.")
+
+
+def main():
+    args = parser.parse_args()
+    root = tempfile.mkdtemp(prefix='cidmgr-replication-')
+    try:
+        check(args, root)
+    finally:
+        shutil.rmtree(root)
+
+
+if __name__ == '__main__':
+    main()
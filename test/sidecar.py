@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+
+## run many short lived workers through a local cidmgr_sidecar, some of them
+## exiting without deleting their id's, and check none leak on the server
+import argparse
+import multiprocessing
+import os
+import signal
+import subprocess
+import time
+
+from trtis_cidmgr import CIDMgrContext
+
+
+def worker(socket_path, cycles, namespace, leak):
+    cidmgr = CIDMgrContext(None, sidecar=socket_path)
+    for i in range(cycles):
+        cidmgr.delete(cidmgr.new(namespace))
+    if leak:
+        cidmgr.new_many(leak, namespace)
+        # Gone without closing, the sidecar has to release them.
+        os._exit(0)
+    cidmgr.close()
+
+
+def wait_for_socket(path, timeout):
+    deadline = time.time() + timeout
+    while not os.path.exists(path):
+        if time.time() > deadline:
+            raise AssertionError("timed out waiting for the sidecar")
+        time.sleep(0.1)
+
+
+def check(args):
+    """Start a cidmgr_sidecar against a running server, run parallel workers
+    getting and deleting id's through it, with every other worker exiting
+    while still holding some, then stop the sidecar and check the server is
+    back where it started.
+    """
+    server = CIDMgrContext(args.url)
+    before = server.active()
+    sidecar = subprocess.Popen([
+        args.sidecar, '-u', args.url, '-s', args.socket,
+        '-r', str(args.reserve)])
+    try:
+        wait_for_socket(args.socket, args.wait)
+        start = time.time()
+        workers = [multiprocessing.Process(
+                       target=worker,
+                       args=(args.socket, args.cycles, args.namespace,
+                             args.leak if i % 2 else 0))
+                   for i in range(args.parallel)]
+        for p in workers:
+            p.start()
+        for p in workers:
+            p.join()
+        elapsed = time.time() - start
+    finally:
+        sidecar.send_signal(signal.SIGTERM)
+        sidecar.wait()
+    after = server.active()
+    server.close()
+    assert after == before, \
+        "%d id's leaked through the sidecar" % (after - before)
+    print("%d workers x %d cycles in %.2fs, no id's leaked"
+          % (args.parallel, args.cycles, elapsed))
+
+
+parser = argparse.ArgumentParser(description=check.__doc__,
+    formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+parser.add_argument('-u', '--url', default='localhost:8001',
+    help="cidmgr server the sidecar connects to.")
+parser.add_argument('-b', '--sidecar', default='../build/install/bin/cidmgr_sidecar',
+    help="cidmgr_sidecar binary.")
+parser.add_argument('-s', '--socket', default='/tmp/cidmgr_sidecar_test.sock',
+    help="Unix socket the sidecar listens on.")
+parser.add_argument('-r', '--reserve', type=int, default=64,
+    help="Id's the sidecar keeps in reserve.")
+parser.add_argument('-p', '--parallel', type=int, default=50,
+    help="Number of worker processes.")
+parser.add_argument('-c', '--cycles', type=int, default=100,
+    help="NEW / DELETE cycles per worker.")
+parser.add_argument('-l', '--leak', type=int, default=10,
+    help="Id's held by the workers that exit without deleting them.")
+parser.add_argument('-n', '--namespace', default=None,
+    help="Namespace the workers get their id's from.")
+parser.add_argument('-w', '--wait', type=float, default=10.0,
+    help="Seconds to wait for the sidecar to start.")
+
+
+def main():
+    check(parser.parse_args())
+
+
+if __name__ == '__main__':
+    main()